@@ -0,0 +1,659 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+/*
+eihort-bench: headless mesh-building benchmark
+
+Builds the meshes for an area of a world the way the viewer's loading
+workers do, but without a window or GL context, and prints the timings as
+JSON on stdout. Build with "make eihort-bench".
+
+Usage: eihort-bench [options] <world path>
+  --threads <n>          Number of building threads (default: all CPUs)
+  --area <minx> <maxx> <miny> <maxy>
+                         Block area to build, in Eihort's coordinates
+                         (default: the whole world)
+  --leaves <file>        Build the leaves listed in the file instead, one
+                         "minx maxx miny maxy" per line
+  --leaf-shift <n>       Split the area into leaves of 2^n blocks, as the
+                         viewer's qtree does (default: 7)
+  --lua <path>           Folder containing lua/blockids.lua (default: the
+                         deploy folder next to the executable)
+  --no-optimize          Leave the meshes unoptimized, as with the viewer's
+                         optimize_meshes = false
+  --write-golden <file>  Write a golden manifest of the built leaves' digests
+  --golden <file>        Build the leaves listed in a golden manifest and
+                         check their digests against it, exiting with
+                         status 2 on any mismatch
+  --tolerance <mode>     How strictly --golden compares the meshes:
+                           exact      every vertex, index and metadata value
+                                      must match, in order (default)
+                           triangles  the same triangles must be drawn, in
+                                      any order and with any vertex sharing
+                           surface    the same area must be covered with the
+                                      same geometry, however it is split into
+                                      triangles and textured
+
+The block tables are loaded from the stock Lua scripts through
+lua/bench.lua, which stands in for the GL-dependent parts of the API.
+Without a GL context, instanced geometry is built expanded. Like the
+viewer, each leaf reads its chunks from the region files afresh.
+Unless built with NO_PROFILE, the output includes the hot path timers'
+histograms as well.
+
+A golden manifest has one line per leaf, "minx maxx miny maxy exact
+triangles surface", with the three digests of the leaf under each tolerance
+in hex. The lighting textures, occluders and sign metadata are part of
+every digest. Digests are computed while meshing, so the timings of golden
+runs are not comparable to plain ones. "make golden-baseline" records a
+manifest of the fixture world built by eihort-worldgen with a known-good
+build, and "make golden-compare" checks a later build against it. No
+manifest is shipped with the sources.
+*/
+
+#include <SDL.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <string>
+#include <vector>
+#include <lua.hpp>
+
+#if defined(_POSIX_VERSION) || defined(__unix__) || defined(__APPLE__)
+#	include <sys/resource.h>
+#	include <unistd.h>
+#endif
+
+#include "geombase.h"
+#include "luafindfile.h"
+#include "luaimage.h"
+#include "mcblockdesc.h"
+#include "mcmap.h"
+#include "mcregionmap.h"
+#include "meshdigest.h"
+#include "platform.h"
+#include "profile.h"
+#include "worker.h"
+#include "worldmeshbuilder.h"
+
+using namespace eihort;
+
+// ---------------------------------------------------------------------------
+//           Globals normally defined by main.cpp for the shared code
+
+unsigned g_width, g_height;
+bool g_needRefresh;
+unsigned g_nWorkers;
+eihort::Worker *g_workers[MAX_WORKERS];
+eihort::EihortShader *g_shader;
+
+// ---------------------------------------------------------------------------
+void onError( const char *context, const char *error ) {
+	fprintf( stderr, "%s: %s\n", context, error );
+	exit( 1 );
+}
+
+
+// ================================ Benchmark ================================
+
+struct LeafDigest {
+	// Digests of one leaf's meshes
+	uint64_t digest[geom::MeshDigest::MODE_COUNT];
+};
+
+struct BenchThread {
+	// State of one building thread
+
+	// Source map, read only by this thread, and emptied after each leaf
+	MCMap *map;
+	// The thread's mesh builder, kept between leaves
+	WorldMeshBuilder *builder;
+	// Recycled geometry buffers
+	geom::ScratchArena arena;
+	// The list of leaves to build, shared by all threads
+	const std::vector<Extents> *leaves;
+	// Index of the next leaf to build, shared by all threads
+	SDL_atomic_t *nextLeaf;
+	// Digest of the geometry being built, or NULL if not needed
+	geom::MeshDigest *digest;
+	// Digests of all leaves, by leaf index, shared by all threads
+	std::vector<LeafDigest> *leafDigests;
+
+	// Time spent loading chunks, meshing, and finding occluders, in
+	// performance counter ticks
+	Uint64 loadTime, meshTime, occluderTime;
+	// Leaves, chunks and mesh sections built
+	unsigned nLeaves, nChunks, nSections;
+	// Triangles, vertex bytes and index bytes output
+	uint64_t nTris, vtxBytes, idxBytes;
+
+	// The thread itself
+	SDL_Thread *thread;
+};
+
+// -----------------------------------------------------------------
+static unsigned countChunks( MCMap *map, const Extents &ext ) {
+	// Count the chunks present within the extents
+	unsigned n = 0;
+	for( int y = ext.miny & ~15; y <= ext.maxy; y += 16 ) {
+		for( int x = ext.minx & ~15; x <= ext.maxx; x += 16 ) {
+			MCMap::Column col;
+			if( map->getColumn( x, y, col ) )
+				n++;
+		}
+	}
+	return n;
+}
+
+// -----------------------------------------------------------------
+static void digestSections( geom::MeshDigest *digest, const std::list<WorldMeshSectionData> &sections, const std::vector<Extents> &occluders ) {
+	// Add everything but the geometry itself, which was recorded as it
+	// was finalized
+	for( auto it = sections.begin(); it != sections.end(); ++it ) {
+		digest->addCommon( &it->hull, (unsigned)sizeof(it->hull) );
+		if( it->lightingTex )
+			digest->addCommon( it->lightingTex.get(), (unsigned)(it->ltSzX * it->ltSzY * it->ltSzZ) );
+	}
+	if( !occluders.empty() )
+		digest->addCommon( &occluders[0], (unsigned)(occluders.size() * sizeof(Extents)) );
+}
+
+// -----------------------------------------------------------------
+static int benchThreadMain( void *cookie ) {
+	BenchThread *t = (BenchThread*)cookie;
+	std::list<WorldMeshSectionData> sections;
+	std::vector<Extents> occluders;
+
+	geom::ScratchArena::bind( &t->arena );
+	geom::MeshDigest::bind( t->digest );
+	while( true ) {
+		unsigned i = (unsigned)SDL_AtomicAdd( t->nextLeaf, 1 );
+		if( i >= t->leaves->size() )
+			break;
+
+		// Load the chunks first, so that meshing is timed on its own
+		Extents ext = (*t->leaves)[i];
+		Uint64 start = SDL_GetPerformanceCounter();
+		Extents loadExt = ext;
+		loadExt.minx -= 16;
+		loadExt.maxx += 16;
+		loadExt.miny -= 16;
+		loadExt.maxy += 16;
+		t->map->getExtentsWithin( loadExt.minx, loadExt.maxx, loadExt.miny, loadExt.maxy, loadExt.minz, loadExt.maxz );
+		t->nChunks += countChunks( t->map, ext );
+		Uint64 loaded = SDL_GetPerformanceCounter();
+
+		if( t->digest )
+			t->digest->clear();
+
+		t->builder->generateOptimal( ext, sections );
+		Uint64 meshed = SDL_GetPerformanceCounter();
+
+		t->builder->generateOccluders( ext, occluders );
+		Uint64 done = SDL_GetPerformanceCounter();
+
+		t->loadTime += loaded - start;
+		t->meshTime += meshed - loaded;
+		t->occluderTime += done - meshed;
+		t->nLeaves++;
+		if( t->digest ) {
+			digestSections( t->digest, sections, occluders );
+			LeafDigest &leaf = (*t->leafDigests)[i];
+			for( unsigned m = 0; m < geom::MeshDigest::MODE_COUNT; m++ )
+				leaf.digest[m] = t->digest->get( (geom::MeshDigest::Mode)m );
+		}
+		for( auto it = sections.begin(); it != sections.end(); ++it ) {
+			t->nSections++;
+			t->nTris += it->nTris;
+			t->vtxBytes += it->vtxStream.getVertSize();
+			t->idxBytes += it->idxStream.getVertSize();
+			delete[] it->biomeCoords;
+			it->biomeCoords = NULL;
+		}
+		sections.clear();
+		occluders.clear();
+
+		// The viewer drops its loaded chunks between leaves, so every
+		// leaf reads its chunks from the region files here too
+		t->map->clearAllLoadedChunks();
+	}
+	geom::MeshDigest::bind( NULL );
+	geom::ScratchArena::bind( NULL );
+
+	return 0;
+}
+
+// -----------------------------------------------------------------
+static void splitIntoLeaves( const Extents &area, unsigned leafShift, std::vector<Extents> &leaves ) {
+	// Leaves are aligned to multiples of the leaf size, like the qtree's
+	int size = 1 << leafShift;
+	int mask = ~(size - 1);
+	for( int y = area.miny & mask; y <= area.maxy; y += size ) {
+		for( int x = area.minx & mask; x <= area.maxx; x += size )
+			leaves.push_back( Extents( x, x + size - 1, y, y + size - 1, area.minz, area.maxz ) );
+	}
+}
+
+// -----------------------------------------------------------------
+static bool readLeafList( const char *filename, int minz, int maxz, std::vector<Extents> &leaves ) {
+	FILE *f = fopen( filename, "r" );
+	if( !f )
+		return false;
+
+	int minx, maxx, miny, maxy;
+	while( 4 == fscanf( f, "%d %d %d %d", &minx, &maxx, &miny, &maxy ) )
+		leaves.push_back( Extents( minx, maxx, miny, maxy, minz, maxz ) );
+
+	fclose( f );
+	return true;
+}
+
+// -----------------------------------------------------------------
+static bool readGolden( const char *filename, int minz, int maxz, std::vector<Extents> &leaves, std::vector<LeafDigest> &digests ) {
+	FILE *f = fopen( filename, "r" );
+	if( !f )
+		return false;
+
+	char line[256];
+	while( fgets( line, sizeof(line), f ) ) {
+		if( line[0] == '#' || line[0] == '\n' || line[0] == '\r' )
+			continue;
+
+		int minx, maxx, miny, maxy;
+		unsigned long long d[geom::MeshDigest::MODE_COUNT];
+		if( 7 != sscanf( line, "%d %d %d %d %llx %llx %llx", &minx, &maxx, &miny, &maxy, &d[0], &d[1], &d[2] ) ) {
+			fclose( f );
+			return false;
+		}
+		leaves.push_back( Extents( minx, maxx, miny, maxy, minz, maxz ) );
+		LeafDigest leaf;
+		for( unsigned m = 0; m < geom::MeshDigest::MODE_COUNT; m++ )
+			leaf.digest[m] = (uint64_t)d[m];
+		digests.push_back( leaf );
+	}
+
+	fclose( f );
+	return true;
+}
+
+// -----------------------------------------------------------------
+static bool writeGolden( const char *filename, const char *worldPath, const std::vector<Extents> &leaves, const std::vector<LeafDigest> &digests ) {
+	FILE *f = fopen( filename, "w" );
+	if( !f )
+		return false;
+
+	fprintf( f, "# Golden mesh digests for %s\n", worldPath );
+	fprintf( f, "# minx maxx miny maxy exact triangles surface\n" );
+	for( size_t i = 0; i < leaves.size(); i++ ) {
+		fprintf( f, "%d %d %d %d", leaves[i].minx, leaves[i].maxx, leaves[i].miny, leaves[i].maxy );
+		for( unsigned m = 0; m < geom::MeshDigest::MODE_COUNT; m++ )
+			fprintf( f, " %016llx", (unsigned long long)digests[i].digest[m] );
+		fprintf( f, "\n" );
+	}
+
+	return 0 == fclose( f );
+}
+
+// -----------------------------------------------------------------
+static void getGeometryIds( const MCBlockDesc *blocks, geom::MeshDigest::GeometryIds &ids ) {
+	// Geometries shared by several blocks are known by the lowest block ID
+	for( unsigned id = BLOCK_ID_COUNT; id--; ) {
+		const geom::BlockGeometry *geom = blocks->getGeometry( id );
+		if( geom )
+			ids[geom] = id;
+	}
+}
+
+// -----------------------------------------------------------------
+static unsigned long getPeakRSSKB() {
+#if defined(_POSIX_VERSION) || defined(__unix__) || defined(__APPLE__)
+	struct rusage usage;
+	if( 0 != getrusage( RUSAGE_SELF, &usage ) )
+		return 0;
+#if defined(__APPLE__) && defined(__MACH__)
+	// Reported in bytes on Mac
+	return (unsigned long)usage.ru_maxrss / 1024;
+#else
+	return (unsigned long)usage.ru_maxrss;
+#endif
+#else
+	return 0;
+#endif
+}
+
+// -----------------------------------------------------------------
+static std::string jsonString( const char *s ) {
+	std::string out = "\"";
+	for( ; *s; s++ ) {
+		if( *s == '"' || *s == '\\' ) {
+			out += '\\';
+			out += *s;
+		} else if( (unsigned char)*s < 0x20 ) {
+			char esc[8];
+			snprintf( esc, sizeof(esc), "\\u%04x", (unsigned)*s );
+			out += esc;
+		} else {
+			out += *s;
+		}
+	}
+	return out + "\"";
+}
+
+// -----------------------------------------------------------------
+static MCBlockDesc *loadBlockDesc( lua_State *L, const char *luaRoot, const std::string &worldRoot, BiomeCoordData &biomeIdToCoords ) {
+	// Set up the parts of the eihort table which work without GL
+	lua_newtable( L );
+	lua_pushstring( L, luaRoot );
+	lua_setfield( L, -2, "ProgramPath" );
+	geom::BlockGeometry::setupLua( L );
+	MCBlockDesc::setupLua( L );
+	FindFile_setupLua( L );
+	LuaImage_setupLua( L );
+	lua_setglobal( L, "eihort" );
+
+	// Run the stock block tables through bench.lua
+	char filename[MAX_PATH];
+	snprintf( filename, MAX_PATH, "%slua/bench.lua", luaRoot );
+	if( 0 != luaL_dofile( L, filename ) ) {
+		fprintf( stderr, "Failed to load the block tables: %s\n", lua_tostring( L, -1 ) );
+		return NULL;
+	}
+	lua_getglobal( L, "loadBenchBlockDesc" );
+	lua_pushstring( L, worldRoot.c_str() );
+	if( 0 != lua_pcall( L, 1, 2, 0 ) ) {
+		fprintf( stderr, "Failed to load the block tables: %s\n", lua_tostring( L, -1 ) );
+		return NULL;
+	}
+
+	// Translate the biome ID -> coordinate table
+	if( lua_type( L, -1 ) == LUA_TTABLE ) {
+		for( lua_pushnil( L ); lua_next( L, -2 ) != 0; lua_pop( L, 1 ) ) {
+			unsigned id = (unsigned)lua_tointeger( L, -2 );
+			if( id >= biomeIdToCoords.size() )
+				biomeIdToCoords.resize( id + 1, 0xAD32u );
+			biomeIdToCoords[id] = (unsigned short)lua_tointeger( L, -1 );
+		}
+	}
+	lua_pop( L, 1 );
+
+	// The block description stays referenced on the stack
+	return getLuaObjectArg<MCBlockDesc>( L, -1, MCBLOCKDESC_META );
+}
+
+// -----------------------------------------------------------------
+static void usage() {
+	fprintf( stderr,
+		"Usage: eihort-bench [options] <world path>\n"
+		"  --threads <n>\n"
+		"  --area <minx> <maxx> <miny> <maxy>\n"
+		"  --leaves <file>\n"
+		"  --leaf-shift <n>\n"
+		"  --lua <path>\n"
+		"  --no-optimize\n"
+		"  --write-golden <file>\n"
+		"  --golden <file>\n"
+		"  --tolerance exact|triangles|surface\n" );
+}
+
+// ================================= Main ====================================
+int main( int argc, char **argv ) {
+	// Parse the command line
+	unsigned nThreads = (unsigned)SDL_GetCPUCount();
+	unsigned leafShift = 7;
+	bool haveArea = false;
+	Extents area( 0, 0, 0, 0, 0, 0 );
+	const char *leafFile = NULL;
+	const char *worldPath = NULL;
+	std::string luaRoot;
+	bool optimize = true;
+	const char *goldenFile = NULL;
+	const char *writeGoldenFile = NULL;
+	geom::MeshDigest::Mode tolerance = geom::MeshDigest::EXACT;
+	for( int i = 1; i < argc; i++ ) {
+		if( 0 == strcmp( argv[i], "--threads" ) && i + 1 < argc ) {
+			nThreads = (unsigned)atoi( argv[++i] );
+		} else if( 0 == strcmp( argv[i], "--area" ) && i + 4 < argc ) {
+			area.minx = atoi( argv[++i] );
+			area.maxx = atoi( argv[++i] );
+			area.miny = atoi( argv[++i] );
+			area.maxy = atoi( argv[++i] );
+			haveArea = true;
+		} else if( 0 == strcmp( argv[i], "--leaves" ) && i + 1 < argc ) {
+			leafFile = argv[++i];
+		} else if( 0 == strcmp( argv[i], "--leaf-shift" ) && i + 1 < argc ) {
+			leafShift = (unsigned)atoi( argv[++i] );
+		} else if( 0 == strcmp( argv[i], "--lua" ) && i + 1 < argc ) {
+			luaRoot = argv[++i];
+		} else if( 0 == strcmp( argv[i], "--no-optimize" ) ) {
+			optimize = false;
+		} else if( 0 == strcmp( argv[i], "--golden" ) && i + 1 < argc ) {
+			goldenFile = argv[++i];
+		} else if( 0 == strcmp( argv[i], "--write-golden" ) && i + 1 < argc ) {
+			writeGoldenFile = argv[++i];
+		} else if( 0 == strcmp( argv[i], "--tolerance" ) && i + 1 < argc ) {
+			const char *name = argv[++i];
+			unsigned m = 0;
+			while( m < geom::MeshDigest::MODE_COUNT && 0 != strcmp( name, geom::MeshDigest::getModeName( (geom::MeshDigest::Mode)m ) ) )
+				m++;
+			if( m == geom::MeshDigest::MODE_COUNT ) {
+				usage();
+				return 1;
+			}
+			tolerance = (geom::MeshDigest::Mode)m;
+		} else if( argv[i][0] != '-' && !worldPath ) {
+			worldPath = argv[i];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if( !worldPath || nThreads == 0 || leafShift < 2 || leafShift > 12 ) {
+		usage();
+		return 1;
+	}
+	nThreads = std::min( nThreads, (unsigned)MAX_WORKERS );
+
+	// The Lua scripts are found in the deploy folder by default
+	if( luaRoot.empty() ) {
+		luaRoot = argv[0];
+		size_t slash = luaRoot.find_last_of( "/\\" );
+		luaRoot = slash == std::string::npos ? std::string( "." ) : luaRoot.substr( 0, slash );
+		luaRoot += "/deploy";
+	}
+	if( luaRoot[luaRoot.length()-1] != '/' )
+		luaRoot += '/';
+	std::string worldRoot = worldPath;
+	if( worldRoot[worldRoot.length()-1] != '/' && worldRoot[worldRoot.length()-1] != '\\' )
+		worldRoot += '/';
+
+	// Open the world, in Anvil format if it has Anvil regions
+	MCRegionMap *regions = new MCRegionMap( worldRoot.c_str(), true );
+	if( regions->getTotalRegionCount() == 0 )
+		regions->changeRoot( worldRoot.c_str(), false );
+	if( regions->getTotalRegionCount() == 0 ) {
+		fprintf( stderr, "No regions found in %s\n", worldPath );
+		return 1;
+	}
+	int minz = 0, maxz = regions->isAnvil() ? 255 : 127;
+
+	// Load the block descriptions
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	Uint64 start = SDL_GetPerformanceCounter();
+	lua_State *L = luaL_newstate();
+	luaL_openlibs( L );
+	BiomeCoordData biomeIdToCoords;
+	MCBlockDesc *blocks = loadBlockDesc( L, luaRoot.c_str(), worldRoot, biomeIdToCoords );
+	if( !blocks )
+		return 1;
+	Uint64 blockDescTime = SDL_GetPerformanceCounter() - start;
+
+	// Decide which leaves to build
+	std::vector<Extents> leaves;
+	std::vector<LeafDigest> golden;
+	if( goldenFile ) {
+		if( !readGolden( goldenFile, minz, maxz, leaves, golden ) ) {
+			fprintf( stderr, "Failed to read %s\n", goldenFile );
+			return 1;
+		}
+	} else if( leafFile ) {
+		if( !readLeafList( leafFile, minz, maxz, leaves ) ) {
+			fprintf( stderr, "Failed to read %s\n", leafFile );
+			return 1;
+		}
+	} else {
+		if( !haveArea )
+			regions->getWorldBlockExtents( area.minx, area.maxx, area.miny, area.maxy );
+		area.minz = minz;
+		area.maxz = maxz;
+		splitIntoLeaves( area, leafShift, leaves );
+	}
+
+	// Digest the meshes if they are to be checked or recorded
+	bool digesting = goldenFile || writeGoldenFile;
+	geom::MeshDigest::GeometryIds geometryIds;
+	std::vector<LeafDigest> leafDigests;
+	if( digesting ) {
+		getGeometryIds( blocks, geometryIds );
+		leafDigests.resize( leaves.size() );
+	}
+
+	// Build everything
+	SDL_atomic_t nextLeaf;
+	SDL_AtomicSet( &nextLeaf, 0 );
+	std::vector<BenchThread*> threads( nThreads );
+	for( unsigned i = 0; i < nThreads; i++ ) {
+		BenchThread *t = threads[i] = new BenchThread;
+		if( regions->isAnvil() ) {
+			MCMap_Anvil *map = new MCMap_Anvil( regions );
+			if( !biomeIdToCoords.empty() )
+				map->setBiomeCoordData( biomeIdToCoords );
+			t->map = map;
+		} else {
+			t->map = new MCMap_MCRegion( regions );
+		}
+		t->builder = new WorldMeshBuilder( t->map, blocks );
+		t->builder->setOptimizeMeshes( optimize );
+		t->leaves = &leaves;
+		t->nextLeaf = &nextLeaf;
+		t->digest = digesting ? new geom::MeshDigest( &geometryIds ) : NULL;
+		t->leafDigests = &leafDigests;
+		t->loadTime = t->meshTime = t->occluderTime = 0;
+		t->nLeaves = t->nChunks = t->nSections = 0;
+		t->nTris = t->vtxBytes = t->idxBytes = 0;
+	}
+	start = SDL_GetPerformanceCounter();
+	for( unsigned i = 0; i < nThreads; i++ )
+		threads[i]->thread = SDL_CreateThread( &benchThreadMain, "Eihort Bench", threads[i] );
+	for( unsigned i = 0; i < nThreads; i++ )
+		SDL_WaitThread( threads[i]->thread, NULL );
+	Uint64 wallTime = SDL_GetPerformanceCounter() - start;
+
+	// Gather the results
+	Uint64 loadTime = 0, meshTime = 0, occluderTime = 0;
+	unsigned nLeaves = 0, nChunks = 0, nSections = 0;
+	uint64_t nTris = 0, vtxBytes = 0, idxBytes = 0;
+	for( unsigned i = 0; i < nThreads; i++ ) {
+		BenchThread *t = threads[i];
+		loadTime += t->loadTime;
+		meshTime += t->meshTime;
+		occluderTime += t->occluderTime;
+		nLeaves += t->nLeaves;
+		nChunks += t->nChunks;
+		nSections += t->nSections;
+		nTris += t->nTris;
+		vtxBytes += t->vtxBytes;
+		idxBytes += t->idxBytes;
+	}
+	double wall = (double)wallTime / (double)freq;
+
+	// Check and record the digests
+	unsigned nMismatches = 0;
+	if( goldenFile ) {
+		for( size_t i = 0; i < leaves.size(); i++ ) {
+			uint64_t got = leafDigests[i].digest[tolerance];
+			uint64_t expected = golden[i].digest[tolerance];
+			if( got != expected ) {
+				fprintf( stderr, "Leaf %d %d %d %d differs: %016llx, expected %016llx\n",
+					leaves[i].minx, leaves[i].maxx, leaves[i].miny, leaves[i].maxy,
+					(unsigned long long)got, (unsigned long long)expected );
+				nMismatches++;
+			}
+		}
+	}
+	if( writeGoldenFile && !writeGolden( writeGoldenFile, worldPath, leaves, leafDigests ) ) {
+		fprintf( stderr, "Failed to write %s\n", writeGoldenFile );
+		return 1;
+	}
+
+	// Stage times are summed over all threads
+	printf( "{\n" );
+	printf( "\t\"world\": %s,\n", jsonString( worldPath ).c_str() );
+	printf( "\t\"threads\": %u,\n", nThreads );
+	printf( "\t\"leafShift\": %u,\n", leafShift );
+	printf( "\t\"leaves\": %u,\n", nLeaves );
+	printf( "\t\"chunks\": %u,\n", nChunks );
+	printf( "\t\"sections\": %u,\n", nSections );
+	printf( "\t\"triangles\": %llu,\n", (unsigned long long)nTris );
+	printf( "\t\"vertexBytes\": %llu,\n", (unsigned long long)vtxBytes );
+	printf( "\t\"indexBytes\": %llu,\n", (unsigned long long)idxBytes );
+	printf( "\t\"stages\": {\n" );
+	printf( "\t\t\"blockDesc\": %.6f,\n", (double)blockDescTime / (double)freq );
+	printf( "\t\t\"chunkLoad\": %.6f,\n", (double)loadTime / (double)freq );
+	printf( "\t\t\"mesh\": %.6f,\n", (double)meshTime / (double)freq );
+	printf( "\t\t\"occluders\": %.6f\n", (double)occluderTime / (double)freq );
+	printf( "\t},\n" );
+	printf( "\t\"wallSeconds\": %.6f,\n", wall );
+	printf( "\t\"trianglesPerSecond\": %.1f,\n", wall > 0.0 ? (double)nTris / wall : 0.0 );
+	printf( "\t\"chunksPerSecond\": %.1f,\n", wall > 0.0 ? (double)nChunks / wall : 0.0 );
+#ifndef NO_PROFILE
+	// Histograms from the hot path timers, in microseconds
+	printf( "\t\"probes\": {\n" );
+	for( unsigned i = 0; i < PROFILE_PROBE_COUNT; i++ ) {
+		ProfileSummary summary;
+		profileSummarize( (ProfileProbe)i, summary );
+		printf( "\t\t\"%s\": { \"count\": %u, \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f }%s\n",
+			getProfileProbeName( (ProfileProbe)i ), summary.count, summary.p50, summary.p99, summary.max,
+			i + 1 < PROFILE_PROBE_COUNT ? "," : "" );
+	}
+	printf( "\t},\n" );
+#endif
+	if( goldenFile ) {
+		printf( "\t\"golden\": {\n" );
+		printf( "\t\t\"manifest\": %s,\n", jsonString( goldenFile ).c_str() );
+		printf( "\t\t\"tolerance\": \"%s\",\n", geom::MeshDigest::getModeName( tolerance ) );
+		printf( "\t\t\"leaves\": %u,\n", (unsigned)leaves.size() );
+		printf( "\t\t\"mismatches\": %u\n", nMismatches );
+		printf( "\t},\n" );
+	}
+	printf( "\t\"peakRSSKB\": %lu\n", getPeakRSSKB() );
+	printf( "}\n" );
+
+	// The builders and maps are left to the OS, since the process is
+	// about to exit anyway
+	lua_close( L );
+
+	return nMismatches ? 2 : 0;
+}
@@ -0,0 +1,979 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+/*
+eihort-worldgen: deterministic synthetic world generator
+
+Writes a seeded synthetic Anvil world for reproducible performance tests.
+The same seed and options always produce byte-identical region files, so
+worlds can be regenerated instead of shared. Build with
+"make eihort-worldgen".
+
+Usage: eihort-worldgen [options] <output folder>
+  --seed <n>      World seed (default: 1)
+  --regions <n>   Number of 32x32 chunk regions to write, laid out in a
+                  square around the origin (default: 1)
+  --palette       Write 1.13-style palette sections (Palette/BlockStates)
+                  instead of Blocks/Data arrays
+
+The world is split into 64x64 block districts. Most are natural terrain with
+caves and biomes ranging from desert to jungle; the rest are either dense
+"city" blocks of multi-storey buildings or fields of sign posts. The district
+at the origin is always a city, and the one east of it is always signs.
+
+Lighting is approximate: sky light is full above the highest block of each
+column, and torches light the blocks around them within their own chunk.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "endian.h"
+#include "nbt.h"
+#include "platform.h"
+
+using namespace eihort;
+
+// Height of the sea surface
+static const int SEA_LEVEL = 62;
+// Ground level of city and sign districts, and of all district edges
+static const int DISTRICT_LEVEL = 64;
+// Minecraft version 1.13.2, for worlds with palette sections
+static const int PALETTE_DATA_VERSION = 1631;
+
+// Block ids used by the generator
+enum {
+	BLOCK_AIR = 0,
+	BLOCK_STONE = 1,
+	BLOCK_GRASS = 2,
+	BLOCK_DIRT = 3,
+	BLOCK_COBBLESTONE = 4,
+	BLOCK_PLANKS = 5,
+	BLOCK_BEDROCK = 7,
+	BLOCK_WATER = 9,
+	BLOCK_SAND = 12,
+	BLOCK_GRAVEL = 13,
+	BLOCK_LOG = 17,
+	BLOCK_LEAVES = 18,
+	BLOCK_GLASS = 20,
+	BLOCK_SANDSTONE = 24,
+	BLOCK_TALLGRASS = 31,
+	BLOCK_DANDELION = 37,
+	BLOCK_POPPY = 38,
+	BLOCK_BRICK = 45,
+	BLOCK_TORCH = 50,
+	BLOCK_SIGN_POST = 63,
+	BLOCK_CACTUS = 81,
+	BLOCK_STONEBRICK = 98
+};
+
+// Biome ids used by the generator
+enum {
+	BIOME_OCEAN = 0,
+	BIOME_PLAINS = 1,
+	BIOME_DESERT = 2,
+	BIOME_FOREST = 4,
+	BIOME_SWAMP = 6,
+	BIOME_JUNGLE = 21
+};
+
+// Kinds of districts
+enum District {
+	DISTRICT_NATURAL,
+	DISTRICT_CITY,
+	DISTRICT_SIGNS
+};
+
+
+// ================================== Noise ==================================
+
+// -----------------------------------------------------------------
+static inline uint32_t hash3( uint32_t seed, int x, int y, int z ) {
+	// Integer hash of a lattice point
+	uint32_t h = seed;
+	h ^= (uint32_t)x * 0x27d4eb2du;
+	h = (h << 13) | (h >> 19);
+	h ^= (uint32_t)y * 0x165667b1u;
+	h = (h << 13) | (h >> 19);
+	h ^= (uint32_t)z * 0x9e3779b1u;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+// -----------------------------------------------------------------
+static inline float unitHash( uint32_t h ) {
+	// Maps a hash to [0,1)
+	return (float)(h >> 8) * (1.0f / 16777216.0f);
+}
+
+// -----------------------------------------------------------------
+static inline float smooth( float t ) {
+	return t * t * (3.0f - 2.0f * t);
+}
+
+// -----------------------------------------------------------------
+static inline float lerp( float a, float b, float t ) {
+	return a + (b - a) * t;
+}
+
+// -----------------------------------------------------------------
+static float valueNoise2( uint32_t seed, float x, float y ) {
+	// Smoothed value noise in [-1,1]
+	float fx = floorf( x ), fy = floorf( y );
+	int ix = (int)fx, iy = (int)fy;
+	float tx = smooth( x - fx ), ty = smooth( y - fy );
+	float v00 = unitHash( hash3( seed, ix, iy, 0 ) );
+	float v10 = unitHash( hash3( seed, ix + 1, iy, 0 ) );
+	float v01 = unitHash( hash3( seed, ix, iy + 1, 0 ) );
+	float v11 = unitHash( hash3( seed, ix + 1, iy + 1, 0 ) );
+	return lerp( lerp( v00, v10, tx ), lerp( v01, v11, tx ), ty ) * 2.0f - 1.0f;
+}
+
+// -----------------------------------------------------------------
+static float valueNoise3( uint32_t seed, float x, float y, float z ) {
+	// Smoothed 3D value noise in [-1,1]
+	float fx = floorf( x ), fy = floorf( y ), fz = floorf( z );
+	int ix = (int)fx, iy = (int)fy, iz = (int)fz;
+	float tx = smooth( x - fx ), ty = smooth( y - fy ), tz = smooth( z - fz );
+	float v[2];
+	for( int dz = 0; dz < 2; dz++ ) {
+		float v00 = unitHash( hash3( seed, ix, iy, iz + dz ) );
+		float v10 = unitHash( hash3( seed, ix + 1, iy, iz + dz ) );
+		float v01 = unitHash( hash3( seed, ix, iy + 1, iz + dz ) );
+		float v11 = unitHash( hash3( seed, ix + 1, iy + 1, iz + dz ) );
+		v[dz] = lerp( lerp( v00, v10, tx ), lerp( v01, v11, tx ), ty );
+	}
+	return lerp( v[0], v[1], tz ) * 2.0f - 1.0f;
+}
+
+// -----------------------------------------------------------------
+static float fractal2( uint32_t seed, float x, float y, unsigned octaves ) {
+	// Sum of octaves of value noise, normalized to [-1,1]
+	float sum = 0.0f, amp = 1.0f, total = 0.0f;
+	for( unsigned i = 0; i < octaves; i++ ) {
+		sum += valueNoise2( seed + i, x, y ) * amp;
+		total += amp;
+		amp *= 0.5f;
+		x *= 2.0f;
+		y *= 2.0f;
+	}
+	return sum / total;
+}
+
+
+// ================================ Generator ================================
+
+struct SignDesc {
+	// A sign post and its text
+
+	// Position of the sign, in Minecraft coordinates
+	int x, y, z;
+	// The four lines of text
+	std::string text[4];
+};
+
+struct ChunkData {
+	// The contents of one chunk while it's being generated
+	// Block arrays are indexed by (y<<8)|(z<<4)|x, as in Anvil sections
+
+	// Block ids
+	unsigned char ids[16*16*256];
+	// Block data values
+	unsigned char data[16*16*256];
+	// Block light levels
+	unsigned char blockLight[16*16*256];
+	// Biome ids, indexed by (z<<4)|x
+	unsigned char biomes[16*16];
+	// Torches placed in the chunk, as block indices
+	std::vector<unsigned> torches;
+	// Sign posts placed in the chunk
+	std::vector<SignDesc> signs;
+};
+
+class WorldGen {
+	// Generates chunks as pure functions of the seed and the chunk position
+
+public:
+	explicit WorldGen( uint32_t seed ) : seed(seed) { }
+
+	// Fill in the chunk at the given chunk coordinates
+	void generateChunk( int cx, int cz, ChunkData &chunk ) const;
+	// Get the terrain height at a column
+	int getHeight( int x, int z ) const;
+	// Get the biome of a column
+	unsigned getBiome( int x, int z, int height ) const;
+	// Get the kind of the district containing a column
+	District getDistrict( int x, int z ) const;
+
+private:
+	// Lay down the stone, soil and water of a column
+	void generateColumn( int x, int z, ChunkData &chunk ) const;
+	// Carve caves through the natural terrain of a column
+	void carveCaves( int x, int z, int height, ChunkData &chunk ) const;
+	// Add trees which overlap the chunk
+	void placeTrees( int cx, int cz, ChunkData &chunk ) const;
+	// Add grass, flowers and cacti to a column
+	void placePlants( int x, int z, int height, ChunkData &chunk ) const;
+	// Build the city in a column
+	void buildCityColumn( int x, int z, ChunkData &chunk ) const;
+	// Place the sign posts in a column
+	void buildSignColumn( int x, int z, ChunkData &chunk ) const;
+	// Spread light from the chunk's torches
+	void lightTorches( ChunkData &chunk ) const;
+
+	// Set a block given in world coordinates, if it is in the chunk
+	static void setBlock( int cx, int cz, int x, int y, int z, unsigned id, unsigned data, ChunkData &chunk, bool onlyAir );
+
+	// The world seed
+	uint32_t seed;
+};
+
+// -----------------------------------------------------------------
+static inline unsigned blockIndex( int x, int y, int z ) {
+	// Index of a block within the chunk arrays, from chunk-local coordinates
+	return ((unsigned)y << 8) | ((unsigned)(z & 15) << 4) | (unsigned)(x & 15);
+}
+
+// -----------------------------------------------------------------
+District WorldGen::getDistrict( int x, int z ) const {
+	int dx = shift_right( x, 6 ), dz = shift_right( z, 6 );
+	if( dx == 0 && dz == 0 )
+		return DISTRICT_CITY;
+	if( dx == 1 && dz == 0 )
+		return DISTRICT_SIGNS;
+	switch( hash3( seed ^ 0xd157u, dx, 0, dz ) & 7 ) {
+	case 0: return DISTRICT_CITY;
+	case 1: return DISTRICT_SIGNS;
+	default: return DISTRICT_NATURAL;
+	}
+}
+
+// -----------------------------------------------------------------
+int WorldGen::getHeight( int x, int z ) const {
+	if( getDistrict( x, z ) != DISTRICT_NATURAL )
+		return DISTRICT_LEVEL;
+
+	// Natural terrain returns to the district level at district edges, so
+	// that flat districts don't sit at the bottom of pits
+	float n = fractal2( seed, (float)x / 128.0f, (float)z / 128.0f, 5 );
+	int lx = x & 63, lz = z & 63;
+	int edge = std::min( std::min( lx, 63 - lx ), std::min( lz, 63 - lz ) );
+	float t = std::min( 1.0f, (float)edge / 12.0f );
+	return DISTRICT_LEVEL + (int)floorf( n * 40.0f * t );
+}
+
+// -----------------------------------------------------------------
+unsigned WorldGen::getBiome( int x, int z, int height ) const {
+	if( getDistrict( x, z ) != DISTRICT_NATURAL )
+		return BIOME_PLAINS;
+	if( height < SEA_LEVEL - 3 )
+		return BIOME_OCEAN;
+
+	float temperature = fractal2( seed + 101, (float)x / 300.0f, (float)z / 300.0f, 2 );
+	float moisture = fractal2( seed + 202, (float)x / 200.0f, (float)z / 200.0f, 2 );
+	if( temperature > 0.25f )
+		return moisture > 0.0f ? BIOME_JUNGLE : BIOME_DESERT;
+	if( temperature < -0.25f )
+		return moisture > 0.1f ? BIOME_SWAMP : BIOME_PLAINS;
+	return BIOME_FOREST;
+}
+
+// -----------------------------------------------------------------
+void WorldGen::setBlock( int cx, int cz, int x, int y, int z, unsigned id, unsigned data, ChunkData &chunk, bool onlyAir ) {
+	if( shift_right( x, 4 ) != cx || shift_right( z, 4 ) != cz || y < 0 || y > 255 )
+		return;
+	unsigned idx = blockIndex( x, y, z );
+	if( onlyAir && chunk.ids[idx] != BLOCK_AIR )
+		return;
+	chunk.ids[idx] = (unsigned char)id;
+	chunk.data[idx] = (unsigned char)data;
+}
+
+// -----------------------------------------------------------------
+void WorldGen::generateChunk( int cx, int cz, ChunkData &chunk ) const {
+	memset( chunk.ids, 0, sizeof(chunk.ids) );
+	memset( chunk.data, 0, sizeof(chunk.data) );
+	memset( chunk.blockLight, 0, sizeof(chunk.blockLight) );
+	chunk.torches.clear();
+	chunk.signs.clear();
+
+	for( int z = cz * 16; z < cz * 16 + 16; z++ ) {
+		for( int x = cx * 16; x < cx * 16 + 16; x++ ) {
+			generateColumn( x, z, chunk );
+			switch( getDistrict( x, z ) ) {
+			case DISTRICT_CITY: buildCityColumn( x, z, chunk ); break;
+			case DISTRICT_SIGNS: buildSignColumn( x, z, chunk ); break;
+			default: break;
+			}
+		}
+	}
+
+	// Trees may hang over from neighbouring chunks, so they are placed
+	// after all columns
+	placeTrees( cx, cz, chunk );
+	lightTorches( chunk );
+}
+
+// -----------------------------------------------------------------
+void WorldGen::generateColumn( int x, int z, ChunkData &chunk ) const {
+	int height = getHeight( x, z );
+	unsigned biome = getBiome( x, z, height );
+	chunk.biomes[((z & 15) << 4) | (x & 15)] = (unsigned char)biome;
+
+	bool beach = height <= SEA_LEVEL + 1;
+	unsigned top = biome == BIOME_DESERT || beach ? BLOCK_SAND : BLOCK_GRASS;
+	unsigned soil = biome == BIOME_DESERT ? BLOCK_SANDSTONE : beach ? BLOCK_SAND : BLOCK_DIRT;
+	if( height < SEA_LEVEL - 3 )
+		top = soil = BLOCK_GRAVEL;
+
+	unsigned idx = blockIndex( x, 0, z );
+	chunk.ids[idx] = BLOCK_BEDROCK;
+	for( int y = 1; y <= std::max( height, SEA_LEVEL ); y++ ) {
+		idx += 256;
+		if( y < height - 3 ) {
+			chunk.ids[idx] = BLOCK_STONE;
+		} else if( y < height ) {
+			chunk.ids[idx] = (unsigned char)soil;
+		} else if( y == height ) {
+			chunk.ids[idx] = (unsigned char)top;
+		} else {
+			chunk.ids[idx] = BLOCK_WATER;
+		}
+	}
+
+	if( getDistrict( x, z ) == DISTRICT_NATURAL ) {
+		carveCaves( x, z, height, chunk );
+		placePlants( x, z, height, chunk );
+	}
+}
+
+// -----------------------------------------------------------------
+void WorldGen::carveCaves( int x, int z, int height, ChunkData &chunk ) const {
+	// Caves are the thin shells where two noise fields are both near zero,
+	// which gives long winding tunnels
+	// Columns under water keep a thick roof, so that the sea stays put
+	int maxY = height < SEA_LEVEL ? height - 6 : height - 1;
+	for( int y = 5; y <= maxY; y++ ) {
+		float a = valueNoise3( seed + 303, (float)x / 24.0f, (float)y / 12.0f, (float)z / 24.0f );
+		if( fabsf( a ) > 0.12f )
+			continue;
+		float b = valueNoise3( seed + 404, (float)x / 24.0f, (float)y / 12.0f, (float)z / 24.0f );
+		if( fabsf( b ) > 0.12f )
+			continue;
+		chunk.ids[blockIndex( x, y, z )] = BLOCK_AIR;
+	}
+}
+
+// -----------------------------------------------------------------
+void WorldGen::placePlants( int x, int z, int height, ChunkData &chunk ) const {
+	if( height < SEA_LEVEL || height > 250 )
+		return;
+	unsigned topIdx = blockIndex( x, height, z );
+	unsigned above = topIdx + 256;
+	if( chunk.ids[above] != BLOCK_AIR )
+		return;
+
+	unsigned biome = chunk.biomes[((z & 15) << 4) | (x & 15)];
+	float r = unitHash( hash3( seed + 505, x, height, z ) );
+	if( chunk.ids[topIdx] == BLOCK_SAND ) {
+		if( biome == BIOME_DESERT && r < 0.01f ) {
+			// Cacti are one to three blocks tall
+			unsigned tall = 1 + (hash3( seed + 506, x, 0, z ) % 3);
+			for( unsigned i = 0; i < tall; i++ )
+				chunk.ids[above + (i << 8)] = BLOCK_CACTUS;
+		}
+		return;
+	}
+	if( chunk.ids[topIdx] != BLOCK_GRASS )
+		return;
+
+	// Foliage-heavy biomes are covered in grass and flowers
+	float grass = biome == BIOME_JUNGLE ? 0.6f : biome == BIOME_FOREST ? 0.35f : biome == BIOME_SWAMP ? 0.2f : 0.25f;
+	if( r < 0.03f ) {
+		chunk.ids[above] = r < 0.015f ? BLOCK_DANDELION : BLOCK_POPPY;
+	} else if( r < 0.03f + grass ) {
+		chunk.ids[above] = BLOCK_TALLGRASS;
+		chunk.data[above] = 1;
+	}
+}
+
+// -----------------------------------------------------------------
+void WorldGen::placeTrees( int cx, int cz, ChunkData &chunk ) const {
+	// Trees are at most 3 blocks in radius, so any tree trunk within 3
+	// blocks of the chunk may put leaves in it
+	for( int tz = cz * 16 - 3; tz < cz * 16 + 19; tz++ ) {
+		for( int tx = cx * 16 - 3; tx < cx * 16 + 19; tx++ ) {
+			if( getDistrict( tx, tz ) != DISTRICT_NATURAL )
+				continue;
+			int height = getHeight( tx, tz );
+			if( height <= SEA_LEVEL + 1 || height > 230 )
+				continue;
+			unsigned biome = getBiome( tx, tz, height );
+			float chance = biome == BIOME_JUNGLE ? 0.08f : biome == BIOME_FOREST ? 0.05f
+				: biome == BIOME_SWAMP ? 0.02f : biome == BIOME_PLAINS ? 0.004f : 0.0f;
+			uint32_t h = hash3( seed + 606, tx, 0, tz );
+			if( unitHash( h ) >= chance )
+				continue;
+
+			// Jungle trees are taller, with wider canopies
+			bool jungle = biome == BIOME_JUNGLE;
+			unsigned wood = jungle ? 3 : 0;
+			int trunk = jungle ? 6 + (int)((h >> 4) % 6) : 4 + (int)((h >> 4) % 3);
+			int radius = jungle ? 3 : 2;
+			int top = height + trunk;
+			for( int y = top - 2; y <= top + 1; y++ ) {
+				int r = y > top - 1 ? radius - 1 : radius;
+				for( int dz = -r; dz <= r; dz++ ) {
+					for( int dx = -r; dx <= r; dx++ ) {
+						// Trim the corners of the canopy at random
+						if( (dx == -r || dx == r) && (dz == -r || dz == r) && (hash3( h, dx, y, dz ) & 1) )
+							continue;
+						setBlock( cx, cz, tx + dx, y, tz + dz, BLOCK_LEAVES, wood, chunk, true );
+					}
+				}
+			}
+			for( int y = height + 1; y <= top; y++ )
+				setBlock( cx, cz, tx, y, tz, BLOCK_LOG, wood, chunk, false );
+		}
+	}
+}
+
+// -----------------------------------------------------------------
+void WorldGen::buildCityColumn( int x, int z, ChunkData &chunk ) const {
+	// Each district is a 4x4 grid of 16x16 lots, separated by roads
+	// Every lot holds a building of 2 to 10 floors
+	int lx = x & 63, lz = z & 63;
+	int px = lx & 15, pz = lz & 15;
+	int ground = DISTRICT_LEVEL;
+	if( px < 3 || pz < 3 ) {
+		chunk.ids[blockIndex( x, ground, z )] = BLOCK_COBBLESTONE;
+		return;
+	}
+	if( px < 4 || px > 14 || pz < 4 || pz > 14 )
+		return;
+
+	// The building's shape depends only on its lot
+	uint32_t h = hash3( seed + 707, shift_right( x, 4 ), 0, shift_right( z, 4 ) );
+	static const unsigned char materials[4] = { BLOCK_BRICK, BLOCK_STONEBRICK, BLOCK_PLANKS, BLOCK_SANDSTONE };
+	unsigned material = materials[(h >> 8) & 3];
+	int floors = 2 + (int)(h % 9);
+	int roof = ground + floors * 4 + 1;
+
+	bool wall = px == 4 || px == 14 || pz == 4 || pz == 14;
+	bool corner = (px == 4 || px == 14) && (pz == 4 || pz == 14);
+	int along = px == 4 || px == 14 ? pz : px;
+	for( int y = ground; y <= roof; y++ ) {
+		unsigned idx = blockIndex( x, y, z );
+		int fy = (y - ground) & 3;
+		if( y == roof ) {
+			chunk.ids[idx] = (unsigned char)material;
+		} else if( wall ) {
+			if( !corner && (fy == 1 || fy == 2) ) {
+				if( y - ground < 4 && pz == 4 && px == 9 ) {
+					// Doorway
+					chunk.ids[idx] = BLOCK_AIR;
+				} else if( along % 3 == 1 ) {
+					chunk.ids[idx] = BLOCK_GLASS;
+				} else {
+					chunk.ids[idx] = (unsigned char)material;
+				}
+			} else {
+				chunk.ids[idx] = (unsigned char)material;
+			}
+		} else if( fy == 0 ) {
+			chunk.ids[idx] = BLOCK_PLANKS;
+		} else if( fy == 1 && px == 5 && pz == 5 ) {
+			// One standing torch on every floor
+			chunk.ids[idx] = BLOCK_TORCH;
+			chunk.data[idx] = 5;
+			chunk.torches.push_back( idx );
+		}
+	}
+}
+
+// -----------------------------------------------------------------
+void WorldGen::buildSignColumn( int x, int z, ChunkData &chunk ) const {
+	// Sign posts stand on a 3 block grid over the whole district
+	if( (x & 63) % 3 != 1 || (z & 63) % 3 != 1 )
+		return;
+
+	int y = DISTRICT_LEVEL + 1;
+	uint32_t h = hash3( seed + 808, x, y, z );
+	unsigned idx = blockIndex( x, y, z );
+	chunk.ids[idx] = BLOCK_SIGN_POST;
+	chunk.data[idx] = (unsigned char)(h & 15);
+
+	SignDesc sign;
+	sign.x = x;
+	sign.y = y;
+	sign.z = z;
+	char line[32];
+	sign.text[0] = "Eihort";
+	snprintf( line, sizeof(line), "%d, %d", x, z );
+	sign.text[1] = line;
+	snprintf( line, sizeof(line), "%08x", h );
+	sign.text[2] = line;
+	// Some signs are left partially blank
+	sign.text[3] = (h & 0x100) ? "Synthetic" : "";
+	chunk.signs.push_back( sign );
+}
+
+// -----------------------------------------------------------------
+void WorldGen::lightTorches( ChunkData &chunk ) const {
+	// Torches give light 14, falling off by 1 per block of distance
+	// Light is not blocked by walls, and does not cross chunk boundaries
+	const int RANGE = 6;
+	for( auto it = chunk.torches.begin(); it != chunk.torches.end(); ++it ) {
+		int tx = *it & 15, tz = (*it >> 4) & 15, ty = *it >> 8;
+		for( int y = std::max( 0, ty - RANGE ); y <= std::min( 255, ty + RANGE ); y++ ) {
+			for( int z = std::max( 0, tz - RANGE ); z <= std::min( 15, tz + RANGE ); z++ ) {
+				for( int x = std::max( 0, tx - RANGE ); x <= std::min( 15, tx + RANGE ); x++ ) {
+					int dist = abs( x - tx ) + abs( y - ty ) + abs( z - tz );
+					if( dist > RANGE )
+						continue;
+					unsigned char level = (unsigned char)(14 - dist);
+					unsigned idx = blockIndex( x, y, z );
+					if( chunk.blockLight[idx] < level )
+						chunk.blockLight[idx] = level;
+				}
+			}
+		}
+	}
+}
+
+
+// =============================== NBT Output ================================
+
+// -----------------------------------------------------------------
+static nbt::Tag tagByte( int8_t b ) {
+	nbt::Tag tag;
+	tag.type = nbt::TAG_Byte;
+	tag.len = 0;
+	tag.data.b = b;
+	return tag;
+}
+
+// -----------------------------------------------------------------
+static nbt::Tag tagInt( int32_t i ) {
+	nbt::Tag tag;
+	tag.type = nbt::TAG_Int;
+	tag.len = 0;
+	tag.data.i = i;
+	return tag;
+}
+
+// -----------------------------------------------------------------
+static nbt::Tag tagLong( int64_t l ) {
+	nbt::Tag tag;
+	tag.type = nbt::TAG_Long;
+	tag.len = 0;
+	tag.data.l = l;
+	return tag;
+}
+
+// -----------------------------------------------------------------
+static nbt::Tag tagString( const std::string &str ) {
+	nbt::Tag tag;
+	tag.type = nbt::TAG_String;
+	tag.allocPayload( (uint32_t)str.length() );
+	memcpy( tag.data.str, str.data(), str.length() );
+	return tag;
+}
+
+// -----------------------------------------------------------------
+static nbt::Tag tagBytes( const void *src, unsigned len ) {
+	nbt::Tag tag;
+	tag.type = nbt::TAG_Byte_Array;
+	tag.allocPayload( len );
+	memcpy( tag.data.bytes, src, len );
+	return tag;
+}
+
+// -----------------------------------------------------------------
+static nbt::Tag tagIntArray( const int32_t *src, unsigned len ) {
+	nbt::Tag tag;
+	tag.type = nbt::TAG_Int_Array;
+	tag.allocPayload( len );
+	memcpy( tag.data.ia, src, len * sizeof(int32_t) );
+	return tag;
+}
+
+// -----------------------------------------------------------------
+static nbt::Tag tagLongArray( const std::vector<int64_t> &src ) {
+	nbt::Tag tag;
+	tag.type = nbt::TAG_Long_Array;
+	tag.allocPayload( (uint32_t)src.size() );
+	memcpy( tag.data.il, &src[0], src.size() * sizeof(int64_t) );
+	return tag;
+}
+
+// -----------------------------------------------------------------
+static nbt::Tag tagList( nbt::List *list ) {
+	nbt::Tag tag;
+	tag.type = nbt::TAG_List;
+	tag.len = 0;
+	tag.data.list = list;
+	return tag;
+}
+
+// -----------------------------------------------------------------
+static nbt::Tag tagCompound( nbt::Compound *comp ) {
+	nbt::Tag tag;
+	tag.type = nbt::TAG_Compound;
+	tag.len = 0;
+	tag.data.comp = comp;
+	return tag;
+}
+
+// -----------------------------------------------------------------
+static void packNibbles( const unsigned char *src, unsigned char *dest ) {
+	// Pack one section of values into nibbles, low nibble first
+	for( unsigned i = 0; i < 4096; i += 2 )
+		dest[i>>1] = (unsigned char)((src[i] & 0xfu) | ((src[i+1] & 0xfu) << 4));
+}
+
+// -----------------------------------------------------------------
+static nbt::Compound *makePaletteEntry( unsigned id, unsigned data ) {
+	// Translate a block id and data value into its 1.13 block state
+	static const char *const woods[4] = { "oak", "spruce", "birch", "jungle" };
+	nbt::Compound *entry = new nbt::Compound;
+	nbt::Compound *props = NULL;
+	std::string name;
+	char value[8];
+	switch( id ) {
+	case BLOCK_AIR: name = "air"; break;
+	case BLOCK_STONE: name = "stone"; break;
+	case BLOCK_GRASS: name = "grass_block"; break;
+	case BLOCK_DIRT: name = "dirt"; break;
+	case BLOCK_COBBLESTONE: name = "cobblestone"; break;
+	case BLOCK_PLANKS: name = "oak_planks"; break;
+	case BLOCK_BEDROCK: name = "bedrock"; break;
+	case BLOCK_WATER:
+		name = "water";
+		props = new nbt::Compound;
+		(*props)["level"] = tagString( "0" );
+		break;
+	case BLOCK_SAND: name = "sand"; break;
+	case BLOCK_GRAVEL: name = "gravel"; break;
+	case BLOCK_LOG:
+		name = std::string( woods[data & 3] ) + "_log";
+		props = new nbt::Compound;
+		(*props)["axis"] = tagString( "y" );
+		break;
+	case BLOCK_LEAVES: name = std::string( woods[data & 3] ) + "_leaves"; break;
+	case BLOCK_GLASS: name = "glass"; break;
+	case BLOCK_SANDSTONE: name = "sandstone"; break;
+	case BLOCK_TALLGRASS: name = "grass"; break;
+	case BLOCK_DANDELION: name = "dandelion"; break;
+	case BLOCK_POPPY: name = "poppy"; break;
+	case BLOCK_BRICK: name = "bricks"; break;
+	case BLOCK_TORCH: name = "torch"; break;
+	case BLOCK_SIGN_POST:
+		name = "sign";
+		props = new nbt::Compound;
+		snprintf( value, sizeof(value), "%u", data & 15 );
+		(*props)["rotation"] = tagString( value );
+		break;
+	case BLOCK_CACTUS: name = "cactus"; break;
+	case BLOCK_STONEBRICK: name = "stone_bricks"; break;
+	default: name = "air"; break;
+	}
+	(*entry)["Name"] = tagString( "minecraft:" + name );
+	if( props )
+		(*entry)["Properties"] = tagCompound( props );
+	return entry;
+}
+
+// -----------------------------------------------------------------
+static void writePaletteBlocks( const ChunkData &chunk, unsigned base, nbt::Compound *section ) {
+	// Build the palette of the section, in order of first appearance
+	std::vector<unsigned> palette;
+	std::vector<unsigned> indices( 4096 );
+	for( unsigned i = 0; i < 4096; i++ ) {
+		unsigned state = ((unsigned)chunk.ids[base + i] << 4) | (chunk.data[base + i] & 0xfu);
+		unsigned p = 0;
+		while( p < palette.size() && palette[p] != state )
+			p++;
+		if( p == palette.size() )
+			palette.push_back( state );
+		indices[i] = p;
+	}
+
+	nbt::List *paletteList = new nbt::List( nbt::TAG_Compound );
+	for( auto it = palette.begin(); it != palette.end(); ++it )
+		paletteList->push_back( tagCompound( makePaletteEntry( *it >> 4, *it & 15 ) ) );
+	(*section)["Palette"] = tagList( paletteList );
+
+	// Indices are packed tightly with at least 4 bits each, and may
+	// straddle two longs
+	unsigned bits = 4;
+	while( (1u << bits) < palette.size() )
+		bits++;
+	std::vector<int64_t> states( 4096 * bits / 64, 0 );
+	for( unsigned i = 0; i < 4096; i++ ) {
+		unsigned bit = i * bits;
+		uint64_t v = indices[i];
+		states[bit >> 6] = (int64_t)((uint64_t)states[bit >> 6] | (v << (bit & 63)));
+		if( (bit & 63) + bits > 64 )
+			states[(bit >> 6) + 1] = (int64_t)((uint64_t)states[(bit >> 6) + 1] | (v >> (64 - (bit & 63))));
+	}
+	(*section)["BlockStates"] = tagLongArray( states );
+}
+
+// -----------------------------------------------------------------
+static nbt::Compound *makeChunkNBT( int cx, int cz, const ChunkData &chunk, bool palette ) {
+	nbt::Compound *level = new nbt::Compound;
+	(*level)["xPos"] = tagInt( cx );
+	(*level)["zPos"] = tagInt( cz );
+	(*level)["LastUpdate"] = tagLong( 0 );
+	(*level)["InhabitedTime"] = tagLong( 0 );
+	(*level)["TerrainPopulated"] = tagByte( 1 );
+	(*level)["LightPopulated"] = tagByte( 1 );
+
+	// Sky light is full above the highest block of each column
+	int32_t heightMap[256];
+	unsigned topSection = 0;
+	for( unsigned i = 0; i < 256; i++ ) {
+		int y = 255;
+		while( y >= 0 && chunk.ids[((unsigned)y << 8) | i] == BLOCK_AIR )
+			y--;
+		heightMap[i] = y + 1;
+		topSection = std::max( topSection, (unsigned)std::max( y, 0 ) >> 4 );
+	}
+	(*level)["HeightMap"] = tagIntArray( heightMap, 256 );
+
+	if( palette ) {
+		int32_t biomes[256];
+		for( unsigned i = 0; i < 256; i++ )
+			biomes[i] = chunk.biomes[i];
+		(*level)["Biomes"] = tagIntArray( biomes, 256 );
+		(*level)["Status"] = tagString( "full" );
+	} else {
+		(*level)["Biomes"] = tagBytes( chunk.biomes, 256 );
+	}
+
+	// Only sections up to the highest block are written, as by Minecraft
+	nbt::List *sections = new nbt::List( nbt::TAG_Compound );
+	unsigned char values[4096], nibbles[2048];
+	for( unsigned sy = 0; sy <= topSection; sy++ ) {
+		unsigned base = sy << 12;
+		nbt::Compound *section = new nbt::Compound;
+		(*section)["Y"] = tagByte( (int8_t)sy );
+		if( palette ) {
+			writePaletteBlocks( chunk, base, section );
+		} else {
+			(*section)["Blocks"] = tagBytes( &chunk.ids[base], 4096 );
+			packNibbles( &chunk.data[base], nibbles );
+			(*section)["Data"] = tagBytes( nibbles, 2048 );
+		}
+		packNibbles( &chunk.blockLight[base], nibbles );
+		(*section)["BlockLight"] = tagBytes( nibbles, 2048 );
+		for( unsigned i = 0; i < 4096; i++ )
+			values[i] = (int)(sy * 16 + (i >> 8)) >= heightMap[i & 255] ? 15 : 0;
+		packNibbles( values, nibbles );
+		(*section)["SkyLight"] = tagBytes( nibbles, 2048 );
+		sections->push_back( tagCompound( section ) );
+	}
+	(*level)["Sections"] = tagList( sections );
+
+	nbt::List *tileEntities = new nbt::List( nbt::TAG_Compound );
+	for( auto it = chunk.signs.begin(); it != chunk.signs.end(); ++it ) {
+		nbt::Compound *te = new nbt::Compound;
+		(*te)["id"] = tagString( palette ? "minecraft:sign" : "Sign" );
+		(*te)["x"] = tagInt( it->x );
+		(*te)["y"] = tagInt( it->y );
+		(*te)["z"] = tagInt( it->z );
+		for( unsigned i = 0; i < 4; i++ ) {
+			char name[8];
+			snprintf( name, sizeof(name), "Text%u", i + 1 );
+			// 1.13 stores sign text as JSON text components
+			(*te)[name] = tagString( palette ? "{\"text\":\"" + it->text[i] + "\"}" : it->text[i] );
+		}
+		tileEntities->push_back( tagCompound( te ) );
+	}
+	(*level)["TileEntities"] = tagList( tileEntities );
+	(*level)["Entities"] = tagList( new nbt::List( nbt::TAG_Compound ) );
+
+	nbt::Compound *root = new nbt::Compound;
+	(*root)["Level"] = tagCompound( level );
+	if( palette )
+		(*root)["DataVersion"] = tagInt( PALETTE_DATA_VERSION );
+	return root;
+}
+
+// -----------------------------------------------------------------
+static bool writeRegion( const WorldGen &gen, const std::string &root, int rx, int rz, bool palette, ChunkData &chunk, unsigned &nSigns ) {
+	// Generate and compress all chunks first, to lay out the sectors
+	std::vector<unsigned char> compressed[1024];
+	for( unsigned i = 0; i < 1024; i++ ) {
+		int cx = rx * 32 + (int)(i & 31);
+		int cz = rz * 32 + (int)(i >> 5);
+		gen.generateChunk( cx, cz, chunk );
+		nSigns += (unsigned)chunk.signs.size();
+		nbt::Compound *nbt = makeChunkNBT( cx, cz, chunk, palette );
+		nbt->writeCompressed( compressed[i], "" );
+		delete nbt;
+	}
+
+	// Chunks are stored in whole 4K sectors after the two header sectors
+	// Timestamps are all zero, to keep the output reproducible
+	std::vector<uint32_t> header( 2048, 0 );
+	uint32_t sector = 2;
+	for( unsigned i = 0; i < 1024; i++ ) {
+		uint32_t sectors = (uint32_t)(compressed[i].size() + 5 + 4095) >> 12;
+		header[i] = bswap_to_big( (sector << 8) | sectors );
+		sector += sectors;
+	}
+
+	char filename[MAX_PATH];
+	snprintf( filename, MAX_PATH, "%sregion/r.%d.%d.mca", root.c_str(), rx, rz );
+	FILE *f = fopen( filename, "wb" );
+	if( !f )
+		return false;
+	fwrite( &header[0], 4, 2048, f );
+	static const unsigned char padding[4096] = { 0 };
+	for( unsigned i = 0; i < 1024; i++ ) {
+		// Chunk length, including the compression type, then zlib data
+		uint32_t len = bswap_to_big( (uint32_t)compressed[i].size() + 1 );
+		unsigned char compression = 2;
+		fwrite( &len, 4, 1, f );
+		fwrite( &compression, 1, 1, f );
+		fwrite( &compressed[i][0], 1, compressed[i].size(), f );
+		size_t used = (compressed[i].size() + 5) & 4095;
+		if( used )
+			fwrite( padding, 1, 4096 - used, f );
+	}
+	bool ok = !ferror( f );
+	fclose( f );
+	return ok;
+}
+
+// -----------------------------------------------------------------
+static void writeLevelDat( const std::string &root, uint32_t seed, bool palette ) {
+	nbt::Compound *data = new nbt::Compound;
+	char name[64];
+	snprintf( name, sizeof(name), "Synthetic %u", seed );
+	(*data)["LevelName"] = tagString( name );
+	(*data)["version"] = tagInt( 19133 );
+	(*data)["RandomSeed"] = tagLong( seed );
+	(*data)["generatorName"] = tagString( "default" );
+	(*data)["LastPlayed"] = tagLong( 0 );
+	(*data)["Time"] = tagLong( 0 );
+	(*data)["DayTime"] = tagLong( 6000 );
+	(*data)["initialized"] = tagByte( 1 );
+	(*data)["SpawnX"] = tagInt( 32 );
+	(*data)["SpawnY"] = tagInt( DISTRICT_LEVEL + 1 );
+	(*data)["SpawnZ"] = tagInt( 32 );
+	if( palette )
+		(*data)["DataVersion"] = tagInt( PALETTE_DATA_VERSION );
+
+	nbt::Compound level;
+	level["Data"] = tagCompound( data );
+	level.write( (root + "level.dat").c_str(), "" );
+}
+
+// -----------------------------------------------------------------
+static bool createDirectory( const std::string &path ) {
+#ifdef _WINDOWS
+	return CreateDirectoryA( path.c_str(), NULL ) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+	struct stat st;
+	return mkdir( path.c_str(), S_IRWXU | S_IRWXG | S_IRWXO ) == 0 || (stat( path.c_str(), &st ) == 0 && S_ISDIR( st.st_mode ));
+#endif
+}
+
+// -----------------------------------------------------------------
+static void usage() {
+	fprintf( stderr,
+		"Usage: eihort-worldgen [options] <output folder>\n"
+		"  --seed <n>\n"
+		"  --regions <n>\n"
+		"  --palette\n" );
+}
+
+// ================================= Main ====================================
+int main( int argc, char **argv ) {
+	uint32_t seed = 1;
+	unsigned nRegions = 1;
+	bool palette = false;
+	const char *outPath = NULL;
+	for( int i = 1; i < argc; i++ ) {
+		if( 0 == strcmp( argv[i], "--seed" ) && i + 1 < argc ) {
+			seed = (uint32_t)strtoul( argv[++i], NULL, 10 );
+		} else if( 0 == strcmp( argv[i], "--regions" ) && i + 1 < argc ) {
+			nRegions = (unsigned)atoi( argv[++i] );
+		} else if( 0 == strcmp( argv[i], "--palette" ) ) {
+			palette = true;
+		} else if( argv[i][0] != '-' && !outPath ) {
+			outPath = argv[i];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if( !outPath || nRegions == 0 ) {
+		usage();
+		return 1;
+	}
+
+	std::string root = outPath;
+	if( root[root.length()-1] != '/' && root[root.length()-1] != '\\' )
+		root += '/';
+	if( !createDirectory( root ) || !createDirectory( root + "region" ) ) {
+		fprintf( stderr, "Failed to create %s\n", outPath );
+		return 1;
+	}
+	writeLevelDat( root, seed, palette );
+
+	// Regions fill a square around the origin, row by row, starting with
+	// the region containing the origin
+	unsigned side = 1;
+	while( side * side < nRegions )
+		side++;
+	WorldGen gen( seed );
+	ChunkData *chunk = new ChunkData;
+	unsigned nSigns = 0;
+	for( unsigned i = 0; i < nRegions; i++ ) {
+		int rx = (int)(i % side) - (int)((side - 1) / 2);
+		int rz = (int)(i / side) - (int)((side - 1) / 2);
+		fprintf( stderr, "Writing region %d, %d (%u/%u)\n", rx, rz, i + 1, nRegions );
+		if( !writeRegion( gen, root, rx, rz, palette, *chunk, nSigns ) ) {
+			fprintf( stderr, "Failed to write region %d, %d\n", rx, rz );
+			return 1;
+		}
+	}
+	delete chunk;
+
+	printf( "Wrote %u regions (%u chunks, %u signs) to %s\n", nRegions, nRegions * 1024, nSigns, outPath );
+	return 0;
+}
@@ -0,0 +1,158 @@
+
+-- This module adjusts the loading settings of a view while it runs
+-- Every few seconds it looks at how long leaves take to build, how busy the
+-- workers are, how long uploads take each frame and whether video memory is
+-- running out, then moves the worker limit and upload budget within the
+-- bounds set in eihort.config and prints what it changed
+-- It also suggests a qtree_leaf_size for each world, which is used the
+-- next time the world is opened when autotune_leaf_size is set
+
+
+------------------------------------------------------------------------------
+-- Leaf size suggestions
+
+local function clamp( v, lo, hi )
+	return math.max( lo, math.min( hi, v ) );
+end
+
+function getTunedLeafShift( worldPath )
+	-- Returns the leaf size suggested for this world earlier in this run,
+	-- or nil if there is none yet
+	return ProgramState.tunedLeafShifts and ProgramState.tunedLeafShifts[worldPath];
+end
+
+local function suggestLeafShift( leafShift, buildMs, drawCalls )
+	-- Leaves which take too long to build are made smaller, and leaves
+	-- which are quick to build but need many draw calls are made larger
+	-- Each step changes the area of a leaf (and its build time) by 4x
+	local targetMs = Config.autotune_leaf_build_ms or 100;
+	local maxDraws = Config.autotune_max_draw_calls or 2000;
+	if buildMs > 2 * targetMs and leafShift > 5 then
+		return leafShift - 1;
+	elseif buildMs < targetMs / 2 and drawCalls > maxDraws and leafShift < 9 then
+		return leafShift + 1;
+	end
+	return leafShift;
+end
+
+------------------------------------------------------------------------------
+-- Controller
+
+function NewAutoTuner( view, worldPath, leafShift )
+	-- Returns a function to call on every idle event
+	local interval = Config.autotune_interval or 2;
+	local poolSize = eihort.getWorkerStats();
+	local minWorkers = clamp( Config.autotune_min_workers or 1, 1, poolSize );
+	local maxWorkers = Config.autotune_max_workers or 0;
+	if maxWorkers <= 0 or maxWorkers > poolSize then
+		maxWorkers = poolSize;
+	end
+	maxWorkers = math.max( maxWorkers, minWorkers );
+	local minUploadUs = Config.autotune_min_upload_us or 1000;
+	local maxUploadUs = math.max( Config.autotune_max_upload_us or 12000, minUploadUs );
+
+	-- Start with every worker and the default upload budget
+	local workers = maxWorkers;
+	local uploadUs = clamp( 4000, minUploadUs, maxUploadUs );
+	view:setWorkerLimit( workers );
+	view:setUploadBudget( uploadUs );
+
+	local function log( fmt, ... )
+		io.stdout:write( "autotune: ", string.format( fmt, ... ), "\n" );
+		io.stdout:flush();
+	end
+
+	-- Counters at the start of the current interval
+	local lastTime = eihort.getTime();
+	local _, lastBusyMs = eihort.getWorkerStats();
+	local _, _, _, lastBuildMs = view:getLoadStats();
+	local lastLeaves = view:getBuilderStats();
+	local lastDropped = view:getGpuResidency().dropped;
+	local firstLeaves, firstBuildMs = lastLeaves, lastBuildMs;
+
+	-- Samples taken during the current interval
+	local samples, workerWaits, uploadWaits, uploadTime, queued = 0, 0, 0, 0, 0;
+	local suggested = leafShift;
+
+	local function adjust( dt )
+		local _, busyMs = eihort.getWorkerStats();
+		local _, _, _, buildMs = view:getLoadStats();
+		local leaves = view:getBuilderStats();
+		local gpu = view:getGpuResidency();
+		local _, _, _, _, drawCalls = view:getLastFrameStats();
+
+		local busy = (busyMs - lastBusyMs) / (dt * 1000 * workers);
+		local built = leaves - lastLeaves;
+		local dropped = gpu.dropped - lastDropped;
+		local workerBound = workerWaits / samples > 0.5;
+		local uploadBound = uploadWaits / samples > 0.25;
+		local meanUploadUs = uploadTime / samples;
+		lastBusyMs, lastBuildMs, lastLeaves, lastDropped = busyMs, buildMs, leaves, gpu.dropped;
+
+		-- Upload budget: raise it while built meshes pile up, and let it
+		-- fall back when uploads take a fraction of it
+		if uploadBound and uploadUs < maxUploadUs then
+			local newUs = clamp( math.floor( uploadUs * 1.5 ), minUploadUs, maxUploadUs );
+			log( "upload budget %d -> %d us (upload queue full in %d%% of frames)",
+				uploadUs, newUs, math.floor( 100 * uploadWaits / samples ) );
+			uploadUs = newUs;
+			view:setUploadBudget( uploadUs );
+		elseif queued / samples < 1 and meanUploadUs < uploadUs / 4 and uploadUs > minUploadUs then
+			local newUs = clamp( math.floor( uploadUs * 0.75 ), minUploadUs, maxUploadUs );
+			log( "upload budget %d -> %d us (%d us used per frame)", uploadUs, newUs, math.floor( meanUploadUs ) );
+			uploadUs = newUs;
+			view:setUploadBudget( uploadUs );
+		end
+
+		-- Worker limit: building leaves which are thrown away for lack of
+		-- video memory, or faster than they can be uploaded, is wasted work
+		if dropped > 0 and workers > minWorkers then
+			log( "workers %d -> %d (%d meshes dropped, gpu %.0f/%.0f MB)", workers, workers - 1,
+				dropped, gpu.used / 1048576, gpu.budget / 1048576 );
+			workers = workers - 1;
+			view:setWorkerLimit( workers );
+		elseif uploadBound and uploadUs >= maxUploadUs and workers > minWorkers then
+			log( "workers %d -> %d (upload budget exhausted)", workers, workers - 1 );
+			workers = workers - 1;
+			view:setWorkerLimit( workers );
+		elseif workerBound and not uploadBound and dropped == 0 and busy > 0.8 and workers < maxWorkers then
+			log( "workers %d -> %d (%d%% busy, %d leaves built, leaves waiting in %d%% of frames)",
+				workers, workers + 1, math.floor( 100 * busy ), built, math.floor( 100 * workerWaits / samples ) );
+			workers = workers + 1;
+			view:setWorkerLimit( workers );
+		end
+
+		-- Leaf size: judged on all leaves built so far in this world
+		local totalLeaves = leaves - firstLeaves;
+		if totalLeaves >= 32 then
+			local meanBuildMs = (buildMs - firstBuildMs) / totalLeaves;
+			local shift = suggestLeafShift( leafShift, meanBuildMs, drawCalls );
+			if shift ~= suggested then
+				suggested = shift;
+				log( "leaves build in %.0f ms with %d draw calls; suggest qtree_leaf_size = %d",
+					meanBuildMs, drawCalls, shift );
+				ProgramState.tunedLeafShifts = ProgramState.tunedLeafShifts or { };
+				ProgramState.tunedLeafShifts[worldPath] = shift;
+			end
+		end
+	end
+
+	return function()
+		-- Sample the per-frame statistics
+		local _, waitingForWorker, waitingForUpload = view:getLoadStats();
+		local nQueued, _, us = view:getUploadStats();
+		samples = samples + 1;
+		workerWaits = workerWaits + (waitingForWorker > 0 and 1 or 0);
+		uploadWaits = uploadWaits + (waitingForUpload > 0 and 1 or 0);
+		uploadTime = uploadTime + us;
+		queued = queued + nQueued;
+
+		local t = eihort.getTime();
+		if t - lastTime >= interval then
+			adjust( t - lastTime );
+			lastTime = t;
+			samples, workerWaits, uploadWaits, uploadTime, queued = 0, 0, 0, 0, 0;
+		end
+	end;
+end
+
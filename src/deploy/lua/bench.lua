@@ -0,0 +1,69 @@
+
+-- This module is the entry point for eihort-bench, the headless mesh
+-- building benchmark
+-- It stands in for the parts of the eihort API which need a window or GL
+-- context, then loads the stock block tables
+
+
+package.path = eihort.ProgramPath .. "lua/?.lua;;";
+
+-- Missing textures are replaced with blank images rather than failing
+Config = { silent_fail_texture_load = true };
+
+------------------------------------------------------------------------------
+-- Stand-ins for the functions normally provided by main.cpp
+
+function eihort.errorDialog( title, msg )
+	io.stderr:write( title, ": ", msg, "\n" );
+end
+
+function eihort.errorDialogYesNo( title, msg )
+	io.stderr:write( title, ": ", msg, "\n" );
+	return false;
+end
+
+function eihort.setFontLoader( loader )
+end
+
+function eihort.intAnd( a, b )
+	return bit32.band( a, b );
+end
+
+function eihort.intOr( a, b )
+	return bit32.bor( a, b );
+end
+
+------------------------------------------------------------------------------
+-- Textures are never uploaded; images hand out unique fake texture ids
+-- instead, since the meshes only store the ids
+
+local nextTextureId = 1;
+local imageMeta = debug.getregistry()["Image"];
+local imageIndex = imageMeta.__index;
+
+local function uploadToGL( img, reuse )
+	-- An existing texture id may be given for re-use
+	if type(reuse) == "number" then
+		return reuse;
+	end
+	nextTextureId = nextTextureId + 1;
+	return nextTextureId;
+end
+
+imageMeta.__index = function( img, key )
+	if key == "uploadToGL" then
+		return uploadToGL;
+	end
+	return imageIndex( img, key );
+end
+
+require "blockids"
+require "biomes"
+
+------------------------------------------------------------------------------
+function loadBenchBlockDesc( worldRoot )
+	-- Returns the block descriptions and the biome ID -> coordinate table
+	local blocks = loadBlockDesc();
+	loadBiomeTextures( blocks, worldRoot );
+	return blocks, getBiomeCoordData();
+end
@@ -283,6 +283,10 @@ do
 		workerCount = eihort.getProcessorCount();
 	end
 	eihort.initWorkers( workerCount );
+
+	if Config.deveoper_tools and Config.trace_timeline then
+		eihort.setTracing( true );
+	end
 end
 
 ------------------------------------------------------------------------------
@@ -384,6 +388,10 @@ if #argv > 0 then
 			if tonumber( argv[key + 1] ) then
 				Config.max_gpu_mem = argv[key + 1];
 			end
+		elseif val == "--bench" or val == "-bench" then -- replay a camera path saved with the splinesave key
+			argSettings.benchPath = argv[key + 1];
+		elseif val == "--bench-out" or val == "-bench-out" then -- write the benchmark report here instead of stdout
+			argSettings.benchReport = argv[key + 1];
 		else
 			if key == 1 then -- set world path if somebody is not using -w /world/to/path
 				argSettings.worldPath = val;
@@ -391,6 +399,19 @@ if #argv > 0 then
 		end
 	end
 	
+	if argSettings.benchPath then
+		-- The camera path knows which world it was recorded in
+		local splines, world, dim = LoadSplines( argSettings.benchPath );
+		if not splines then
+			eihort.errorDialog( LANG"ERR_Error", world );
+			return 1;
+		end
+		argSettings.benchSplines = splines;
+		argSettings.worldPath = argSettings.worldPath or world;
+		argSettings.dim = argSettings.dim or dim;
+		ProgramState.useCmdArgs = true;
+	end
+
 	startWorld, startWorldName = loadWorld( argSettings.worldPath );
 	if not startWorld or startWorld:getRegionCount() == 0 then
 		eihort.errorDialog( LANG"ERR_Error", LANG( "ERR_No_Regions", argSettings.worldPath ) );
@@ -404,7 +425,12 @@ end
 ScreenWidth = Config.screenwidth or 800;
 ScreenHeight = Config.screenheight or 600;
 ScreenAspect = ScreenWidth / ScreenHeight;
-assert( eihort.initializeVideo( ScreenWidth, ScreenHeight, Config.fullscreen, Config.multisample or 0 ) );
+if argSettings.benchSplines then
+	-- Benchmarks render into a hidden window without vsync
+	assert( eihort.initializeVideo( ScreenWidth, ScreenHeight, false, Config.multisample or 0, true ) );
+else
+	assert( eihort.initializeVideo( ScreenWidth, ScreenHeight, Config.fullscreen, Config.multisample or 0 ) );
+end
 
 if startWorld then
 	-- World loaded - enter the main map view
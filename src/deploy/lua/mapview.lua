@@ -6,6 +6,8 @@ require "ui"
 require "blockids"
 require "biomes"
 require "spline"
+require "pathbench"
+require "autotune"
 require "assets"
 require "lang"
 
@@ -289,6 +291,26 @@ local function GetWorldTime( worldPath )
 	return worldTime;
 end
 
+-- Starts reading the chunks around the player on the workers, so they are
+-- ready by the time the view asks for them
+local function startPreload( world, worldPath, argsTable )
+	local radius = Config.preload_radius or 0;
+	if radius <= 0 or (argsTable and argsTable.benchSplines) then
+		return false;
+	end
+	-- Positions given on the command line and other dimensions are not
+	-- preloaded, since the view only moves there later
+	if ProgramState.useCmdArgs and argsTable and (argsTable.eyeX or argsTable.eyeZ or argsTable.dim) then
+		return false;
+	end
+	local x, _, z, _, _, dim = getPlayerPosition( worldPath );
+	if dim ~= 0 then
+		return false;
+	end
+	world:preload( x, z, math.min( radius, Config.start_view_distance or 500 ) );
+	return true;
+end
+
 -- Add shortcut button tooltips
 local function ShortcutButtonTooltip( shortcutName, buttonTable )
 	local output = LANG"EO_Shortcut" .. ": ";
@@ -419,10 +441,16 @@ end
 function beginMapView( world, worldName, argsTable )
 	-- Create the main worldView object which will be doing the rendering
 	local worldPath = world:getRootPath();
+	local preloading = startPreload( world, worldPath, argsTable );
 	local blocks = loadBlockDesc();
 	loadBiomeTextures( blocks, world:getRootPath() );
-	local worldView = world:createView( blocks, Config.qtree_leaf_size or 7, getBiomeCoordData() );
+	local leafShift = Config.qtree_leaf_size or 7;
+	if Config.autotune and Config.autotune_leaf_size then
+		leafShift = getTunedLeafShift( worldPath ) or leafShift;
+	end
+	local worldView = world:createView( blocks, leafShift, getBiomeCoordData() );
 	setGpuAllowance( worldView );
+	worldView:setLODDistance( Config.lod_distance or 0 );
 	
 	-- Load the skies
 	local owSky, setMoonPhase = createOverworldSky();
@@ -592,6 +620,17 @@ function beginMapView( world, worldName, argsTable )
 	local infoformat = string.format( "%s: (%%.0f %%.0f %%.0f)\n%%s%%s%%s%%s%%s%s\n\n%s: %%s\n%s: %%.0f:%%02.0f\n%s: %%.0f%%s",
 		LANG"INFO_Coords", LANG"INFO_Config", LANG"INFO_Light_Strength",
 		LANG"INFO_Time", LANG"INFO_View_Distance" );
+	local function preloadStatus()
+		-- Progress of the chunks being preloaded, while there are any left
+		if not preloading then
+			return "";
+		end
+		local done, total = world:getPreloadProgress();
+		if done >= total then
+			return "";
+		end
+		return string.format( "\n%s: %d%%", LANG"INFO_Preload", math.floor( 100 * done / total ) );
+	end
 	local function refreshInfoDisplay()
 		local triCount, vtxMem, idxMem, texMem = worldView:getLastFrameStats();
 		infoDisplay.text = string.format( infoformat,
@@ -607,7 +646,7 @@ function beginMapView( world, worldName, argsTable )
 			lightStr,
 			math.floor( worldTime * 12 + 12 ), math.floor( math.fmod( worldTime * 12 + 12, 1 ) * 60 ),
 			viewDistance,
-			(monitorEnabled and "\n" .. LANG"INFO_Monitor") or "" );
+			((monitorEnabled and "\n" .. LANG"INFO_Monitor") or "") .. preloadStatus() );
 	end
 	
 	-- Move the player to another dimension
@@ -626,7 +665,11 @@ function beginMapView( world, worldName, argsTable )
 			refreshPosition();
 			if dim == 0 then
 				-- Change the lighting to the overworld lighting
-				world:changeRootPath( worldPath );
+				-- (the world starts out in the overworld folder; changing to
+				-- it again would wait for the preloading to finish)
+				if world:getRootPath() ~= worldPath then
+					world:changeRootPath( worldPath );
+				end
 				light0 = 0.8^15;
 				lightStr = LANG"INFO_LS_Overworld";
 				updateLightModels = updateLightModels_overworld;
@@ -913,6 +956,16 @@ function beginMapView( world, worldName, argsTable )
 			end
 			splinet = splines.x.n-1;
 		end;
+		-- Save the spline as a camera path for eihort --bench
+		splinesave = function()
+			if splines.x.n > 0 then
+				local fn = os.date( eihort.output_path .. "eihort-%Y.%m.%d-%H.%M.%S.spline" );
+				local success, msg = SaveSplines( fn, splines, worldPath, inDim );
+				if not success then
+					eihort.errorDialog( LANG"ERR_Error", msg );
+				end
+			end
+		end;
 		
 		-- Developer keys
 		restarteihort = function()
@@ -920,6 +973,20 @@ function beginMapView( world, worldName, argsTable )
 				RestartEihort( worldPath, eyeX, eyeY, eyeZ, TransformViewDirection( "pitch", "minecraft", pitch ), TransformViewDirection ( "azimuth", "minecraft", azimuth ), inDim );
 			end
 		end;
+		-- Start recording a timeline, or dump the one being recorded
+		dumptrace = function()
+			if Config.deveoper_tools and Config.enable_developer_keys then
+				if not eihort.isTracing() then
+					eihort.setTracing( true );
+				else
+					eihort.createDirectory( Config.deveoper_tools_path );
+					local fn = os.date( Config.deveoper_tools_path .. "trace-%Y.%m.%d-%H.%M.%S.json" );
+					if not eihort.dumpTrace( fn ) then
+						eihort.errorDialog( "Trace", LANG( "ERR_Failed_Open", fn ) );
+					end
+				end
+			end
+		end;
 	};
 
 	-------------------------------------------------------------------
@@ -1313,9 +1380,53 @@ function beginMapView( world, worldName, argsTable )
 	
 	local minFrameTime = 1 / (Config.fps_limit or 60);
 	local lastFrameTime = eihort.getTime();
+	local memoryLogInterval = Config.memory_log_interval or 0;
+	local lastMemoryLog = lastFrameTime;
+	local benchmarking = argsTable and argsTable.benchSplines;
+	local autoTune = Config.autotune and not benchmarking and NewAutoTuner( worldView, worldPath, leafShift );
+	local lastPreloadDone = 0;
+
+	local function logMemory()
+		-- Prints one line with the memory held by each consumer, in MB
+		local stats = eihort.getMemoryStats();
+		local gpu = worldView:getGpuResidency();
+		local names = { };
+		for name, _ in pairs( stats ) do
+			if name ~= "total" then
+				table.insert( names, name );
+			end
+		end
+		table.sort( names );
+		local parts = { };
+		for _, name in ipairs( names ) do
+			table.insert( parts, string.format( "%s %.1f", name, stats[name].bytes / 1048576 ) );
+		end
+		io.stdout:write( string.format( "memory (MB): total %.1f, %s, gpu %.1f/%.1f\n",
+			stats.total / 1048576, table.concat( parts, ", " ), gpu.used / 1048576, gpu.budget / 1048576 ) );
+		io.stdout:flush();
+	end
 
 	Event.idle = function()
 		local t = eihort.getTime();
+		if memoryLogInterval > 0 and t - lastMemoryLog >= memoryLogInterval then
+			lastMemoryLog = t;
+			logMemory();
+		end
+		if autoTune then
+			autoTune();
+		end
+		if preloading then
+			local done, total = world:getPreloadProgress();
+			if done ~= lastPreloadDone then
+				lastPreloadDone = done;
+				redrawNextFrame = true;
+			end
+			if done >= total and worldView:getBuilderStats() > 0 and not worldView:isLoading() then
+				-- Free the chunks which the view never asked for
+				world:endPreload();
+				preloading = false;
+			end
+		end
 		local dt = t - lastFrameTime;
 		if dt > minFrameTime then
 			if dt > 0.1 then
@@ -1328,4 +1439,26 @@ function beginMapView( world, worldName, argsTable )
 		end
 		return true;
 	end;
+
+	-------------------------------------------------------------------
+	-- Camera path benchmark
+
+	if argsTable and argsTable.benchSplines then
+		-- Frames are only drawn by the benchmark, one per simulated step
+		local redraw = Event.redraw;
+		Event.redraw = function() end;
+		splines = argsTable.benchSplines;
+		showUI = false;
+		Event.idle = NewPathBenchmark( argsTable.benchPath, argsTable.benchReport, splines, worldView, {
+			setSplineT = function( t )
+				splinet = t;
+				resolveSplinePos();
+				refreshPosition();
+			end;
+			redraw = redraw;
+			finish = function()
+				QuitFlag = 0;
+			end;
+		} );
+	end
 end
@@ -0,0 +1,185 @@
+
+-- This module drives the camera path benchmark, started with
+-- eihort --bench path.spline
+-- The camera follows the path at a fixed simulated timestep, holding at each
+-- waypoint until everything in view has loaded, and a JSON report is written
+-- when it reaches the end
+
+
+------------------------------------------------------------------------------
+-- JSON output
+
+local function quoteJSON( s )
+	-- Quotes and escapes a string
+	return '"' .. string.gsub( s, '[%c"\\]', function( c )
+		return string.format( "\\u%04x", string.byte( c ) );
+	end ) .. '"';
+end
+
+local function writeJSON( out, value, indent )
+	-- Writes a value made of tables, strings, numbers and booleans
+	-- Tables with a non-empty array part are written as arrays, and all
+	-- other tables must have string keys
+	local t = type( value );
+	if t == "table" then
+		local inner = indent .. "\t";
+		if #value > 0 then
+			out:write( "[" );
+			for i, v in ipairs( value ) do
+				out:write( i > 1 and ", " or "" );
+				writeJSON( out, v, inner );
+			end
+			out:write( "]" );
+		else
+			local keys = { };
+			for k, _ in pairs( value ) do
+				table.insert( keys, k );
+			end
+			table.sort( keys );
+			out:write( "{" );
+			for i, k in ipairs( keys ) do
+				out:write( i > 1 and ",\n" or "\n", inner, quoteJSON( k ), ": " );
+				writeJSON( out, value[k], inner );
+			end
+			out:write( #keys > 0 and ("\n" .. indent) or "", "}" );
+		end
+	elseif t == "number" then
+		if value ~= value or value == math.huge or value == -math.huge then
+			out:write( "null" );
+		elseif value == math.floor( value ) and math.abs( value ) < 2^53 then
+			out:write( string.format( "%d", value ) );
+		else
+			out:write( string.format( "%.6g", value ) );
+		end
+	elseif t == "string" then
+		out:write( quoteJSON( value ) );
+	elseif t == "boolean" then
+		out:write( tostring( value ) );
+	else
+		out:write( "null" );
+	end
+end
+
+------------------------------------------------------------------------------
+-- Statistics
+
+local function summarize( samples )
+	-- Mean, median, 99th percentile and maximum of a list of numbers
+	local n = #samples;
+	if n == 0 then
+		return { count = 0 };
+	end
+	local sorted, sum = { }, 0;
+	for i, v in ipairs( samples ) do
+		sorted[i] = v;
+		sum = sum + v;
+	end
+	table.sort( sorted );
+	return {
+		count = n;
+		mean = sum / n;
+		p50 = sorted[math.ceil( n * 0.5 )];
+		p99 = sorted[math.ceil( n * 0.99 )];
+		max = sorted[n];
+	};
+end
+
+------------------------------------------------------------------------------
+-- Benchmark driver
+
+function NewPathBenchmark( pathFile, reportFile, splines, view, hooks )
+	-- Returns the Event.idle function which runs the benchmark
+	-- hooks.setSplineT( t ) moves the camera to point t on the path
+	-- hooks.redraw() renders one frame
+	-- hooks.finish() is called once the report has been written
+	local step = 1 / (Config.bench_fps or 60);
+	local speed = Config.spline_speed or 0.5;
+	local settleTimeout = Config.bench_waypoint_timeout or 60;
+	local lastPoint = splines.x.n - 1;
+
+	local frames, frameMs, waypoints = { }, { }, { };
+	local t, waypoint = 0, 0;
+	local settling, settleStart, settleFrames = true, eihort.getTime(), 0;
+	local startTime = settleStart;
+	local done = false;
+
+	eihort.resetProfile();
+	hooks.setSplineT( 0 );
+
+	local function writeReport()
+		local gpu = view:getGpuResidency();
+		local report = {
+			path = pathFile;
+			seconds = eihort.getTime() - startTime;
+			frameMs = summarize( frameMs );
+			waypoints = waypoints;
+			gpuBytes = gpu.used;
+			gpuPeakBytes = 0;
+			evictions = gpu.evictions;
+			memory = eihort.getMemoryStats();
+			profile = eihort.getProfile();
+			slowestLeaves = view:getSlowestLeaves();
+			-- One entry per frame: { t, ms, leavesLoading, gpuBytes }
+			frames = frames;
+		};
+		for _, f in ipairs( frames ) do
+			report.gpuPeakBytes = math.max( report.gpuPeakBytes, f[4] );
+		end
+
+		local out = io.stdout;
+		if reportFile then
+			local msg;
+			out, msg = io.open( reportFile, "w" );
+			if not out then
+				io.stderr:write( "Failed to write ", reportFile, ": ", msg, "\n" );
+				out = io.stdout;
+			end
+		end
+		writeJSON( out, report, "" );
+		out:write( "\n" );
+		if out ~= io.stdout then
+			out:close();
+		end
+	end
+
+	return function()
+		if done then
+			return true;
+		end
+
+		-- Render a frame at the current point
+		local before = eihort.getTime();
+		hooks.redraw();
+		local ms = (eihort.getTime() - before) * 1000;
+		local loading, nLoading = view:isLoading();
+		table.insert( frameMs, ms );
+		table.insert( frames, { t, ms, nLoading or 0, view:getGpuResidency().used } );
+
+		if settling then
+			-- Hold until nothing is left to load around the waypoint
+			settleFrames = settleFrames + 1;
+			local elapsed = eihort.getTime() - settleStart;
+			local timedOut = elapsed > settleTimeout;
+			if (not loading and settleFrames > 1) or timedOut then
+				table.insert( waypoints, { t = waypoint; loadSeconds = elapsed; frames = settleFrames; timedOut = timedOut } );
+				settling = false;
+				if waypoint >= lastPoint then
+					done = true;
+					writeReport();
+					hooks.finish();
+					return true;
+				end
+				waypoint = waypoint + 1;
+			end
+		else
+			-- Advance along the path at a fixed rate per frame
+			t = math.min( t + speed * step, waypoint );
+			hooks.setSplineT( t );
+			if t >= waypoint then
+				settling, settleStart, settleFrames = true, eihort.getTime(), 0;
+			end
+		end
+		return false;
+	end;
+end
+
@@ -62,3 +62,60 @@ end
 
 
 
+---------------------------------------------
+-- The camera path is made up of these splines, in this order
+local pathComponents = { "x", "y", "z", "azimuth", "pitch" };
+
+---------------------------------------------
+function SaveSplines( filename, splines, world, dim )
+	-- Saves a camera path (a table of splines keyed by pathComponents)
+	-- to a .spline file, along with the world it was recorded in
+	local f, msg = io.open( filename, "w" );
+	if not f then
+		return false, msg;
+	end
+	f:write( "-- Eihort camera path\nreturn {\n" );
+	f:write( "\tworld = ", string.format( "%q", world ), ";\n" );
+	f:write( "\tdim = ", dim, ";\n" );
+	f:write( "\tpoints = {\n" );
+	for i = 1, splines.x.n do
+		local pt = { };
+		for j, k in ipairs( pathComponents ) do
+			pt[j] = string.format( "%.17g", splines[k].x[i] );
+		end
+		f:write( "\t\t{ ", table.concat( pt, ", " ), " };\n" );
+	end
+	f:write( "\t};\n};\n" );
+	f:close();
+	return true;
+end
+
+---------------------------------------------
+function LoadSplines( filename )
+	-- Loads a camera path saved by SaveSplines
+	-- Returns the splines, the world path and the dimension,
+	-- or nil and an error message
+	local chunk, msg = loadfile( filename, "t", { } );
+	if not chunk then
+		return nil, msg;
+	end
+	local ok, path = pcall( chunk );
+	if not ok then
+		return nil, path;
+	end
+	if type( path ) ~= "table" or type( path.points ) ~= "table" or #path.points == 0 then
+		return nil, filename .. " does not contain a camera path";
+	end
+
+	local splines = { };
+	for _, k in ipairs( pathComponents ) do
+		splines[k] = NewSpline();
+	end
+	for _, pt in ipairs( path.points ) do
+		for j, k in ipairs( pathComponents ) do
+			splines[k]:addPt( tonumber( pt[j] ) or 0 );
+		end
+	end
+	return splines, path.world, path.dim or 0;
+end
+
@@ -33,16 +33,37 @@ void onError( const char *context, const char *error );
 
 namespace eihort {
 
+#ifdef VERTEX_LIGHTING
+// Lighting is baked into the vertices
+#define LIGHTING_VERTEX_DECL "attribute vec2 vertexLight;\n" "varying vec2 baseLight;\n"
+#define LIGHTING_VERTEX_MAIN "baseLight = vertexLight;\n"
+#define LIGHTING_FRAGMENT_DECL "varying vec2 baseLight;\n"
+#define LIGHTING_FRAGMENT_MAIN "vec2 lighting = baseLight + lightOffset;\n"
+#else
+// Lighting is in a 3D texture
+#define LIGHTING_VERTEX_DECL ""
+#define LIGHTING_VERTEX_MAIN ""
+#define LIGHTING_FRAGMENT_DECL "uniform sampler3D lightTex;\n"
+#define LIGHTING_FRAGMENT_MAIN "vec2 lighting = texture3D( lightTex, gl_TexCoord[1].xyz ).ga + lightOffset;\n"
+#endif
+
 // -----------------------------------------------------------------
 static const char *vertex_program =
 "#version 110\n"
 "varying vec3 V;\n"
+"attribute vec2 vertexUV;\n"
+"attribute vec3 instanceOffset;\n"
+LIGHTING_VERTEX_DECL
 "void main(void) {\n"
-	"V = vec3( gl_ModelViewMatrix * gl_Vertex );\n"
-	"gl_Position = ftransform();\n"
-	"gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+	// Instanced geometry is offset per instance; the offset is 0 otherwise
+	"vec4 pos = gl_Vertex + vec4( instanceOffset, 0.0 );\n"
+	"V = vec3( gl_ModelViewMatrix * pos );\n"
+	"gl_Position = gl_ModelViewProjectionMatrix * pos;\n"
+	// UVs are normalized by the vertex layout
+	"gl_TexCoord[0] = vec4( vertexUV, 0.0, 1.0 );\n"
 	// gl_TexCoord[1] is the lighting texture
-	"gl_TexCoord[1] = gl_TextureMatrix[1] * (gl_Vertex + 8.0 * vec4( gl_Normal, 0.0 ));\n"
+	"gl_TexCoord[1] = gl_TextureMatrix[1] * (pos + 8.0 * vec4( gl_Normal, 0.0 ));\n"
+	LIGHTING_VERTEX_MAIN
 "}\n"
 ;
 
@@ -50,12 +71,21 @@ static const char *vertex_program =
 static const char *vertex_program_texGen0 =
 "#version 110\n"
 "varying vec3 V;\n"
+"uniform vec4 texGenS;\n"
+"uniform vec4 texGenT;\n"
+"attribute vec3 instanceOffset;\n"
+LIGHTING_VERTEX_DECL
 "void main(void) {\n"
-	"V = vec3( gl_ModelViewMatrix * gl_Vertex );\n"
-	"gl_Position = ftransform();\n"
-	"gl_TexCoord[0] = gl_TextureMatrix[0] * gl_Vertex;\n"
-	// gl_TexCoord[1] is the lighting texture
-	"gl_TexCoord[1] = gl_TextureMatrix[1] * (gl_Vertex + 8.0 * vec4( gl_Normal, 0.0 ));\n"
+	// Instanced geometry is offset per instance; the offset is 0 otherwise
+	"vec4 pos = gl_Vertex + vec4( instanceOffset, 0.0 );\n"
+	"V = vec3( gl_ModelViewMatrix * pos );\n"
+	"gl_Position = gl_ModelViewProjectionMatrix * pos;\n"
+	// UVs are planar projections of the position
+	"gl_TexCoord[0] = vec4( dot( texGenS, pos ), dot( texGenT, pos ), 0.0, 1.0 );\n"
+	// gl_TexCoord[1] is the lighting texture, and doubles as the biome
+	// coordinate, so instances need not store one
+	"gl_TexCoord[1] = gl_TextureMatrix[1] * (pos + 8.0 * vec4( gl_Normal, 0.0 ));\n"
+	LIGHTING_VERTEX_MAIN
 "}\n"
 ;
 
@@ -63,7 +93,7 @@ static const char *vertex_program_texGen0 =
 static const char *fragment_program =
 "#version 110\n"
 "uniform sampler2D mainTex;\n"
-"uniform sampler3D lightTex;\n"
+LIGHTING_FRAGMENT_DECL
 "uniform sampler2D lightShadeTex;\n"
 "uniform vec2 lightOffset;\n"
 "varying vec3 V;\n"
@@ -71,8 +101,8 @@ static const char *fragment_program =
 "void main(void) {"
 	// Diffuse material color from the main texture
 	"vec4 diffuse = texture2D( mainTex, gl_TexCoord[0].xy );\n"
-	// (sky, block) lighting from the 3D lighting texture
-	"vec2 lighting = texture3D( lightTex, gl_TexCoord[1].xyz ).ga + lightOffset;\n"
+	// (sky, block) lighting from the 3D lighting texture or the vertices
+	LIGHTING_FRAGMENT_MAIN
 	// Get RGB lighting by lookup of the (sky, block) value
 	"vec4 light = texture2D( lightShadeTex, lighting );\n"
 
@@ -86,7 +116,7 @@ static const char *fragment_program =
 static const char *fragment_program_foliage =
 "#version 110\n"
 "uniform sampler2D mainTex;\n"
-"uniform sampler3D lightTex;\n"
+LIGHTING_FRAGMENT_DECL
 "uniform sampler2D foliageTex;\n"
 "uniform sampler2D lightShadeTex;\n"
 "uniform vec2 lightOffset;\n"
@@ -95,8 +125,8 @@ static const char *fragment_program_foliage =
 "void main(void) {"
 	// Diffuse material color from the main texture
 	"vec4 diffuse = texture2D( mainTex, gl_TexCoord[0].xy );\n"
-	// (sky, block) lighting from the 3D lighting texture
-	"vec2 lighting = texture3D( lightTex, gl_TexCoord[1].xyz ).ga + lightOffset;\n"
+	// (sky, block) lighting from the 3D lighting texture or the vertices
+	LIGHTING_FRAGMENT_MAIN
 	// Foliage color from the foliage texture (coords are same as for the lighting)
 	"vec4 foliage = texture2D( foliageTex, gl_TexCoord[1].xy );\n"
 	// Get RGB lighting by lookup of the (sky, block) value
@@ -112,7 +142,7 @@ static const char *fragment_program_foliage =
 static const char *fragment_program_foliage_alpha =
 "#version 110\n"
 "uniform sampler2D mainTex;\n"
-"uniform sampler3D lightTex;\n"
+LIGHTING_FRAGMENT_DECL
 "uniform sampler2D foliageTex;\n"
 "uniform sampler2D lightShadeTex;\n"
 "uniform vec2 lightOffset;\n"
@@ -121,8 +151,8 @@ static const char *fragment_program_foliage_alpha =
 "void main(void) {"
 	// Diffuse material color from the main texture
 	"vec4 diffuse = texture2D( mainTex, gl_TexCoord[0].xy );\n"
-	// (sky, block) lighting from the 3D lighting texture
-	"vec2 lighting = texture3D( lightTex, gl_TexCoord[1].xyz ).ga + lightOffset;\n"
+	// (sky, block) lighting from the 3D lighting texture or the vertices
+	LIGHTING_FRAGMENT_MAIN
 	// Foliage color from the foliage texture (coords are same as for the lighting)
 	"vec4 foliage = texture2D( foliageTex, gl_TexCoord[1].xy );\n"
 	// Get RGB lighting by lookup of the (sky, block) value
@@ -167,6 +197,11 @@ void EihortShader::ShaderFlavour::link( GLShaderObject *vs, GLShaderObject *fs,
 	// Attach the shader objects
 	shader.attach( vs );
 	shader.attach( fs );
+	shader.bindVertexAttribute( "vertexUV", VERTEX_UV_ATTRIB );
+	shader.bindVertexAttribute( "instanceOffset", VERTEX_INSTANCE_ATTRIB );
+#ifdef VERTEX_LIGHTING
+	shader.bindVertexAttribute( "vertexLight", VERTEX_LIGHT_ATTRIB );
+#endif
 
 	// Perform the link
 	char err[1024];
@@ -178,6 +213,8 @@ void EihortShader::ShaderFlavour::link( GLShaderObject *vs, GLShaderObject *fs,
 
 	// Get uniforms
 	lightOffsetUniform = shader.uniform( "lightOffset" );
+	texGenSUniform = shader.uniform( "texGenS" );
+	texGenTUniform = shader.uniform( "texGenT" );
 
 	// Set defaults for all uniforms
 	shader.bind();
@@ -216,4 +253,12 @@ void EihortShader::setLightOffset( float blockLight, float skyLight ) {
 		glUniform2f( bound->lightOffsetUniform, blockLight, skyLight );
 }
 
+// -----------------------------------------------------------------
+void EihortShader::setTexGen( const float *s, const float *t ) {
+	if( bound && bound->texGenSUniform >= 0 ) {
+		glUniform4fv( bound->texGenSUniform, 1, s );
+		glUniform4fv( bound->texGenTUniform, 1, t );
+	}
+}
+
 } // namespace eihort
@@ -26,6 +26,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include "glshader.h"
 
+// Vertex attribute holding the baked lighting when lighting is baked into
+// the vertices (VERTEX_LIGHTING builds)
+#define VERTEX_LIGHT_ATTRIB 6
+// Vertex attribute holding the normalized UVs of the "normal" shader
+#define VERTEX_UV_ATTRIB 7
+// Vertex attribute holding the per-instance offset of instanced geometry
+// Attribute 1 is not aliased to any fixed-function array which the
+// immediate-mode UI code could leave a value in
+#define VERTEX_INSTANCE_ATTRIB 1
+
 namespace eihort {
 
 class EihortShader {
@@ -38,7 +48,7 @@ public:
 
 	// Bind the "normal" shader - XYZ and UV in vertices, one texture
 	void bindNormal() { bindFlavour( &normal ); }
-	// Bind the "UV-generating" shader - only XYZ in vertices, texture matrix is expected
+	// Bind the "UV-generating" shader - only XYZ in vertices, UVs from setTexGen
 	void bindTexGen() { bindFlavour( &texGen ); }
 	// Bind the "biome" shader - XYZ in verts, UV generated, two textures (output = tex1 * tex2) 
 	void bindFoliage() { bindFlavour( &foliage ); }
@@ -51,6 +61,10 @@ public:
 	// The shader must be bound
 	// Used to make certain sides of blocks darker
 	void setLightOffset( float blockLight, float skyLight );
+	// Set the planes which generate UVs from the vertex positions
+	// in the UV-generating shaders: UV = (dot(s, pos), dot(t, pos))
+	// The shader must be bound
+	void setTexGen( const float *s, const float *t );
 
 private:
 	struct ShaderFlavour {
@@ -61,6 +75,8 @@ private:
 		GLShader shader;
 		// The uniform index for lightOffset
 		int lightOffsetUniform;
+		// The uniform indices for texGenS and texGenT (-1 if not generating UVs)
+		int texGenSUniform, texGenTUniform;
 	};
 
 	// Available shaders
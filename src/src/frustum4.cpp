@@ -0,0 +1,149 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <algorithm>
+#include <float.h>
+#include <math.h>
+#include "platform.h"
+#include "frustum4.h"
+
+#ifdef EIHORT_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace eihort {
+
+// -----------------------------------------------------------------
+void Frustum4::set( const jPlane *frustum ) {
+	for( unsigned i = 0; i < 5; i++ ) {
+		nx[i] = frustum[i].a;
+		ny[i] = frustum[i].b;
+		nz[i] = frustum[i].c;
+		ax[i] = fabsf( frustum[i].a );
+		ay[i] = fabsf( frustum[i].b );
+		az[i] = fabsf( frustum[i].c );
+		d[i] = frustum[i].d;
+	}
+	sx = frustum[5].a;
+	sy = frustum[5].b;
+	sz = frustum[5].c;
+	sr = frustum[5].d;
+}
+
+#ifdef EIHORT_SSE
+
+// -----------------------------------------------------------------
+void Frustum4::getVisibleDistances( float *dist, const float *x, const float *y, float z, float rad ) const {
+	__m128 px = _mm_loadu_ps( x );
+	__m128 py = _mm_loadu_ps( y );
+	__m128 pz = _mm_set1_ps( z );
+
+	// Far sphere
+	__m128 dx = _mm_sub_ps( px, _mm_set1_ps( sx ) );
+	__m128 dy = _mm_sub_ps( py, _mm_set1_ps( sy ) );
+	__m128 dz = _mm_sub_ps( pz, _mm_set1_ps( sz ) );
+	__m128 distSq = _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, dx ), _mm_mul_ps( dy, dy ) ), _mm_mul_ps( dz, dz ) );
+	__m128 bSphereRad = _mm_set1_ps( rad + sr );
+	__m128 out = _mm_cmpgt_ps( distSq, _mm_mul_ps( bSphereRad, bSphereRad ) );
+
+	// Side planes
+	__m128 negRad = _mm_set1_ps( -rad );
+	for( unsigned i = 0; i < 5; i++ ) {
+		__m128 dot = _mm_add_ps(
+			_mm_add_ps( _mm_mul_ps( _mm_set1_ps( nx[i] ), px ), _mm_mul_ps( _mm_set1_ps( ny[i] ), py ) ),
+			_mm_add_ps( _mm_mul_ps( _mm_set1_ps( nz[i] ), pz ), _mm_set1_ps( d[i] ) ) );
+		out = _mm_or_ps( out, _mm_cmplt_ps( dot, negRad ) );
+	}
+
+	_mm_storeu_ps( dist, _mm_or_ps( _mm_and_ps( out, _mm_set1_ps( FLT_MAX ) ), _mm_andnot_ps( out, distSq ) ) );
+}
+
+// -----------------------------------------------------------------
+unsigned Frustum4::intersectBoxes( const float *cx, const float *cy, const float *cz,
+                                   const float *hx, const float *hy, const float *hz ) const {
+	__m128 px = _mm_loadu_ps( cx ), py = _mm_loadu_ps( cy ), pz = _mm_loadu_ps( cz );
+	__m128 ex = _mm_loadu_ps( hx ), ey = _mm_loadu_ps( hy ), ez = _mm_loadu_ps( hz );
+	__m128 zero = _mm_setzero_ps();
+	__m128 out = zero;
+
+	// Side planes: the box is outside if its nearest corner is behind the plane
+	for( unsigned i = 0; i < 5; i++ ) {
+		__m128 dot = _mm_add_ps(
+			_mm_add_ps( _mm_mul_ps( _mm_set1_ps( nx[i] ), px ), _mm_mul_ps( _mm_set1_ps( ny[i] ), py ) ),
+			_mm_add_ps( _mm_mul_ps( _mm_set1_ps( nz[i] ), pz ), _mm_set1_ps( d[i] ) ) );
+		__m128 reach = _mm_add_ps(
+			_mm_add_ps( _mm_mul_ps( _mm_set1_ps( ax[i] ), ex ), _mm_mul_ps( _mm_set1_ps( ay[i] ), ey ) ),
+			_mm_mul_ps( _mm_set1_ps( az[i] ), ez ) );
+		out = _mm_or_ps( out, _mm_cmplt_ps( dot, _mm_sub_ps( zero, reach ) ) );
+	}
+
+	// Far sphere: distance from its center to the closest point of the box
+	__m128 signMask = _mm_set1_ps( -0.0f );
+	__m128 qx = _mm_max_ps( _mm_sub_ps( _mm_andnot_ps( signMask, _mm_sub_ps( px, _mm_set1_ps( sx ) ) ), ex ), zero );
+	__m128 qy = _mm_max_ps( _mm_sub_ps( _mm_andnot_ps( signMask, _mm_sub_ps( py, _mm_set1_ps( sy ) ) ), ey ), zero );
+	__m128 qz = _mm_max_ps( _mm_sub_ps( _mm_andnot_ps( signMask, _mm_sub_ps( pz, _mm_set1_ps( sz ) ) ), ez ), zero );
+	__m128 closestDistSq = _mm_add_ps( _mm_add_ps( _mm_mul_ps( qx, qx ), _mm_mul_ps( qy, qy ) ), _mm_mul_ps( qz, qz ) );
+	out = _mm_or_ps( out, _mm_cmpnlt_ps( closestDistSq, _mm_set1_ps( sr * sr ) ) );
+
+	return ~(unsigned)_mm_movemask_ps( out ) & 0xfu;
+}
+
+#else // EIHORT_SSE
+
+// -----------------------------------------------------------------
+void Frustum4::getVisibleDistances( float *dist, const float *x, const float *y, float z, float rad ) const {
+	float bSphereRad = rad + sr;
+	for( unsigned j = 0; j < 4; j++ ) {
+		float dx = x[j] - sx, dy = y[j] - sy, dz = z - sz;
+		float distSq = dx*dx + dy*dy + dz*dz;
+		dist[j] = distSq > bSphereRad * bSphereRad ? FLT_MAX : distSq;
+		for( unsigned i = 0; i < 5; i++ ) {
+			if( nx[i]*x[j] + ny[i]*y[j] + nz[i]*z + d[i] < -rad )
+				dist[j] = FLT_MAX;
+		}
+	}
+}
+
+// -----------------------------------------------------------------
+unsigned Frustum4::intersectBoxes( const float *cx, const float *cy, const float *cz,
+                                   const float *hx, const float *hy, const float *hz ) const {
+	unsigned mask = 0;
+	for( unsigned j = 0; j < 4; j++ ) {
+		bool inside = true;
+		for( unsigned i = 0; i < 5; i++ ) {
+			if( nx[i]*cx[j] + ny[i]*cy[j] + nz[i]*cz[j] + d[i] < -(ax[i]*hx[j] + ay[i]*hy[j] + az[i]*hz[j]) )
+				inside = false;
+		}
+		float qx = std::max( fabsf( cx[j] - sx ) - hx[j], 0.0f );
+		float qy = std::max( fabsf( cy[j] - sy ) - hy[j], 0.0f );
+		float qz = std::max( fabsf( cz[j] - sz ) - hz[j], 0.0f );
+		if( inside && qx*qx + qy*qy + qz*qz < sr * sr )
+			mask |= 1u << j;
+	}
+	return mask;
+}
+
+#endif // EIHORT_SSE
+
+} // namespace eihort
@@ -0,0 +1,63 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef FRUSTUM4_H
+#define FRUSTUM4_H
+
+#include "jmath.h"
+
+namespace eihort {
+
+struct Frustum4 {
+	// The view frustum, laid out for testing 4 volumes at once
+	// The 5 side planes are stored as separate component arrays (SoA) so
+	// that each plane can be splatted across a 4-wide SSE register
+
+	// Convert from the 5 side planes + far sphere form of WorldQTree
+	void set( const jPlane *frustum );
+
+	// Get the squared distances from the camera to the centers of 4
+	// spheres of radius rad centered at (x[i], y[i], z)
+	// Spheres outside the frustum get FLT_MAX
+	void getVisibleDistances( float *dist, const float *x, const float *y, float z, float rad ) const;
+	// Test 4 axis-aligned boxes, given by their centers and half-sizes
+	// Returns a mask with bit i set if box i intersects the frustum
+	unsigned intersectBoxes( const float *cx, const float *cy, const float *cz,
+	                         const float *hx, const float *hy, const float *hz ) const;
+
+	// Side plane normals
+	float nx[5], ny[5], nz[5];
+	// Absolute values of the side plane normals
+	float ax[5], ay[5], az[5];
+	// Side plane offsets
+	float d[5];
+	// Center of the far sphere
+	float sx, sy, sz;
+	// Radius of the far sphere
+	float sr;
+};
+
+} // namespace eihort
+
+#endif
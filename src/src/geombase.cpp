@@ -23,6 +23,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 
 #include <GL/glew.h>
 #include <cassert>
+#include <cstddef>
 #include <cstring>
 
 #include "geombase.h"
@@ -31,23 +32,127 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 #include "geomsimple.h"
 #include "eihortshader.h"
 #include "lightmodel.h"
+#include "memstats.h"
 #include "uidrawcontext.h"
+#include "platform.h"
 
 namespace eihort {
 namespace geom {
 
 // -=-=-=-=------------------------------------------------------=-=-=-=-
-void GeometryStream::ensureVertCap( unsigned cap ) {
-	if( !vertCapacity )
-		vertCapacity = 128;
+// The arena bound to each thread
+static THREAD_LOCAL ScratchArena *g_threadArena = NULL;
+
+// -----------------------------------------------------------------
+ScratchArena::ScratchArena()
+: heapAllocs(0), reuses(0)
+{
+}
+
+// -----------------------------------------------------------------
+ScratchArena::~ScratchArena() {
+	trim();
+}
+
+// -----------------------------------------------------------------
+void ScratchArena::bind( ScratchArena *arena ) {
+	g_threadArena = arena;
+}
+
+// -----------------------------------------------------------------
+ScratchArena *ScratchArena::current() {
+	return g_threadArena;
+}
+
+// -----------------------------------------------------------------
+unsigned ScratchArena::getBucket( unsigned capacity ) {
+	unsigned bucket = 0;
+	while( (1u << bucket) < capacity )
+		bucket++;
+	return bucket;
+}
+
+// -----------------------------------------------------------------
+void *ScratchArena::alloc( unsigned capacity ) {
+	std::vector<void*> &list = freeLists[getBucket( capacity )];
+	if( list.empty() ) {
+		heapAllocs++;
+		return malloc( capacity );
+	}
+
+	reuses++;
+	void *buf = list.back();
+	list.pop_back();
+	memFree( MEM_GEOMETRY_CACHE, capacity );
+	return buf;
+}
+
+// -----------------------------------------------------------------
+void ScratchArena::release( void *buf, unsigned capacity ) {
+	freeLists[getBucket( capacity )].push_back( buf );
+	memAlloc( MEM_GEOMETRY_CACHE, capacity );
+}
+
+// -----------------------------------------------------------------
+void ScratchArena::trim() {
+	for( unsigned i = 0; i < 32; i++ ) {
+		for( std::vector<void*>::iterator it = freeLists[i].begin(); it != freeLists[i].end(); ++it ) {
+			free( *it );
+			memFree( MEM_GEOMETRY_CACHE, (size_t)1 << i );
+		}
+		std::vector<void*>().swap( freeLists[i] );
+	}
+}
 
-	while( vertCapacity < cap )
-		vertCapacity <<= 1;
 
-	void *newVerts = malloc( vertCapacity );
-	memcpy( newVerts, verts, vertSize );
-	free( verts );
+// -=-=-=-=------------------------------------------------------=-=-=-=-
+void GeometryStream::ensureVertCap( unsigned cap ) {
+	unsigned newCapacity = vertCapacity ? vertCapacity : 128;
+	while( newCapacity < cap )
+		newCapacity <<= 1;
+
+	void *newVerts = acquireBuffer( newCapacity );
+	if( vertSize )
+		memcpy( newVerts, verts, vertSize );
+	releaseBuffer( verts, vertCapacity );
 	verts = newVerts;
+	vertCapacity = newCapacity;
+}
+
+// -----------------------------------------------------------------
+void GeometryStream::ensureIdxCap( unsigned cap ) {
+	unsigned newCapacity = idxCapacity ? idxCapacity : 64;
+	while( newCapacity < cap )
+		newCapacity <<= 1;
+
+	unsigned *newIndices = (unsigned*)acquireBuffer( newCapacity * (unsigned)sizeof(unsigned) );
+	if( idxCount )
+		memcpy( newIndices, indices, idxCount * sizeof(unsigned) );
+	releaseBuffer( indices, idxCapacity * (unsigned)sizeof(unsigned) );
+	indices = newIndices;
+	idxCapacity = newCapacity;
+}
+
+// -----------------------------------------------------------------
+void *GeometryStream::acquireBuffer( unsigned capacity ) {
+	ScratchArena *arena = ScratchArena::current();
+	memAlloc( MEM_GEOMETRY, capacity );
+	return arena ? arena->alloc( capacity ) : malloc( capacity );
+}
+
+// -----------------------------------------------------------------
+void GeometryStream::releaseBuffer( void *buf, unsigned capacity ) {
+	// Buffers may be released on a different thread than the one which
+	// acquired them, but they all come from malloc in the end
+	if( !buf )
+		return;
+	memFree( MEM_GEOMETRY, capacity );
+	ScratchArena *arena = ScratchArena::current();
+	if( arena ) {
+		arena->release( buf, capacity );
+	} else {
+		free( buf );
+	}
 }
 
 // -----------------------------------------------------------------
@@ -60,6 +165,59 @@ void GeometryStream::emitVertex( const void *src, unsigned size ) {
 }
 
 
+// -=-=-=-=------------------------------------------------------=-=-=-=-
+#ifdef VERTEX_LIGHTING
+#define VERTEX_LAYOUT_LIGHT( V ) , (unsigned)offsetof( V, light )
+#else
+#define VERTEX_LAYOUT_LIGHT( V )
+#endif
+
+// Layouts of the vertex formats, in VertexFormat order
+static const VertexLayout VERTEX_LAYOUTS[VertexFormat::COUNT] = {
+	{ "pos16", (unsigned)sizeof( VertexPos16 ), 0, 0, 0 VERTEX_LAYOUT_LIGHT( VertexPos16 ) },
+	{ "pos16_uv8", (unsigned)sizeof( VertexPos16UV8 ), 2, GL_UNSIGNED_BYTE, (unsigned)offsetof( VertexPos16UV8, uv ) VERTEX_LAYOUT_LIGHT( VertexPos16UV8 ) },
+	{ "pos16_uv16", (unsigned)sizeof( VertexPos16UV16 ), 2, GL_UNSIGNED_SHORT, (unsigned)offsetof( VertexPos16UV16, uv ) VERTEX_LAYOUT_LIGHT( VertexPos16UV16 ) },
+};
+
+#undef VERTEX_LAYOUT_LIGHT
+
+// -----------------------------------------------------------------
+const VertexLayout &VertexLayout::get( VertexFormat::Id fmt ) {
+	assert( fmt < VertexFormat::COUNT );
+	return VERTEX_LAYOUTS[fmt];
+}
+
+// -----------------------------------------------------------------
+void VertexLayout::enable() const {
+	glEnableClientState( GL_VERTEX_ARRAY );
+	if( uvCount )
+		glEnableVertexAttribArray( VERTEX_UV_ATTRIB );
+#ifdef VERTEX_LIGHTING
+	glEnableVertexAttribArray( VERTEX_LIGHT_ATTRIB );
+#endif
+}
+
+// -----------------------------------------------------------------
+void VertexLayout::bind( std::size_t offset ) const {
+	glVertexPointer( 3, GL_SHORT, stride, (void*)offset );
+	if( uvCount )
+		glVertexAttribPointer( VERTEX_UV_ATTRIB, uvCount, uvType, GL_TRUE, stride, (void*)(offset + uvOffset) );
+#ifdef VERTEX_LIGHTING
+	glVertexAttribPointer( VERTEX_LIGHT_ATTRIB, 2, GL_UNSIGNED_BYTE, GL_TRUE, stride, (void*)(offset + lightOffset) );
+#endif
+}
+
+// -----------------------------------------------------------------
+void VertexLayout::disable() const {
+	glDisableClientState( GL_VERTEX_ARRAY );
+	if( uvCount )
+		glDisableVertexAttribArray( VERTEX_UV_ATTRIB );
+#ifdef VERTEX_LIGHTING
+	glDisableVertexAttribArray( VERTEX_LIGHT_ATTRIB );
+#endif
+}
+
+
 // -=-=-=-=------------------------------------------------------=-=-=-=-
 GeometryCluster::GeometryCluster()
 {
@@ -141,10 +299,15 @@ bool MetaGeometryCluster::destroyIfEmpty() {
 }
 
 // -----------------------------------------------------------------
-void MetaGeometryCluster::finalize( GeometryStream *meta, GeometryStream*, GeometryStream* ) {
+unsigned MetaGeometryCluster::finalize( GeometryStream *meta, GeometryStream*, GeometryStream*, MeshOptimizer* ) {
+	MeshDigest::recordMeta( geom, &str );
 	meta->emitVertex( geom );
 	meta->emitVertex( n );
 	meta->emitVertex( str.getVertices(), str.getVertSize() );
+
+	// The geometry is only generated when rendering
+	delete this;
+	return 0;
 }
 
 
@@ -179,13 +342,17 @@ bool MultiGeometryCluster::destroyIfEmpty() {
 }
 
 // -----------------------------------------------------------------
-void MultiGeometryCluster::finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx ) {
+unsigned MultiGeometryCluster::finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx, MeshOptimizer *opt ) {
+	unsigned nTris = 0;
 	for( unsigned i = 0; i < clusters.size(); i++ ) {
 		if( clusters[i] ) {
-			clusters[i]->finalize( meta, vtx, idx );
+			nTris += clusters[i]->finalize( meta, vtx, idx, opt );
 			clusters[i] = NULL;
 		}
 	}
+
+	delete this;
+	return nTris;
 }
 
 // -----------------------------------------------------------------
@@ -229,6 +396,190 @@ bool MultiGeometryCluster::callContinueIsland( IslandDesc *island, const Instanc
 	return ret;
 }
 
+// -=-=-=-=------------------------------------------------------=-=-=-=-
+InstancedGeometryCluster::InstancedGeometryCluster( BlockGeometry *geom )
+: geom(geom)
+{
+	for( unsigned i = 0; i < MAX_VARIANTS; i++ )
+		variants[i] = NULL;
+}
+
+// -----------------------------------------------------------------
+InstancedGeometryCluster::~InstancedGeometryCluster() {
+	for( unsigned i = 0; i < MAX_VARIANTS; i++ )
+		delete variants[i];
+}
+
+// -----------------------------------------------------------------
+bool InstancedGeometryCluster::destroyIfEmpty() {
+	for( unsigned i = 0; i < MAX_VARIANTS; i++ ) {
+		if( variants[i] && !variants[i]->instances.empty() )
+			return false;
+	}
+
+	delete this;
+	return true;
+}
+
+// -----------------------------------------------------------------
+GeometryStream *InstancedGeometryCluster::getTemplate( unsigned variant ) {
+	assert( variant < MAX_VARIANTS );
+	if( !variants[variant] )
+		variants[variant] = new Variant;
+	return &variants[variant]->mesh;
+}
+
+// -----------------------------------------------------------------
+void InstancedGeometryCluster::addInstance( unsigned variant, const Point &block, const unsigned char *light ) {
+	assert( variant < MAX_VARIANTS && variants[variant] );
+
+	Instance inst;
+	inst.pos[0] = (short)(block.x * 16);
+	inst.pos[1] = (short)(block.y * 16);
+	inst.pos[2] = (short)(block.z * 16);
+#ifdef VERTEX_LIGHTING
+	inst.light[0] = light[0];
+	inst.light[1] = light[1];
+#else
+	(void)light;
+#endif
+	variants[variant]->instances.push_back( inst );
+}
+
+// -----------------------------------------------------------------
+unsigned InstancedGeometryCluster::finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx, MeshOptimizer *opt ) {
+	Meta1 m1;
+	m1.n = 0;
+	for( unsigned i = 0; i < MAX_VARIANTS; i++ ) {
+		if( variants[i] && !variants[i]->instances.empty() )
+			m1.n++;
+	}
+
+	meta->emitVertex( geom );
+	meta->emitVertex( m1 );
+
+	bool instanced = isInstancingSupported();
+	unsigned nTris = 0;
+	for( unsigned i = 0; i < MAX_VARIANTS; i++ ) {
+		Variant *var = variants[i];
+		if( !var || var->instances.empty() )
+			continue;
+
+		// Every copy shares the template's vertex order, so optimizing the
+		// template is enough
+		GeometryStream *mesh = &var->mesh;
+		if( opt && mesh->getVertexFormat() != VertexFormat::UNDECLARED )
+			opt->optimize( mesh );
+
+		Meta2 m2;
+		m2.variant = i;
+
+		GeometryStream expanded;
+		if( instanced ) {
+			m2.nInstances = (unsigned)var->instances.size();
+		} else {
+			expandInstances( &expanded, mesh, var->instances );
+			mesh = &expanded;
+			m2.nInstances = 0;
+		}
+		MeshDigest::record( geom, i, mesh );
+
+		vtx->alignVertices();
+		m2.vtx_offset = vtx->getVertSize();
+		vtx->emitVertex( mesh->getVertices(), mesh->getVertSize() );
+		m2.nVerts = mesh->getVertCount();
+
+		unsigned idxSize = compressIndexBuffer( mesh->getIndices(), mesh->getVertCount(), mesh->getTriCount()*3 );
+		idx->alignVertices( idxSize );
+		m2.idx_offset = idx->getVertSize();
+		idx->emitVertex( mesh->getIndices(), mesh->getTriCount()*3*idxSize );
+		m2.nTris = mesh->getTriCount();
+		m2.idxType = indexSizeToGLType( idxSize );
+
+		if( instanced ) {
+			vtx->alignVertices();
+			m2.inst_offset = vtx->getVertSize();
+			vtx->emitVertex( &var->instances[0], m2.nInstances * (unsigned)sizeof(Instance) );
+		} else {
+			m2.inst_offset = 0;
+		}
+
+		meta->emitVertex( m2 );
+		nTris += m2.nTris * (instanced ? m2.nInstances : 1);
+	}
+
+	delete this;
+	return nTris;
+}
+
+// -----------------------------------------------------------------
+void InstancedGeometryCluster::expandInstances( GeometryStream *target, const GeometryStream *mesh, const std::vector<Instance> &instances ) {
+	const VertexLayout &layout = VertexLayout::get( mesh->getVertexFormat() );
+	unsigned char vert[32];
+	assert( layout.stride <= sizeof(vert) );
+
+	unsigned nVerts = mesh->getVertCount();
+	unsigned nIndices = mesh->getTriCount()*3;
+	const unsigned *indices = mesh->getIndices();
+	for( std::vector<Instance>::const_iterator it = instances.begin(); it != instances.end(); ++it ) {
+		unsigned idxBase = target->getIndexBase();
+
+		// Move each vertex of the template to the instance
+		const unsigned char *src = (const unsigned char*)mesh->getVertices();
+		for( unsigned i = 0; i < nVerts; i++, src += layout.stride ) {
+			memcpy( vert, src, layout.stride );
+			short pos[3];
+			memcpy( pos, vert, sizeof(pos) );
+			for( unsigned j = 0; j < 3; j++ )
+				pos[j] = (short)(pos[j] + it->pos[j]);
+			memcpy( vert, pos, sizeof(pos) );
+#ifdef VERTEX_LIGHTING
+			memcpy( vert + layout.lightOffset, it->light, sizeof(it->light) );
+#endif
+			target->emitVertex( vert, layout.stride );
+		}
+
+		for( unsigned i = 0; i < nIndices; i += 3 )
+			target->emitTriangle( idxBase + indices[i], idxBase + indices[i+1], idxBase + indices[i+2] );
+	}
+}
+
+// -----------------------------------------------------------------
+void InstancedGeometryCluster::skipMeta( void *&meta ) {
+	Meta1 *m1 = (Meta1*)meta;
+	meta = (Meta2*)&m1[1] + m1->n;
+}
+
+// -----------------------------------------------------------------
+bool InstancedGeometryCluster::isInstancingSupported() {
+	// GLEW fills these in once at startup, so they can be read from any thread
+	return GLEW_ARB_instanced_arrays != 0 && GLEW_ARB_draw_instanced != 0;
+}
+
+// -----------------------------------------------------------------
+void InstancedGeometryCluster::bindInstances( std::size_t offset ) {
+	glEnableVertexAttribArray( VERTEX_INSTANCE_ATTRIB );
+	glVertexAttribPointer( VERTEX_INSTANCE_ATTRIB, 3, GL_SHORT, GL_FALSE, sizeof(Instance), (void*)(offset + offsetof( Instance, pos )) );
+	glVertexAttribDivisorARB( VERTEX_INSTANCE_ATTRIB, 1 );
+#ifdef VERTEX_LIGHTING
+	// The lighting comes from the instance rather than the template
+	glVertexAttribPointer( VERTEX_LIGHT_ATTRIB, 2, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Instance), (void*)(offset + offsetof( Instance, light )) );
+	glVertexAttribDivisorARB( VERTEX_LIGHT_ATTRIB, 1 );
+#endif
+}
+
+// -----------------------------------------------------------------
+void InstancedGeometryCluster::unbindInstances() {
+	glVertexAttribDivisorARB( VERTEX_INSTANCE_ATTRIB, 0 );
+	glDisableVertexAttribArray( VERTEX_INSTANCE_ATTRIB );
+	// The attribute's value is undefined after drawing from an array, and
+	// all other geometry expects no offset
+	glVertexAttrib3f( VERTEX_INSTANCE_ATTRIB, 0.0f, 0.0f, 0.0f );
+#ifdef VERTEX_LIGHTING
+	glVertexAttribDivisorARB( VERTEX_LIGHT_ATTRIB, 0 );
+#endif
+}
+
 // -=-=-=-=------------------------------------------------------=-=-=-=-
 BlockGeometry::BlockGeometry() {
 	rg = RenderGroup::LAST;
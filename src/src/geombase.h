@@ -25,15 +25,22 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #define GEOMBASE_H
 
 #include <cfloat>
+#include <cmath>
 #include <cstdlib>
 #include <vector>
 #include "jmath.h"
 #include "luaobject.h"
+#include "meshdigest.h"
+#include "meshoptimizer.h"
 
 struct triangulateio;
 namespace eihort {
 class EihortShader;
 class LightModel;
+class OcclusionBuffer;
+namespace geom {
+class SolidFaceBatch;
+}
 }
 
 // Lua metatable name
@@ -51,6 +58,23 @@ namespace geom {
 
 class BlockGeometry;
 
+namespace VertexFormat {
+	// The declared vertex formats which geometry is emitted in
+	// See VertexLayout for their exact layouts
+	enum Id {
+		// 16-bit position only - UVs are generated from the position
+		POS16 = 0,
+		// 16-bit position and 8-bit normalized UV
+		POS16_UV8,
+		// 16-bit position and 16-bit normalized UV
+		POS16_UV16,
+		// Number of declared formats
+		COUNT,
+		// Vertices emitted as raw bytes, without a declared format
+		UNDECLARED = COUNT
+	};
+}
+
 // ===========================================================================
 // Main intermediate map structures used during geometry generation
 // These structures are generally constructed in mcworldmesh, and then
@@ -108,6 +132,9 @@ struct InstanceContext {
 	// HACK to pass information in this structure. Used by:
 	//  - ForwardingMultiGeometryAdapter
 	unsigned cookie;
+	// Block and sky light at the block
+	// Only filled in when lighting is baked into the vertices
+	unsigned char light[2];
 };
 
 struct RenderContext {
@@ -117,8 +144,18 @@ struct RenderContext {
 	jVec3 viewPos;
 	// Currently rendered triangle count
 	unsigned renderedTriCount;
+	// Number of draw calls submitted
+	unsigned drawCallCount;
 	// Current number of bytes used in render calls this frame
 	unsigned vertexSize, indexSize, texSize;
+	// Bytes of vertices drawn this frame, by vertex format
+	unsigned vertexFormatSize[VertexFormat::COUNT];
+	// Instances drawn this frame, bytes of their per-instance data, and
+	// bytes of vertices they would have taken as plain geometry
+	unsigned instanceCount, instanceSize, instanceExpandedSize;
+	// Byte offsets of the current section's vertices and indices in the
+	// bound buffers; geometry offsets are relative to these
+	std::size_t vtxBase, idxBase;
 	// Global shader object
 	EihortShader *shader;
 	// Biome textures of the current qtree chunk
@@ -127,6 +164,10 @@ struct RenderContext {
 	LightModel *lightModels;
 	// Is block lighting enabled?
 	bool enableBlockLighting;
+	// Batch collecting solid block faces, or NULL to draw them immediately
+	SolidFaceBatch *solidBatch;
+	// Buffer to test sections against before drawing them, or NULL
+	OcclusionBuffer *occlusion;
 };
 
 class GeometryCluster;
@@ -162,6 +203,14 @@ struct IslandDesc {
 	// Island index
 	// Used for ISLAND_REPEATed islands
 	unsigned islandIndex;
+	// Block and sky light in front of all faces of the island
+	// Only filled in when lighting is baked into the vertices
+	unsigned char light[2];
+	// Set when the light varies over the face, in which case the island is
+	// only the origin block's face and the light at each of its corners is
+	// in cornerLight[x][y] (1 = the corner further along the x or y axis)
+	bool cornerLit;
+	unsigned char cornerLight[2][2][2];
 	// Axis mapping into 'island space', where the x and y axes form the
 	// island plane, and z is perpendicular
 	unsigned xax, yax, zax;
@@ -197,11 +246,201 @@ struct IslandDesc {
 	GeometryCluster *curCluster;
 };
 
+// Copy baked lighting into a vertex
+// Does nothing unless lighting is baked into the vertices (VERTEX_LIGHTING)
+template< typename V >
+inline void setVertexLight( V &vtx, const unsigned char *light ) {
+#ifdef VERTEX_LIGHTING
+	vtx.light[0] = light[0];
+	vtx.light[1] = light[1];
+#else
+	(void)vtx;
+	(void)light;
+#endif
+}
+
+// Get the baked lighting for an island vertex at the contour point pt
+inline const unsigned char *getVertexLight( const IslandDesc *ctx, const Point &pt ) {
+#ifdef VERTEX_LIGHTING
+	if( ctx->cornerLit ) {
+		unsigned x = pt.v[ctx->xax] > ctx->origin.block.pos.v[ctx->xax] ? 1 : 0;
+		unsigned y = pt.v[ctx->yax] > ctx->origin.block.pos.v[ctx->yax] ? 1 : 0;
+		return ctx->cornerLight[x][y];
+	}
+#else
+	(void)pt;
+#endif
+	return ctx->light;
+}
+
+// ===========================================================================
+// Vertex formats
+// All geometry is emitted in one of the declared formats below. Positions
+// are quantized to 16 bits, in pixels (1/16th of a block size) relative to
+// the origin of the mesh section, and UVs are normalized to 8 or 16 bits.
+// No normals are stored - they are derived from the direction of the faces
+// (see getFaceNormal).
+
+struct VertexPos16 {
+	// Vertex with only a position (VertexFormat::POS16)
+	static const VertexFormat::Id FORMAT = VertexFormat::POS16;
+
+	// Position of the vertex in pixels from the section origin
+	short pos[3];
+#ifdef VERTEX_LIGHTING
+	// Block and sky light at the vertex
+	unsigned char light[2];
+#endif
+};
+
+struct VertexPos16UV8 {
+	// Vertex with a position and 8-bit UV (VertexFormat::POS16_UV8)
+	static const VertexFormat::Id FORMAT = VertexFormat::POS16_UV8;
+
+	// Position of the vertex in pixels from the section origin
+	short pos[3];
+	// Texture coordinates, mapping [0,255] to [0,1]
+	unsigned char uv[2];
+#ifdef VERTEX_LIGHTING
+	// Block and sky light at the vertex
+	unsigned char light[2];
+#endif
+};
+
+struct VertexPos16UV16 {
+	// Vertex with a position and 16-bit UV (VertexFormat::POS16_UV16)
+	static const VertexFormat::Id FORMAT = VertexFormat::POS16_UV16;
+
+	// Position of the vertex in pixels from the section origin
+	short pos[3];
+	// Texture coordinates, mapping [0,65535] to [0,1]
+	unsigned short uv[2];
+#ifdef VERTEX_LIGHTING
+	// Block and sky light at the vertex
+	unsigned char light[2];
+#endif
+};
+
+struct VertexLayout {
+	// Declared layout of one of the vertex formats
+	// The position is always 3 shorts at the start of the vertex
+
+	// Name of the format
+	const char *name;
+	// Size of one vertex in bytes
+	unsigned stride;
+	// Number of UV components (0 when the UVs are generated from the position)
+	unsigned uvCount;
+	// GL type and byte offset of the normalized UVs
+	unsigned uvType, uvOffset;
+#ifdef VERTEX_LIGHTING
+	// Byte offset of the baked lighting
+	unsigned lightOffset;
+#endif
+
+	// Enable the vertex arrays used by this layout
+	void enable() const;
+	// Point the vertex arrays at vertices starting at the given offset in
+	// the bound vertex buffer
+	void bind( std::size_t offset ) const;
+	// Disable the vertex arrays used by this layout
+	void disable() const;
+
+	// Get the layout of a vertex format
+	static const VertexLayout &get( VertexFormat::Id fmt );
+};
+
+// Quantize a position in pixels to a 16-bit vertex position
+inline short quantizePosition( float px ) {
+	return (short)std::floor( px + 0.5f );
+}
+
+// Quantize a value in [0,1] to a normalized integer of type T
+template< typename T >
+inline T quantizeUnorm( float x ) {
+	const float MAX = (float)(T)~(T)0;
+	return (T)((x <= 0.0f ? 0.0f : x >= 1.0f ? MAX : x * MAX) + 0.5f);
+}
+
+// Set the position of a vertex from a position in pixels
+template< typename V >
+inline void setVertexPos( V &vtx, const jVec3 *px ) {
+	vtx.pos[0] = quantizePosition( px->x );
+	vtx.pos[1] = quantizePosition( px->y );
+	vtx.pos[2] = quantizePosition( px->z );
+}
+
+// Vertices without UVs ignore them
+inline void setVertexUV( VertexPos16&, float, float ) {
+}
+
+// Set the UV of a vertex with 8-bit UVs
+inline void setVertexUV( VertexPos16UV8 &vtx, float u, float v ) {
+	vtx.uv[0] = quantizeUnorm<unsigned char>( u );
+	vtx.uv[1] = quantizeUnorm<unsigned char>( v );
+}
+
+// Set the UV of a vertex with 16-bit UVs
+inline void setVertexUV( VertexPos16UV16 &vtx, float u, float v ) {
+	vtx.uv[0] = quantizeUnorm<unsigned short>( u );
+	vtx.uv[1] = quantizeUnorm<unsigned short>( v );
+}
+
+// Get the normal of faces in the given direction
+// Ordered as X-, X+, Y-, Y+, Z-, Z+ (in Eihort's coordinate scheme)
+inline void getFaceNormal( jVec3 *n, unsigned dir ) {
+	jVec3Zero( n );
+	n->v[dir>>1] = dir&1 ? 1.0f : -1.0f;
+}
+
 // ===========================================================================
 // Geometry containers.
 // These classes contain the intermediate geometry at all stages of the
 // generation pipeline.
 
+class ScratchArena {
+	// Recycles the buffers of the GeometryStreams used on one thread
+	// Each mesh building worker owns one of these. While it is bound to the
+	// worker's thread, buffers released by GeometryStreams are kept for
+	// reuse instead of being returned to the heap, so that building a mesh
+	// does little heap allocation once the arena is warmed up.
+
+public:
+	ScratchArena();
+	~ScratchArena();
+
+	// Make arena the arena for the calling thread (NULL for none)
+	static void bind( ScratchArena *arena );
+	// Get the arena bound to the calling thread, if any
+	static ScratchArena *current();
+
+	// Get a buffer of the given capacity, which must be a power of two
+	void *alloc( unsigned capacity );
+	// Return a buffer obtained from alloc to the arena
+	void release( void *buf, unsigned capacity );
+	// Return all recycled buffers to the heap
+	void trim();
+
+	// Number of buffers which had to be allocated from the heap
+	inline unsigned getHeapAllocCount() const { return heapAllocs; }
+	// Number of buffers which were recycled instead of allocated
+	inline unsigned getReuseCount() const { return reuses; }
+
+private:
+	ScratchArena( const ScratchArena& ) = delete;
+	ScratchArena &operator=( const ScratchArena& ) = delete;
+
+	// Get the free list for buffers of the given capacity
+	static unsigned getBucket( unsigned capacity );
+
+	// Recycled buffers, by log2 of their capacity
+	std::vector<void*> freeLists[32];
+	// Number of buffers which had to be allocated from the heap
+	unsigned heapAllocs;
+	// Number of buffers which were recycled instead of allocated
+	unsigned reuses;
+};
+
 class GeometryStream {
 	// Output stream for geometry (e.g. vertex data, index data)
 	// This class has also been coopted as a general data stream
@@ -209,17 +448,27 @@ class GeometryStream {
 public:
 	GeometryStream()
 		: verts(NULL), vertSize(0), vertCapacity(0), vertCount(0)
+		, vertFormat(VertexFormat::UNDECLARED)
+		, indices(NULL), idxCount(0), idxCapacity(0)
 	{ }
 	~GeometryStream() {
-		free( verts );
+		releaseBuffer( verts, vertCapacity );
+		releaseBuffer( indices, idxCapacity * (unsigned)sizeof(unsigned) );
 	}
 	GeometryStream(const GeometryStream&) = delete;
-	GeometryStream(GeometryStream &&other) {
+	GeometryStream(GeometryStream &&other)
+		: verts(NULL), vertSize(0), vertCapacity(0), vertCount(0)
+		, vertFormat(VertexFormat::UNDECLARED)
+		, indices(NULL), idxCount(0), idxCapacity(0)
+	{
 		std::swap( verts, other.verts );
 		std::swap( vertSize, other.vertSize );
 		std::swap( vertCapacity, other.vertCapacity );
 		std::swap( vertCount, other.vertCount );
+		std::swap( vertFormat, other.vertFormat );
 		std::swap( indices, other.indices );
+		std::swap( idxCount, other.idxCount );
+		std::swap( idxCapacity, other.idxCapacity );
 	}
 
 	// Access to the vertex buffer
@@ -230,6 +479,25 @@ public:
 	unsigned getVertSize() const { return vertSize; }
 	// Number of vertices in the vertex buffer
 	unsigned getVertCount() const { return vertCount; }
+	// Format of the vertices, if they were emitted with emitFormattedVertex
+	VertexFormat::Id getVertexFormat() const { return vertFormat; }
+
+	// Emit a vertex in one of the declared vertex formats
+	// All vertices in the stream should be in the same format
+	template< typename V >
+	inline void emitFormattedVertex( const V &vtx ) {
+		vertFormat = V::FORMAT;
+		emitVertex( &vtx, (unsigned)sizeof(V) );
+	}
+
+	// Drop all but the first nVerts vertices
+	// All vertices in the stream must be the same size
+	inline void truncateVertices( unsigned nVerts ) {
+		if( vertCount ) {
+			vertSize = vertSize / vertCount * nVerts;
+			vertCount = nVerts;
+		}
+	}
 
 	// Emit a vertex in arbitrary format
 	template< typename T >
@@ -237,6 +505,20 @@ public:
 	// Emit a vertex in arbitrary format
 	void emitVertex( const void *src, unsigned size );
 
+	// Pad the vertex buffer so that its size is a multiple of the given size
+	// Unlike alignVertices, the size need not be a power of two
+	inline void padVertices( unsigned multiple ) {
+		const unsigned char PADDING[] = { 0xad, 0xad, 0xad, 0xad, 0xad, 0xad, 0xad, 0xad };
+		unsigned remainder = vertSize % multiple;
+		if( remainder ) {
+			for( unsigned left = multiple - remainder; left; ) {
+				unsigned n = left < sizeof(PADDING) ? left : (unsigned)sizeof(PADDING);
+				emitVertex( &PADDING[0], n );
+				left -= n;
+			}
+		}
+	}
+
 	// Pad the vertex buffer to ensure the given alignment for the next vertex
 	// Assumes that getVertCount will not be called on this buffer, as the
 	// vertices are no longer contiguous
@@ -250,19 +532,21 @@ public:
 	}
 
 	// Access to the index buffer
-	const unsigned *getIndices() const { return &indices[0]; }
+	const unsigned *getIndices() const { return indices; }
 	// Access to the index buffer
-	unsigned *getIndices() { return &indices[0]; }
+	unsigned *getIndices() { return indices; }
 	// The the starting index of any new geometry to be put in this stream
 	unsigned getIndexBase() const { return getVertCount(); }
 	// Number of triangles
-	unsigned getTriCount() const { return (unsigned)indices.size()/3; }
+	unsigned getTriCount() const { return idxCount/3; }
 
 	// Emit indices for a single triangle
 	inline void emitTriangle( unsigned i, unsigned j, unsigned k ) {
-		indices.push_back( (unsigned)i );
-		indices.push_back( (unsigned)j );
-		indices.push_back( (unsigned)k );
+		if( idxCount + 3 > idxCapacity )
+			ensureIdxCap( idxCount + 3 );
+		indices[idxCount++] = i;
+		indices[idxCount++] = j;
+		indices[idxCount++] = k;
 	}
 	// Emit indices for a quad
 	inline void emitQuad( unsigned i, unsigned j, unsigned k, unsigned l ) {
@@ -273,6 +557,12 @@ public:
 private:
 	// Ensures that there is enough space in the vertex buffer for a new vertex
 	void ensureVertCap( unsigned cap );
+	// Ensures that there is enough space in the index buffer for cap indices
+	void ensureIdxCap( unsigned cap );
+	// Get a buffer of capacity bytes, from the thread's ScratchArena if it has one
+	static void *acquireBuffer( unsigned capacity );
+	// Release a buffer from acquireBuffer
+	static void releaseBuffer( void *buf, unsigned capacity );
 
 	// The vertex buffer
 	void *verts;
@@ -282,8 +572,14 @@ private:
 	unsigned vertCapacity;
 	// Number of vertices emitted into the vertex buffer
 	unsigned vertCount;
+	// Declared format of the vertices
+	VertexFormat::Id vertFormat;
 	// The index buffer
-	std::vector<unsigned> indices;
+	unsigned *indices;
+	// Number of indices in the index buffer
+	unsigned idxCount;
+	// Capacity of the index buffer, in indices
+	unsigned idxCapacity;
 };
 
 class GeometryCluster {
@@ -297,7 +593,9 @@ public:
 	// Deletes itself if empty. Returns true on suicide.
 	virtual bool destroyIfEmpty() = 0;
 	// Flatten all geometry contained in this cluster into the given data streams
-	virtual void finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx ) = 0;
+	// If opt is not NULL, the geometry is optimized with it on the way
+	// Returns the number of triangles the finalized geometry draws
+	virtual unsigned finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx, MeshOptimizer *opt ) = 0;
 
 protected:
 	GeometryCluster();
@@ -322,7 +620,7 @@ public:
 	explicit MetaGeometryCluster( BlockGeometry *geom );
 
 	virtual bool destroyIfEmpty();
-	virtual void finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx  );
+	virtual unsigned finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx, MeshOptimizer *opt );
 
 	// Access to the underlying data stream
 	inline GeometryStream *getStream() { return &str; }
@@ -353,7 +651,7 @@ public:
 	SingleStreamGeometryClusterEx( BlockGeometry *geom, Extra ex );
 
 	virtual bool destroyIfEmpty();
-	virtual void finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx  );
+	virtual unsigned finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx, MeshOptimizer *opt );
 
 	// Access to the underlying geometry stream
 	inline GeometryStream *getStream() { return &str; }
@@ -403,7 +701,7 @@ public:
 	explicit MultiStreamGeometryCluster( BlockGeometry *geom );
 
 	virtual bool destroyIfEmpty();
-	virtual void finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx  );
+	virtual unsigned finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx, MeshOptimizer *opt );
 
 	// Access to a given underlying geometry stream
 	inline GeometryStream *getStream( unsigned i ) { return &str[i]; }
@@ -466,7 +764,7 @@ public:
 	MultiGeometryCluster();
 
 	virtual bool destroyIfEmpty();
-	virtual void finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx  );
+	virtual unsigned finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx, MeshOptimizer *opt );
 
 	// Access to the underlying geometry clusters
 	GeometryCluster *getCluster( unsigned i );
@@ -494,6 +792,99 @@ private:
 	GeometryCluster *subCluster;
 };
 
+class InstancedGeometryCluster : public GeometryCluster {
+	// Small pieces of geometry such as torches, rails and plants are the
+	// same few triangles repeated over many blocks. This GeometryCluster
+	// keeps one template mesh per variant of the geometry (e.g. per block
+	// data value), built with the block at the origin, and only a small
+	// instance record per block. The templates are drawn once per instance
+	// with hardware instancing. Where that is unsupported, the instances
+	// are expanded into plain geometry when finalizing.
+
+public:
+	explicit InstancedGeometryCluster( BlockGeometry *geom );
+
+	virtual bool destroyIfEmpty();
+	virtual unsigned finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx, MeshOptimizer *opt );
+
+	// Maximum number of variants in a cluster
+	static const unsigned MAX_VARIANTS = 16;
+
+	// Access to the template mesh of a variant
+	// The template is empty until the variant's first instance emits it
+	GeometryStream *getTemplate( unsigned variant );
+	// Place a copy of a variant's template at the given block
+	// light is the baked (block, sky) lighting for the copy
+	void addInstance( unsigned variant, const Point &block, const unsigned char *light );
+
+	struct Instance {
+		// Per-instance data, stored in the vertex buffer after the template
+
+		// Offset of the instance in pixels from the section origin
+		short pos[3];
+#ifdef VERTEX_LIGHTING
+		// Block and sky light at the instance
+		unsigned char light[2];
+#endif
+	};
+
+	struct Meta1 {
+		// First piece of metadata output to the metadata stream
+
+		// The number of non-empty variants output
+		unsigned n;
+	};
+
+	struct Meta2 {
+		// One of these will exist per non-empty variant
+
+		// The variant of the geometry
+		unsigned variant;
+		// Offset into the grand vertex buffer of the variant's vertices
+		unsigned vtx_offset;
+		// Offset into the grand index buffer of the variant's indices
+		unsigned idx_offset;
+		// Number of triangles in one copy of the variant
+		unsigned nTris;
+		// Number of vertices in one copy of the variant
+		unsigned nVerts;
+		// The index format used by the variant
+		unsigned idxType;
+		// Offset into the grand vertex buffer of the instance data
+		unsigned inst_offset;
+		// Number of instances, or 0 if they were expanded into the vertices
+		unsigned nInstances;
+	};
+
+	// Skip over the metadata of one cluster
+	static void skipMeta( void *&meta );
+	// Can the current GL context draw instances?
+	static bool isInstancingSupported();
+	// Point the instance attributes at instance data starting at the given
+	// offset in the bound vertex buffer
+	static void bindInstances( std::size_t offset );
+	// Stop reading instance attributes from the vertex buffer
+	static void unbindInstances();
+
+private:
+	~InstancedGeometryCluster();
+
+	// Copy the template of a variant once per instance into the given stream
+	static void expandInstances( GeometryStream *target, const GeometryStream *mesh, const std::vector<Instance> &instances );
+
+	struct Variant {
+		// The template mesh
+		GeometryStream mesh;
+		// Where to place copies of the template
+		std::vector<Instance> instances;
+	};
+
+	// The variants used so far, or NULL
+	Variant *variants[MAX_VARIANTS];
+	// The BlockGeometry responsible for rendering this geometry
+	BlockGeometry *geom;
+};
+
 // ===========================================================================
 // Block Geometries. BlockGeometry and its subclasses describe all the
 // different geometry types, as well as material types that Eihort is
@@ -659,9 +1050,13 @@ bool SingleStreamGeometryClusterEx<Extra>::destroyIfEmpty() {
 
 // -----------------------------------------------------------------
 template< typename Extra >
-void SingleStreamGeometryClusterEx<Extra>::finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx ) {
+unsigned SingleStreamGeometryClusterEx<Extra>::finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx, MeshOptimizer *opt ) {
 	Meta mdata;
 
+	if( opt && str.getVertexFormat() != VertexFormat::UNDECLARED )
+		opt->optimize( &str );
+	MeshDigest::record( geom, 0, &str );
+
 	vtx->alignVertices();
 	mdata.vtx_offset = vtx->getVertSize();
 	vtx->emitVertex( str.getVertices(), str.getVertSize() );
@@ -680,6 +1075,7 @@ void SingleStreamGeometryClusterEx<Extra>::finalize( GeometryStream *meta, Geome
 	meta->emitVertex( mdata );
 
 	delete this;
+	return mdata.nTris;
 }
 
 // -----------------------------------------------------------------
@@ -698,10 +1094,8 @@ template< unsigned N >
 MultiStreamGeometryCluster<N>::MultiStreamGeometryCluster( BlockGeometry *geom )
 : geom(geom)
 {
-	for( unsigned i = N > 6 ? 6 : N; i--; ) {
-		jVec3Zero( &cutoutVectors[i] );
-		cutoutVectors[i].v[i>>1] = i&1 ? 1.0f : -1.0f;
-	}
+	for( unsigned i = N > 6 ? 6 : N; i--; )
+		getFaceNormal( &cutoutVectors[i], i );
 }
 
 // -----------------------------------------------------------------
@@ -722,7 +1116,7 @@ bool MultiStreamGeometryCluster<N>::destroyIfEmpty() {
 
 // -----------------------------------------------------------------
 template< unsigned N >
-void MultiStreamGeometryCluster<N>::finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx ) {
+unsigned MultiStreamGeometryCluster<N>::finalize( GeometryStream *meta, GeometryStream *vtx, GeometryStream *idx, MeshOptimizer *opt ) {
 	Meta1 m1;
 	m1.n = 0;
 	for( unsigned i = 0; i < N; i++ ) {
@@ -733,10 +1127,18 @@ void MultiStreamGeometryCluster<N>::finalize( GeometryStream *meta, GeometryStre
 	meta->emitVertex( geom );
 	meta->emitVertex( m1 );
 
+	unsigned nTris = 0;
 	for( unsigned i = 0; i < N; i++ ) {
 		if( str[i].getVertCount() ) {
+			if( opt && str[i].getVertexFormat() != VertexFormat::UNDECLARED )
+				opt->optimize( &str[i] );
+			MeshDigest::record( geom, i, &str[i] );
+
 			Meta2 m2;
-			vtx->alignVertices();
+			// Align to both 4 bytes and the vertex size, so that the offset
+			// can also be given as a base vertex
+			unsigned vtxStride = str[i].getVertSize()/str[i].getVertCount();
+			vtx->padVertices( vtxStride % 4 == 0 ? vtxStride : vtxStride % 2 == 0 ? vtxStride * 2 : vtxStride * 4 );
 			m2.vtx_offset = vtx->getVertSize();
 			m2.nVerts = str[i].getVertCount();
 
@@ -745,6 +1147,7 @@ void MultiStreamGeometryCluster<N>::finalize( GeometryStream *meta, GeometryStre
 			m2.idx_offset = idx->getVertSize();
 			m2.idxType = indexSizeToGLType( idxType );
 			m2.nTris = str[i].getTriCount();
+			nTris += m2.nTris;
 
 			m2.dir = i;
 
@@ -762,7 +1165,6 @@ void MultiStreamGeometryCluster<N>::finalize( GeometryStream *meta, GeometryStre
 				// Get a good cutout plane
 				jVec3Copy( &m2.cutoutPlane.n, &cutoutVectors[i] );
 				m2.cutoutPlane.d = 0.0f;
-				unsigned vtxStride = str[i].getVertSize()/m2.nVerts;
 				float minD = FLT_MAX;
 				for( unsigned v = 0; v < vtxSize; v += vtxStride ) {
 					short *pos = (short*)((char*)str[i].getVertices() + v);
@@ -778,6 +1180,7 @@ void MultiStreamGeometryCluster<N>::finalize( GeometryStream *meta, GeometryStre
 	}
 
 	delete this;
+	return nTris;
 }
 
 
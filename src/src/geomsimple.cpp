@@ -31,8 +31,9 @@ namespace eihort {
 namespace geom {
 
 // -=-=-=-=------------------------------------------------------=-=-=-=-
-SimpleGeometry::SimpleGeometry()
+SimpleGeometry::SimpleGeometry( VertexFormat::Id fmt )
 : BlockGeometry()
+, vtxFormat(fmt)
 {
 }
 
@@ -42,7 +43,7 @@ SimpleGeometry::~SimpleGeometry() {
 
 // -----------------------------------------------------------------
 GeometryCluster *SimpleGeometry::newCluster() {
-	return new SingleStreamGeometryCluster( this );
+	return new InstancedGeometryCluster( this );
 }
 
 // -----------------------------------------------------------------
@@ -57,60 +58,131 @@ void SimpleGeometry::render( void *&metaData, RenderContext *ctx ) {
 
 // -----------------------------------------------------------------
 void SimpleGeometry::rawRender( void *&metaData, RenderContext *ctx ) {
-	SingleStreamGeometryCluster::Meta *meta = (SingleStreamGeometryCluster::Meta*)metaData;
+	InstancedGeometryCluster::Meta1 *m1 = (InstancedGeometryCluster::Meta1*)metaData;
+	InstancedGeometryCluster::Meta2 *m2 = (InstancedGeometryCluster::Meta2*)&m1[1];
+
+	const VertexLayout &layout = VertexLayout::get( vtxFormat );
+	layout.enable();
+
+	// The vertices carry no normals - simple geometry is lit as top-facing
+	jVec3 normal;
+	getFaceNormal( &normal, 5 );
+	glNormal3fv( normal.v );
+
+	bool instanced = false;
+	for( unsigned i = 0; i < m1->n; i++, m2++ ) {
+		bindVariant( m2->variant );
+
+		// Set up our vertex buffers
+		layout.bind( ctx->vtxBase + m2->vtx_offset );
+
+		// Draw the geometry
+		ctx->drawCallCount++;
+		ctx->vertexFormatSize[vtxFormat] += m2->nVerts * layout.stride;
+		const void *indices = (void*)(ctx->idxBase + m2->idx_offset);
+		if( m2->nInstances ) {
+			// One copy of the template per instance
+			InstancedGeometryCluster::bindInstances( ctx->vtxBase + m2->inst_offset );
+			instanced = true;
+
+			ctx->renderedTriCount += m2->nTris * m2->nInstances;
+			ctx->instanceCount += m2->nInstances;
+			ctx->instanceSize += m2->nInstances * (unsigned)sizeof(InstancedGeometryCluster::Instance);
+			ctx->instanceExpandedSize += m2->nInstances * m2->nVerts * layout.stride;
+			glDrawElementsInstancedARB( GL_TRIANGLES, m2->nTris*3, m2->idxType, indices, m2->nInstances );
+		} else {
+			ctx->renderedTriCount += m2->nTris;
+			glDrawElements( GL_TRIANGLES, m2->nTris*3, m2->idxType, indices );
+		}
+	}
 
-	// Set up our vertex and index buffers
-	glEnableClientState( GL_VERTEX_ARRAY );
-	glEnableClientState( GL_TEXTURE_COORD_ARRAY );
-	glVertexPointer( 3, GL_FLOAT, sizeof( Vertex ), (void*)meta->vtx_offset );
-	glTexCoordPointer( 2, GL_FLOAT, sizeof( Vertex ), (void*)(meta->vtx_offset + 12) );
+	// Clean up
+	if( instanced )
+		InstancedGeometryCluster::unbindInstances();
+	layout.disable();
 
-	// Draw the geometry
-	ctx->renderedTriCount += meta->nTris;
-	glDrawElements( GL_TRIANGLES, meta->nTris*3, meta->idxType, (void*)meta->idx_offset );
+	metaData = m2;
+}
 
-	// Clean up
-	glDisableClientState( GL_VERTEX_ARRAY );
-	glDisableClientState( GL_TEXTURE_COORD_ARRAY );
+// -----------------------------------------------------------------
+void SimpleGeometry::emitInstance( GeometryCluster *out, const InstanceContext *ctx, unsigned variant ) {
+	InstancedGeometryCluster *cluster = (InstancedGeometryCluster*)out;
+	GeometryStream *tmpl = cluster->getTemplate( variant );
+	if( tmpl->getVertCount() == 0 )
+		emitTemplate( tmpl, variant );
+	cluster->addInstance( variant, ctx->block.pos, ctx->light );
+}
 
-	metaData = &meta[1];
+// -----------------------------------------------------------------
+void SimpleGeometry::bindVariant( unsigned ) {
 }
 
 // -----------------------------------------------------------------
+template< typename V >
 void SimpleGeometry::emitSimpleQuad( GeometryStream *target, const jMatrix *loc, const jMatrix *tex ) {
+	// Walk around the corners in pixels, quantizing each into the vertex
+	jVec3 pos;
+	jVec3Scale( &pos, &loc->pos, 16.0f );
+	float u = tex->pos.x, v = tex->pos.z;
+
+	// The baked lighting comes from the instances
+	static const unsigned char NO_LIGHT[2] = { 0, 0 };
+	V vtx;
+	setVertexLight( vtx, NO_LIGHT );
+	
+	unsigned idxBase = target->getIndexBase();
+
+	setVertexPos( vtx, &pos );
+	setVertexUV( vtx, u, v );
+	target->emitFormattedVertex( vtx );
+	jVec3MA( &pos, &loc->right, 16.0f, &pos );
+	u += tex->right.x;
+	v += tex->right.z;
+	setVertexPos( vtx, &pos );
+	setVertexUV( vtx, u, v );
+	target->emitFormattedVertex( vtx );
+	jVec3MA( &pos, &loc->up, 16.0f, &pos );
+	u += tex->up.x;
+	v += tex->up.z;
+	setVertexPos( vtx, &pos );
+	setVertexUV( vtx, u, v );
+	target->emitFormattedVertex( vtx );
+	jVec3MA( &pos, &loc->right, -16.0f, &pos );
+	u -= tex->right.x;
+	v -= tex->right.z;
+	setVertexPos( vtx, &pos );
+	setVertexUV( vtx, u, v );
+	target->emitFormattedVertex( vtx );
+
+	target->emitQuad( idxBase, idxBase+1, idxBase+2, idxBase+3 );
+}
+
+// -----------------------------------------------------------------
+void SimpleGeometry::emitSimpleQuad( GeometryStream *target, const jMatrix *loc, const jMatrix *tex ) const {
 	jMatrix id;
 	if( tex == NULL ) {
 		jMatrixSetIdentity( &id );
 		tex = &id;
 	}
-	
-	Vertex v;
-	jVec3Scale( &v.pos, &loc->pos, 16.0f );
-	v.u = tex->pos.x; v.v = tex->pos.z;
-	
-	unsigned idxBase = target->getIndexBase();
-
-	target->emitVertex( v );
-	jVec3MA( &v.pos, &loc->right, 16.0f, &v.pos );
-	v.u += tex->right.x;
-	v.v += tex->right.z;
-	target->emitVertex( v );
-	jVec3MA( &v.pos, &loc->up, 16.0f, &v.pos );
-	v.u += tex->up.x;
-	v.v += tex->up.z;
-	target->emitVertex( v );
-	jVec3MA( &v.pos, &loc->right, -16.0f, &v.pos );
-	v.u -= tex->right.x;
-	v.v -= tex->right.z;
-	target->emitVertex( v );
 
-	target->emitQuad( idxBase, idxBase+1, idxBase+2, idxBase+3 );
+	switch( vtxFormat ) {
+	case VertexFormat::POS16:
+		emitSimpleQuad<VertexPos16>( target, loc, tex );
+		break;
+	case VertexFormat::POS16_UV8:
+		emitSimpleQuad<VertexPos16UV8>( target, loc, tex );
+		break;
+	default:
+		emitSimpleQuad<VertexPos16UV16>( target, loc, tex );
+		break;
+	}
 }
 
 
 // -=-=-=-=------------------------------------------------------=-=-=-=-
 RailGeometry::RailGeometry( unsigned txStraight, unsigned txTurn )
-: texStraight(txStraight), texTurn(txTurn)
+: SimpleGeometry( VertexFormat::POS16_UV8 )
+, texStraight(txStraight), texTurn(txTurn)
 {
 	rg = RenderGroup::OPAQUE + 100;
 }
@@ -119,44 +191,32 @@ RailGeometry::RailGeometry( unsigned txStraight, unsigned txTurn )
 RailGeometry::~RailGeometry() {
 }
 
-// -----------------------------------------------------------------
-GeometryCluster *RailGeometry::newCluster() {
-	// Two clusters - one for each texture
-	MultiGeometryCluster *clust = new MultiGeometryCluster;
-	clust->newCluster( 0, new SingleStreamGeometryClusterEx<unsigned>( this, 0 ) );
-	clust->newCluster( 1, new SingleStreamGeometryClusterEx<unsigned>( this, 1 ) );
-	return clust;
-}
-
 // -----------------------------------------------------------------
 void RailGeometry::render( void *&meta, RenderContext *ctx ) {
+	// The texture is bound per variant
 	glEnable( GL_TEXTURE_2D );
-	glNormal3f( 0.0f, 0.0f, 1.0f );
-	
-	unsigned *mid = (unsigned*)meta;
-	meta = &mid[1];
-	if( mid[0] == 0 ) {
-		glBindTexture( GL_TEXTURE_2D, texStraight );
-		SimpleGeometry::render( meta, ctx );
-	} else {
-		glBindTexture( GL_TEXTURE_2D, texTurn );
-		SimpleGeometry::render( meta, ctx );
-	}
-
+	SimpleGeometry::render( meta, ctx );
 	glDisable( GL_TEXTURE_2D );
 }
 
+// -----------------------------------------------------------------
+void RailGeometry::bindVariant( unsigned variant ) {
+	glBindTexture( GL_TEXTURE_2D, variant < 6 ? texStraight : texTurn );
+}
+
 // -----------------------------------------------------------------
 bool RailGeometry::beginEmit( GeometryCluster *outCluster, InstanceContext *ctx ) {
-	outCluster = ((MultiGeometryCluster*)outCluster)->getCluster( ctx->block.data < 6 ? 0 : 1 );
-	GeometryStream *out = ((SingleStreamGeometryClusterEx<unsigned>*)outCluster)->getStream();
+	emitInstance( outCluster, ctx, ctx->block.data % InstancedGeometryCluster::MAX_VARIANTS );
+	return false;
+}
 
+// -----------------------------------------------------------------
+void RailGeometry::emitTemplate( GeometryStream *out, unsigned variant ) {
 	jVec3 v1, v2, v3, v4;
-	float z = ctx->block.pos.z * 16.0f + 1.0f;
-	float x = (float)ctx->block.pos.x * 16.0f, y = (float)ctx->block.pos.y * 16.0f;
+	const float x = 0.0f, y = 0.0f, z = 1.0f;
 	const float ONE = 16.0f; // One block is 16 pixels
 
-	switch( ctx->block.data ) {
+	switch( variant ) {
 	case 0: // Flat east/west track
 		jVec3Set( &v1, x, y, z );
 		jVec3Set( &v2, x+ONE, y, z );
@@ -219,32 +279,36 @@ bool RailGeometry::beginEmit( GeometryCluster *outCluster, InstanceContext *ctx
 		break;
 	}
 
-	Vertex v;
-	jVec3Copy( &v.pos, &v1 );
-	v.u = 0.0f; v.v = 0.0f;
+	// The track texture is mapped once over the block, so 8-bit UVs suffice
+	// The baked lighting comes from the instances
+	static const unsigned char NO_LIGHT[2] = { 0, 0 };
+	VertexPos16UV8 v;
+	setVertexLight( v, NO_LIGHT );
 	
 	unsigned idxBase = out->getIndexBase();
 
-	out->emitVertex( v );
-	jVec3Copy( &v.pos, &v2 );
-	v.v += 1.0f;
-	out->emitVertex( v );
-	jVec3Copy( &v.pos, &v3 );
-	v.u = 1.0f;
-	out->emitVertex( v );
-	jVec3Copy( &v.pos, &v4 );
-	v.v = 0.0f;
-	out->emitVertex( v );
+	setVertexPos( v, &v1 );
+	setVertexUV( v, 0.0f, 0.0f );
+	out->emitFormattedVertex( v );
+	setVertexPos( v, &v2 );
+	setVertexUV( v, 0.0f, 1.0f );
+	out->emitFormattedVertex( v );
+	setVertexPos( v, &v3 );
+	setVertexUV( v, 1.0f, 1.0f );
+	out->emitFormattedVertex( v );
+	setVertexPos( v, &v4 );
+	setVertexUV( v, 1.0f, 0.0f );
+	out->emitFormattedVertex( v );
 
 	out->emitQuad( idxBase, idxBase+1, idxBase+2, idxBase+3 );
-
-	return false;
 }
 
 
 // -=-=-=-=------------------------------------------------------=-=-=-=-
 TorchGeometry::TorchGeometry( unsigned tx )
-: tex(tx)
+// Torches map small parts of their texture, which 8-bit UVs cannot hit exactly
+: SimpleGeometry( VertexFormat::POS16_UV16 )
+, tex(tx)
 {
 	rg = RenderGroup::OPAQUE + 100;
 }
@@ -256,7 +320,7 @@ TorchGeometry::~TorchGeometry() {
 // -----------------------------------------------------------------
 void TorchGeometry::render( void *&meta, RenderContext *ctx ) {
 	if( jVec3LengthSq( &ctx->viewPos ) > 200.0f*200.0f ) {
-		meta = (char*)meta + sizeof(SingleStreamGeometryCluster::Meta);
+		InstancedGeometryCluster::skipMeta( meta );
 		return;
 	}
 
@@ -276,10 +340,14 @@ void TorchGeometry::render( void *&meta, RenderContext *ctx ) {
 
 // -----------------------------------------------------------------
 bool TorchGeometry::beginEmit( GeometryCluster *outCluster, InstanceContext *ctx ) {
-	GeometryStream *out = ((SingleStreamGeometryCluster*)outCluster)->getStream();
+	emitInstance( outCluster, ctx, ctx->block.data % InstancedGeometryCluster::MAX_VARIANTS );
+	return false;
+}
 
+// -----------------------------------------------------------------
+void TorchGeometry::emitTemplate( GeometryStream *target, unsigned variant ) {
 	jVec3 base, top;
-	jVec3Set( &base, (float)ctx->block.pos.x, (float)ctx->block.pos.y, (float)ctx->block.pos.z );
+	jVec3Zero( &base );
 	jVec3Copy( &top, &base );
 	top.z += 1.0f;
 
@@ -287,7 +355,7 @@ bool TorchGeometry::beginEmit( GeometryCluster *outCluster, InstanceContext *ctx
 	const float ONWALL_MOVE_Z = 3.0f / 16.0f;
 	const float TOP_MOVE = 2.0f/16.0f;
 	const float TORCH_WIDTH = 2/16.0f;
-	switch( ctx->block.data ) {
+	switch( variant ) {
 	case 1: // Pointing South
 		top.y -= TOP_MOVE;
 		base.y -= BASE_MOVE;
@@ -326,26 +394,26 @@ bool TorchGeometry::beginEmit( GeometryCluster *outCluster, InstanceContext *ctx
 	jVec3Copy( &pos.pos, &base );
 	jVec3Set( &pos.right, 1.0f, 0.0f, 0.0f );
 	pos.pos.y += 0.5f - TORCH_WIDTH/2;
-	emitSimpleQuad( out, &pos, &tx );
+	emitSimpleQuad( target, &pos, &tx );
 
 	// Y- Side
 	pos.right.x = -1.0f;
 	pos.pos.y += TORCH_WIDTH;
 	pos.pos.x += 1.0f;
-	emitSimpleQuad( out, &pos, &tx );
+	emitSimpleQuad( target, &pos, &tx );
 
 	// X+ Side
 	pos.right.x = 0.0f;
 	pos.right.y = 1.0f;
 	pos.pos.y = base.y;
 	pos.pos.x = base.x + 0.5f + TORCH_WIDTH/2;
-	emitSimpleQuad( out, &pos, &tx );
+	emitSimpleQuad( target, &pos, &tx );
 
 	// X- Side
 	pos.right.y = -1.0f;
 	pos.pos.y += 1.0f;
 	pos.pos.x -= TORCH_WIDTH;
-	emitSimpleQuad( out, &pos, &tx );
+	emitSimpleQuad( target, &pos, &tx );
 
 	// Bottom
 	jVec3Set( &pos.right, TORCH_WIDTH, 0.0f, 0.0f );
@@ -357,7 +425,7 @@ bool TorchGeometry::beginEmit( GeometryCluster *outCluster, InstanceContext *ctx
 	tx.pos.z = 1.0f;
 	tx.right.x = TORCH_WIDTH;
 	tx.up.z = -TORCH_WIDTH;
-	emitSimpleQuad( out, &pos, &tx );
+	emitSimpleQuad( target, &pos, &tx );
 
 	// Top
 	jVec3Set( &pos.right, TORCH_WIDTH, 0.0f, 0.0f );
@@ -369,15 +437,22 @@ bool TorchGeometry::beginEmit( GeometryCluster *outCluster, InstanceContext *ctx
 	tx.pos.z = 0.5f;
 	tx.right.x = TORCH_WIDTH;
 	tx.up.z = -TORCH_WIDTH;
-	emitSimpleQuad( out, &pos, &tx );
-
-	return false;
+	emitSimpleQuad( target, &pos, &tx );
 }
 
 
 // -=-=-=-=------------------------------------------------------=-=-=-=-
 XShapedBlockGeometry::XShapedBlockGeometry( unsigned tx )
-: tex(tx)
+: SimpleGeometry( VertexFormat::POS16_UV8 )
+, tex(tx)
+{
+	rg = RenderGroup::OPAQUE + 100;
+}
+
+// -----------------------------------------------------------------
+XShapedBlockGeometry::XShapedBlockGeometry( unsigned tx, VertexFormat::Id fmt )
+: SimpleGeometry( fmt )
+, tex(tx)
 {
 	rg = RenderGroup::OPAQUE + 100;
 }
@@ -421,18 +496,22 @@ void XShapedBlockGeometry::emitIsland( GeometryCluster *outCluster, const Island
 	// TODO: Proper emit for reeds/tall grass.. this would probably
 	// actually result in a decent speedboost
 
-	GeometryStream *out = ((SingleStreamGeometryCluster*)outCluster)->getStream();
+	// Every plant is the same X
+	emitInstance( outCluster, &ctx->origin, 0 );
+}
 
+// -----------------------------------------------------------------
+void XShapedBlockGeometry::emitTemplate( GeometryStream *target, unsigned ) {
 	jMatrix pos, tx;
 	jMatrixSetIdentity( &tx );
 	tx.pos.z = 1.0f;
 	tx.up.z = -1.0f;
 
 	// Make one diagonal
-	jVec3Set( &pos.pos, (float)ctx->origin.block.pos.x, (float)ctx->origin.block.pos.y, (float)ctx->origin.block.pos.z );
+	jVec3Zero( &pos.pos );
 	jVec3Set( &pos.up, 0.0f, 0.0f, 1.0f );
 	jVec3Set( &pos.right, 1.0f, 1.0f, 0.0f );
-	emitSimpleQuad( out, &pos, &tx );
+	emitSimpleQuad( target, &pos, &tx );
 
 	/*
 	// Flip it around
@@ -440,17 +519,17 @@ void XShapedBlockGeometry::emitIsland( GeometryCluster *outCluster, const Island
 	jVec3Set( &pos.right, -1.0f, -1.0f, 0.0f );
 	tx.pos.x = 1.0f;
 	tx.right.x = -1.0f;
-	emitSimpleQuad( out, &pos, &tx );
+	emitSimpleQuad( target, &pos, &tx );
 	*/
 
 	// Make the other diagonal
 	tx.pos.x = 0.0f;
 	tx.right.x = 1.0f;
-	jVec3Set( &pos.pos, (float)ctx->origin.block.pos.x, (float)ctx->origin.block.pos.y, (float)ctx->origin.block.pos.z );
+	jVec3Zero( &pos.pos );
 	jVec3Set( &pos.up, 0.0f, 0.0f, 1.0f );
 	jVec3Set( &pos.right, 1.0f, -1.0f, 0.0f );
 	pos.pos.y += 1.0f;
-	emitSimpleQuad( out, &pos, &tx );
+	emitSimpleQuad( target, &pos, &tx );
 
 	/*
 	// Flip it around
@@ -458,14 +537,15 @@ void XShapedBlockGeometry::emitIsland( GeometryCluster *outCluster, const Island
 	jVec3Set( &pos.right, -1.0f, 1.0f, 0.0f );
 	tx.pos.x = 1.0f;
 	tx.right.x = -1.0f;
-	emitSimpleQuad( out, &pos, &tx );
+	emitSimpleQuad( target, &pos, &tx );
 	*/
 }
 
 
 // -=-=-=-=------------------------------------------------------=-=-=-=-
 BiomeXShapedBlockGeometry::BiomeXShapedBlockGeometry( unsigned tx, unsigned biomeTex )
-: XShapedBlockGeometry( tx ), biomeTex(biomeTex)
+// The foliage shader generates the UVs, so none are stored
+: XShapedBlockGeometry( tx, VertexFormat::POS16 ), biomeTex(biomeTex)
 {
 }
 
@@ -485,15 +565,10 @@ void BiomeXShapedBlockGeometry::render( void *&meta, RenderContext *ctx ) {
 	glBindTexture( GL_TEXTURE_2D, ctx->biomeTextures[biomeTex] );
 	glActiveTexture( GL_TEXTURE0 );
 
-	// To use the foliage shader, we need a texture matrix
-	glMatrixMode( GL_TEXTURE );
-	const float texMat[] = {
-		1.f/16, 0.f, 0.f, 0.f,
-		0.f, 0.f, 0.f, 0.f,
-		0.f, -1.f/16, 0.f, 0.f,
-		0.f, 0.f, 0.f, 0.f
-	};
-	glLoadMatrixf( &texMat[0] );
+	// The foliage shader generates the UVs from the positions
+	const float texGenS[] = { 1.f/16, 0.f, 0.f, 0.f };
+	const float texGenT[] = { 0.f, 0.f, -1.f/16, 0.f };
+	ctx->shader->setTexGen( texGenS, texGenT );
 
 	glDisable( GL_CULL_FACE );
 	glEnable( GL_TEXTURE_2D );
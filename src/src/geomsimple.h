@@ -35,8 +35,10 @@ namespace geom {
 
 class SimpleGeometry : public BlockGeometry {
 	// Parent BlockGeometry for geometry which follows a more normal
-	// render pipeline - vertices are specified with float positions
-	// and carry texture uv.
+	// render pipeline - vertices carry texture uv.
+	// The geometry of each block is one of a few variants (e.g. one per
+	// block data value), so it is emitted as instances of template meshes
+	// in an InstancedGeometryCluster.
 
 public:
 	virtual ~SimpleGeometry();
@@ -45,19 +47,28 @@ public:
 	virtual GeometryCluster *newCluster();
 
 protected:
-	explicit SimpleGeometry();
-
-	// Helper to emit a quad
-	static void emitSimpleQuad( GeometryStream *target, const jMatrix *loc, const jMatrix *tex = NULL );
+	// The geometry's vertices are emitted in the given format
+	explicit SimpleGeometry( VertexFormat::Id fmt );
+
+	// Place an instance of the given variant at the block
+	// The variant's template is emitted with emitTemplate when first used
+	void emitInstance( GeometryCluster *out, const InstanceContext *ctx, unsigned variant );
+	// Emit the template mesh of a variant, with the block at the origin
+	virtual void emitTemplate( GeometryStream *target, unsigned variant ) = 0;
+	// Set up the material of a variant before it is drawn
+	virtual void bindVariant( unsigned variant );
+
+	// Helper to emit a quad in the geometry's vertex format
+	void emitSimpleQuad( GeometryStream *target, const jMatrix *loc, const jMatrix *tex = NULL ) const;
+	// Helper to emit a quad in the vertex format V
+	template< typename V >
+	static void emitSimpleQuad( GeometryStream *target, const jMatrix *loc, const jMatrix *tex );
 	// Render the geometry
 	// To be called by subclasses after setting up the material
 	void rawRender( void *&meta, RenderContext *ctx );
 
-	struct Vertex {
-		// "Simple" geometry vertex format
-		jVec3 pos;
-		float u, v;
-	};
+	// Format of the geometry's vertices
+	VertexFormat::Id vtxFormat;
 };
 
 class RailGeometry : public SimpleGeometry {
@@ -68,11 +79,13 @@ public:
 	explicit RailGeometry( unsigned txStraight, unsigned txTurn );
 	virtual ~RailGeometry();
 
-	virtual GeometryCluster *newCluster();
-
 	virtual bool beginEmit( GeometryCluster *out, InstanceContext *ctx );
 	virtual void render( void *&meta, RenderContext *ctx );
 
+protected:
+	virtual void emitTemplate( GeometryStream *target, unsigned variant );
+	virtual void bindVariant( unsigned variant );
+
 private:
 	// Texture for straight pieces
 	unsigned texStraight;
@@ -90,6 +103,9 @@ public:
 	virtual bool beginEmit( GeometryCluster *out, InstanceContext *ctx );
 	virtual void render( void *&meta, RenderContext *ctx );
 
+protected:
+	virtual void emitTemplate( GeometryStream *target, unsigned variant );
+
 private:
 	// Torch texture
 	unsigned tex;
@@ -111,6 +127,11 @@ public:
 	virtual void emitIsland( GeometryCluster *out, const IslandDesc *ctx );
 
 protected:
+	// Construct with vertices in a different format
+	XShapedBlockGeometry( unsigned tx, VertexFormat::Id fmt );
+
+	virtual void emitTemplate( GeometryStream *target, unsigned variant );
+
 	// XShapedBlock texture
 	unsigned tex;
 };
@@ -22,6 +22,7 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 
 #include <GL/glew.h>
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 
@@ -29,10 +30,152 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 #include "triangle.h"
 #include "eihortshader.h"
 #include "lightmodel.h"
+#include "profile.h"
 
 namespace eihort {
 namespace geom {
 
+// -----------------------------------------------------------------
+static inline bool sameVector( const jVec3 *a, const jVec3 *b ) {
+	return a->x == b->x && a->y == b->y && a->z == b->z;
+}
+
+// -=-=-=-=------------------------------------------------------=-=-=-=-
+SolidFaceBatch::SolidFaceBatch()
+{
+}
+
+// -----------------------------------------------------------------
+SolidFaceBatch::~SolidFaceBatch() {
+}
+
+// -----------------------------------------------------------------
+bool SolidFaceBatch::Face::sameState( const Face &other ) const {
+	return dir == other.dir && sameVector( &normal, &other.normal )
+		&& tex == other.tex && color == other.color
+		&& texScale[0] == other.texScale[0] && texScale[1] == other.texScale[1]
+		&& idxType == other.idxType;
+}
+
+// -----------------------------------------------------------------
+bool SolidFaceBatch::Face::operator<( const Face &other ) const {
+	// Direction first, as the light model and normal change with it
+	if( dir != other.dir ) return dir < other.dir;
+	for( unsigned i = 0; i < 3; i++ ) {
+		if( normal.v[i] != other.normal.v[i] )
+			return normal.v[i] < other.normal.v[i];
+	}
+	if( tex != other.tex ) return tex < other.tex;
+	if( color != other.color ) return color < other.color;
+	if( texScale[0] != other.texScale[0] ) return texScale[0] < other.texScale[0];
+	if( texScale[1] != other.texScale[1] ) return texScale[1] < other.texScale[1];
+	if( idxType != other.idxType ) return idxType < other.idxType;
+	// Keep the faces in buffer order within a group
+	return idx_offset < other.idx_offset;
+}
+
+// -----------------------------------------------------------------
+void SolidFaceBatch::queue( const SolidBlockGeometry *geom, void *&metaData, RenderContext *ctx ) {
+	// Geometry metadata is in SixSidedGeometryCluster format
+	SixSidedGeometryCluster::Meta1 *m1 = (SixSidedGeometryCluster::Meta1*)metaData;
+	SixSidedGeometryCluster::Meta2 *m2 = (SixSidedGeometryCluster::Meta2*)((char*)metaData + sizeof(SixSidedGeometryCluster::Meta1));
+
+	for( unsigned i = 0; i < m1->n; i++, m2++ ) {
+		if( jPlaneDot3( &m2->cutoutPlane, &ctx->viewPos ) >= 0.0f ) {
+			// This geometry is facing the camera
+			Face face;
+			face.dir = m2->dir;
+			jVec3Copy( &face.normal, &m2->cutoutPlane.n );
+			face.tex = geom->tex[m2->dir];
+			face.color = geom->color;
+			face.texScale[0] = geom->xTexScale;
+			face.texScale[1] = geom->yTexScale;
+			face.idxType = m2->idxType;
+			face.vtx_offset = m2->vtx_offset;
+			face.idx_offset = m2->idx_offset;
+			face.nTris = m2->nTris;
+			faces.push_back( face );
+			ctx->vertexFormatSize[SolidBlockGeometry::Vertex::FORMAT] += m2->nVerts * (unsigned)sizeof( SolidBlockGeometry::Vertex );
+		}
+	}
+
+	// Point the metadata pointer at the end of this geometry's metadata
+	metaData = (void*)m2;
+}
+
+// -----------------------------------------------------------------
+void SolidFaceBatch::flush( RenderContext *ctx ) {
+	typedef SolidBlockGeometry::Vertex Vertex;
+
+	if( faces.empty() )
+		return;
+
+	std::sort( faces.begin(), faces.end() );
+
+	// Set GL state
+	ctx->shader->bindTexGen();
+	const VertexLayout &layout = VertexLayout::get( Vertex::FORMAT );
+	layout.enable();
+	glEnable( GL_TEXTURE_2D );
+
+	// With base vertices, all faces can share one vertex pointer at the
+	// start of the section's vertices
+	// The vertex offsets are multiples of the vertex size (see
+	// MultiStreamGeometryCluster::finalize)
+	bool baseVertex = GLEW_ARB_draw_elements_base_vertex != 0;
+	if( baseVertex )
+		layout.bind( ctx->vtxBase );
+
+	const Face *prev = NULL;
+	for( std::size_t first = 0; first < faces.size(); ) {
+		// Find the faces sharing this face's state
+		const Face &face = faces[first];
+		std::size_t last = first + 1;
+		while( last < faces.size() && faces[last].sameState( face ) )
+			last++;
+
+		// Apply the state which differs from the last group
+		if( !prev || prev->dir != face.dir || !sameVector( &prev->normal, &face.normal )
+		 || prev->texScale[0] != face.texScale[0] || prev->texScale[1] != face.texScale[1] )
+			SolidBlockGeometry::setFaceState( face.dir, &face.normal, face.texScale[0], face.texScale[1], ctx );
+		if( !prev || prev->tex != face.tex )
+			glBindTexture( GL_TEXTURE_2D, face.tex );
+		if( !prev || prev->color != face.color )
+			SolidBlockGeometry::applyColor( face.color );
+		prev = &face;
+
+		if( baseVertex ) {
+			counts.clear();
+			offsets.clear();
+			baseVertices.clear();
+			for( std::size_t i = first; i < last; i++ ) {
+				counts.push_back( (int)faces[i].nTris * 3 );
+				offsets.push_back( (const void*)(ctx->idxBase + faces[i].idx_offset) );
+				baseVertices.push_back( (int)(faces[i].vtx_offset / sizeof( Vertex )) );
+				ctx->renderedTriCount += faces[i].nTris;
+			}
+			glMultiDrawElementsBaseVertex( GL_TRIANGLES, &counts[0], face.idxType, &offsets[0], (int)counts.size(), &baseVertices[0] );
+			ctx->drawCallCount++;
+		} else {
+			for( std::size_t i = first; i < last; i++ ) {
+				layout.bind( ctx->vtxBase + faces[i].vtx_offset );
+				glDrawElements( GL_TRIANGLES, faces[i].nTris*3, face.idxType, (void*)(ctx->idxBase + faces[i].idx_offset) );
+				ctx->renderedTriCount += faces[i].nTris;
+				ctx->drawCallCount++;
+			}
+		}
+
+		first = last;
+	}
+
+	// Undo GL state damage
+	layout.disable();
+	glDisable( GL_TEXTURE_2D );
+
+	faces.clear();
+}
+
+
 // -=-=-=-=------------------------------------------------------=-=-=-=-
 SolidBlockGeometry::SolidBlockGeometry( unsigned tx, unsigned color )
 : color(color)
@@ -66,36 +209,50 @@ GeometryCluster *SolidBlockGeometry::newCluster() {
 
 // -----------------------------------------------------------------
 void SolidBlockGeometry::render( void *&metaData, RenderContext *ctx ) {
+	if( ctx->solidBatch ) {
+		// Draw later, together with the rest of the section
+		ctx->solidBatch->queue( this, metaData, ctx );
+		return;
+	}
+
 	ctx->shader->bindTexGen();
 	applyColor();
 	solidBlockRender( metaData, ctx );
 }
 
+// -----------------------------------------------------------------
+void SolidBlockGeometry::setFaceState( unsigned dir, const jVec3 *normal, float xScale, float yScale, RenderContext *ctx ) {
+	// Texture coordinate generation parameters for each face
+	// The UVs are generated in the vertex shader as (dot(S, pos), dot(T, pos))
+	static const unsigned TEX_GEN_S_AXIS[] = { 1, 1, 0, 0, 1, 1 };
+	static const float TEX_GEN_S_SCALE[] = { -1/16.0f, 1/16.0f, 1/16.0f, -1/16.0f, 1/16.0f, 1/16.0f };
+	static const unsigned TEX_GEN_T_AXIS[] = { 2, 2, 2, 2, 0, 0 };
+	static const float TEX_GEN_T_SCALE[] = { -1/16.0f, -1/16.0f, -1/16.0f, -1/16.0f, -1/16.0f, 1/16.0f };
+
+	glNormal3fv( normal->v );
+	ctx->lightModels[dir].uploadGL();
+
+	float texGenS[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	float texGenT[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	texGenS[TEX_GEN_S_AXIS[dir]] = TEX_GEN_S_SCALE[dir] * xScale;
+	texGenT[TEX_GEN_T_AXIS[dir]] = TEX_GEN_T_SCALE[dir] * yScale;
+	ctx->shader->setTexGen( texGenS, texGenT );
+}
+
 // -----------------------------------------------------------------
 void SolidBlockGeometry::solidBlockRender( void *&metaData, RenderContext *ctx ) {
 	// This is the heavily-optimized render function for most of the
 	// geometry visible in a Minecraft world
 
-	// Texture matrix generation parameters for each face
-	static const unsigned TEX_MATRIX_X_COORD[] = { 4, 4, 0, 0, 4, 4 };
-	static const float TEX_MATRIX_X_SCALE[] = { -1/16.0f, 1/16.0f, 1/16.0f, -1/16.0f, 1/16.0f, 1/16.0f };
-	static const unsigned TEX_MATRIX_Y_COORD[] = { 9, 9, 9, 9, 1, 1 };
-	static const float TEX_MATRIX_Y_SCALE[] = { -1/16.0f, -1/16.0f, -1/16.0f, -1/16.0f, -1/16.0f, 1/16.0f };
-
 	// Geometry metadata is in SixSidedGeometryCluster format
 	SixSidedGeometryCluster::Meta1 *m1 = (SixSidedGeometryCluster::Meta1*)metaData;
 	SixSidedGeometryCluster::Meta2 *m2 = (SixSidedGeometryCluster::Meta2*)((char*)metaData + sizeof(SixSidedGeometryCluster::Meta1));
 
 	// Set GL state
-	glEnableClientState( GL_VERTEX_ARRAY );
+	const VertexLayout &layout = VertexLayout::get( Vertex::FORMAT );
+	layout.enable();
 	glEnable( GL_TEXTURE_2D );
 
-	// Initialize the texture matrix
-	glMatrixMode( GL_TEXTURE );
-	float glmat[16];
-	for( unsigned i = 0; i < 16; i++ )
-		glmat[i] = 0.0f;
-
 	// Previous texture ID
 	unsigned prevT = 0;
 
@@ -108,29 +265,19 @@ void SolidBlockGeometry::solidBlockRender( void *&metaData, RenderContext *ctx )
 				glBindTexture( GL_TEXTURE_2D, prevT = tex[m2->dir] );
 
 			// Set up face-specific GL states
-			glVertexPointer( 3, GL_SHORT, sizeof( Vertex ), (void*)m2->vtx_offset );
-			glNormal3fv( m2->cutoutPlane.n.v );
-			ctx->lightModels[m2->dir].uploadGL();
-
-			// Set up the texture matrix for this face
-			unsigned texCoordX = TEX_MATRIX_X_COORD[m2->dir];
-			unsigned texCoordY = TEX_MATRIX_Y_COORD[m2->dir];
-			glmat[texCoordX] = TEX_MATRIX_X_SCALE[m2->dir] * xTexScale;
-			glmat[texCoordY] = TEX_MATRIX_Y_SCALE[m2->dir] * yTexScale;
-			glLoadMatrixf( &glmat[0] );
+			layout.bind( ctx->vtxBase + m2->vtx_offset );
+			setFaceState( m2->dir, &m2->cutoutPlane.n, xTexScale, yTexScale, ctx );
 
 			// Actual draw call
-			glDrawElements( GL_TRIANGLES, m2->nTris*3, m2->idxType, (void*)m2->idx_offset );
+			glDrawElements( GL_TRIANGLES, m2->nTris*3, m2->idxType, (void*)(ctx->idxBase + m2->idx_offset) );
 			ctx->renderedTriCount += m2->nTris;
-
-			// Reset the texture matrix
-			glmat[texCoordX] = 0.0f;
-			glmat[texCoordY] = 0.0f;
+			ctx->drawCallCount++;
+			ctx->vertexFormatSize[Vertex::FORMAT] += m2->nVerts * (unsigned)sizeof( Vertex );
 		}
 	}
 
 	// Undo GL state damage
-	glDisableClientState( GL_VERTEX_ARRAY );
+	layout.disable();
 	glDisable( GL_TEXTURE_2D );
 
 	// Point the metadata pointer at the end of this geometry's metadata
@@ -168,7 +315,10 @@ void SolidBlockGeometry::emitContour( GeometryStream *out, const IslandDesc *ctx
 		triOut.pointmarkerlist = NULL;
 		triOut.trianglelist = NULL;
 		triOut.segmentlist = NULL;
-		triangulate( const_cast<char*>("QjzpBP"), &triIn, &triOut, NULL );
+		{
+			PROFILE_SCOPE( PROFILE_MESH_TRIANGULATE );
+			triangulate( const_cast<char*>("QjzpBP"), &triIn, &triOut, NULL );
+		}
 		freeIslandTriangleIO( &triIn );
 		emitTriangulated( out, ctx, &triOut, offsetPx );
 	}
@@ -292,12 +442,15 @@ void SolidBlockGeometry::emitTriangulated( GeometryStream *target, const IslandD
 
 	// Emit vertices
 	Vertex vtx;
+	// Unevenly lit faces are always quads
+	assert( !ctx->cornerLit );
+	setVertexLight( vtx, ctx->light );
 	vtx.pos[ctx->zax] = (short)(ctx->contourPoints[0].v[ctx->zax] * 16 + ctx->zd * offsetPx );
 	for( unsigned i = 0; i < (unsigned)tri->numberofpoints; i++ ) {
 		vtx.pos[ctx->xax] = (short)(ctx->xd1 * (int)floor( tri->pointlist[i<<1] ) * 16);
 		vtx.pos[ctx->yax] = (short)(ctx->yd1 * (int)floor( tri->pointlist[(i<<1)+1] ) * 16);
 		
-		target->emitVertex( vtx );
+		target->emitFormattedVertex( vtx );
 	}
 
 	// Emit indices
@@ -318,12 +471,13 @@ void SolidBlockGeometry::emitQuad( GeometryStream *target, const IslandDesc *ctx
 	short offset = (short)(ctx->zd * offsetPx);
 	Vertex vtx;
 	for( unsigned i = 0; i < 4; i++ ) {
+		setVertexLight( vtx, getVertexLight( ctx, ctx->contourPoints[i] ) );
 		vtx.pos[0] = (short)(ctx->contourPoints[i].x * 16);
 		vtx.pos[1] = (short)(ctx->contourPoints[i].y * 16);
 		vtx.pos[2] = (short)(ctx->contourPoints[i].z * 16);
 		vtx.pos[ctx->zax] += offset;
 
-		target->emitVertex( vtx );
+		target->emitFormattedVertex( vtx );
 	}
 
 	target->emitQuad( indexBase, indexBase+1, indexBase+2, indexBase+3 );
@@ -347,11 +501,12 @@ void SolidBlockGeometry::emitQuad( GeometryStream *target, const IslandDesc *ctx
 	// Emit the quad with offsets
 	Vertex vtx;
 	for( unsigned i = 0; i < 4; i++ ) {
+		setVertexLight( vtx, getVertexLight( ctx, ctx->contourPoints[i] ) );
 		vtx.pos[0] = (short)(ctx->contourPoints[i].x * 16 + (ctx->contourPoints[i].x == highPos.x ? offsets[1] : -offsets[0]));
 		vtx.pos[1] = (short)(ctx->contourPoints[i].y * 16 + (ctx->contourPoints[i].y == highPos.y ? offsets[3] : -offsets[2]));
 		vtx.pos[2] = (short)(ctx->contourPoints[i].z * 16 + (ctx->contourPoints[i].z == highPos.z ? offsets[5] : -offsets[4]));
 
-		target->emitVertex( vtx );
+		target->emitFormattedVertex( vtx );
 	}
 
 	target->emitQuad( indexBase, indexBase+1, indexBase+2, indexBase+3 );
@@ -359,6 +514,11 @@ void SolidBlockGeometry::emitQuad( GeometryStream *target, const IslandDesc *ctx
 
 // -----------------------------------------------------------------
 void SolidBlockGeometry::applyColor() {
+	applyColor( color );
+}
+
+// -----------------------------------------------------------------
+void SolidBlockGeometry::applyColor( unsigned color ) {
 	float colors[4];
 	colors[0] = ((color>>16)&0xff) / 255.0f;
 	colors[1] = ((color>>8)&0xff) / 255.0f;
@@ -556,8 +716,11 @@ void HashShapedBlockGeometry::emitIsland( GeometryCluster *outCluster, const Isl
 
 // -----------------------------------------------------------------
 void HashShapedBlockGeometry::render( void *&meta, RenderContext *ctx ) {
+	// Not batched, since the faces are drawn without culling
+	ctx->shader->bindTexGen();
+	applyColor();
 	glDisable( GL_CULL_FACE );
-	SolidBlockGeometry::render( meta, ctx );
+	solidBlockRender( meta, ctx );
 	glEnable( GL_CULL_FACE );
 }
 
@@ -703,12 +866,13 @@ void SquashedSolidBlockGeometry::emitIsland( GeometryCluster *outCluster, const
 		// Emit the vertices
 		Vertex vtx;
 		for( unsigned i = 0; i < 4; i++ ) {
+			setVertexLight( vtx, getVertexLight( ctx, ctx->contourPoints[i] ) );
 			vtx.pos[0] = (short)(ctx->contourPoints[i].x * 16);
 			vtx.pos[1] = (short)(ctx->contourPoints[i].y * 16);
 			// Offset the z axis
 			vtx.pos[2] = (short)(ctx->contourPoints[i].z * 16 + (ctx->contourPoints[i].z == topz ? top : -bottom));
 
-			target->emitVertex( vtx );
+			target->emitFormattedVertex( vtx );
 		}
 
 		target->emitQuad( indexBase, indexBase+1, indexBase+2, indexBase+3 );
@@ -35,6 +35,61 @@ struct triangulateio;
 namespace eihort {
 namespace geom {
 
+class SolidBlockGeometry;
+
+class SolidFaceBatch {
+	// Collects the camera-facing faces of the SolidBlockGeometries in a
+	// mesh section, and draws them grouped by direction and texture
+	// Faces sharing all of their GL state are submitted together with
+	// glMultiDrawElementsBaseVertex when it is available
+	// Sections are not batched together, as each has its own transform,
+	// lighting texture and biome texture
+
+public:
+	SolidFaceBatch();
+	~SolidFaceBatch();
+
+	// Queue the faces in the given SixSidedGeometryCluster metadata
+	// Advances meta past the geometry's metadata
+	void queue( const SolidBlockGeometry *geom, void *&meta, RenderContext *ctx );
+	// Draw all queued faces and empty the batch
+	// The buffers of the section the faces came from must be bound
+	void flush( RenderContext *ctx );
+
+private:
+	struct Face {
+		// A queued face direction of one geometry
+
+		// Direction of the faces
+		unsigned dir;
+		// Normal given to the faces
+		jVec3 normal;
+		// Texture of the faces
+		unsigned tex;
+		// Material color
+		unsigned color;
+		// Texture scale
+		float texScale[2];
+		// Index format
+		unsigned idxType;
+		// Offsets of the vertices and indices in the section's buffers
+		unsigned vtx_offset, idx_offset;
+		// Number of triangles
+		unsigned nTris;
+
+		// Can this face be drawn in the same call as the other?
+		bool sameState( const Face &other ) const;
+		// Order for grouping faces with the same state
+		bool operator<( const Face &other ) const;
+	};
+
+	// The queued faces
+	std::vector<Face> faces;
+	// Arguments to glMultiDrawElementsBaseVertex
+	std::vector<int> counts, baseVertices;
+	std::vector<const void*> offsets;
+};
+
 class SolidBlockGeometry : public BlockGeometry {
 	// A simple, normal block.
 	// Most blocks that make up the world use this.
@@ -103,18 +158,21 @@ protected:
 	// Helper to emit a single quad, with offsets/shrinkage in all dimensions
 	static void emitQuad( GeometryStream *out, const IslandDesc *ctx, int *offsets );
 
+	friend class SolidFaceBatch;
+
 	// Actual render function, after the material state has been set
 	void solidBlockRender( void *&meta, RenderContext *ctx );
 	// Helper to apply the color to the global GL render state
 	void applyColor();
-
-	struct Vertex {
-		// Vertex format used by geometry generated by SolidBlockGeometry
-		
-		// Position of the vertex, as a pixel (1/16th of a block size)
-		// offset from the center of the qtree chunk
-		short pos[3];
-	};
+	// Helper to apply a color to the global GL render state
+	static void applyColor( unsigned color );
+	// Set up the normal, light model and texture coordinate generation for
+	// faces in the given direction
+	static void setFaceState( unsigned dir, const jVec3 *normal, float xScale, float yScale, RenderContext *ctx );
+
+	// Vertex format used by geometry generated by SolidBlockGeometry
+	// UVs are generated from the position, and the normal from the face
+	typedef VertexPos16 Vertex;
 
 	// Textures to use for each face
 	unsigned tex[6];
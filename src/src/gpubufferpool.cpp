@@ -0,0 +1,259 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <cassert>
+#include <GL/glew.h>
+#include "gpubufferpool.h"
+
+namespace eihort {
+
+// -----------------------------------------------------------------
+static unsigned blockOrder( unsigned size, unsigned minOrder ) {
+	// Log2 of the smallest power of two holding size bytes
+	unsigned order = minOrder;
+	while( order < 31 && (1u << order) < size )
+		order++;
+	return order;
+}
+
+// -----------------------------------------------------------------
+GpuBufferPool::GpuBufferPool( unsigned target, unsigned pageShift )
+: target(target)
+, pageShift(pageShift < MIN_ORDER ? MIN_ORDER : pageShift)
+, reservedBytes(0), allocatedBytes(0), usedBytes(0), movedBytes(0)
+{
+}
+
+// -----------------------------------------------------------------
+GpuBufferPool::~GpuBufferPool() {
+	// Any ranges still out are released with their pages
+	while( !pages.empty() ) {
+		Page *page = pages.back();
+		for( auto it = page->ranges.begin(); it != page->ranges.end(); ++it )
+			delete *it;
+		page->ranges.clear();
+		freePage( page );
+	}
+}
+
+// -----------------------------------------------------------------
+GpuBufferPool::Range *GpuBufferPool::alloc( unsigned size ) {
+	unsigned order = blockOrder( size, MIN_ORDER );
+
+	// Prefer the fullest page with room, so that sparse pages drain
+	Page *page = findPage( order, NULL );
+	if( !page ) {
+		// Oversized ranges get a page of their own
+		page = newPage( order > pageShift ? order : pageShift );
+	}
+
+	unsigned offset;
+	bool found = allocBlock( page, order, offset );
+	assert( found );
+	(void)found;
+
+	Range *range = new Range;
+	range->buffer = page->buffer;
+	range->offset = offset;
+	range->size = size;
+	range->page = page;
+	range->order = order;
+	page->ranges.insert( range );
+	page->allocated += 1u << order;
+	allocatedBytes += 1u << order;
+	usedBytes += size;
+
+	return range;
+}
+
+// -----------------------------------------------------------------
+void GpuBufferPool::free( Range *range ) {
+	Page *page = range->page;
+	freeBlock( page, range->order, range->offset );
+	page->allocated -= 1u << range->order;
+	allocatedBytes -= 1u << range->order;
+	usedBytes -= range->size;
+	page->ranges.erase( range );
+	delete range;
+
+	// Keep one empty page around to avoid churning buffers when a
+	// single leaf is reloaded
+	if( page->ranges.empty() && pages.size() > 1 )
+		freePage( page );
+}
+
+// -----------------------------------------------------------------
+unsigned GpuBufferPool::defragment( unsigned maxBytes ) {
+	if( !GLEW_ARB_copy_buffer || pages.size() < 2 )
+		return 0;
+
+	// Find the emptiest page
+	Page *victim = NULL;
+	double victimUse = 0.0;
+	for( auto it = pages.begin(); it != pages.end(); ++it ) {
+		double use = (double)(*it)->allocated / (double)(1ull << (*it)->order);
+		if( !victim || use < victimUse ) {
+			victim = *it;
+			victimUse = use;
+		}
+	}
+
+	// Pages more than half full are not worth the copying
+	if( victimUse > 0.5 )
+		return 0;
+
+	unsigned moved = 0;
+	std::vector<Range*> toMove( victim->ranges.begin(), victim->ranges.end() );
+	for( auto it = toMove.begin(); it != toMove.end() && moved < maxBytes; ++it ) {
+		Range *range = *it;
+		Page *dest = findPage( range->order, victim );
+		if( !dest )
+			break;
+
+		unsigned offset;
+		allocBlock( dest, range->order, offset );
+
+		// Copy on the GPU
+		glBindBuffer( GL_COPY_READ_BUFFER, victim->buffer );
+		glBindBuffer( GL_COPY_WRITE_BUFFER, dest->buffer );
+		glCopyBufferSubData( GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, range->offset, offset, range->size );
+
+		// Hand the range over to its new page
+		freeBlock( victim, range->order, range->offset );
+		victim->allocated -= 1u << range->order;
+		dest->allocated += 1u << range->order;
+		victim->ranges.erase( range );
+		dest->ranges.insert( range );
+		range->page = dest;
+		range->buffer = dest->buffer;
+		range->offset = offset;
+
+		moved += range->size;
+	}
+
+	glBindBuffer( GL_COPY_READ_BUFFER, 0 );
+	glBindBuffer( GL_COPY_WRITE_BUFFER, 0 );
+
+	if( victim->ranges.empty() )
+		freePage( victim );
+
+	movedBytes += moved;
+	return moved;
+}
+
+// -----------------------------------------------------------------
+unsigned GpuBufferPool::getBlockSize( unsigned size ) {
+	return 1u << blockOrder( size, MIN_ORDER );
+}
+
+// -----------------------------------------------------------------
+GpuBufferPool::Page *GpuBufferPool::newPage( unsigned order ) {
+	Page *page = new Page;
+	page->order = order;
+	page->allocated = 0;
+	page->freeBlocks.resize( order - MIN_ORDER + 1 );
+	page->freeBlocks[order - MIN_ORDER].insert( 0 );
+
+	glGenBuffers( 1, &page->buffer );
+	glBindBuffer( target, page->buffer );
+	glBufferData( target, 1u << order, NULL, GL_STATIC_DRAW );
+	glBindBuffer( target, 0 );
+
+	pages.push_back( page );
+	reservedBytes += 1u << order;
+	return page;
+}
+
+// -----------------------------------------------------------------
+void GpuBufferPool::freePage( Page *page ) {
+	assert( page->ranges.empty() );
+
+	glDeleteBuffers( 1, &page->buffer );
+	reservedBytes -= 1u << page->order;
+
+	for( auto it = pages.begin(); it != pages.end(); ++it ) {
+		if( *it == page ) {
+			pages.erase( it );
+			break;
+		}
+	}
+	delete page;
+}
+
+// -----------------------------------------------------------------
+bool GpuBufferPool::allocBlock( Page *page, unsigned order, unsigned &offset ) {
+	// Find the smallest free block which fits
+	unsigned k = order;
+	while( k <= page->order && page->freeBlocks[k - MIN_ORDER].empty() )
+		k++;
+	if( k > page->order )
+		return false;
+
+	// Take the lowest one, to keep the page packed towards the start
+	std::set<unsigned> &freeList = page->freeBlocks[k - MIN_ORDER];
+	offset = *freeList.begin();
+	freeList.erase( freeList.begin() );
+
+	// Split it down to size, freeing the upper halves
+	while( k > order ) {
+		k--;
+		page->freeBlocks[k - MIN_ORDER].insert( offset + (1u << k) );
+	}
+	return true;
+}
+
+// -----------------------------------------------------------------
+void GpuBufferPool::freeBlock( Page *page, unsigned order, unsigned offset ) {
+	// Merge with the buddy for as long as it is free
+	while( order < page->order ) {
+		std::set<unsigned> &freeList = page->freeBlocks[order - MIN_ORDER];
+		auto buddy = freeList.find( offset ^ (1u << order) );
+		if( buddy == freeList.end() )
+			break;
+		freeList.erase( buddy );
+		offset &= ~(1u << order);
+		order++;
+	}
+	page->freeBlocks[order - MIN_ORDER].insert( offset );
+}
+
+// -----------------------------------------------------------------
+GpuBufferPool::Page *GpuBufferPool::findPage( unsigned order, const Page *exclude ) const {
+	Page *best = NULL;
+	for( auto it = pages.begin(); it != pages.end(); ++it ) {
+		Page *page = *it;
+		if( page == exclude || order > page->order )
+			continue;
+		if( best && page->allocated <= best->allocated )
+			continue;
+		for( unsigned k = order; k <= page->order; k++ ) {
+			if( !page->freeBlocks[k - MIN_ORDER].empty() ) {
+				best = page;
+				break;
+			}
+		}
+	}
+	return best;
+}
+
+} // namespace eihort
@@ -0,0 +1,135 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef GPUBUFFERPOOL_H
+#define GPUBUFFERPOOL_H
+
+#include <set>
+#include <vector>
+
+namespace eihort {
+
+class GpuBufferPool {
+	// Suballocates vertex or index data out of a few large GL buffers
+	// Ranges are handed out by a buddy allocator within each page, and
+	// can be moved between pages (see defragment) without their owners
+	// noticing, as long as they look up buffer and offset at draw time
+
+	struct Page;
+
+public:
+	struct Range {
+		// GL buffer holding the range
+		unsigned buffer;
+		// Byte offset of the range in the buffer
+		unsigned offset;
+		// Number of bytes requested for the range
+		unsigned size;
+
+	private:
+		friend class GpuBufferPool;
+		// The page the range lives in
+		Page *page;
+		// Log2 of the size of the buddy block holding the range
+		unsigned order;
+	};
+
+	GpuBufferPool( const GpuBufferPool& ) = delete;
+	GpuBufferPool( GpuBufferPool&& ) = delete;
+	// target is the GL binding point used to create the pages
+	// (GL_ARRAY_BUFFER or GL_ELEMENT_ARRAY_BUFFER)
+	GpuBufferPool( unsigned target, unsigned pageShift );
+	~GpuBufferPool();
+
+	// Allocate a range of size bytes
+	// Its contents are undefined until uploaded (see GpuStaging)
+	Range *alloc( unsigned size );
+	// Return a range to the pool
+	void free( Range *range );
+
+	// Move ranges out of the emptiest page into the other pages, so the
+	// page can be released
+	// Stops after moving about maxBytes; returns the bytes moved
+	// Does nothing without ARB_copy_buffer
+	unsigned defragment( unsigned maxBytes );
+
+	// Number of GL buffers owned by the pool
+	inline unsigned getPageCount() const { return (unsigned)pages.size(); }
+	// Bytes of video memory reserved for the pages
+	inline unsigned long long getReservedBytes() const { return reservedBytes; }
+	// Bytes handed out in buddy blocks (includes rounding)
+	inline unsigned long long getAllocatedBytes() const { return allocatedBytes; }
+	// Bytes actually requested by the owners of the ranges
+	inline unsigned long long getUsedBytes() const { return usedBytes; }
+	// Total bytes moved by defragment
+	inline unsigned long long getMovedBytes() const { return movedBytes; }
+
+	// Size of the buddy block which would hold size bytes
+	static unsigned getBlockSize( unsigned size );
+
+private:
+	// Smallest block handed out (256 bytes), which also sets the alignment
+	// of every range
+	static const unsigned MIN_ORDER = 8;
+
+	struct Page {
+		// GL buffer name
+		unsigned buffer;
+		// Log2 of the page size
+		unsigned order;
+		// Bytes allocated out of the page
+		unsigned allocated;
+		// Offsets of the free blocks of each order (from MIN_ORDER)
+		std::vector< std::set<unsigned> > freeBlocks;
+		// Ranges allocated from this page
+		std::set<Range*> ranges;
+	};
+
+	// Create a new page of 2^order bytes
+	Page *newPage( unsigned order );
+	// Release a page and its buffer
+	void freePage( Page *page );
+	// Take a block of 2^order bytes from the page
+	// Returns false if the page has no block large enough
+	static bool allocBlock( Page *page, unsigned order, unsigned &offset );
+	// Return a block to the page, merging it with its free buddies
+	static void freeBlock( Page *page, unsigned order, unsigned offset );
+	// Find the fullest page (other than exclude) with a free block of
+	// 2^order bytes, or NULL
+	Page *findPage( unsigned order, const Page *exclude ) const;
+
+	// GL binding point used to create the pages
+	unsigned target;
+	// Log2 of the default page size
+	unsigned pageShift;
+	// All pages
+	std::vector<Page*> pages;
+
+	// Statistics (see the getters above)
+	unsigned long long reservedBytes, allocatedBytes, usedBytes, movedBytes;
+};
+
+} // namespace eihort
+
+#endif // GPUBUFFERPOOL_H
@@ -0,0 +1,146 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <GL/glew.h>
+#include "gpuresidency.h"
+
+namespace eihort {
+
+// -----------------------------------------------------------------
+GpuResidency::GpuResidency( unsigned pageShift, unsigned stagingSize )
+: vtxPool(GL_ARRAY_BUFFER, pageShift)
+, idxPool(GL_ELEMENT_ARRAY_BUFFER, pageShift)
+, staging(stagingSize)
+, budget(512*1024*1024)
+, nEvictions(0), nDropped(0)
+{
+	for( unsigned i = 0; i < N_CATEGORIES; i++ ) {
+		texBytes[i] = 0;
+		evictedBytes[i] = 0;
+	}
+}
+
+// -----------------------------------------------------------------
+GpuResidency::~GpuResidency() {
+}
+
+// -----------------------------------------------------------------
+unsigned long long GpuResidency::getBytes( Category cat ) const {
+	switch( cat ) {
+	// The pools' whole pages count, free space and all
+	case VERTICES: return vtxPool.getReservedBytes();
+	case INDICES: return idxPool.getReservedBytes();
+	default: return texBytes[cat];
+	}
+}
+
+// -----------------------------------------------------------------
+unsigned long long GpuResidency::getUsedBytes() const {
+	unsigned long long used = 0;
+	for( unsigned i = 0; i < N_CATEGORIES; i++ )
+		used += getBytes( (Category)i );
+	return used;
+}
+
+// -----------------------------------------------------------------
+unsigned long long GpuResidency::getAvailableBytes() const {
+	unsigned long long used = getUsedBytes();
+	return used < budget ? budget - used : 0;
+}
+
+// -----------------------------------------------------------------
+void GpuResidency::add( Resident *r, unsigned frame, float distance ) {
+	r->index = lru.size();
+	LruEntry e = { r, frame, distance, totalBytes( r ), r->rebuildCost };
+	lru.push_back( e );
+}
+
+// -----------------------------------------------------------------
+void GpuResidency::remove( Resident *r ) {
+	assert( r->index < lru.size() && lru[r->index].r == r );
+	lru[r->index] = lru.back();
+	lru[r->index].r->index = r->index;
+	lru.pop_back();
+}
+
+// -----------------------------------------------------------------
+bool GpuResidency::chooseEvictions( unsigned long long need, float incomingDistance, unsigned frame, std::vector<Resident*> &victims ) {
+	victims.clear();
+
+	// Gather everything which may go, and how much that would free
+	candidates.clear();
+	unsigned long long available = 0;
+	for( auto it = lru.begin(); it != lru.end(); ++it ) {
+		if( it->lastSeen + 1 >= frame && it->distance <= incomingDistance )
+			continue;
+		candidates.push_back( std::make_pair( evictionScore( *it, frame ), it->r ) );
+		available += it->bytes;
+	}
+	if( available < need )
+		return false;
+
+	// Evict the best candidates until enough is free
+	std::sort( candidates.begin(), candidates.end(),
+		[]( const std::pair<float, Resident*> &a, const std::pair<float, Resident*> &b ) { return a.first > b.first; } );
+	unsigned long long freed = 0;
+	for( auto it = candidates.begin(); it != candidates.end() && freed < need; ++it ) {
+		victims.push_back( it->second );
+		freed += totalBytes( it->second );
+	}
+	return true;
+}
+
+// -----------------------------------------------------------------
+void GpuResidency::noteEviction( const Resident *r ) {
+	nEvictions++;
+	for( unsigned i = 0; i < N_CATEGORIES; i++ )
+		evictedBytes[i] += r->bytes[i];
+}
+
+// -----------------------------------------------------------------
+const char *GpuResidency::getCategoryName( Category cat ) {
+	static const char *const NAMES[] = { "vertex", "index", "lighting", "biome" };
+	return NAMES[cat];
+}
+
+// -----------------------------------------------------------------
+float GpuResidency::evictionScore( const LruEntry &e, unsigned frame ) {
+	// Large meshes which have not been seen for a while, are far away
+	// and are quick to rebuild are the best to evict
+	float unseen = (float)(frame - e.lastSeen);
+	float distance = sqrtf( e.distance );
+	return (float)e.bytes * (1.0f + unseen) * (1.0f + distance / 64.0f) / (1.0f + (float)e.rebuildCost);
+}
+
+// -----------------------------------------------------------------
+unsigned long long GpuResidency::totalBytes( const Resident *r ) {
+	unsigned long long total = 0;
+	for( unsigned i = 0; i < N_CATEGORIES; i++ )
+		total += r->bytes[i];
+	return total;
+}
+
+} // namespace eihort
@@ -0,0 +1,175 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef GPURESIDENCY_H
+#define GPURESIDENCY_H
+
+#include <vector>
+#include "gpubufferpool.h"
+#include "gpustaging.h"
+
+namespace eihort {
+
+class GpuResidency {
+	// Owns the video memory used by world meshes: the vertex and index
+	// buffer pools, and the accounting of the lighting and biome textures
+	// Decides which meshes to evict when the budget runs out
+
+public:
+	enum Category {
+		VERTICES,
+		INDICES,
+		LIGHT_TEXTURES,
+		BIOME_TEXTURES,
+		N_CATEGORIES
+	};
+
+	struct Resident {
+		// Memory which is evicted as a unit (the mesh of a qtree leaf)
+		// The owner fills in the fields before adding it
+
+		// Object to evict
+		void *owner;
+		// Bytes held in each category
+		unsigned bytes[N_CATEGORIES];
+		// Time it took to build, in ms
+		unsigned rebuildCost;
+
+	private:
+		friend class GpuResidency;
+		// Position in the LRU list
+		size_t index;
+	};
+
+	GpuResidency( const GpuResidency& ) = delete;
+	GpuResidency( GpuResidency&& ) = delete;
+	// pageShift is the log2 of the buffer pool page size, and
+	// stagingSize the size of the staging ring
+	GpuResidency( unsigned pageShift, unsigned stagingSize );
+	~GpuResidency();
+
+	// The pools all mesh vertices and indices are allocated from
+	inline GpuBufferPool &getVertexPool() { return vtxPool; }
+	inline GpuBufferPool &getIndexPool() { return idxPool; }
+	inline const GpuBufferPool &getVertexPool() const { return vtxPool; }
+	inline const GpuBufferPool &getIndexPool() const { return idxPool; }
+	// The path all vertex and index data takes into the pools
+	inline GpuStaging &getStaging() { return staging; }
+	inline const GpuStaging &getStaging() const { return staging; }
+
+	// Account for textures created or destroyed
+	// (vertex and index bytes come straight from the pools)
+	inline void addTextureBytes( Category cat, unsigned bytes ) { texBytes[cat] += bytes; }
+	inline void removeTextureBytes( Category cat, unsigned bytes ) { texBytes[cat] -= bytes; }
+
+	// Set the total number of bytes which may be in use
+	inline void setBudget( unsigned long long b ) { budget = b; }
+	inline unsigned long long getBudget() const { return budget; }
+	// Bytes in use in one category
+	// For vertices and indices, this is all of the pools' pages
+	unsigned long long getBytes( Category cat ) const;
+	// Bytes in use in all categories
+	unsigned long long getUsedBytes() const;
+	// Bytes left in the budget (0 if over budget)
+	unsigned long long getAvailableBytes() const;
+
+	// Start or stop tracking a resident for eviction
+	// A new resident counts as seen on frame, at the given squared distance
+	void add( Resident *r, unsigned frame, float distance );
+	void remove( Resident *r );
+	// Record that a resident was drawn on frame, at the given squared distance
+	inline void touch( const Resident *r, unsigned frame, float distance ) {
+		LruEntry &e = lru[r->index];
+		e.lastSeen = frame;
+		e.distance = distance;
+	}
+
+	// Pick residents to evict to free need bytes for a mesh at the given
+	// squared distance
+	// Residents drawn on the last frame are only considered if they are
+	// farther than the incoming mesh
+	// Returns false (and picks nothing) if not enough can be freed
+	bool chooseEvictions( unsigned long long need, float incomingDistance, unsigned frame, std::vector<Resident*> &victims );
+	// Record that the owner evicted r (call before removing it)
+	void noteEviction( const Resident *r );
+	// Record that a new mesh was dropped for lack of space
+	inline void noteDropped() { nDropped++; }
+
+	// Statistics
+	inline unsigned getEvictionCount() const { return nEvictions; }
+	inline unsigned getDroppedCount() const { return nDropped; }
+	inline unsigned long long getEvictedBytes( Category cat ) const { return evictedBytes[cat]; }
+	inline size_t getResidentCount() const { return lru.size(); }
+	// Get a resident by position (positions change as residents are removed)
+	inline Resident *getResident( size_t i ) const { return lru[i].r; }
+	// Name of a category, as exposed to Lua
+	static const char *getCategoryName( Category cat );
+
+private:
+	struct LruEntry {
+		// Everything eviction decisions need about a resident, kept
+		// together so that choosing victims never touches the owners
+
+		// The resident
+		Resident *r;
+		// Frame on which the resident was last drawn
+		unsigned lastSeen;
+		// Squared distance from the camera when last seen
+		float distance;
+		// Total bytes held
+		unsigned long long bytes;
+		// Time it took to build, in ms
+		unsigned rebuildCost;
+	};
+
+	// How desirable it is to evict e; higher scores go first
+	static float evictionScore( const LruEntry &e, unsigned frame );
+	// Total bytes held by r
+	static unsigned long long totalBytes( const Resident *r );
+
+	// Shared vertex and index buffers
+	GpuBufferPool vtxPool, idxPool;
+	// Uploads into the pools
+	GpuStaging staging;
+	// Texture bytes in use per category
+	unsigned long long texBytes[N_CATEGORIES];
+	// Maximum bytes in use
+	unsigned long long budget;
+
+	// Everything which can be evicted, in no particular order
+	std::vector<LruEntry> lru;
+	// Scratch list of candidates used by chooseEvictions
+	std::vector< std::pair<float, Resident*> > candidates;
+
+	// Number of residents evicted
+	unsigned nEvictions;
+	// Number of new meshes dropped for lack of space
+	unsigned nDropped;
+	// Bytes evicted per category
+	unsigned long long evictedBytes[N_CATEGORIES];
+};
+
+} // namespace eihort
+
+#endif // GPURESIDENCY_H
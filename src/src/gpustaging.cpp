@@ -0,0 +1,203 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <cassert>
+#include <cstring>
+#include "gpustaging.h"
+
+namespace eihort {
+
+// -----------------------------------------------------------------
+GpuStaging::GpuStaging( unsigned ringSize )
+: ring(0), mapped(NULL), ringSize(ringSize)
+, head(0), heldBytes(0)
+, orphan(0)
+, stagedBytes(0), directBytes(0)
+{
+	mutex = SDL_CreateMutex();
+
+	if( GLEW_ARB_buffer_storage && GLEW_ARB_copy_buffer ) {
+		// Map the ring once and leave it mapped
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers( 1, &ring );
+		glBindBuffer( GL_COPY_READ_BUFFER, ring );
+		glBufferStorage( GL_COPY_READ_BUFFER, ringSize, NULL, flags );
+		mapped = (unsigned char*)glMapBufferRange( GL_COPY_READ_BUFFER, 0, ringSize, flags );
+		glBindBuffer( GL_COPY_READ_BUFFER, 0 );
+		if( !mapped ) {
+			glDeleteBuffers( 1, &ring );
+			ring = 0;
+		}
+	}
+
+	if( GLEW_ARB_copy_buffer )
+		glGenBuffers( 1, &orphan );
+}
+
+// -----------------------------------------------------------------
+GpuStaging::~GpuStaging() {
+	for( auto it = regions.begin(); it != regions.end(); ++it ) {
+		if( it->fence )
+			glDeleteSync( it->fence );
+	}
+	if( ring ) {
+		glBindBuffer( GL_COPY_READ_BUFFER, ring );
+		glUnmapBuffer( GL_COPY_READ_BUFFER );
+		glBindBuffer( GL_COPY_READ_BUFFER, 0 );
+		glDeleteBuffers( 1, &ring );
+	}
+	if( orphan )
+		glDeleteBuffers( 1, &orphan );
+	SDL_DestroyMutex( mutex );
+}
+
+// -----------------------------------------------------------------
+bool GpuStaging::stage( const void *data, unsigned size, unsigned &offset ) {
+	if( !mapped || size == 0 )
+		return false;
+
+	// Keep the regions aligned
+	unsigned allocSize = (size + 255) & ~255u;
+
+	SDL_mutexP( mutex );
+	bool found = false;
+	if( regions.empty() ) {
+		// The whole ring is free
+		offset = 0;
+		found = allocSize <= ringSize;
+	} else {
+		unsigned tail = regions.front().begin;
+		if( head > tail ) {
+			// Free space is after head, and before tail
+			if( head + allocSize <= ringSize ) {
+				offset = head;
+				found = true;
+			} else if( allocSize <= tail ) {
+				offset = 0;
+				found = true;
+			}
+		} else if( head + allocSize <= tail ) {
+			// Wrapped around; free space is between head and tail
+			offset = head;
+			found = true;
+		}
+	}
+	if( found ) {
+		Region region;
+		region.begin = offset;
+		region.end = offset + allocSize;
+		region.copied = false;
+		region.fence = NULL;
+		regions.push_back( region );
+		head = region.end;
+		heldBytes += allocSize;
+		stagedBytes += size;
+	}
+	SDL_mutexV( mutex );
+
+	// The region is ours, so the copy can happen outside the lock
+	if( found )
+		memcpy( mapped + offset, data, size );
+	return found;
+}
+
+// -----------------------------------------------------------------
+void GpuStaging::upload( const GpuBufferPool::Range *dst, bool staged, unsigned offset, const void *data ) {
+	if( staged ) {
+		// The data is already in GPU-visible memory; copy it over on the GPU
+		glBindBuffer( GL_COPY_READ_BUFFER, ring );
+		glBindBuffer( GL_COPY_WRITE_BUFFER, dst->buffer );
+		glCopyBufferSubData( GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offset, dst->offset, dst->size );
+
+		// The region can be reclaimed once the copy is done
+		SDL_mutexP( mutex );
+		markCopied( offset );
+		SDL_mutexV( mutex );
+	} else if( orphan ) {
+		// Respecify the orphan's storage, so this never waits for the GPU
+		// to finish with the last upload, then copy into the page
+		glBindBuffer( GL_COPY_READ_BUFFER, orphan );
+		glBufferData( GL_COPY_READ_BUFFER, dst->size, data, GL_STREAM_DRAW );
+		glBindBuffer( GL_COPY_WRITE_BUFFER, dst->buffer );
+		glCopyBufferSubData( GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, dst->offset, dst->size );
+		directBytes += dst->size;
+	} else {
+		glBindBuffer( GL_ARRAY_BUFFER, dst->buffer );
+		glBufferSubData( GL_ARRAY_BUFFER, dst->offset, dst->size, data );
+		glBindBuffer( GL_ARRAY_BUFFER, 0 );
+		directBytes += dst->size;
+		return;
+	}
+
+	glBindBuffer( GL_COPY_READ_BUFFER, 0 );
+	glBindBuffer( GL_COPY_WRITE_BUFFER, 0 );
+}
+
+// -----------------------------------------------------------------
+void GpuStaging::discard( unsigned offset ) {
+	// Nothing will read the region, so its fence passes as soon as it is
+	// placed; regions are only reclaimed in order, so leaving it unmarked
+	// would block the ring for good
+	SDL_mutexP( mutex );
+	markCopied( offset );
+	SDL_mutexV( mutex );
+}
+
+// -----------------------------------------------------------------
+void GpuStaging::markCopied( unsigned offset ) {
+	for( auto it = regions.rbegin(); it != regions.rend(); ++it ) {
+		if( it->begin == offset ) {
+			it->copied = true;
+			return;
+		}
+	}
+	assert( false );
+}
+
+// -----------------------------------------------------------------
+void GpuStaging::endUploads() {
+	if( !mapped )
+		return;
+
+	SDL_mutexP( mutex );
+
+	// Fence the copies queued this frame
+	for( auto it = regions.begin(); it != regions.end(); ++it ) {
+		if( it->copied && !it->fence )
+			it->fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+	}
+
+	// Reclaim the oldest regions, as long as their copies are done
+	while( !regions.empty() && regions.front().fence ) {
+		GLenum status = glClientWaitSync( regions.front().fence, 0, 0 );
+		if( status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED )
+			break;
+		glDeleteSync( regions.front().fence );
+		heldBytes -= regions.front().end - regions.front().begin;
+		regions.pop_front();
+	}
+
+	SDL_mutexV( mutex );
+}
+
+} // namespace eihort
@@ -0,0 +1,112 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef GPUSTAGING_H
+#define GPUSTAGING_H
+
+#include <deque>
+#include <vector>
+#include <SDL_mutex.h>
+#include <GL/glew.h>
+#include "gpubufferpool.h"
+
+namespace eihort {
+
+class GpuStaging {
+	// Carries vertex and index data into the buffer pools
+	// With ARB_buffer_storage, a persistently mapped ring buffer lets the
+	// mesh workers copy their output straight into memory the GPU can
+	// read, and the render thread only queues GPU-side copies out of it
+	// Otherwise, with ARB_copy_buffer, data goes through an orphaned
+	// buffer so that uploads never wait on pages the GPU is drawing from
+	// Failing both, data is written into the pages directly
+
+public:
+	GpuStaging( const GpuStaging& ) = delete;
+	GpuStaging( GpuStaging&& ) = delete;
+	// ringSize is the size of the persistently mapped ring, in bytes
+	explicit GpuStaging( unsigned ringSize );
+	~GpuStaging();
+
+	// Copy size bytes of data into the ring and return its offset there
+	// Safe to call from any thread; returns false if there is no
+	// persistent ring or no room in it
+	bool stage( const void *data, unsigned size, unsigned &offset );
+	// Fill dst with data staged at offset by stage(), or with data
+	// if staged is false (render thread)
+	void upload( const GpuBufferPool::Range *dst, bool staged, unsigned offset, const void *data );
+	// Give back data staged at offset which will never be uploaded, so
+	// that the ring can move past it (render thread)
+	void discard( unsigned offset );
+	// Fence the copies queued since the last call, and reclaim the parts
+	// of the ring the GPU has finished with (render thread, once a frame)
+	void endUploads();
+
+	// Is the persistently mapped ring in use?
+	inline bool isPersistent() const { return mapped != NULL; }
+	// Statistics
+	inline unsigned long long getStagedBytes() const { return stagedBytes; }
+	inline unsigned long long getDirectBytes() const { return directBytes; }
+	// Bytes of the ring not yet reclaimed
+	// This drops back to 0 whenever the uploads catch up
+	inline unsigned getHeldBytes() const { return heldBytes; }
+
+private:
+	struct Region {
+		// A part of the ring holding one staged block
+		// Start and end offsets in the ring
+		unsigned begin, end;
+		// Has the copy out of it been queued?
+		bool copied;
+		// Fence for the copy (NULL until fenced)
+		GLsync fence;
+	};
+
+	// The ring buffer and its mapping (if persistent)
+	unsigned ring;
+	unsigned char *mapped;
+	unsigned ringSize;
+	// Live regions, in ring order
+	std::deque<Region> regions;
+	// Where the next region will go
+	unsigned head;
+	// Total size of the live regions
+	unsigned heldBytes;
+	// Protects regions, head and heldBytes
+	SDL_mutex *mutex;
+
+	// Orphaned buffer for non-persistent uploads
+	unsigned orphan;
+
+	// Bytes which went through the ring, and which were uploaded by the
+	// render thread
+	unsigned long long stagedBytes, directBytes;
+
+	// Mark the region at offset as copied (with the mutex held)
+	void markCopied( unsigned offset );
+};
+
+} // namespace eihort
+
+#endif // GPUSTAGING_H
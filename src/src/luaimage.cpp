@@ -34,6 +34,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <fstream>
 
 #include "luaimage.h"
+#include "memstats.h"
 #include "unzip.h"
 
 #ifdef _WINDOWS
@@ -269,6 +270,16 @@ static SDL_Surface *convertSurfaceTo32Bit( SDL_Surface *s ) {
 	return s;
 }
 
+// -----------------------------------------------------------------
+static void pushImage( lua_State *L, SDL_Surface *s ) {
+	// Wraps a surface in a new Image, which takes ownership of it
+	*(SDL_Surface**)lua_newuserdata( L, sizeof( SDL_Surface* ) ) = s;
+	luaL_newmetatable( L, LUAIMAGE_META );
+	lua_setmetatable( L, -2 );
+	if( s )
+		eihort::memAlloc( eihort::MEM_IMAGES, (size_t)s->pitch * s->h );
+}
+
 // -----------------------------------------------------------------
 static int luaImageNew( lua_State *L ) {
 	int width = (int)luaL_checknumber( L, 1 );
@@ -300,9 +311,7 @@ static int luaImageNew( lua_State *L ) {
 	// Done
 	SDL_UnlockSurface( surf );
 
-	*(SDL_Surface**)lua_newuserdata( L, sizeof( SDL_Surface* ) ) = surf;
-	luaL_newmetatable( L, LUAIMAGE_META );
-	lua_setmetatable( L, -2 );
+	pushImage( L, surf );
 	return 1;
 }
 
@@ -311,10 +320,7 @@ static int luaImageLoadFromFile( lua_State *L ) {
 	const char *path = luaL_checkstring( L, 1 );
 	SDL_Surface *s = IMG_Load( path );
 	if( s ) {
-		SDL_Surface **pSurf = (SDL_Surface**)lua_newuserdata( L, sizeof( SDL_Surface* ) );
-		*pSurf = convertSurfaceTo32Bit( s );
-		luaL_newmetatable( L, LUAIMAGE_META );
-		lua_setmetatable( L, -2 );
+		pushImage( L, convertSurfaceTo32Bit( s ) );
 		return 1;
 	}
 	return 0;
@@ -338,10 +344,7 @@ static int luaImageLoadFromZip( lua_State *L ) {
 				// ... and load it
 				SDL_Surface *s = IMG_Load_RW( SDL_RWFromMem( bufptr, int(it->uncompressed_size())), 1 );
 				if( s ) {
-					SDL_Surface **pSurf = (SDL_Surface**)lua_newuserdata( L, sizeof( SDL_Surface* ) );
-					*pSurf = convertSurfaceTo32Bit( s );
-					luaL_newmetatable( L, LUAIMAGE_META );
-					lua_setmetatable( L, -2 );
+					pushImage( L, convertSurfaceTo32Bit( s ) );
 					return 1;
 				}
 			}
@@ -415,10 +418,7 @@ static int luaImageLoadFromZipDirect( lua_State *L ) {
 	SDL_FreeRW( mem );
 	free( data );
 	if( s ) {
-		SDL_Surface **pSurf = (SDL_Surface**)lua_newuserdata( L, sizeof( SDL_Surface* ) );
-		*pSurf = convertSurfaceTo32Bit( s );
-		luaL_newmetatable( L, LUAIMAGE_META );
-		lua_setmetatable( L, -2 );
+		pushImage( L, convertSurfaceTo32Bit( s ) );
 		return 1;
 	}
 	return 0;
@@ -433,9 +433,7 @@ static int luaImageScreengrab( lua_State *L ) {
 	glReadPixels( 0, 0, g_width, g_height, GL_RGB, GL_UNSIGNED_BYTE, grab->pixels );
 
 	// Return the new image
-	*(SDL_Surface**)lua_newuserdata( L, sizeof( SDL_Surface* ) ) = grab;
-	luaL_newmetatable( L, LUAIMAGE_META );
-	lua_setmetatable( L, -2 );
+	pushImage( L, grab );
 	return 1;
 }
 
@@ -580,9 +578,7 @@ lock_failed:
 	SDL_UnlockSurface( im );
 	SDL_UnlockSurface( im2 );
 
-	*(SDL_Surface**)lua_newuserdata( L, sizeof( SDL_Surface* ) ) = im2;
-	luaL_newmetatable( L, LUAIMAGE_META );
-	lua_setmetatable( L, -2 );
+	pushImage( L, im2 );
 	return 1;
 }
 
@@ -605,9 +601,7 @@ static int luaImageSub( lua_State *L ) {
 	SDL_Surface *imcopy = SDL_ConvertSurface( im2, im2->format, SDL_SWSURFACE );
 	SDL_FreeSurface( im2 );
 
-	*(SDL_Surface**)lua_newuserdata( L, sizeof( SDL_Surface* ) ) = imcopy;
-	luaL_newmetatable( L, LUAIMAGE_META );
-	lua_setmetatable( L, -2 );
+	pushImage( L, imcopy );
 	return 1;
 }
 
@@ -615,9 +609,7 @@ static int luaImageSub( lua_State *L ) {
 static int luaImageCopy( lua_State *L ) {
 	SDL_Surface *im = *(SDL_Surface**)luaL_checkudata( L, 1, LUAIMAGE_META );
 	SDL_Surface *im2 = SDL_ConvertSurface( im, im->format, SDL_SWSURFACE );
-	*(SDL_Surface**)lua_newuserdata( L, sizeof( SDL_Surface* ) ) = im2;
-	luaL_newmetatable( L, LUAIMAGE_META );
-	lua_setmetatable( L, -2 );
+	pushImage( L, im2 );
 	return 1;
 }
 
@@ -884,6 +876,8 @@ static int luaImagePut( lua_State *L ) {
 // -----------------------------------------------------------------
 static int luaImageDestroy( lua_State *L ) {
 	SDL_Surface **pim = (SDL_Surface**)luaL_checkudata( L, 1, LUAIMAGE_META );
+	if( *pim )
+		eihort::memFree( eihort::MEM_IMAGES, (size_t)(*pim)->pitch * (*pim)->h );
 	SDL_FreeSurface( *pim );
 	*pim = NULL;
 	return 0;
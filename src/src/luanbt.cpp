@@ -115,15 +115,13 @@ static void luaGetTagData( lua_State *L, nbt::Tag &tag, int idx ) {
 	case nbt::TAG_Byte_Array: {
 		size_t len;
 		const char *bytes = luaL_checklstring( L, idx, &len );
-		tag.len = (uint32_t)len;
-		tag.data.bytes = malloc( len );
+		tag.allocPayload( (uint32_t)len );
 		memcpy( tag.data.bytes, bytes, len );
 		break; }
 	case nbt::TAG_String: {
 		size_t len;
 		const char *s = luaL_checklstring( L, idx, &len );
-		tag.len = (uint32_t)len;
-		tag.data.str = (char*)malloc( len );
+		tag.allocPayload( (uint32_t)len );
 		memcpy( tag.data.str, s, len );
 		break; }
 	case nbt::TAG_List:
@@ -54,6 +54,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include "luanbt.h"
 #include "luaimage.h"
 #include "unzip.h"
+#include "memstats.h"
+#include "profile.h"
+#include "trace.h"
 
 #if defined(__APPLE__) && defined(__MACH__)
 # include <CoreFoundation/CoreFoundation.h>
@@ -107,6 +110,9 @@ eihort::EihortShader *g_shader;
 // The path to the Eihort executable
 char g_programRoot[MAX_PATH];
 
+// Start of the frame being rendered, for the tracer
+static Uint64 g_frameTraceStart;
+
 
 // --------------------------- Utility Functions ----------------------------
 static const char *SDLKeyToString( SDL_Keycode key ) {
@@ -511,10 +517,111 @@ static int luaInitWorkers( lua_State *L ) {
 	return 0;
 }
 
+// ---------------------------------------------------------------------------
+static int luaGetWorkerStats( lua_State *L ) {
+	// workers, busyMs = eihort.getWorkerStats()
+	unsigned busy = 0;
+	for( unsigned i = 0; i < g_nWorkers; i++ )
+		busy += g_workers[i]->getBusyTime();
+	lua_pushnumber( L, g_nWorkers );
+	lua_pushnumber( L, busy );
+	return 2;
+}
+
+
+// -------------------------------- Profiling --------------------------------
+static int luaGetProfile( lua_State *L ) {
+	// profile = eihort.getProfile()
+	// profile[probe] = { count = n, p50 = us, p99 = us, max = us }
+	// Empty when built with NO_PROFILE
+	lua_newtable( L );
+#ifndef NO_PROFILE
+	for( unsigned i = 0; i < eihort::PROFILE_PROBE_COUNT; i++ ) {
+		eihort::ProfileProbe probe = (eihort::ProfileProbe)i;
+		eihort::ProfileSummary summary;
+		eihort::profileSummarize( probe, summary );
+		lua_createtable( L, 0, 4 );
+		lua_pushnumber( L, summary.count );
+		lua_setfield( L, -2, "count" );
+		lua_pushnumber( L, summary.p50 );
+		lua_setfield( L, -2, "p50" );
+		lua_pushnumber( L, summary.p99 );
+		lua_setfield( L, -2, "p99" );
+		lua_pushnumber( L, summary.max );
+		lua_setfield( L, -2, "max" );
+		lua_setfield( L, -2, eihort::getProfileProbeName( probe ) );
+	}
+#endif
+	return 1;
+}
+
+// ---------------------------------------------------------------------------
+static int luaResetProfile( lua_State* ) {
+	// eihort.resetProfile()
+	eihort::profileReset();
+	return 0;
+}
+
+// ---------------------------------------------------------------------------
+static int luaSetTracing( lua_State *L ) {
+	// eihort.setTracing( enable )
+	eihort::traceEnable( !!lua_toboolean( L, 1 ) );
+	return 0;
+}
+
+// ---------------------------------------------------------------------------
+static int luaIsTracing( lua_State *L ) {
+	// enabled = eihort.isTracing()
+	lua_pushboolean( L, eihort::g_traceEnabled );
+	return 1;
+}
+
+// ---------------------------------------------------------------------------
+static int luaDumpTrace( lua_State *L ) {
+	// success = eihort.dumpTrace( filename )
+	const char *filename = luaL_checkstring( L, 1 );
+	lua_pushboolean( L, eihort::traceDump( filename ) );
+	return 1;
+}
+
+// ---------------------------------------------------------------------------
+static int luaGetMemoryStats( lua_State *L ) {
+	// stats = eihort.getMemoryStats()
+	// stats[tag] = { bytes = n, count = n }
+	// stats.lua = { bytes = n }
+	// stats.total = n
+	lua_createtable( L, 0, eihort::MEM_TAG_COUNT + 2 );
+	lua_Number total = 0;
+	for( unsigned i = 0; i < eihort::MEM_TAG_COUNT; i++ ) {
+		eihort::MemTag tag = (eihort::MemTag)i;
+		eihort::MemTagStats stats;
+		eihort::memGetStats( tag, stats );
+		lua_createtable( L, 0, 2 );
+		lua_pushnumber( L, (lua_Number)stats.bytes );
+		lua_setfield( L, -2, "bytes" );
+		lua_pushnumber( L, (lua_Number)stats.count );
+		lua_setfield( L, -2, "count" );
+		lua_setfield( L, -2, eihort::getMemTagName( tag ) );
+		total += (lua_Number)stats.bytes;
+	}
+
+	// The Lua heap is measured by Lua itself
+	lua_Number luaBytes = (lua_Number)lua_gc( L, LUA_GCCOUNT, 0 ) * 1024 + lua_gc( L, LUA_GCCOUNTB, 0 );
+	lua_createtable( L, 0, 1 );
+	lua_pushnumber( L, luaBytes );
+	lua_setfield( L, -2, "bytes" );
+	lua_setfield( L, -2, "lua" );
+	total += luaBytes;
+
+	lua_pushnumber( L, total );
+	lua_setfield( L, -2, "total" );
+	return 1;
+}
+
 
 // --------------------------- Window and Video ------------------------------
 static int luaInitializeVideo( lua_State *L ) {
-	// success, message = initializeVideo( w, h, fullscreen, msaa )
+	// success, message = initializeVideo( w, h, fullscreen, msaa, hidden )
 	int width = (int)luaL_checknumber( L, 1 );
 	luaL_argcheck( L, width > 20, 1, "Width too small" );
 	int height = (int)luaL_checknumber( L, 2 );
@@ -522,6 +629,7 @@ static int luaInitializeVideo( lua_State *L ) {
 	bool fullscreen = !!lua_toboolean( L, 3 );
 	int msaa = (int)luaL_checknumber( L, 4 );
 	luaL_argcheck( L, msaa >= 0, 4, "MSAA too small" );
+	bool hidden = !!lua_toboolean( L, 5 );
 	char filename[MAX_PATH];
 
 	g_width = width;
@@ -545,7 +653,7 @@ static int luaInitializeVideo( lua_State *L ) {
 #endif
 	
 	// Create the window
-	Uint32 flags = SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE;
+	Uint32 flags = SDL_WINDOW_OPENGL | (hidden ? SDL_WINDOW_HIDDEN : SDL_WINDOW_SHOWN) | SDL_WINDOW_RESIZABLE;
 	if( fullscreen )
 		flags |= SDL_WINDOW_FULLSCREEN;
 	g_window = SDL_CreateWindow( "Eihort v" VERSION,
@@ -591,7 +699,9 @@ static int luaInitializeVideo( lua_State *L ) {
 	}
 
 	// GL setup
-	SDL_GL_SetSwapInterval( 1 );
+	// Hidden windows are only used for benchmarking, which shouldn't wait
+	// for vsync
+	SDL_GL_SetSwapInterval( hidden ? 0 : 1 );
 	glClearColor( 0.0f, 0.0f, 0.0f, 1.0f );
 	glClearDepth( 1.0 );
 
@@ -679,6 +789,7 @@ static int luaShouldRedraw( lua_State *L ) {
 // ---------------------------------------------------------------------------
 static int luaBeginRender( lua_State *L ) {
 	// eihort.beginRender( x, y, w, h )
+	g_frameTraceStart = TRACE_NOW();
 
 	// Set up the viewport
 	int vpX = (int)luaL_optnumber( L, 1, 0 );
@@ -724,7 +835,12 @@ static int luaClearScreen( lua_State* ) {
 // ---------------------------------------------------------------------------
 static int luaEndRender( lua_State *L ) {
 	// success, message = eihort.endRender()
-	SDL_GL_SwapWindow( g_window );
+	{
+		TRACE_SCOPE( "swapWindow" );
+		SDL_GL_SwapWindow( g_window );
+	}
+	TRACE_RECORD( "frame", g_frameTraceStart );
+	g_frameTraceStart = 0;
 
 	GLenum err = glGetError();
 	if( err == GL_NO_ERROR ) {
@@ -994,6 +1110,15 @@ const luaL_Reg BaseEihort_functions[] = {
 	// Workers
 	{ "getProcessorCount", &luaGetProcessorCount },
 	{ "initWorkers", &luaInitWorkers },
+	{ "getWorkerStats", &luaGetWorkerStats },
+
+	// Profiling
+	{ "getProfile", &luaGetProfile },
+	{ "resetProfile", &luaResetProfile },
+	{ "setTracing", &luaSetTracing },
+	{ "isTracing", &luaIsTracing },
+	{ "dumpTrace", &luaDumpTrace },
+	{ "getMemoryStats", &luaGetMemoryStats },
 
 	// Window and video controls
 	{ "initializeVideo", &luaInitializeVideo },
@@ -1155,6 +1280,7 @@ int main( int argc, char **argv ) {
 
 	initLowLevel(*argv);
 	initLua();
+	eihort::traceSetThreadName( "Render" );
 
 	return runLuaMain( argc, (const char**)argv );
 }
@@ -144,7 +144,7 @@ void MCBiome::freeBiomeTextures( unsigned *textures ) const {
 }
 
 // -----------------------------------------------------------------
-unsigned short *MCBiome::readBiomeCoords( MCMap *map, int minx, int maxx, int miny, int maxy ) const {
+unsigned short *MCBiome::readBiomeCoords( MCMap *map, int minx, int maxx, int miny, int maxy, unsigned lod ) const {
 	if( enabled && ((map && map->getRegions()->isAnvil()) || biomePath.length() > 0) ) {
 		unsigned w = (unsigned)(maxx-minx+1), h = (unsigned)(maxy-miny+1);
 		unsigned len = w * h;
@@ -152,7 +152,19 @@ unsigned short *MCBiome::readBiomeCoords( MCMap *map, int minx, int maxx, int mi
 
 		bool readCoords;
 		if( map && map->getRegions()->isAnvil() ) {
+			// Downsampled maps carry their own biomes
 			readCoords = readBiomeCoords_anvil( map, minx, maxx, miny, maxy, coords );
+		} else if( lod > 0 ) {
+			// Read at full resolution, then take the biome at the lowest
+			// corner of each cell, as MCMap_Downsampled does
+			unsigned fullW = w << lod;
+			unsigned short *full = new unsigned short[fullW * (h << lod)];
+			readCoords = readBiomeCoords_extracted( miny << lod, ((maxy+1) << lod) - 1, minx << lod, ((maxx+1) << lod) - 1, full );
+			for( unsigned y = 0; y < h; y++ ) {
+				for( unsigned x = 0; x < w; x++ )
+					coords[y*w+x] = full[(y << lod)*fullW + (x << lod)];
+			}
+			delete[] full;
 		} else {
 			readCoords = readBiomeCoords_extracted( miny, maxy, minx, maxx, coords );
 		}
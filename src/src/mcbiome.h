@@ -63,9 +63,11 @@ public:
 	void freeBiomeTextures( unsigned *textures ) const;
 
 	// Reads biome coordinates for a region of the world
+	// If lod is not 0, the region is in the coordinates of a map downsampled
+	// to that LOD (see MCMap_Downsampled)
 	// Returns NULL if no coordinates are available
 	// Otherwise, returns a pointer which should be passed to finalizeBiomeTextures
-	unsigned short *readBiomeCoords( MCMap *map, int minx, int maxx, int miny, int maxy ) const;
+	unsigned short *readBiomeCoords( MCMap *map, int minx, int maxx, int miny, int maxy, unsigned lod = 0 ) const;
 
 private:
 	// Clears any resources associated with a channel
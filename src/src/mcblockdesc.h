@@ -51,6 +51,8 @@ public:
 	inline unsigned shouldHighlight( unsigned id ) const { return blockFlags[id] & 0x80u; }
 	// Get the solidity of a block from the given direction
 	inline unsigned getSolidity( unsigned id, unsigned dir ) const { return blockFlags[id] & (1u<<dir); }
+	// Is the block solid from every direction?
+	inline bool isOpaque( unsigned id ) const { return (blockFlags[id] & 0x3fu) == 0x3fu; }
 	// Get the geometry generator for a block id
 	inline geom::BlockGeometry *getGeometry( unsigned id ) const { return geometry[id]; }
 	// Is block lighting enabled globally?
@@ -27,6 +27,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <cstring>
 
 #include "mcmap.h"
+#include "mcblockdesc.h"
+#include "memstats.h"
+#include "profile.h"
 
 namespace eihort {
 
@@ -36,6 +39,7 @@ MCMap::MCMap( MCRegionMap *regions )
 , loadedList(NULL)
 , loadedListTail(NULL)
 , nLoadedChunks(0)
+, chunkLoadTicks(0)
 , regions(regions)
 {
 }
@@ -114,7 +118,7 @@ void MCMap::getSignsInArea( int minx, int maxx, int miny, int maxy, MCMap::SignL
 			// This chunk overlaps the target region
 			// Check all TileEntities in the chunk
 			Chunk *chunk = getChunk( chX<<4, chY<<4 );
-			if( !chunk )
+			if( !chunk || !chunk->nbt )
 				continue;
 
 			nbt::Compound *level = (*chunk->nbt)["Level"].data.comp;
@@ -183,19 +187,27 @@ MCMap::Chunk *MCMap::getChunk_impl( ChunkCoords &coords ) {
 		}
 	} else {
 		// Nope. Try to load the chunk
+		Uint64 readStart = SDL_GetPerformanceCounter();
 		Chunk chunk;
 		chunk.coords = coords;
-		chunk.nbt = regions->readChunk( coords.x, coords.y );
-		if( !chunk.nbt )
+		if( !readChunk( chunk ) ) {
+			chunkLoadTicks += SDL_GetPerformanceCounter() - readStart;
 			return lastChunk = NULL;
+		}
 
 		// Unload chunks if we have lots loaded
 		if( nLoadedChunks >= 200 )
 			unloadOneChunk();
 
 		// Pass off the main loading work to the subclass's loading function
-		if( !loadChunk( chunk ) )
+		Uint64 loadStart = PROFILE_NOW();
+		chunk.decodedBytes = 0;
+		bool loaded = loadChunk( chunk );
+		PROFILE_RECORD( PROFILE_LOAD_CHUNK, PROFILE_NOW() - loadStart );
+		chunkLoadTicks += SDL_GetPerformanceCounter() - readStart;
+		if( !loaded )
 			return lastChunk = NULL;
+		memAlloc( MEM_CHUNKS, chunk.decodedBytes );
 		
 		// Chunk successfully loaded
 		nLoadedChunks++;
@@ -219,6 +231,12 @@ MCMap::Chunk *MCMap::getChunk_impl( ChunkCoords &coords ) {
 	return loadedListTail;
 }
 
+// -----------------------------------------------------------------
+bool MCMap::readChunk( Chunk &chunk ) {
+	chunk.nbt = regions->readChunk( chunk.coords.x, chunk.coords.y );
+	return chunk.nbt != NULL;
+}
+
 // -----------------------------------------------------------------
 void MCMap::unloadOneChunk() {
 	assert( loadedList );
@@ -230,6 +248,7 @@ void MCMap::unloadOneChunk() {
 	loadedList->nbt = NULL;
 
 	// Pass off the rest of the unload to the subclass
+	memFree( MEM_CHUNKS, loadedList->decodedBytes );
 	unloadChunk( *loadedList );
 
 	// Unlink the chunk from the LRU list
@@ -282,6 +301,7 @@ bool MCMap_MCRegion::loadChunk( MCMap::Chunk &chunk ) {
 	// MCRegion only provides 1 byte.
 	const unsigned char *idsrc = (unsigned char*)(*level)["Blocks"].data.bytes;
 	chunk.id = new unsigned short[16*16*128];
+	chunk.decodedBytes = 16*16*128 * sizeof(unsigned short);
 	for( unsigned i = 0; i < 16*16*128; i++ )
 		chunk.id[i] = idsrc[i];
 
@@ -326,7 +346,7 @@ void MCMap_Anvil::getExtentsWithin( int &minx, int &maxx, int &miny, int &maxy,
 				cminx = std::min( cminx, cx << 4 );
 				cmaxx = std::max( cmaxx, (cx << 4) + 15 );
 				cminy = std::min( cminy, cy << 4 );
-				cmaxy = std::max( cmaxx, (cy << 4) + 15 );
+				cmaxy = std::max( cmaxy, (cy << 4) + 15 );
 				cminz = std::min( cminz, chunk->minZ );
 				cmaxz = std::max( cmaxz, chunk->maxZ );
 			}
@@ -385,6 +405,7 @@ bool MCMap_Anvil::loadChunk( MCMap::Chunk &chunk ) {
 	memset( chunk.blockLight, 0, blocks>>1 );
 	memset( chunk.skyLight, 0, blocks>>1 );
 	memset( chunk.data, 0, blocks>>1 );
+	chunk.decodedBytes = (blocks<<1) + 3*(blocks>>1);
 	bool *zSectionFilled = new bool[zSections];
 	for( unsigned i = 0; i < zSections; i++ )
 		zSectionFilled[i] = false;
@@ -431,6 +452,7 @@ bool MCMap_Anvil::loadChunk( MCMap::Chunk &chunk ) {
 
 		unsigned char *biomeIds = (unsigned char*)(*level)["Biomes"].data.bytes;
 		chunk.biomes = new unsigned short[16*16];
+		chunk.decodedBytes += 16*16 * sizeof(unsigned short);
 		for( unsigned i = 0; i < 16*16; i++ ) {
 			if( biomeIds[i] < biomeIdToCoords.size() ) {
 				chunk.biomes[(i>>4)+((i&0xf)<<4)] = biomeIdToCoords[biomeIds[i]];
@@ -478,4 +500,181 @@ void MCMap_Anvil::unloadChunk( Chunk &chunk ) {
 	chunk.biomes = NULL;
 }
 
+// -----------------------------------------------------------------
+MCMap_Downsampled::MCMap_Downsampled( MCMap *source, const MCBlockDesc *blocks, unsigned lod )
+: MCMap( source->getRegions() )
+, source(source)
+, blockDesc(blocks)
+, lod(lod)
+{
+}
+
+// -----------------------------------------------------------------
+MCMap_Downsampled::~MCMap_Downsampled() {
+	clearAllLoadedChunks();
+}
+
+// -----------------------------------------------------------------
+void MCMap_Downsampled::getExtentsWithin( int &minx, int &maxx, int &miny, int &maxy, int &minz, int &maxz ) {
+	int cell = 1 << lod;
+	int sminx = minx << lod, smaxx = (maxx << lod) + cell - 1;
+	int sminy = miny << lod, smaxy = (maxy << lod) + cell - 1;
+	int sminz = minz << lod, smaxz = (maxz << lod) + cell - 1;
+	source->getExtentsWithin( sminx, smaxx, sminy, smaxy, sminz, smaxz );
+	minx = shift_right( sminx, lod );
+	maxx = shift_right( smaxx, lod );
+	miny = shift_right( sminy, lod );
+	maxy = shift_right( smaxy, lod );
+	minz = shift_right( sminz, lod );
+	maxz = shift_right( smaxz, lod );
+}
+
+// -----------------------------------------------------------------
+bool MCMap_Downsampled::readChunk( Chunk &chunk ) {
+	// Downsampled chunks are built from the source map, not read
+	// from the region files - see loadChunk
+	chunk.nbt = NULL;
+	return true;
+}
+
+// -----------------------------------------------------------------
+bool MCMap_Downsampled::loadChunk( MCMap::Chunk &chunk ) {
+	const unsigned cell = 1u << lod;
+	// Source block coordinates of the first column in this chunk
+	// (ChunkCoords are in Minecraft order, so x and y are swapped)
+	int srcx0 = chunk.coords.y << (4 + lod);
+	int srcy0 = chunk.coords.x << (4 + lod);
+
+	// Allocate memory for all the data
+	chunk.minZ = 0;
+	chunk.maxZ = (regions->isAnvil() ? 255 : 127) >> lod;
+	unsigned zHeight = chunk.maxZ - chunk.minZ + 1;
+	chunk.zHtShift = 1;
+	while( zHeight > (1u << chunk.zHtShift) )
+		chunk.zHtShift++;
+
+	unsigned blocks = (16*16) << chunk.zHtShift;
+	chunk.id = new unsigned short[blocks];
+	chunk.blockLight = new unsigned char[blocks>>1];
+	chunk.skyLight = new unsigned char[blocks>>1];
+	chunk.data = new unsigned char[blocks>>1];
+	memset( chunk.id, 0, blocks<<1 );
+	memset( chunk.blockLight, 0, blocks>>1 );
+	memset( chunk.skyLight, 0, blocks>>1 );
+	memset( chunk.data, 0, blocks>>1 );
+	chunk.biomes = regions->isAnvil() ? new unsigned short[16*16] : NULL;
+	chunk.decodedBytes = (blocks<<1) + 3*(blocks>>1) + (chunk.biomes ? 16*16 * sizeof(unsigned short) : 0);
+
+	// Which blocks may stand in for a whole cube on their own?
+	bool solid[BLOCK_ID_COUNT];
+	for( unsigned i = 0; i < BLOCK_ID_COUNT; i++ ) {
+		solid[i] = false;
+		for( unsigned dir = 0; dir < 6; dir++ )
+			solid[i] |= !!blockDesc->getSolidity( i, dir );
+	}
+
+	bool anyExists = false;
+	Column *srcCols = new Column[cell*cell];
+	bool *srcExists = new bool[cell*cell];
+	for( unsigned xo = 0; xo < 16; xo++ ) {
+		for( unsigned yo = 0; yo < 16; yo++ ) {
+			// Gather the source columns covered by this column
+			int srcx = srcx0 + (int)(xo << lod);
+			int srcy = srcy0 + (int)(yo << lod);
+			for( unsigned i = 0; i < cell*cell; i++ ) {
+				srcExists[i] = source->getColumn( srcx + (int)(i % cell), srcy + (int)(i / cell), srcCols[i] );
+				anyExists |= srcExists[i];
+			}
+
+			unsigned xyc = toLinearCoordInChunk( xo, yo );
+			if( chunk.biomes ) {
+				unsigned short biome = 0x7F7Fu;
+				source->getBiomeCoords( srcx, srcy, biome );
+				chunk.biomes[xyc] = biome;
+			}
+
+			xyc <<= chunk.zHtShift;
+			for( int z = chunk.minZ; z <= chunk.maxZ; z++ ) {
+				// Pick the block which best represents the cube:
+				// the highest solid block, or failing that, the
+				// highest non-air block if at least half of the
+				// cube is filled
+				unsigned solidId = 0, solidData = 0, solidZ = 0;
+				unsigned fillId = 0, fillData = 0, fillZ = 0, nFilled = 0;
+				unsigned maxBlockLight = 0, maxSkyLight = 0;
+				int srcz0 = z << lod;
+				for( unsigned i = 0; i < cell*cell; i++ ) {
+					const Column &col = srcCols[i];
+					if( !srcExists[i] ) {
+						// Missing columns are treated as air in full sun
+						maxSkyLight = 0xfu;
+						continue;
+					}
+					for( unsigned zo = 0; zo < cell; zo++ ) {
+						int sz = srcz0 + (int)zo;
+						unsigned id = col.getId( sz );
+						if( id == 0 || !blockDesc->getGeometry( id ) ) {
+							maxBlockLight = std::max( maxBlockLight, col.getBlockLight( sz ) );
+							maxSkyLight = std::max( maxSkyLight, col.getSkyLight( sz ) );
+							continue;
+						}
+						if( solid[id] ) {
+							if( !solidId || zo >= solidZ ) {
+								solidId = id;
+								solidData = col.getData( sz );
+								solidZ = zo;
+							}
+						} else {
+							maxBlockLight = std::max( maxBlockLight, col.getBlockLight( sz ) );
+							maxSkyLight = std::max( maxSkyLight, col.getSkyLight( sz ) );
+						}
+						if( !fillId || zo >= fillZ ) {
+							fillId = id;
+							fillData = col.getData( sz );
+							fillZ = zo;
+						}
+						nFilled++;
+					}
+				}
+
+				unsigned destIdx = xyc + (unsigned)(z - chunk.minZ);
+				unsigned dest4Shift = (destIdx&1u)<<2;
+				if( solidId ) {
+					chunk.id[destIdx] = (unsigned short)solidId;
+					chunk.data[destIdx>>1] |= (unsigned char)(solidData << dest4Shift);
+				} else if( nFilled * 2 >= cell*cell*cell ) {
+					chunk.id[destIdx] = (unsigned short)fillId;
+					chunk.data[destIdx>>1] |= (unsigned char)(fillData << dest4Shift);
+				}
+				chunk.blockLight[destIdx>>1] |= (unsigned char)(maxBlockLight << dest4Shift);
+				chunk.skyLight[destIdx>>1] |= (unsigned char)(maxSkyLight << dest4Shift);
+			}
+		}
+	}
+	delete[] srcCols;
+	delete[] srcExists;
+
+	if( !anyExists ) {
+		// Nothing to downsample here
+		unloadChunk( chunk );
+		return false;
+	}
+
+	return true;
+}
+
+// -----------------------------------------------------------------
+void MCMap_Downsampled::unloadChunk( Chunk &chunk ) {
+	delete[] chunk.id;
+	chunk.id = NULL;
+	delete[] chunk.blockLight;
+	chunk.blockLight = NULL;
+	delete[] chunk.skyLight;
+	chunk.skyLight = NULL;
+	delete[] chunk.data;
+	chunk.data = NULL;
+	delete[] chunk.biomes;
+	chunk.biomes = NULL;
+}
+
 } // namespace eihort
@@ -35,6 +35,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 namespace eihort {
 
+class MCBlockDesc;
+
 class MCMap {
 	// This class abstracts the low-level chunk-based representation of
 	// a Minecraft map, and presents a significantly easier-to-work-with
@@ -116,6 +118,9 @@ public:
 	
 	// Clear all the currently-loaded chunks
 	void clearAllLoadedChunks();
+	// Total time spent reading and decoding chunks, in performance
+	// counter ticks
+	Uint64 getChunkLoadTime() const { return chunkLoadTicks; }
 
 protected:
 	// Initialize the MCMap with the given chunk source
@@ -147,6 +152,8 @@ protected:
 		int minZ, maxZ;
 		// (1<<zHtShift) is the pitch of the columns in all data arrays
 		unsigned zHtShift;
+		// Bytes allocated by loadChunk, as counted under MEM_CHUNKS
+		unsigned decodedBytes;
 	};
 
 	// Converts an (x,y) position in a chunk to a single contiguous
@@ -172,6 +179,9 @@ protected:
 	// Looks up a chunk by coordinates
 	// The chunk is loaded if necessary
 	Chunk *getChunk_impl( ChunkCoords &coords );
+	// Reads the raw NBT for a chunk from the region files
+	// Returns true if the chunk exists
+	virtual bool readChunk( Chunk &chunk );
 	// Chunk loading function
 	// Returns true on success
 	virtual bool loadChunk( Chunk &chunk ) = 0;
@@ -195,6 +205,8 @@ protected:
 	Chunk *loadedListTail;
 	// Number of currently loaded chunks
 	unsigned nLoadedChunks;
+	// Time spent reading and decoding chunks so far
+	Uint64 chunkLoadTicks;
 
 	// Raw chunk data source
 	MCRegionMap *regions;
@@ -239,6 +251,36 @@ protected:
 	BiomeCoordData biomeIdToCoords;
 };
 
+class MCMap_Downsampled : public MCMap {
+	// Presents a coarser version of another MCMap, where each block
+	// stands in for a cube of (1<<lod) blocks on a side in the source.
+	// Used to build the level-of-detail meshes for distant terrain.
+
+public:
+	// Create a downsampled view of source
+	MCMap_Downsampled( MCMap *source, const MCBlockDesc *blocks, unsigned lod );
+	virtual ~MCMap_Downsampled();
+
+	virtual void getExtentsWithin( int &minx, int &maxx, int &miny, int &maxy, int &minz, int &maxz );
+
+	// Get the downsampling level
+	inline unsigned getLOD() const { return lod; }
+	// Get the map which is being downsampled
+	inline MCMap *getSource() { return source; }
+
+protected:
+	virtual bool readChunk( Chunk &chunk );
+	virtual bool loadChunk( Chunk &chunk );
+	virtual void unloadChunk( Chunk &chunk );
+
+	// The full-resolution map
+	MCMap *source;
+	// Used to decide which block best represents each cube
+	const MCBlockDesc *blockDesc;
+	// Each block covers (1<<lod) source blocks in each dimension
+	unsigned lod;
+};
+
 } // namespace eihort
 
 #endif
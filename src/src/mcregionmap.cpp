@@ -22,15 +22,23 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 
+#include <algorithm>
+
 #include "findfile.h"
 #include "mcregionmap.h"
 #include "mcbiome.h"
 #include "worldqtree.h"
+#include "worker.h"
 #include "platform.h"
 #include "endian.h"
+#include "profile.h"
+#include "trace.h"
 
 #define MCREGIONMAP_META "MCRegionMap"
 
+extern unsigned g_nWorkers;
+extern eihort::Worker *g_workers[];
+
 #if defined(__APPLE__) && defined(__MACH__)
   // Needed for FSEvent api
 # include <CoreServices/CoreServices.h>
@@ -44,6 +52,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 namespace eihort {
 
+// Chunks a worker preloads before going back to its other tasks
+static const unsigned PRELOAD_BATCH = 4;
+
 // -----------------------------------------------------------------
 inline int toRegionCoord( int x ) {
 	return shift_right( x, 5 );
@@ -56,6 +67,10 @@ MCRegionMap::MCRegionMap( const char *rootPath, bool anvil )
 , watchUpdates(false)
 {
 	rgDescMutex = SDL_CreateMutex();
+	preloadMutex = SDL_CreateMutex();
+	SDL_AtomicSet( &preloadNext, 0 );
+	SDL_AtomicSet( &preloadDone, 0 );
+	SDL_AtomicSet( &preloadWorkers, 0 );
 
 	changeRoot( rootPath, anvil );
 	changeThread = SDL_CreateThread( updateScanner, "Eihort File Scanner", this );
@@ -63,14 +78,27 @@ MCRegionMap::MCRegionMap( const char *rootPath, bool anvil )
 
 // -----------------------------------------------------------------
 MCRegionMap::~MCRegionMap() {
+	endPreload();
+	SDL_DestroyMutex( preloadMutex );
 }
 
 // -----------------------------------------------------------------
 void MCRegionMap::changeRoot( const char *newRoot, bool anvil ) {
-	root = newRoot;
+	std::string newRootPath = newRoot;
+	if( !newRootPath.empty() && (newRootPath[newRootPath.length()-1] == '/' || newRootPath[newRootPath.length()-1] == '\\') )
+		newRootPath = newRootPath.substr( 0, newRootPath.length()-1 );
+
+	// The region descriptors can't be flushed under the preloading workers
+	// Preloaded chunks are only kept if they came from the same folder, so
+	// a preload of another folder is cancelled rather than waited out
+	if( newRootPath != root || anvil != this->anvil ) {
+		endPreload();
+	} else {
+		waitForPreload();
+	}
+
+	root = newRootPath;
 	this->anvil = anvil;
-	if( root[this->root.length()-1] == '/' || root[this->root.length()-1] == '\\' )
-		this->root = this->root.substr( 0, this->root.length()-1 );
 	
 	flushRegionSectors();
 	exploreDirectories();
@@ -109,6 +137,25 @@ void MCRegionMap::getWorldBlockExtents( int &minx, int &maxx, int &miny, int &ma
 
 // -----------------------------------------------------------------
 nbt::Compound *MCRegionMap::readChunk( int x, int y ) {
+	// Preloaded chunks are handed out once
+	ChunkCoords c = { x, y };
+	SDL_LockMutex( preloadMutex );
+	std::map< ChunkCoords, nbt::Compound* >::iterator it = preloaded.find( c );
+	if( it != preloaded.end() ) {
+		nbt::Compound *chunk = it->second;
+		preloaded.erase( it );
+		SDL_UnlockMutex( preloadMutex );
+		return chunk;
+	}
+	SDL_UnlockMutex( preloadMutex );
+
+	return readChunkFromFile( x, y );
+}
+
+// -----------------------------------------------------------------
+nbt::Compound *MCRegionMap::readChunkFromFile( int x, int y ) {
+	PROFILE_SCOPE( PROFILE_READ_CHUNK );
+	TRACE_SCOPE2( "readChunk", "x", x, "z", y );
 	unsigned t;
 	if( getChunkInfo( x, y, t ) ) {
 		char regionfn[MAX_PATH];
@@ -217,11 +264,11 @@ void MCRegionMap::checkRegionForChanges( int x, int y, RegionDesc *region ) {
 		if( region->chunkTimes[i] < newTime ) {
 			// A chunk changed!
 			region->chunkTimes[i] = newTime;
-			if( listener ) {
-				int x = (c.x<<5)+(int)(i&31);
-				int y = (c.y*32)+(int)(i>>5);
+			int x = (c.x<<5)+(int)(i&31);
+			int y = (c.y*32)+(int)(i>>5);
+			clearPreloaded( x, y );
+			if( listener )
 				listener->chunkChanged( y, x );
-			}
 		}
 	}
 
@@ -230,7 +277,7 @@ void MCRegionMap::checkRegionForChanges( int x, int y, RegionDesc *region ) {
 
 // -----------------------------------------------------------------
 bool MCRegionMap::getChunkInfo( int x, int y, unsigned &updTime ) {
-	SDL_mutexP( rgDescMutex );
+	TRACE_MUTEXP( rgDescMutex, "waitRgDescMutex" );
 
 	// Find the region
 	ChunkCoords c = { toRegionCoord(x), toRegionCoord(y) };
@@ -273,9 +320,117 @@ bool MCRegionMap::getChunkInfo( int x, int y, unsigned &updTime ) {
 	return it->second.sectors[i] != 0;
 }
 
+// -----------------------------------------------------------------
+void MCRegionMap::preload( int x, int y, int radius ) {
+	endPreload();
+	if( g_nWorkers == 0 || radius < 0 )
+		return;
+
+	// Queue the chunks in the circle, nearest first
+	for( int dy = -radius; dy <= radius; dy++ ) {
+		for( int dx = -radius; dx <= radius; dx++ ) {
+			if( dx * dx + dy * dy <= radius * radius ) {
+				ChunkCoords c = { x + dx, y + dy };
+				preloadQueue.push_back( c );
+			}
+		}
+	}
+	std::sort( preloadQueue.begin(), preloadQueue.end(),
+		[x, y]( const ChunkCoords &a, const ChunkCoords &b ) {
+			return (a.x-x)*(a.x-x) + (a.y-y)*(a.y-y) < (b.x-x)*(b.x-x) + (b.y-y)*(b.y-y);
+		} );
+
+	// Start every worker on it
+	SDL_AtomicSet( &preloadNext, 0 );
+	SDL_AtomicSet( &preloadDone, 0 );
+	SDL_AtomicSet( &preloadWorkers, (int)g_nWorkers );
+	preloadTasks.resize( g_nWorkers );
+	for( unsigned i = 0; i < g_nWorkers; i++ ) {
+		preloadTasks[i].regions = this;
+		preloadTasks[i].worker = g_workers[i];
+		g_workers[i]->doTask( &preload_worker, &preloadTasks[i] );
+	}
+}
+
+// -----------------------------------------------------------------
+void MCRegionMap::getPreloadProgress( unsigned &done, unsigned &total ) {
+	done = (unsigned)SDL_AtomicGet( &preloadDone );
+	total = (unsigned)preloadQueue.size();
+}
+
+// -----------------------------------------------------------------
+void MCRegionMap::endPreload() {
+	// Skip the rest of the queue and wait for the workers to notice
+	SDL_AtomicSet( &preloadNext, (int)preloadQueue.size() );
+	waitForPreload();
+
+	clearPreloaded();
+	preloadQueue.clear();
+	SDL_AtomicSet( &preloadDone, 0 );
+}
+
+// -----------------------------------------------------------------
+void MCRegionMap::waitForPreload() {
+	while( SDL_AtomicGet( &preloadWorkers ) > 0 )
+		SDL_Delay( 1 );
+}
+
+// -----------------------------------------------------------------
+void MCRegionMap::clearPreloaded() {
+	SDL_LockMutex( preloadMutex );
+	for( std::map< ChunkCoords, nbt::Compound* >::iterator it = preloaded.begin(); it != preloaded.end(); ++it )
+		delete it->second;
+	preloaded.clear();
+	SDL_UnlockMutex( preloadMutex );
+}
+
+// -----------------------------------------------------------------
+void MCRegionMap::clearPreloaded( int x, int y ) {
+	ChunkCoords c = { x, y };
+	SDL_LockMutex( preloadMutex );
+	std::map< ChunkCoords, nbt::Compound* >::iterator it = preloaded.find( c );
+	if( it != preloaded.end() ) {
+		delete it->second;
+		preloaded.erase( it );
+	}
+	SDL_UnlockMutex( preloadMutex );
+}
+
+// -----------------------------------------------------------------
+void MCRegionMap::preload_worker( void *taskCookie ) {
+	PreloadTask *task = static_cast<PreloadTask*>( taskCookie );
+	MCRegionMap *rgMap = task->regions;
+	TRACE_SCOPE( "preloadChunks" );
+
+	unsigned total = (unsigned)rgMap->preloadQueue.size();
+	for( unsigned n = 0; n < PRELOAD_BATCH; n++ ) {
+		unsigned i = (unsigned)SDL_AtomicAdd( &rgMap->preloadNext, 1 );
+		if( i >= total ) {
+			// All done (or cancelled)
+			SDL_AtomicAdd( &rgMap->preloadWorkers, -1 );
+			return;
+		}
+
+		const ChunkCoords &c = rgMap->preloadQueue[i];
+		nbt::Compound *chunk = rgMap->readChunkFromFile( c.x, c.y );
+		if( chunk ) {
+			SDL_LockMutex( rgMap->preloadMutex );
+			nbt::Compound *&slot = rgMap->preloaded[c];
+			delete slot;
+			slot = chunk;
+			SDL_UnlockMutex( rgMap->preloadMutex );
+		}
+		SDL_AtomicAdd( &rgMap->preloadDone, 1 );
+	}
+
+	// Go to the back of the queue, so that leaves can be built in between
+	task->worker->doTask( &preload_worker, task );
+}
+
 // -----------------------------------------------------------------
 int MCRegionMap::updateScanner( void *rgMapCookie ) {
 	MCRegionMap *rgMap = static_cast<MCRegionMap*>( rgMapCookie );
+	traceSetThreadName( "File Scanner" );
 
 #ifdef _WINDOWS
 	unsigned lastFullScan = SDL_GetTicks();
@@ -299,7 +454,8 @@ int MCRegionMap::updateScanner( void *rgMapCookie ) {
 					lastFullScan = now;
 				}
 
-				SDL_mutexP( rgMap->rgDescMutex );
+				TRACE_SCOPE( "scanDirectories" );
+				TRACE_MUTEXP( rgMap->rgDescMutex, "waitRgDescMutex" );
 				rgMap->exploreDirectories();
 				SDL_mutexV( rgMap->rgDescMutex );
 			}
@@ -317,7 +473,8 @@ int MCRegionMap::updateScanner( void *rgMapCookie ) {
 			MCRegionMap *rgMap = static_cast<MCRegionMap*>( cookie );
       if (rgMap->watchUpdates)
       {
-        SDL_mutexP( rgMap->rgDescMutex );
+        TRACE_SCOPE( "scanDirectories" );
+        TRACE_MUTEXP( rgMap->rgDescMutex, "waitRgDescMutex" );
         rgMap->exploreDirectories();
         SDL_mutexV( rgMap->rgDescMutex );
       }
@@ -358,9 +515,12 @@ int MCRegionMap::updateScanner( void *rgMapCookie ) {
 # endif
     if (rgMap->watchUpdates)
     {
-      SDL_mutexP( rgMap->rgDescMutex );
-      rgMap->exploreDirectories();
-      SDL_mutexV( rgMap->rgDescMutex );
+      {
+        TRACE_SCOPE( "scanDirectories" );
+        TRACE_MUTEXP( rgMap->rgDescMutex, "waitRgDescMutex" );
+        rgMap->exploreDirectories();
+        SDL_mutexV( rgMap->rgDescMutex );
+      }
       SDL_Delay(1000);
     }
 #endif
@@ -446,6 +606,34 @@ int MCRegionMap::lua_createView( lua_State *L ) {
 	return 1;
 }
 
+// -----------------------------------------------------------------
+int MCRegionMap::lua_preload( lua_State *L ) {
+	// regions:preload( x, z, radius )
+	MCRegionMap *regions = getLuaObjectArg<MCRegionMap>( L, 1, MCREGIONMAP_META );
+	int x = (int)floor( luaL_checknumber( L, 2 ) );
+	int z = (int)floor( luaL_checknumber( L, 3 ) );
+	int radius = (int)luaL_checknumber( L, 4 );
+	regions->preload( shift_right( x, 4 ), shift_right( z, 4 ), (radius + 15) / 16 );
+	return 0;
+}
+
+// -----------------------------------------------------------------
+int MCRegionMap::lua_getPreloadProgress( lua_State *L ) {
+	// done, total = regions:getPreloadProgress()
+	unsigned done, total;
+	getLuaObjectArg<MCRegionMap>( L, 1, MCREGIONMAP_META )->getPreloadProgress( done, total );
+	lua_pushnumber( L, done );
+	lua_pushnumber( L, total );
+	return 2;
+}
+
+// -----------------------------------------------------------------
+int MCRegionMap::lua_endPreload( lua_State *L ) {
+	// regions:endPreload()
+	getLuaObjectArg<MCRegionMap>( L, 1, MCREGIONMAP_META )->endPreload();
+	return 0;
+}
+
 // -----------------------------------------------------------------
 int MCRegionMap::lua_destroy( lua_State *L ) {
 	// regions:destroy()
@@ -460,6 +648,9 @@ static const luaL_Reg MCRegionMap_functions[] = {
 	{ "changeRootPath", &MCRegionMap::lua_changeRootPath },
 	{ "setMonitorState", &MCRegionMap::lua_setMonitorState },
 	{ "createView", &MCRegionMap::lua_createView },
+	{ "preload", &MCRegionMap::lua_preload },
+	{ "getPreloadProgress", &MCRegionMap::lua_getPreloadProgress },
+	{ "endPreload", &MCRegionMap::lua_endPreload },
 	{ "destroy", &MCRegionMap::lua_destroy },
 	{ NULL, NULL }
 };
@@ -25,6 +25,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #define MCREGIONMAP_H
 
 #include <string>
+#include <vector>
+#include <map>
 #include <SDL.h>
 
 #include "luaobject.h"
@@ -35,6 +37,7 @@ struct lua_State;
 namespace eihort {
 
 class MCBiome;
+class Worker;
 
 struct ChunkCoords {
 	// Chunk coordinates
@@ -103,6 +106,15 @@ public:
 	// This function is thread-safe
 	nbt::Compound *readChunk( int x, int y );
 
+	// Read the chunks within radius chunks of (x,y) on all workers, nearest
+	// first, and hand them out through readChunk
+	// Workers go back to their other tasks between every few chunks
+	void preload( int x, int y, int radius );
+	// Get the number of chunks preloaded so far, out of the total
+	void getPreloadProgress( unsigned &done, unsigned &total );
+	// Stop preloading and free the chunks which were never read
+	void endPreload();
+
 	// Change the root folder and re-search for regions
 	void changeRoot( const char *newRoot, bool anvil = true );
 	// Get the current root folder
@@ -124,6 +136,9 @@ public:
 	static int lua_changeRootPath( lua_State *L );
 	static int lua_setMonitorState( lua_State *L );
 	static int lua_createView( lua_State *L );
+	static int lua_preload( lua_State *L );
+	static int lua_getPreloadProgress( lua_State *L );
+	static int lua_endPreload( lua_State *L );
 	static int lua_destroy( lua_State *L );
 	static void setupLua( lua_State *L );
 
@@ -145,6 +160,24 @@ private:
 	void checkRegionForChanges( int x, int y, RegionDesc *region );
 	// Get the last update time of a specific chunk
 	bool getChunkInfo( int x, int y, unsigned &updTime );
+	// Read the NBT for a chunk from its region file
+	nbt::Compound *readChunkFromFile( int x, int y );
+	// Wait until no worker is preloading
+	void waitForPreload();
+	// Free the preloaded chunks, or only the one at (x,y)
+	void clearPreloaded();
+	void clearPreloaded( int x, int y );
+
+	struct PreloadTask {
+		// Preloading task of one worker
+
+		// The region map being preloaded
+		MCRegionMap *regions;
+		// The worker running the task
+		Worker *worker;
+	};
+	// Worker task which preloads the next few chunks
+	static void preload_worker( void *taskCookie );
 
 	// Entry point for the change scanning thread
 	static int updateScanner( void *rgMapCookie );
@@ -171,6 +204,21 @@ private:
 	ChangeListener *listener;
 	// Should we watch for chunk changes?
 	bool watchUpdates;
+
+	// Chunks to preload, nearest first
+	std::vector<ChunkCoords> preloadQueue;
+	// Preloading tasks, one per worker
+	std::vector<PreloadTask> preloadTasks;
+	// Index of the next chunk to preload
+	SDL_atomic_t preloadNext;
+	// Number of chunks preloaded so far
+	SDL_atomic_t preloadDone;
+	// Number of workers still preloading
+	SDL_atomic_t preloadWorkers;
+	// Preloaded chunks which have not been read yet
+	std::map< ChunkCoords, nbt::Compound* > preloaded;
+	// Mutex protecting preloaded
+	SDL_mutex *preloadMutex;
 };
 
 } // namespace eihort
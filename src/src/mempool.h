@@ -25,8 +25,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #define _MEMPOOL_H
 
 #include <cassert>
+#include <cstdlib>
 #include <vector>
 
+#include "memstats.h"
+
 
 template <typename T>
 class MemoryPool {
@@ -34,20 +37,24 @@ class MemoryPool {
 
 public:
 	// ----------------------------------------------------------------------------
-	explicit MemoryPool (int allocIncrement = (4096 - 8) / sizeof(T))
-		: pools(0), freeObjects(0), allocIncrement(allocIncrement)
+	// The memory is counted under tag
+	explicit MemoryPool (eihort::MemTag tag, int allocIncrement = (4096 - 8) / sizeof(T))
+		: pools(0), freeObjects(0), allocIncrement(allocIncrement), tag(tag)
 	{ }
 
 	// ----------------------------------------------------------------------------
 	~MemoryPool() {
-		for (unsigned int i = 0; i < pools.size(); i++)
-			free( pools[i] );
+		reset();
 	}
 
 	// ----------------------------------------------------------------------------
 	void reset() {
-		for (unsigned int i = 0; i < pools.size(); i++)
-			free( pools[i] );		pools.clear();
+		// ::free, since free(T*) only returns an object to the pool
+		for (unsigned int i = 0; i < pools.size(); i++) {
+			::free( pools[i] );
+			eihort::memFree( tag, allocIncrement * sizeof(T) );
+		}
+		pools.clear();
 		freeObjects.clear();
 	}
 
@@ -56,6 +63,7 @@ public:
 		if (freeObjects.size() == 0) {
 			// allocate more
 			T *newObjs = (T*)malloc( allocIncrement * sizeof(T) );
+			eihort::memAlloc( tag, allocIncrement * sizeof(T) );
 			pools.push_back (newObjs);
 			for (int i = allocIncrement - 1; i >= 0; i--) {
 				freeObjects.push_back (newObjs + i);
@@ -85,6 +93,7 @@ private:
 	std::vector<T*> pools;
 	std::vector<T*> freeObjects;
 	int allocIncrement;
+	eihort::MemTag tag;
 };
 
 #endif
@@ -0,0 +1,100 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <SDL_atomic.h>
+
+#include "platform.h"
+#include "memstats.h"
+
+namespace eihort {
+
+// Slots for threads' totals; any threads beyond this share the last one
+static const unsigned MEM_MAX_THREADS = MAX_WORKERS + 8;
+
+struct MemThreadData {
+	// Totals counted by a single thread
+	// Only the owning thread writes to these, except in the shared last
+	// slot, which is guarded by g_memSharedLock. Reads from other threads
+	// are unsynchronized, which is enough for statistics.
+
+	// Bytes held per tag
+	int64_t bytes[MEM_TAG_COUNT];
+	// Allocations held per tag
+	int64_t count[MEM_TAG_COUNT];
+};
+
+// Totals of all threads
+static MemThreadData g_memThreads[MEM_MAX_THREADS];
+// Number of slots handed out so far
+static SDL_atomic_t g_memThreadCount;
+// Guards the shared last slot
+static SDL_SpinLock g_memSharedLock;
+// The slot of the current thread
+static THREAD_LOCAL MemThreadData *g_threadMem = NULL;
+
+// Names of the tags, as reported to Lua
+static const char *const g_memTagNames[MEM_TAG_COUNT] = {
+	"nbt",
+	"chunks",
+	"meshSections",
+	"geometry",
+	"geometryCache",
+	"qtree",
+	"images"
+};
+
+// -----------------------------------------------------------------
+void memAccount( MemTag tag, int64_t bytes, int count ) {
+	MemThreadData *data = g_threadMem;
+	if( !data ) {
+		unsigned slot = (unsigned)SDL_AtomicAdd( &g_memThreadCount, 1 );
+		data = g_threadMem = &g_memThreads[slot < MEM_MAX_THREADS ? slot : MEM_MAX_THREADS - 1];
+	}
+
+	MemThreadData *shared = &g_memThreads[MEM_MAX_THREADS - 1];
+	if( data == shared )
+		SDL_AtomicLock( &g_memSharedLock );
+	data->bytes[tag] += bytes;
+	data->count[tag] += count;
+	if( data == shared )
+		SDL_AtomicUnlock( &g_memSharedLock );
+}
+
+// -----------------------------------------------------------------
+void memGetStats( MemTag tag, MemTagStats &out ) {
+	unsigned nThreads = (unsigned)SDL_AtomicGet( &g_memThreadCount );
+	if( nThreads > MEM_MAX_THREADS )
+		nThreads = MEM_MAX_THREADS;
+	out.bytes = out.count = 0;
+	for( unsigned i = 0; i < nThreads; i++ ) {
+		out.bytes += g_memThreads[i].bytes[tag];
+		out.count += g_memThreads[i].count[tag];
+	}
+}
+
+// -----------------------------------------------------------------
+const char *getMemTagName( MemTag tag ) {
+	return g_memTagNames[tag];
+}
+
+} // namespace eihort
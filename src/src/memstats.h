@@ -0,0 +1,108 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include <cstddef>
+#include <stdint.h>
+
+/*
+Accounting of the heap memory held by each of the large consumers, so that
+the process's memory use can be attributed.
+Each thread counts into its own slot without taking any locks, and
+memGetStats() adds the slots up on request. Memory may be released on a
+different thread than the one which allocated it; only the totals over all
+threads are meaningful.
+*/
+
+namespace eihort {
+
+enum MemTag {
+	// Consumers whose memory is accounted for
+
+	// NBT payload arrays and containers
+	MEM_NBT,
+	// Block, lighting and biome arrays of the chunks loaded by MCMaps
+	MEM_CHUNKS,
+	// Built WorldMeshSectionData which has not been uploaded yet,
+	// with its lighting texture and biome coordinates
+	MEM_MESH_SECTIONS,
+	// Buffers held by GeometryStreams
+	MEM_GEOMETRY,
+	// GeometryStream buffers kept for reuse by ScratchArenas
+	MEM_GEOMETRY_CACHE,
+	// Node and leaf pools of the WorldQTrees
+	MEM_QTREE,
+	// Pixels of the images held by Lua
+	MEM_IMAGES,
+
+	MEM_TAG_COUNT
+};
+
+struct MemTagStats {
+	// Totals for one tag
+
+	// Bytes currently held
+	int64_t bytes;
+	// Number of allocations currently held
+	int64_t count;
+};
+
+// Add to the bytes and number of allocations held under a tag
+void memAccount( MemTag tag, int64_t bytes, int count );
+// Count an allocation or release of the given size
+inline void memAlloc( MemTag tag, size_t bytes ) { memAccount( tag, (int64_t)bytes, 1 ); }
+inline void memFree( MemTag tag, size_t bytes ) { memAccount( tag, -(int64_t)bytes, -1 ); }
+// Add up all threads' totals for a tag
+void memGetStats( MemTag tag, MemTagStats &out );
+// Get the name under which a tag is reported
+const char *getMemTagName( MemTag tag );
+
+template< MemTag TAG >
+class MemCharge {
+	// A number of bytes counted under TAG for as long as the object which
+	// holds this lives
+
+public:
+	MemCharge() : bytes(0) { memAccount( TAG, 0, 1 ); }
+	MemCharge( MemCharge &&other ) : bytes(other.bytes) { other.bytes = 0; memAccount( TAG, 0, 1 ); }
+	~MemCharge() { memFree( TAG, bytes ); }
+	MemCharge( const MemCharge& ) = delete;
+	MemCharge &operator=( const MemCharge& ) = delete;
+
+	// Change the number of bytes held
+	inline void set( size_t n ) {
+		memAccount( TAG, (int64_t)n - (int64_t)bytes, 0 );
+		bytes = n;
+	}
+
+private:
+	// Bytes counted
+	size_t bytes;
+};
+
+} // namespace eihort
+
+#endif // MEMSTATS_H
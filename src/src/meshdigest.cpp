@@ -0,0 +1,247 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <cstring>
+#include <typeinfo>
+
+#include "meshdigest.h"
+#include "geombase.h"
+#include "platform.h"
+
+namespace eihort {
+namespace geom {
+
+// -=-=-=-=------------------------------------------------------=-=-=-=-
+// The digest bound to each thread
+static THREAD_LOCAL MeshDigest *g_threadDigest = NULL;
+
+// FNV-1a parameters
+static const uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+static const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+// -----------------------------------------------------------------
+static uint64_t hashBytes( uint64_t h, const void *data, unsigned size ) {
+	// FNV-1a
+	const unsigned char *p = (const unsigned char*)data;
+	for( unsigned i = 0; i < size; i++ ) {
+		h ^= p[i];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+// -----------------------------------------------------------------
+template< typename T >
+static uint64_t hashValue( uint64_t h, T value ) {
+	return hashBytes( h, &value, (unsigned)sizeof(T) );
+}
+
+// -----------------------------------------------------------------
+static uint64_t mix( uint64_t x ) {
+	// SplitMix64 finalizer, so that sums of hashes stay well distributed
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+// -----------------------------------------------------------------
+static int64_t gcd( int64_t a, int64_t b ) {
+	if( a < 0 ) a = -a;
+	if( b < 0 ) b = -b;
+	while( b ) {
+		int64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+
+// -=-=-=-=------------------------------------------------------=-=-=-=-
+MeshDigest::MeshDigest( const GeometryIds *ids )
+: ids(ids)
+{
+	clear();
+}
+
+// -----------------------------------------------------------------
+void MeshDigest::bind( MeshDigest *digest ) {
+	g_threadDigest = digest;
+}
+
+// -----------------------------------------------------------------
+void MeshDigest::record( const BlockGeometry *geom, unsigned part, const GeometryStream *str ) {
+	if( g_threadDigest && str->getVertCount() )
+		g_threadDigest->addTriangles( geom, part, str );
+}
+
+// -----------------------------------------------------------------
+void MeshDigest::recordMeta( const BlockGeometry *geom, const GeometryStream *str ) {
+	MeshDigest *digest = g_threadDigest;
+	if( digest ) {
+		digest->common = hashValue( digest->common, digest->getGeometryId( geom ) );
+		digest->addCommon( str->getVertices(), str->getVertSize() );
+	}
+}
+
+// -----------------------------------------------------------------
+void MeshDigest::addCommon( const void *data, unsigned size ) {
+	common = hashValue( common, size );
+	common = hashBytes( common, data, size );
+}
+
+// -----------------------------------------------------------------
+void MeshDigest::clear() {
+	exact = FNV_OFFSET;
+	common = FNV_OFFSET;
+	triangles = 0;
+	surface.clear();
+}
+
+// -----------------------------------------------------------------
+uint64_t MeshDigest::get( Mode mode ) const {
+	uint64_t h = hashValue( common, (unsigned)mode );
+	switch( mode ) {
+	case EXACT:
+		return hashValue( h, exact );
+	case TRIANGLES:
+		return hashValue( h, triangles );
+	case SURFACE:
+		for( std::map<uint64_t, int64_t>::const_iterator it = surface.begin(); it != surface.end(); ++it ) {
+			if( it->second ) {
+				h = hashValue( h, it->first );
+				h = hashValue( h, it->second );
+			}
+		}
+		return h;
+	default:
+		return 0;
+	}
+}
+
+// -----------------------------------------------------------------
+const char *MeshDigest::getModeName( Mode mode ) {
+	switch( mode ) {
+	case EXACT: return "exact";
+	case TRIANGLES: return "triangles";
+	case SURFACE: return "surface";
+	default: return NULL;
+	}
+}
+
+// -----------------------------------------------------------------
+void MeshDigest::addTriangles( const BlockGeometry *geom, unsigned part, const GeometryStream *str ) {
+	unsigned id = getGeometryId( geom );
+	unsigned nVerts = str->getVertCount();
+	unsigned nTris = str->getTriCount();
+	unsigned stride = str->getVertSize() / nVerts;
+	VertexFormat::Id format = str->getVertexFormat();
+	const unsigned char *verts = (const unsigned char*)str->getVertices();
+	const unsigned *indices = str->getIndices();
+
+	// Everything, in order
+	exact = hashValue( exact, id );
+	exact = hashValue( exact, part );
+	exact = hashValue( exact, (unsigned)format );
+	exact = hashValue( exact, nVerts );
+	exact = hashValue( exact, nTris );
+	exact = hashBytes( exact, verts, str->getVertSize() );
+	exact = hashBytes( exact, indices, nTris * 3 * (unsigned)sizeof(unsigned) );
+
+	uint64_t seed = hashValue( hashValue( FNV_OFFSET, id ), part );
+	for( unsigned t = 0; t < nTris; t++ ) {
+		const unsigned char *v[3];
+		for( unsigned i = 0; i < 3; i++ )
+			v[i] = verts + indices[t*3+i] * stride;
+		if( 0 == memcmp( v[0], v[1], stride ) || 0 == memcmp( v[1], v[2], stride ) || 0 == memcmp( v[0], v[2], stride ) )
+			continue;
+
+		// Start from the smallest vertex, keeping the winding
+		unsigned first = 0;
+		if( memcmp( v[1], v[first], stride ) < 0 )
+			first = 1;
+		if( memcmp( v[2], v[first], stride ) < 0 )
+			first = 2;
+		uint64_t h = seed;
+		for( unsigned i = 0; i < 3; i++ )
+			h = hashBytes( h, v[(first+i)%3], stride );
+		triangles += mix( h );
+
+		if( format == VertexFormat::UNDECLARED ) {
+			// Without a declared format, the position is unknown
+			surface[h]++;
+			continue;
+		}
+
+		// Every declared format starts with short pos[3]
+		int64_t p[3][3];
+		for( unsigned i = 0; i < 3; i++ ) {
+			short pos[3];
+			memcpy( &pos[0], v[i], sizeof(pos) );
+			for( unsigned j = 0; j < 3; j++ )
+				p[i][j] = pos[j];
+		}
+		int64_t e1[3], e2[3], n[3];
+		for( unsigned j = 0; j < 3; j++ ) {
+			e1[j] = p[1][j] - p[0][j];
+			e2[j] = p[2][j] - p[0][j];
+		}
+		n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+		n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+		n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+		int64_t g = gcd( gcd( n[0], n[1] ), n[2] );
+		if( g == 0 )
+			continue;
+
+		// Coplanar triangles facing the same way have the same reduced
+		// normal and offset, and their areas are multiples of it
+		int64_t offset = 0;
+		uint64_t key = seed;
+		for( unsigned j = 0; j < 3; j++ ) {
+			n[j] /= g;
+			offset += n[j] * p[0][j];
+			key = hashValue( key, n[j] );
+		}
+		key = hashValue( key, offset );
+		surface[key] += g;
+	}
+}
+
+// -----------------------------------------------------------------
+unsigned MeshDigest::getGeometryId( const BlockGeometry *geom ) const {
+	if( ids ) {
+		GeometryIds::const_iterator it = ids->find( geom );
+		if( it != ids->end() )
+			return it->second;
+	}
+
+	// Geometries outside the table are told apart by their type
+	const char *name = typeid(*geom).name();
+	return (unsigned)hashBytes( FNV_OFFSET, name, (unsigned)strlen( name ) );
+}
+
+} // namespace geom
+} // namespace eihort
@@ -0,0 +1,105 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef MESHDIGEST_H
+#define MESHDIGEST_H
+
+#include <map>
+#include <stdint.h>
+
+namespace eihort {
+namespace geom {
+
+class BlockGeometry;
+class GeometryStream;
+
+class MeshDigest {
+	// Canonical hashes of the geometry finalized on one thread, for checking
+	// that changes to the mesh builders leave their output unchanged.
+	// Like ScratchArena, a digest is bound to a thread; the geometry clusters
+	// report each stream they finalize through record(), which does nothing
+	// unless a digest is bound.
+
+public:
+	enum Mode {
+		// How much the geometry may change while keeping the same hash
+
+		// Every vertex, index and metadata value, in order
+		EXACT,
+		// The set of triangles, ignoring their order, the rotation of their
+		// vertices (but not their winding) and how vertices are shared, so
+		// that welding and reordering do not change it
+		TRIANGLES,
+		// The area covered in each plane by each geometry, ignoring
+		// triangulation and texture coordinates, so that merging faces
+		// does not change it
+		SURFACE,
+
+		MODE_COUNT
+	};
+
+	// Stable ids for the geometries, since their addresses change from
+	// run to run
+	typedef std::map<const BlockGeometry*, unsigned> GeometryIds;
+
+	explicit MeshDigest( const GeometryIds *ids );
+
+	// Make digest the digest for the calling thread (NULL for none)
+	static void bind( MeshDigest *digest );
+	// Report a finalized stream of triangles
+	// part distinguishes the streams of a single cluster
+	static void record( const BlockGeometry *geom, unsigned part, const GeometryStream *str );
+	// Report metadata which is drawn without any triangles (e.g. sign text)
+	static void recordMeta( const BlockGeometry *geom, const GeometryStream *str );
+
+	// Add data which is identical under every mode, such as lighting
+	void addCommon( const void *data, unsigned size );
+	// Forget everything added so far
+	void clear();
+	// Get the hash of everything added since the last clear
+	uint64_t get( Mode mode ) const;
+
+	// Name of a mode, as used on the command line
+	static const char *getModeName( Mode mode );
+
+private:
+	// Add a stream of triangles
+	void addTriangles( const BlockGeometry *geom, unsigned part, const GeometryStream *str );
+	// Get the stable id of a geometry
+	unsigned getGeometryId( const BlockGeometry *geom ) const;
+
+	// Stable ids of the geometries
+	const GeometryIds *ids;
+	// Running hashes of everything in order, and of the common data
+	uint64_t exact, common;
+	// Order-independent sum of the hashes of all triangles
+	uint64_t triangles;
+	// Twice the area covered, keyed by geometry, part, facing and plane
+	std::map<uint64_t, int64_t> surface;
+};
+
+} // namespace geom
+} // namespace eihort
+
+#endif // MESHDIGEST_H
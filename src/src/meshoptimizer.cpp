@@ -0,0 +1,311 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <cmath>
+#include <cstring>
+#include "meshoptimizer.h"
+#include "geombase.h"
+
+namespace eihort {
+namespace geom {
+
+// Constants of Forsyth's vertex scoring function
+static const float CACHE_DECAY_POWER = 1.5f;
+static const float LAST_TRI_SCORE = 0.75f;
+static const float VALENCE_BOOST_SCALE = 2.0f;
+static const float VALENCE_BOOST_POWER = 0.5f;
+
+// Marks an empty slot or a missing entry
+static const unsigned NONE = ~0u;
+
+// -=-=-=-=------------------------------------------------------=-=-=-=-
+void MeshOptimizeStats::clear() {
+	vertsIn = vertsOut = 0;
+	tris = 0;
+	missesIn = missesOut = 0;
+}
+
+// -----------------------------------------------------------------
+void MeshOptimizeStats::add( const MeshOptimizeStats &other ) {
+	vertsIn += other.vertsIn;
+	vertsOut += other.vertsOut;
+	tris += other.tris;
+	missesIn += other.missesIn;
+	missesOut += other.missesOut;
+}
+
+
+// -=-=-=-=------------------------------------------------------=-=-=-=-
+MeshOptimizer::MeshOptimizer() {
+	stats.clear();
+}
+
+// -----------------------------------------------------------------
+MeshOptimizer::~MeshOptimizer() {
+}
+
+// -----------------------------------------------------------------
+void MeshOptimizer::optimize( GeometryStream *str ) {
+	unsigned nVerts = str->getVertCount();
+	unsigned nIndices = str->getTriCount() * 3;
+	if( nVerts == 0 || nIndices == 0 )
+		return;
+
+	unsigned stride = str->getVertSize() / nVerts;
+	unsigned char *verts = (unsigned char*)str->getVertices();
+	unsigned *indices = str->getIndices();
+
+	stats.vertsIn += nVerts;
+	stats.tris += nIndices / 3;
+	stats.missesIn += countCacheMisses( indices, nIndices );
+
+	nVerts = weld( verts, stride, nVerts, indices, nIndices );
+	reorderTriangles( indices, nIndices, nVerts );
+	nVerts = reorderVertices( verts, stride, nVerts, indices, nIndices );
+	str->truncateVertices( nVerts );
+
+	stats.vertsOut += nVerts;
+	stats.missesOut += countCacheMisses( indices, nIndices );
+}
+
+// -----------------------------------------------------------------
+unsigned MeshOptimizer::countCacheMisses( const unsigned *indices, unsigned nIndices ) {
+	unsigned cache[ACMR_CACHE_SIZE];
+	for( unsigned i = 0; i < ACMR_CACHE_SIZE; i++ )
+		cache[i] = NONE;
+
+	unsigned misses = 0, next = 0;
+	for( unsigned i = 0; i < nIndices; i++ ) {
+		bool hit = false;
+		for( unsigned j = 0; j < ACMR_CACHE_SIZE; j++ ) {
+			if( cache[j] == indices[i] ) {
+				hit = true;
+				break;
+			}
+		}
+		if( !hit ) {
+			misses++;
+			cache[next] = indices[i];
+			next = (next + 1) % ACMR_CACHE_SIZE;
+		}
+	}
+	return misses;
+}
+
+// -----------------------------------------------------------------
+unsigned MeshOptimizer::weld( unsigned char *verts, unsigned stride, unsigned nVerts, unsigned *indices, unsigned nIndices ) {
+	// Open-addressed hash table of the unique vertices, at most half full
+	unsigned tableSize = 16;
+	while( tableSize < nVerts * 2 )
+		tableSize <<= 1;
+	hashTable.assign( tableSize, NONE );
+	remap.resize( nVerts );
+
+	// Unique vertices are compacted to the front of the buffer as they
+	// are found; the slots they move into have already been processed
+	unsigned unique = 0;
+	for( unsigned v = 0; v < nVerts; v++ ) {
+		const unsigned char *src = verts + v * stride;
+
+		// FNV-1a hash of the vertex
+		unsigned hash = 2166136261u;
+		for( unsigned i = 0; i < stride; i++ )
+			hash = (hash ^ src[i]) * 16777619u;
+
+		for( unsigned slot = hash & (tableSize-1); ; slot = (slot + 1) & (tableSize-1) ) {
+			unsigned existing = hashTable[slot];
+			if( existing == NONE ) {
+				hashTable[slot] = unique;
+				if( unique != v )
+					memcpy( verts + unique * stride, src, stride );
+				remap[v] = unique++;
+				break;
+			}
+			if( memcmp( verts + existing * stride, src, stride ) == 0 ) {
+				remap[v] = existing;
+				break;
+			}
+		}
+	}
+
+	for( unsigned i = 0; i < nIndices; i++ )
+		indices[i] = remap[indices[i]];
+	return unique;
+}
+
+// -----------------------------------------------------------------
+float MeshOptimizer::vertexScore( int cachePos, unsigned remaining ) {
+	if( remaining == 0 )
+		return -1.0f;
+
+	float score = 0.0f;
+	if( cachePos >= 0 ) {
+		if( cachePos < 3 ) {
+			// The vertices of the last triangle get a fixed score, so that
+			// the order within the triangle does not matter
+			score = LAST_TRI_SCORE;
+		} else {
+			const float scale = 1.0f / (CACHE_SIZE - 3);
+			score = powf( 1.0f - (cachePos - 3) * scale, CACHE_DECAY_POWER );
+		}
+	}
+
+	// Boost vertices with few triangles left, to finish them off
+	score += VALENCE_BOOST_SCALE * powf( (float)remaining, -VALENCE_BOOST_POWER );
+	return score;
+}
+
+// -----------------------------------------------------------------
+void MeshOptimizer::reorderTriangles( unsigned *indices, unsigned nIndices, unsigned nVerts ) {
+	unsigned nTris = nIndices / 3;
+
+	// Build the list of triangles using each vertex
+	remaining.assign( nVerts, 0 );
+	for( unsigned i = 0; i < nIndices; i++ )
+		remaining[indices[i]]++;
+	triStart.resize( nVerts + 1 );
+	triStart[0] = 0;
+	for( unsigned v = 0; v < nVerts; v++ )
+		triStart[v+1] = triStart[v] + remaining[v];
+	vtxTris.resize( nIndices );
+	remap.assign( triStart.begin(), triStart.end() - 1 );
+	for( unsigned i = 0; i < nIndices; i++ )
+		vtxTris[remap[indices[i]]++] = i / 3;
+
+	// Initial scores
+	cachePos.assign( nVerts, -1 );
+	score.resize( nVerts );
+	for( unsigned v = 0; v < nVerts; v++ )
+		score[v] = vertexScore( -1, remaining[v] );
+	triAdded.assign( nTris, false );
+	triScore.resize( nTris );
+	unsigned bestTri = 0;
+	for( unsigned t = 0; t < nTris; t++ ) {
+		triScore[t] = score[indices[t*3]] + score[indices[t*3+1]] + score[indices[t*3+2]];
+		if( triScore[t] > triScore[bestTri] )
+			bestTri = t;
+	}
+
+	// The simulated LRU cache, with room for a new triangle's vertices
+	unsigned cache[CACHE_SIZE + 3], newCache[CACHE_SIZE + 3];
+	unsigned cacheCount = 0;
+
+	newIndices.resize( nIndices );
+	unsigned nextUnadded = 0;
+	for( unsigned out = 0; out < nTris; out++ ) {
+		if( bestTri == NONE ) {
+			// Nothing in the cache leads anywhere - take the next triangle
+			// in the original order
+			while( triAdded[nextUnadded] )
+				nextUnadded++;
+			bestTri = nextUnadded;
+		}
+
+		// Output the triangle
+		const unsigned *tri = &indices[bestTri*3];
+		newIndices[out*3] = tri[0];
+		newIndices[out*3+1] = tri[1];
+		newIndices[out*3+2] = tri[2];
+		triAdded[bestTri] = true;
+
+		// Remove it from its vertices' lists of remaining triangles
+		for( unsigned i = 0; i < 3; i++ ) {
+			unsigned v = tri[i];
+			unsigned *list = &vtxTris[triStart[v]];
+			for( unsigned j = 0; j < remaining[v]; j++ ) {
+				if( list[j] == bestTri ) {
+					list[j] = list[remaining[v]-1];
+					remaining[v]--;
+					break;
+				}
+			}
+		}
+
+		// Move the triangle's vertices to the front of the cache
+		unsigned newCount = 0;
+		for( unsigned i = 0; i < 3; i++ ) {
+			if( newCount == 0 || (tri[i] != newCache[0] && (newCount == 1 || tri[i] != newCache[1])) )
+				newCache[newCount++] = tri[i];
+		}
+		for( unsigned i = 0; i < cacheCount; i++ ) {
+			unsigned v = cache[i];
+			if( v != tri[0] && v != tri[1] && v != tri[2] )
+				newCache[newCount++] = v;
+		}
+
+		// Rescore the vertices which were in or have entered the cache
+		// Vertices pushed past the end of the cache fall out of it
+		for( unsigned i = 0; i < newCount; i++ ) {
+			unsigned v = newCache[i];
+			cachePos[v] = i < CACHE_SIZE ? (int)i : -1;
+			score[v] = vertexScore( cachePos[v], remaining[v] );
+		}
+
+		// Rescore their triangles, and pick the best one to output next
+		bestTri = NONE;
+		float bestScore = -1.0f;
+		for( unsigned i = 0; i < newCount; i++ ) {
+			unsigned v = newCache[i];
+			const unsigned *list = &vtxTris[triStart[v]];
+			for( unsigned j = 0; j < remaining[v]; j++ ) {
+				unsigned t = list[j];
+				const unsigned *ti = &indices[t*3];
+				triScore[t] = score[ti[0]] + score[ti[1]] + score[ti[2]];
+				if( triScore[t] > bestScore ) {
+					bestScore = triScore[t];
+					bestTri = t;
+				}
+			}
+		}
+
+		cacheCount = newCount < CACHE_SIZE ? newCount : CACHE_SIZE;
+		memcpy( cache, newCache, cacheCount * sizeof(unsigned) );
+	}
+
+	memcpy( indices, &newIndices[0], nIndices * sizeof(unsigned) );
+}
+
+// -----------------------------------------------------------------
+unsigned MeshOptimizer::reorderVertices( unsigned char *verts, unsigned stride, unsigned nVerts, unsigned *indices, unsigned nIndices ) {
+	// Number the vertices in the order in which they are first used
+	remap.assign( nVerts, NONE );
+	unsigned used = 0;
+	for( unsigned i = 0; i < nIndices; i++ ) {
+		unsigned &r = remap[indices[i]];
+		if( r == NONE )
+			r = used++;
+		indices[i] = r;
+	}
+
+	// Unused vertices are dropped
+	newVerts.resize( used * stride );
+	for( unsigned v = 0; v < nVerts; v++ ) {
+		if( remap[v] != NONE )
+			memcpy( &newVerts[remap[v] * stride], verts + v * stride, stride );
+	}
+	memcpy( verts, &newVerts[0], used * stride );
+	return used;
+}
+
+} // namespace geom
+} // namespace eihort
@@ -0,0 +1,130 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef MESHOPTIMIZER_H
+#define MESHOPTIMIZER_H
+
+#include <vector>
+
+namespace eihort {
+namespace geom {
+
+class GeometryStream;
+
+struct MeshOptimizeStats {
+	// Totals gathered while optimizing geometry streams
+
+	// Vertices before and after welding
+	unsigned vertsIn, vertsOut;
+	// Triangles processed
+	unsigned tris;
+	// Simulated vertex cache misses before and after reordering
+	unsigned missesIn, missesOut;
+
+	// Reset all totals to zero
+	void clear();
+	// Add another set of totals to these
+	void add( const MeshOptimizeStats &other );
+	// Average cache miss ratio (misses per triangle) before optimization
+	inline float getACMRBefore() const { return tris ? (float)missesIn / tris : 0.0f; }
+	// Average cache miss ratio (misses per triangle) after optimization
+	inline float getACMRAfter() const { return tris ? (float)missesOut / tris : 0.0f; }
+};
+
+class MeshOptimizer {
+	// Optimizes finalized geometry streams for the GPU
+	// Identical vertices are welded together, the triangles are reordered
+	// for the post-transform vertex cache with Tom Forsyth's linear-speed
+	// algorithm, and the vertices are then stored in the order in which
+	// they are first used.
+	// One optimizer is used per thread, so that its scratch space is reused.
+
+public:
+	MeshOptimizer();
+	~MeshOptimizer();
+
+	// Size of the LRU cache modelled when reordering triangles
+	static const unsigned CACHE_SIZE = 32;
+	// Size of the FIFO cache simulated to measure the ACMR
+	static const unsigned ACMR_CACHE_SIZE = 16;
+
+	// Optimize the vertices and indices of a stream
+	// All vertices in the stream must be the same size
+	void optimize( GeometryStream *str );
+
+	// Totals over all streams optimized since the last resetStats
+	inline const MeshOptimizeStats &getStats() const { return stats; }
+	// Reset the totals
+	inline void resetStats() { stats.clear(); }
+
+	// Count the cache misses of drawing the indexed triangles through a
+	// FIFO cache of ACMR_CACHE_SIZE vertices
+	static unsigned countCacheMisses( const unsigned *indices, unsigned nIndices );
+
+private:
+	MeshOptimizer( const MeshOptimizer& ) = delete;
+	MeshOptimizer &operator=( const MeshOptimizer& ) = delete;
+
+	// Merge identical vertices, rewriting the indices
+	// Returns the number of unique vertices, which are compacted to the
+	// front of the buffer
+	unsigned weld( unsigned char *verts, unsigned stride, unsigned nVerts, unsigned *indices, unsigned nIndices );
+	// Reorder the triangles for the vertex cache
+	void reorderTriangles( unsigned *indices, unsigned nIndices, unsigned nVerts );
+	// Store the vertices in the order they are first used, dropping unused ones
+	// Returns the number of vertices left
+	unsigned reorderVertices( unsigned char *verts, unsigned stride, unsigned nVerts, unsigned *indices, unsigned nIndices );
+
+	// Forsyth's score of a vertex, given its position in the LRU cache
+	// (-1 if not in the cache) and its number of remaining triangles
+	static float vertexScore( int cachePos, unsigned remaining );
+
+	// Totals over the optimized streams
+	MeshOptimizeStats stats;
+
+	// Scratch space, kept to reuse its storage
+	// Hash table of vertex indices while welding
+	std::vector<unsigned> hashTable;
+	// Map from old to new vertex indices
+	std::vector<unsigned> remap;
+	// Per vertex: first entry in vtxTris, number of remaining triangles,
+	// position in the cache and score
+	std::vector<unsigned> triStart, remaining;
+	std::vector<int> cachePos;
+	std::vector<float> score;
+	// Triangles using each vertex
+	std::vector<unsigned> vtxTris;
+	// Per triangle: has it been output, and its score
+	std::vector<bool> triAdded;
+	std::vector<float> triScore;
+	// Reordered indices
+	std::vector<unsigned> newIndices;
+	// Reordered vertices
+	std::vector<unsigned char> newVerts;
+};
+
+} // namespace geom
+} // namespace eihort
+
+#endif
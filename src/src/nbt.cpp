@@ -30,6 +30,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include "nbt.h"
 #include "endian.h"
+#include "memstats.h"
+#include "profile.h"
 
 namespace eihort {
 namespace nbt {
@@ -140,7 +142,10 @@ gzistream::gzistream( const char *fn, unsigned idx ) {
 	// Uncompress the data
 	uLongf bytesAvailable = 512*1024; // 512K buffer
 	data = (unsigned char*)malloc( bytesAvailable );
-	uncompress( data, &bytesAvailable, (unsigned char*)fileBuf, len-1 );
+	{
+		PROFILE_SCOPE( PROFILE_DECOMPRESS );
+		uncompress( data, &bytesAvailable, (unsigned char*)fileBuf, len-1 );
+	}
 	free( fileBuf );
 
 	bufferLeft = bytesAvailable;
@@ -180,13 +185,23 @@ public:
 	gzostream( const gzostream& ) = delete;
 	gzostream( gzostream&& ) = delete;
 	explicit gzostream( const char *fn )
+		: zbuffer(NULL)
 	{
-		// Only plain files supported for output (no MCRegion)
+		// Only plain files supported for direct output (no MCRegion)
 		out = gzopen( const_cast<char*>(fn), "wb" );
 	}
+	explicit gzostream( std::vector<unsigned char> &buffer )
+		: out(Z_NULL), zbuffer(&buffer) { }
 	~gzostream() {
 		if( out )
 			gzclose( out );
+		if( zbuffer ) {
+			// Compress everything at once, as a region file chunk
+			uLongf len = compressBound( (uLong)raw.size() );
+			zbuffer->resize( len );
+			compress( &(*zbuffer)[0], &len, raw.empty() ? NULL : &raw[0], (uLong)raw.size() );
+			zbuffer->resize( len );
+		}
 	}
 
 	// Write a character
@@ -198,11 +213,21 @@ public:
 	template< typename T >
 	void writei( T data ) { write(bswap_to_big(data)); }
 	// Write arbitrary date
-	void write( const void *src, size_t sz ) { gzwrite( out, src, (unsigned)sz ); }
+	void write( const void *src, size_t sz ) {
+		if( zbuffer ) {
+			raw.insert( raw.end(), (const unsigned char*)src, (const unsigned char*)src + sz );
+		} else {
+			gzwrite( out, src, (unsigned)sz );
+		}
+	}
 
 private:
 	// The compressed output file
 	gzFile out;
+	// The output buffer for zlib streams, or NULL when writing to a file
+	std::vector<unsigned char> *zbuffer;
+	// Uncompressed data waiting to be written to zbuffer
+	std::vector<unsigned char> raw;
 };
 
 
@@ -259,13 +284,11 @@ void nbtistream::readTagPayload( Tag &tag ) {
 	case TAG_Double:
 	case TAG_Long:   tag.data.l = readi<int64_t>(); break;
 	case TAG_Byte_Array:
-		tag.len = readi<uint32_t>();
-		tag.data.bytes = malloc( tag.len );
+		tag.allocPayload( readi<uint32_t>() );
 		read( tag.data.bytes, tag.len );
 		break;
 	case TAG_String:
-		tag.len = readi<int16_t>();
-		tag.data.str = (char*)malloc( tag.len );
+		tag.allocPayload( (uint16_t)readi<int16_t>() );
 		read( tag.data.str, tag.len );
 		break;
 	case TAG_List:
@@ -275,14 +298,12 @@ void nbtistream::readTagPayload( Tag &tag ) {
 		tag.data.comp = readCompound();
 		break;
 	case TAG_Int_Array:
-		tag.len = readi<uint32_t>();
-		tag.data.ia = new int[tag.len];
+		tag.allocPayload( readi<uint32_t>() );
 		for( unsigned i = 0; i < tag.len; i++ )
 			tag.data.ia[i] = readi<int32_t>();
 		break;
 	case TAG_Long_Array:
-		tag.len = readi<uint32_t>();
-		tag.data.il = new int64_t[tag.len];
+		tag.allocPayload( readi<uint32_t>() );
 		for( unsigned i = 0; i < tag.len; i++ )
 			tag.data.il[i] = readi<int64_t>();
 		break;
@@ -332,6 +353,8 @@ class nbtostream : public gzostream {
 public:
 	explicit nbtostream( const char *fn )
 		: gzostream(fn) { }
+	explicit nbtostream( std::vector<unsigned char> &buffer )
+		: gzostream(buffer) { }
 	~nbtostream() { }
 
 	// Write a named tag
@@ -425,6 +448,31 @@ void nbtostream::writeCompound( const Compound *comp ) {
 
 // ============================== NBT Management =============================
 
+void Tag::allocPayload( uint32_t length ) {
+	len = length;
+	switch( type ) {
+	case TAG_Byte_Array:
+		data.bytes = malloc( len );
+		memAlloc( MEM_NBT, len );
+		break;
+	case TAG_String:
+		data.str = new char[len];
+		memAlloc( MEM_NBT, len );
+		break;
+	case TAG_Int_Array:
+		data.ia = new int32_t[len];
+		memAlloc( MEM_NBT, len * sizeof(int32_t) );
+		break;
+	case TAG_Long_Array:
+		data.il = new int64_t[len];
+		memAlloc( MEM_NBT, len * sizeof(int64_t) );
+		break;
+	default:
+		assert( false );
+	}
+}
+
+// -----------------------------------------------------------------
 void Tag::destroyPayload() {
 	switch( type ) {
 	case TAG_End:
@@ -434,21 +482,27 @@ void Tag::destroyPayload() {
 	case TAG_Long:
 	case TAG_Float:
 	case TAG_Double: break;
-	case TAG_Byte_Array: free( data.bytes ); break;
-	case TAG_String:     delete[] data.str;  break;
-	case TAG_List:       delete   data.list; break;
-	case TAG_Compound:   delete   data.comp; break;
-	case TAG_Int_Array:  delete[] data.ia;   break;
-	case TAG_Long_Array: delete[] data.il;   break;
+	case TAG_Byte_Array: free( data.bytes ); memFree( MEM_NBT, len );                   break;
+	case TAG_String:     delete[] data.str;  memFree( MEM_NBT, len );                   break;
+	case TAG_List:       delete   data.list;                                            break;
+	case TAG_Compound:   delete   data.comp;                                            break;
+	case TAG_Int_Array:  delete[] data.ia;   memFree( MEM_NBT, len * sizeof(int32_t) ); break;
+	case TAG_Long_Array: delete[] data.il;   memFree( MEM_NBT, len * sizeof(int64_t) ); break;
 	default: assert( false );
 	}
 	type = TAG_Int;
 }
 
+// -----------------------------------------------------------------
+Compound::Compound() {
+	memAlloc( MEM_NBT, sizeof(Compound) );
+}
+
 // -----------------------------------------------------------------
 Compound::~Compound() {
 	for( iterator it = begin(); it != end(); ++it ) 
 		it->second.destroyPayload();
+	memFree( MEM_NBT, sizeof(Compound) );
 }
 
 // -----------------------------------------------------------------
@@ -475,6 +529,15 @@ void Compound::write( const char *filename, const std::string &outerName ) {
 	nbtOut.writeNamedTag( outerName, me );
 }
 
+// -----------------------------------------------------------------
+void Compound::writeCompressed( std::vector<unsigned char> &out, const std::string &outerName ) {
+	nbtostream nbtOut( out );
+	Tag me;
+	me.type = TAG_Compound;
+	me.data.comp = this;
+	nbtOut.writeNamedTag( outerName, me );
+}
+
 // -----------------------------------------------------------------
 void Compound::printReadable( std::ostream &out, const char *pre ) const {
 	if( size() == 0 ) {
@@ -545,10 +608,18 @@ void Compound::printReadable( std::ostream &out, const char *pre ) const {
 }
 
 
+// -----------------------------------------------------------------
+List::List( TagType type )
+: std::list<Tag>(), type(type)
+{
+	memAlloc( MEM_NBT, sizeof(List) );
+}
+
 // -----------------------------------------------------------------
 List::~List() {
 	for( iterator it = begin(); it != end(); ++it )
 		it->destroyPayload();
+	memFree( MEM_NBT, sizeof(List) );
 }
 
 
@@ -572,6 +643,7 @@ Compound *readNBT( const char *filename, std::string *outerName ) {
 Compound *readFromRegionFile( const char *filename, unsigned idx ) {
 	nbtistream is( filename, idx );
 	if( is.fileFound() ) {
+		PROFILE_SCOPE( PROFILE_NBT_PARSE );
 		Tag tag;
 		std::string name;
 		is.readNamedTag( name, tag );
@@ -27,6 +27,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <list>
 #include <map>
 #include <string>
+#include <vector>
 #include <iostream>
 #include "stdint.h"
 
@@ -84,6 +85,9 @@ struct Tag {
 	// The data type to be stored here
 	TagData data;
 
+	// Allocates the (uninitialized) payload of an array or string Tag
+	// of the given length; the type must already be set
+	void allocPayload( uint32_t length );
 	// Deletes any data associated with this Tag
 	void destroyPayload();
 	// Get the size of this data
@@ -94,7 +98,7 @@ class Compound : public std::map< std::string, Tag > {
 	// NBT Compound
 
 public:
-	Compound() { }
+	Compound();
 	~Compound();
 
 	// Does this Compound have a tag with the given name?
@@ -105,6 +109,8 @@ public:
 	void replaceTag( const std::string &tagName, const Tag &newTag );
 	// Writes the Compound to a file
 	void write( const char *filename, const std::string &outerName );
+	// Writes the Compound to a zlib stream, as stored in region files
+	void writeCompressed( std::vector<unsigned char> &out, const std::string &outerName );
 	// Stringifies this Compound in a nice way
 	void printReadable( std::ostream &out, const char *pre = "" ) const;
 };
@@ -113,8 +119,7 @@ class List : public std::list< Tag > {
 	// NBT List
 
 public:
-	inline List( TagType type )
-		: std::list<Tag>(), type(type) { }
+	explicit List( TagType type );
 	~List();
 
 	// Get the type of the objects in the list
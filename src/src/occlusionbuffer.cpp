@@ -0,0 +1,277 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <algorithm>
+#include <float.h>
+#include <math.h>
+#include <SDL_timer.h>
+#include "platform.h"
+#include "occlusionbuffer.h"
+
+#ifdef EIHORT_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace eihort {
+
+// Occluders are pushed back by this factor so that rounding never lets a
+// box hide itself or the boxes it touches
+static const float OCCLUDER_DEPTH_BIAS = 0.999f;
+// Tiles across the buffer
+static const unsigned TILES_X = OcclusionBuffer::WIDTH / OcclusionBuffer::TILE_SIZE;
+static const unsigned TILES_Y = OcclusionBuffer::HEIGHT / OcclusionBuffer::TILE_SIZE;
+
+// -----------------------------------------------------------------
+OcclusionBuffer::OcclusionBuffer()
+: enabled(true), active(false)
+, scaleX(1.0f), scaleY(1.0f), nearPlane(0.1f)
+, depth(WIDTH * HEIGHT, 0.0f), tileMin(TILES_X * TILES_Y, 0.0f)
+, nOccluders(0), rasterTime(0), nTests(0), nOccluded(0)
+{
+	for( unsigned i = 0; i < 3; i++ ) {
+		eyePos[i] = 0.0f;
+		for( unsigned j = 0; j < 4; j++ )
+			eyeRows[i][j] = 0.0f;
+	}
+}
+
+// -----------------------------------------------------------------
+void OcclusionBuffer::begin( const jMatrix *eyeMat, float tanX, float tanY, float nearPlane ) {
+	// The columns of eyeMat are the camera's axes in world space
+	const jVec3 *axes[3] = { &eyeMat->c1, &eyeMat->c2, &eyeMat->c3 };
+	for( unsigned i = 0; i < 3; i++ ) {
+		eyePos[i] = eyeMat->c4.v[i];
+		for( unsigned j = 0; j < 3; j++ )
+			eyeRows[i][j] = axes[i]->v[j];
+		eyeRows[i][3] = -jVec3Dot( axes[i], &eyeMat->c4 );
+	}
+	scaleX = (float)WIDTH / 2.0f / tanX;
+	scaleY = (float)HEIGHT / 2.0f / tanY;
+	this->nearPlane = nearPlane;
+
+	tris.clear();
+	active = false;
+	nOccluders = 0;
+	rasterTime = 0;
+	nTests = 0;
+	nOccluded = 0;
+}
+
+// -----------------------------------------------------------------
+bool OcclusionBuffer::projectBox( const Extents &ext, float *sx, float *sy, float *iw ) const {
+	float bmin[3] = { (float)ext.minx, (float)ext.miny, (float)ext.minz };
+	float bmax[3] = { (float)ext.maxx + 1.0f, (float)ext.maxy + 1.0f, (float)ext.maxz + 1.0f };
+	for( unsigned i = 0; i < 8; i++ ) {
+		float p[3] = { i & 1 ? bmax[0] : bmin[0], i & 2 ? bmax[1] : bmin[1], i & 4 ? bmax[2] : bmin[2] };
+		float ex, ey, ez;
+		toEye( p, ex, ey, ez );
+		if( ey < nearPlane )
+			return false;
+		iw[i] = 1.0f / ey;
+		sx[i] = (float)WIDTH / 2.0f + ex * scaleX * iw[i];
+		sy[i] = (float)HEIGHT / 2.0f - ez * scaleY * iw[i];
+	}
+	return true;
+}
+
+// -----------------------------------------------------------------
+bool OcclusionBuffer::addOccluder( const Extents &ext ) {
+	if( !enabled || tris.size() + 6 > MAX_TRIANGLES )
+		return false;
+
+	// Occluders reaching past the near plane are simply dropped
+	float sx[8], sy[8], iw[8];
+	if( !projectBox( ext, sx, sy, iw ) )
+		return false;
+
+	// Draw the (up to 3) faces which face the camera
+	float bmin[3] = { (float)ext.minx, (float)ext.miny, (float)ext.minz };
+	float bmax[3] = { (float)ext.maxx + 1.0f, (float)ext.maxy + 1.0f, (float)ext.maxz + 1.0f };
+	for( unsigned j = 0; j < 3; j++ ) {
+		unsigned side;
+		if( eyePos[j] < bmin[j] ) {
+			side = 0;
+		} else if( eyePos[j] > bmax[j] ) {
+			side = 1u << j;
+		} else {
+			continue;
+		}
+		unsigned u = 1u << ((j + 1) % 3), v = 1u << ((j + 2) % 3);
+		addTriangle( sx, sy, iw, side, side | u, side | u | v );
+		addTriangle( sx, sy, iw, side, side | u | v, side | v );
+	}
+	nOccluders++;
+	return true;
+}
+
+// -----------------------------------------------------------------
+void OcclusionBuffer::addTriangle( const float *sx, const float *sy, const float *iw, unsigned i0, unsigned i1, unsigned i2 ) {
+	float area = (sx[i1] - sx[i0]) * (sy[i2] - sy[i0]) - (sy[i1] - sy[i0]) * (sx[i2] - sx[i0]);
+	if( fabsf( area ) < 1e-4f )
+		return;
+	if( area < 0.0f ) {
+		std::swap( i1, i2 );
+		area = -area;
+	}
+
+	Triangle t;
+	t.minX = std::max( (int)floorf( std::min( std::min( sx[i0], sx[i1] ), sx[i2] ) ), 0 );
+	t.maxX = std::min( (int)ceilf( std::max( std::max( sx[i0], sx[i1] ), sx[i2] ) ), (int)WIDTH - 1 );
+	t.minY = std::max( (int)floorf( std::min( std::min( sy[i0], sy[i1] ), sy[i2] ) ), 0 );
+	t.maxY = std::min( (int)ceilf( std::max( std::max( sy[i0], sy[i1] ), sy[i2] ) ), (int)HEIGHT - 1 );
+	if( t.minX > t.maxX || t.minY > t.maxY )
+		return;
+
+	// Edge k runs between the two vertices other than vertex k, so that
+	// its function is proportional to vertex k's barycentric coordinate
+	unsigned idx[3] = { i0, i1, i2 };
+	for( unsigned k = 0; k < 3; k++ ) {
+		unsigned p = idx[(k + 1) % 3], q = idx[(k + 2) % 3];
+		t.a[k] = sy[p] - sy[q];
+		t.b[k] = sx[q] - sx[p];
+		t.c[k] = -(t.a[k] * sx[p] + t.b[k] * sy[p]);
+	}
+
+	// 1/w is affine in screen space
+	float inv = OCCLUDER_DEPTH_BIAS / area;
+	t.za = (t.a[0] * iw[i0] + t.a[1] * iw[i1] + t.a[2] * iw[i2]) * inv;
+	t.zb = (t.b[0] * iw[i0] + t.b[1] * iw[i1] + t.b[2] * iw[i2]) * inv;
+	t.zc = (t.c[0] * iw[i0] + t.c[1] * iw[i1] + t.c[2] * iw[i2]) * inv;
+	tris.push_back( t );
+}
+
+// -----------------------------------------------------------------
+void OcclusionBuffer::rasterize() {
+	if( !enabled || tris.empty() )
+		return;
+
+	Uint64 start = SDL_GetPerformanceCounter();
+	std::fill( depth.begin(), depth.end(), 0.0f );
+
+	for( auto it = tris.begin(); it != tris.end(); ++it ) {
+		const Triangle &t = *it;
+		// Pixels are drawn in groups of 4, starting on a multiple of 4
+		int x0 = t.minX & ~3;
+		for( int y = t.minY; y <= t.maxY; y++ ) {
+			float *row = &depth[y * WIDTH];
+			float py = (float)y + 0.5f;
+			float px = (float)x0 + 0.5f;
+#ifdef EIHORT_SSE
+			__m128 offs = _mm_setr_ps( 0.0f, 1.0f, 2.0f, 3.0f );
+			__m128 xs = _mm_add_ps( _mm_set1_ps( px ), offs );
+			__m128 e0 = _mm_add_ps( _mm_mul_ps( _mm_set1_ps( t.a[0] ), xs ), _mm_set1_ps( t.b[0] * py + t.c[0] ) );
+			__m128 e1 = _mm_add_ps( _mm_mul_ps( _mm_set1_ps( t.a[1] ), xs ), _mm_set1_ps( t.b[1] * py + t.c[1] ) );
+			__m128 e2 = _mm_add_ps( _mm_mul_ps( _mm_set1_ps( t.a[2] ), xs ), _mm_set1_ps( t.b[2] * py + t.c[2] ) );
+			__m128 z = _mm_add_ps( _mm_mul_ps( _mm_set1_ps( t.za ), xs ), _mm_set1_ps( t.zb * py + t.zc ) );
+			__m128 de0 = _mm_set1_ps( t.a[0] * 4.0f ), de1 = _mm_set1_ps( t.a[1] * 4.0f ), de2 = _mm_set1_ps( t.a[2] * 4.0f );
+			__m128 dz = _mm_set1_ps( t.za * 4.0f );
+			__m128 zero = _mm_setzero_ps();
+			for( int x = x0; x <= t.maxX; x += 4 ) {
+				__m128 inside = _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( e0, zero ), _mm_cmpge_ps( e1, zero ) ), _mm_cmpge_ps( e2, zero ) );
+				__m128 old = _mm_loadu_ps( row + x );
+				__m128 nearer = _mm_max_ps( old, z );
+				_mm_storeu_ps( row + x, _mm_or_ps( _mm_and_ps( inside, nearer ), _mm_andnot_ps( inside, old ) ) );
+				e0 = _mm_add_ps( e0, de0 );
+				e1 = _mm_add_ps( e1, de1 );
+				e2 = _mm_add_ps( e2, de2 );
+				z = _mm_add_ps( z, dz );
+			}
+#else
+			for( int x = x0; x <= t.maxX; x++, px += 1.0f ) {
+				if( t.a[0] * px + t.b[0] * py + t.c[0] >= 0.0f
+				 && t.a[1] * px + t.b[1] * py + t.c[1] >= 0.0f
+				 && t.a[2] * px + t.b[2] * py + t.c[2] >= 0.0f )
+					row[x] = std::max( row[x], t.za * px + t.zb * py + t.zc );
+			}
+#endif
+		}
+	}
+
+	// Find the farthest depth in each tile
+	for( unsigned ty = 0; ty < TILES_Y; ty++ ) {
+		for( unsigned tx = 0; tx < TILES_X; tx++ ) {
+			float farthest = FLT_MAX;
+			for( unsigned y = ty * TILE_SIZE; y < (ty + 1) * TILE_SIZE; y++ ) {
+				const float *row = &depth[y * WIDTH + tx * TILE_SIZE];
+				for( unsigned x = 0; x < TILE_SIZE; x++ )
+					farthest = std::min( farthest, row[x] );
+			}
+			tileMin[ty * TILES_X + tx] = farthest;
+		}
+	}
+
+	rasterTime = (unsigned)((SDL_GetPerformanceCounter() - start) * 1000000 / SDL_GetPerformanceFrequency());
+	active = true;
+}
+
+// -----------------------------------------------------------------
+bool OcclusionBuffer::isOccluded( const Extents &ext ) {
+	if( !active )
+		return false;
+	nTests++;
+
+	// Boxes reaching past the near plane are always visible
+	float sx[8], sy[8], iw[8];
+	if( !projectBox( ext, sx, sy, iw ) )
+		return false;
+
+	// Compare the nearest point of the box against the whole rectangle
+	// it covers on the screen, grown by a pixel to cover for occluder
+	// edges only being sampled at pixel centers
+	// (Gaps between occluders narrower than a pixel still go unseen)
+	float nearest = iw[0];
+	float minSx = sx[0], maxSx = sx[0], minSy = sy[0], maxSy = sy[0];
+	for( unsigned i = 1; i < 8; i++ ) {
+		nearest = std::max( nearest, iw[i] );
+		minSx = std::min( minSx, sx[i] );
+		maxSx = std::max( maxSx, sx[i] );
+		minSy = std::min( minSy, sy[i] );
+		maxSy = std::max( maxSy, sy[i] );
+	}
+	int x0 = std::max( (int)floorf( minSx ) - 1, 0 ), x1 = std::min( (int)floorf( maxSx ) + 1, (int)WIDTH - 1 );
+	int y0 = std::max( (int)floorf( minSy ) - 1, 0 ), y1 = std::min( (int)floorf( maxSy ) + 1, (int)HEIGHT - 1 );
+	if( x0 > x1 || y0 > y1 )
+		return false;
+
+	for( int ty = y0 / (int)TILE_SIZE; ty <= y1 / (int)TILE_SIZE; ty++ ) {
+		for( int tx = x0 / (int)TILE_SIZE; tx <= x1 / (int)TILE_SIZE; tx++ ) {
+			// Skip tiles which are entirely nearer than the box
+			if( tileMin[ty * TILES_X + tx] > nearest )
+				continue;
+			int py0 = std::max( y0, ty * (int)TILE_SIZE ), py1 = std::min( y1, (ty + 1) * (int)TILE_SIZE - 1 );
+			int px0 = std::max( x0, tx * (int)TILE_SIZE ), px1 = std::min( x1, (tx + 1) * (int)TILE_SIZE - 1 );
+			for( int y = py0; y <= py1; y++ ) {
+				const float *row = &depth[y * WIDTH];
+				for( int x = px0; x <= px1; x++ ) {
+					if( row[x] <= nearest )
+						return false;
+				}
+			}
+		}
+	}
+	nOccluded++;
+	return true;
+}
+
+} // namespace eihort
@@ -0,0 +1,134 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef OCCLUSIONBUFFER_H
+#define OCCLUSIONBUFFER_H
+
+#include <vector>
+#include "jmath.h"
+#include "worldmeshbuilder.h"
+
+namespace eihort {
+
+class OcclusionBuffer {
+	// A small depth buffer, drawn on the CPU, for culling hidden geometry
+	// Boxes of opaque blocks (occluders) are rasterized into the buffer at
+	// the start of the frame, and the bounding boxes of leaves and
+	// sections are tested against it before they are drawn or loaded
+	// Depth is stored as 1/w, so larger values are nearer
+	// The buffer is small enough to be drawn on the render thread; handing
+	// it to helper threads would make the frame wait on them
+
+public:
+	OcclusionBuffer( const OcclusionBuffer& ) = delete;
+	OcclusionBuffer( OcclusionBuffer&& ) = delete;
+	OcclusionBuffer();
+
+	// Size of the buffer, in pixels
+	static const unsigned WIDTH = 256, HEIGHT = 128;
+	// Size of the square tiles keeping the farthest depth of their pixels
+	static const unsigned TILE_SIZE = 8;
+	// Maximum number of triangles drawn in a frame
+	static const unsigned MAX_TRIANGLES = 16384;
+
+	// Turn occlusion culling on or off
+	inline void setEnabled( bool on ) { enabled = on; }
+	// Is occlusion culling turned on?
+	inline bool isEnabled() const { return enabled; }
+
+	// Start a new frame with the given camera, discarding all occluders
+	// tanX and tanY are the tangents of half the horizontal and vertical
+	// fields of view
+	void begin( const jMatrix *eyeMat, float tanX, float tanY, float nearPlane );
+	// Queue the front faces of a box of opaque blocks for drawing
+	// Returns false if the box was rejected (too close, or out of room)
+	bool addOccluder( const Extents &ext );
+	// Draw all queued occluders into the buffer
+	void rasterize();
+	// Is the box completely hidden behind the occluders?
+	bool isOccluded( const Extents &ext );
+
+	// Number of occluders drawn this frame
+	inline unsigned getOccluderCount() const { return nOccluders; }
+	// Number of triangles drawn this frame
+	inline unsigned getTriangleCount() const { return (unsigned)tris.size(); }
+	// Time taken to draw the occluders this frame, in microseconds
+	inline unsigned getRasterTime() const { return rasterTime; }
+	// Number of boxes tested this frame
+	inline unsigned getTestCount() const { return nTests; }
+	// Number of boxes found to be hidden this frame
+	inline unsigned getOccludedCount() const { return nOccluded; }
+
+private:
+	struct Triangle {
+		// A screen-space triangle set up for rasterization
+
+		// Edge functions: a*x + b*y + c >= 0 inside the triangle
+		float a[3], b[3], c[3];
+		// Plane of 1/w over the screen
+		float za, zb, zc;
+		// Bounding rectangle, in pixels (inclusive)
+		int minX, maxX, minY, maxY;
+	};
+
+	// Transform a point into eye space (x right, y forward, z up)
+	inline void toEye( const float *p, float &ex, float &ey, float &ez ) const {
+		ex = eyeRows[0][0]*p[0] + eyeRows[0][1]*p[1] + eyeRows[0][2]*p[2] + eyeRows[0][3];
+		ey = eyeRows[1][0]*p[0] + eyeRows[1][1]*p[1] + eyeRows[1][2]*p[2] + eyeRows[1][3];
+		ez = eyeRows[2][0]*p[0] + eyeRows[2][1]*p[1] + eyeRows[2][2]*p[2] + eyeRows[2][3];
+	}
+	// Project the 8 corners of a box onto the screen
+	// Corner i takes the maximum along axis j if bit j of i is set
+	// Returns false if any corner is closer than the near plane
+	bool projectBox( const Extents &ext, float *sx, float *sy, float *iw ) const;
+	// Set up a triangle for rasterization
+	void addTriangle( const float *sx, const float *sy, const float *iw, unsigned i0, unsigned i1, unsigned i2 );
+
+	// Is occlusion culling turned on?
+	bool enabled;
+	// Is there anything in the buffer to test against this frame?
+	bool active;
+	// Rows of the world to eye transform
+	float eyeRows[3][4];
+	// Camera position
+	float eyePos[3];
+	// Scale from eye-space x/y and z/y to pixels
+	float scaleX, scaleY;
+	// Distance of the near plane
+	float nearPlane;
+
+	// Depth of the nearest occluder at each pixel (as 1/w; 0 if none)
+	std::vector<float> depth;
+	// Depth of the farthest pixel in each tile
+	std::vector<float> tileMin;
+	// Triangles queued for drawing
+	std::vector<Triangle> tris;
+
+	// Statistics for the current frame
+	unsigned nOccluders, rasterTime, nTests, nOccluded;
+};
+
+} // namespace eihort
+
+#endif
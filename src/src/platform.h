@@ -38,6 +38,18 @@ T shift_right( T what, unsigned how_far ) {
 
 #define MAX_WORKERS 64
 
+// Thread-local storage for plain data
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// 4-wide SSE code paths (culling)
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define EIHORT_SSE
+#endif
+
 #ifdef _WINDOWS
 #define WINDOWS_LEAN_AND_MEAN
 #include <windows.h>
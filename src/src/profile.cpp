@@ -0,0 +1,163 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <algorithm>
+#include <SDL_atomic.h>
+
+#include "platform.h"
+#include "profile.h"
+
+namespace eihort {
+
+// Histograms have 4 linear buckets per power of two, from 1 tick to 2^32
+// ticks; longer samples are clamped into the last bucket
+static const unsigned PROFILE_BUCKETS = 124;
+// Slots for threads' histograms; any threads beyond this share the last one
+static const unsigned PROFILE_MAX_THREADS = MAX_WORKERS + 8;
+
+struct ProfileThreadData {
+	// Histograms recorded by a single thread
+	// All counters are atomic so that they can be read while being
+	// written, and so that the last slot can be shared
+
+	// Sample counts per bucket
+	SDL_atomic_t buckets[PROFILE_PROBE_COUNT][PROFILE_BUCKETS];
+	// Longest sample, in ticks
+	SDL_atomic_t max[PROFILE_PROBE_COUNT];
+};
+
+// Histogram storage for all threads
+static ProfileThreadData g_profileThreads[PROFILE_MAX_THREADS];
+// Number of slots handed out so far
+static SDL_atomic_t g_profileThreadCount;
+// The slot of the current thread
+static THREAD_LOCAL ProfileThreadData *g_threadProfile = NULL;
+
+// Names of the probes, as reported to Lua
+static const char *const g_probeNames[PROFILE_PROBE_COUNT] = {
+	"readChunk",
+	"decompress",
+	"nbtParse",
+	"loadChunk",
+	"meshLighting",
+	"meshIslands",
+	"meshTriangulate",
+	"meshFinalize",
+	"meshUpload",
+	"renderList",
+	"leafQueue",
+	"leafChunks",
+	"leafMesh",
+	"leafUploadWait",
+	"leafDrawWait",
+	"leafVisible"
+};
+
+// -----------------------------------------------------------------
+static unsigned getBucket( Uint32 ticks ) {
+	if( ticks < 4 )
+		return ticks;
+	unsigned msb = 2;
+	while( msb < 31 && (ticks >> (msb + 1)) )
+		msb++;
+	return ((msb - 1) << 2) + ((ticks >> (msb - 2)) & 3);
+}
+
+// -----------------------------------------------------------------
+static double getBucketMidpoint( unsigned bucket ) {
+	if( bucket < 4 )
+		return (double)bucket;
+	unsigned msb = (bucket >> 2) + 1;
+	double width = (double)(1u << (msb - 2));
+	return (double)(4 + (bucket & 3)) * width + width * 0.5;
+}
+
+// -----------------------------------------------------------------
+void profileRecord( ProfileProbe probe, Uint64 ticks ) {
+	ProfileThreadData *data = g_threadProfile;
+	if( !data ) {
+		unsigned slot = (unsigned)SDL_AtomicAdd( &g_profileThreadCount, 1 );
+		data = g_threadProfile = &g_profileThreads[slot < PROFILE_MAX_THREADS ? slot : PROFILE_MAX_THREADS - 1];
+	}
+
+	Uint32 t = ticks > 0xffffffffu ? 0xffffffffu : (Uint32)ticks;
+	SDL_AtomicAdd( &data->buckets[probe][getBucket( t )], 1 );
+	int prevMax = SDL_AtomicGet( &data->max[probe] );
+	while( t > (Uint32)prevMax && !SDL_AtomicCAS( &data->max[probe], prevMax, (int)t ) )
+		prevMax = SDL_AtomicGet( &data->max[probe] );
+}
+
+// -----------------------------------------------------------------
+void profileSummarize( ProfileProbe probe, ProfileSummary &out ) {
+	unsigned nThreads = std::min( (unsigned)SDL_AtomicGet( &g_profileThreadCount ), PROFILE_MAX_THREADS );
+	unsigned counts[PROFILE_BUCKETS] = { 0 };
+	Uint32 maxTicks = 0;
+	out.count = 0;
+	for( unsigned i = 0; i < nThreads; i++ ) {
+		for( unsigned b = 0; b < PROFILE_BUCKETS; b++ ) {
+			unsigned n = (unsigned)SDL_AtomicGet( &g_profileThreads[i].buckets[probe][b] );
+			counts[b] += n;
+			out.count += n;
+		}
+		maxTicks = std::max( maxTicks, (Uint32)SDL_AtomicGet( &g_profileThreads[i].max[probe] ) );
+	}
+
+	// Find the buckets holding the percentiles
+	double usPerTick = 1000000.0 / (double)SDL_GetPerformanceFrequency();
+	unsigned p50Rank = (out.count + 1) / 2;
+	unsigned p99Rank = out.count - out.count / 100;
+	unsigned seen = 0;
+	out.p50 = out.p99 = 0.0;
+	for( unsigned b = 0; b < PROFILE_BUCKETS && seen < p99Rank; b++ ) {
+		if( seen < p50Rank && seen + counts[b] >= p50Rank )
+			out.p50 = getBucketMidpoint( b ) * usPerTick;
+		seen += counts[b];
+		if( seen >= p99Rank )
+			out.p99 = getBucketMidpoint( b ) * usPerTick;
+	}
+	out.max = (double)maxTicks * usPerTick;
+
+	// The midpoint of the last bucket may lie past the longest sample
+	out.p50 = std::min( out.p50, out.max );
+	out.p99 = std::min( out.p99, out.max );
+}
+
+// -----------------------------------------------------------------
+void profileReset() {
+	for( unsigned i = 0; i < PROFILE_MAX_THREADS; i++ ) {
+		for( unsigned p = 0; p < PROFILE_PROBE_COUNT; p++ ) {
+			for( unsigned b = 0; b < PROFILE_BUCKETS; b++ )
+				SDL_AtomicSet( &g_profileThreads[i].buckets[p][b], 0 );
+			SDL_AtomicSet( &g_profileThreads[i].max[p], 0 );
+		}
+	}
+}
+
+// -----------------------------------------------------------------
+const char *getProfileProbeName( ProfileProbe probe ) {
+	return g_probeNames[probe];
+}
+
+} // namespace eihort
+
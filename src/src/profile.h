@@ -0,0 +1,130 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <SDL_timer.h>
+
+/*
+Lightweight timers for the loading, meshing and rendering hot paths.
+Each thread records into its own log-linear histograms without taking any
+locks, and profileSummarize() merges them on request.
+Building with NO_PROFILE compiles all probes out.
+*/
+
+namespace eihort {
+
+enum ProfileProbe {
+	// Stages timed by the profiler
+
+	// MCRegionMap::readChunk, including decompression and parsing
+	PROFILE_READ_CHUNK,
+	// Decompression of one chunk from a region file
+	PROFILE_DECOMPRESS,
+	// Parsing the NBT of one chunk
+	PROFILE_NBT_PARSE,
+	// Conversion of a chunk's NBT into block arrays
+	PROFILE_LOAD_CHUNK,
+	// Lighting of one mesh section
+	PROFILE_MESH_LIGHTING,
+	// Island generation of one mesh section, including triangulation
+	PROFILE_MESH_ISLANDS,
+	// One call to Triangle
+	PROFILE_MESH_TRIANGULATE,
+	// Finalizing the geometry clusters of one mesh section
+	PROFILE_MESH_FINALIZE,
+	// Uploading one leaf's WorldMesh
+	PROFILE_MESH_UPLOAD,
+	// One generateRenderList pass over the qtree
+	PROFILE_RENDER_LIST,
+	// Time a leaf waited for a worker after generateRenderList wanted it
+	PROFILE_LEAF_QUEUE,
+	// Time a leaf's build spent reading and decoding chunks
+	PROFILE_LEAF_CHUNKS,
+	// The rest of a leaf's build: meshing and staging
+	PROFILE_LEAF_MESH,
+	// Time a built leaf waited to be uploaded
+	PROFILE_LEAF_UPLOAD_WAIT,
+	// Time from a leaf's upload to its first draw
+	PROFILE_LEAF_DRAW_WAIT,
+	// Time from generateRenderList wanting a leaf to its first draw
+	PROFILE_LEAF_VISIBLE,
+
+	PROFILE_PROBE_COUNT
+};
+
+struct ProfileSummary {
+	// Merged statistics for one probe, with times in microseconds
+
+	// Number of samples recorded
+	unsigned count;
+	// Median and 99th percentile, to within the histogram's resolution
+	double p50, p99;
+	// Longest sample
+	double max;
+};
+
+// Record one sample of the given length, in performance counter ticks
+void profileRecord( ProfileProbe probe, Uint64 ticks );
+// Merge all threads' histograms for a probe
+void profileSummarize( ProfileProbe probe, ProfileSummary &out );
+// Clear all recorded samples
+void profileReset();
+// Get the name under which a probe is reported
+const char *getProfileProbeName( ProfileProbe probe );
+
+class ProfileScope {
+	// Records the time between its construction and destruction
+
+public:
+	explicit ProfileScope( ProfileProbe probe )
+		: probe(probe), start(SDL_GetPerformanceCounter()) { }
+	~ProfileScope() { profileRecord( probe, SDL_GetPerformanceCounter() - start ); }
+
+private:
+	// The probe to record into
+	ProfileProbe probe;
+	// Time at construction
+	Uint64 start;
+};
+
+} // namespace eihort
+
+#ifdef NO_PROFILE
+#define PROFILE_SCOPE( probe )
+#define PROFILE_NOW() ((Uint64)0)
+#define PROFILE_RECORD( probe, ticks ) ((void)(ticks))
+#else
+#define PROFILE_CONCAT_( a, b ) a##b
+#define PROFILE_CONCAT( a, b ) PROFILE_CONCAT_( a, b )
+// Time the rest of the enclosing block
+#define PROFILE_SCOPE( probe ) eihort::ProfileScope PROFILE_CONCAT( profileScope, __LINE__ )( eihort::probe )
+// Read the clock, for stages split across several pieces of code
+#define PROFILE_NOW() SDL_GetPerformanceCounter()
+// Record a sample measured with PROFILE_NOW
+#define PROFILE_RECORD( probe, ticks ) eihort::profileRecord( eihort::probe, ticks )
+#endif
+
+#endif // PROFILE_H
@@ -0,0 +1,178 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <cstdio>
+#include <vector>
+#include <SDL_atomic.h>
+
+#include "platform.h"
+#include "trace.h"
+
+namespace eihort {
+
+// Events kept per thread; must be a power of two
+static const unsigned TRACE_RING_EVENTS = 16384;
+// Threads which can record events; any further threads are not traced
+static const unsigned TRACE_MAX_THREADS = MAX_WORKERS + 8;
+
+struct TraceEvent {
+	// One complete event
+
+	// Performance counter times at the start and end of the event
+	Uint64 start, end;
+	// Name of the event
+	const char *name;
+	// Names of the arguments, or NULL if unused
+	const char *argNames[2];
+	// Values of the arguments
+	int args[2];
+};
+
+struct TraceThread {
+	// Event ring of a single thread
+	// Only the owning thread writes to it; traceDump reads it concurrently
+	// and discards anything that may have been overwritten meanwhile
+
+	// Total number of events ever written to the ring
+	SDL_atomic_t head;
+	// Name of the thread
+	const char *name;
+	// The ring itself, indexed by event number modulo TRACE_RING_EVENTS
+	TraceEvent events[TRACE_RING_EVENTS];
+};
+
+volatile bool g_traceEnabled = false;
+
+// Time of the first traceEnable, which becomes 0 in the trace
+static Uint64 g_traceOrigin = 0;
+// Rings of all threads which have recorded events
+static void *g_traceThreads[TRACE_MAX_THREADS];
+// Number of slots handed out so far
+static SDL_atomic_t g_traceThreadCount;
+// The ring of the current thread
+static THREAD_LOCAL TraceThread *g_threadTrace = NULL;
+// Set when the current thread could not get a ring
+static THREAD_LOCAL bool g_threadUntraced = false;
+// Name given to the current thread
+static THREAD_LOCAL const char *g_threadTraceName = NULL;
+
+// -----------------------------------------------------------------
+void traceEnable( bool enable ) {
+	if( enable && !g_traceOrigin )
+		g_traceOrigin = SDL_GetPerformanceCounter();
+	g_traceEnabled = enable;
+}
+
+// -----------------------------------------------------------------
+void traceSetThreadName( const char *name ) {
+	g_threadTraceName = name;
+	if( g_threadTrace )
+		g_threadTrace->name = name;
+}
+
+// -----------------------------------------------------------------
+void traceRecord( const char *name, Uint64 start, const char *arg0Name, int arg0, const char *arg1Name, int arg1 ) {
+	Uint64 end = SDL_GetPerformanceCounter();
+	TraceThread *thread = g_threadTrace;
+	if( !thread ) {
+		if( g_threadUntraced )
+			return;
+
+		// First event on this thread
+		unsigned slot = (unsigned)SDL_AtomicAdd( &g_traceThreadCount, 1 );
+		if( slot >= TRACE_MAX_THREADS ) {
+			g_threadUntraced = true;
+			return;
+		}
+		thread = g_threadTrace = new TraceThread;
+		SDL_AtomicSet( &thread->head, 0 );
+		thread->name = g_threadTraceName;
+		SDL_AtomicSetPtr( &g_traceThreads[slot], thread );
+	}
+
+	unsigned head = (unsigned)SDL_AtomicGet( &thread->head );
+	TraceEvent &e = thread->events[head & (TRACE_RING_EVENTS - 1)];
+	e.start = start;
+	e.end = end;
+	e.name = name;
+	e.argNames[0] = arg0Name;
+	e.argNames[1] = arg1Name;
+	e.args[0] = arg0;
+	e.args[1] = arg1;
+	SDL_AtomicSet( &thread->head, (int)(head + 1) );
+}
+
+// -----------------------------------------------------------------
+bool traceDump( const char *filename ) {
+	FILE *f = fopen( filename, "w" );
+	if( !f )
+		return false;
+
+	fprintf( f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+	fprintf( f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Eihort\"}}" );
+
+	unsigned nThreads = (unsigned)SDL_AtomicGet( &g_traceThreadCount );
+	if( nThreads > TRACE_MAX_THREADS )
+		nThreads = TRACE_MAX_THREADS;
+	double usPerTick = 1000000.0 / (double)SDL_GetPerformanceFrequency();
+	std::vector<TraceEvent> events;
+	for( unsigned i = 0; i < nThreads; i++ ) {
+		TraceThread *thread = (TraceThread*)SDL_AtomicGetPtr( &g_traceThreads[i] );
+		if( !thread )
+			continue;
+		unsigned tid = i + 1;
+
+		// Copy the ring, then throw away anything the thread may have
+		// overwritten while it was being copied
+		unsigned head = (unsigned)SDL_AtomicGet( &thread->head );
+		unsigned first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+		events.clear();
+		for( unsigned j = first; j < head; j++ )
+			events.push_back( thread->events[j & (TRACE_RING_EVENTS - 1)] );
+		unsigned newHead = (unsigned)SDL_AtomicGet( &thread->head );
+		unsigned skip = newHead - first >= TRACE_RING_EVENTS ? newHead - first - TRACE_RING_EVENTS + 1 : 0;
+
+		fprintf( f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+		         tid, thread->name ? thread->name : "Unnamed" );
+		for( unsigned j = skip; j < events.size(); j++ ) {
+			const TraceEvent &e = events[j];
+			fprintf( f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+			         e.name, tid, (double)(e.start - g_traceOrigin) * usPerTick, (double)(e.end - e.start) * usPerTick );
+			if( e.argNames[0] ) {
+				fprintf( f, ",\"args\":{\"%s\":%d", e.argNames[0], e.args[0] );
+				if( e.argNames[1] )
+					fprintf( f, ",\"%s\":%d", e.argNames[1], e.args[1] );
+				fputc( '}', f );
+			}
+			fputc( '}', f );
+		}
+	}
+
+	fprintf( f, "\n]}\n" );
+	bool ok = !ferror( f );
+	fclose( f );
+	return ok;
+}
+
+} // namespace eihort
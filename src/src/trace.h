@@ -0,0 +1,107 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <SDL_mutex.h>
+#include <SDL_timer.h>
+
+/*
+Opt-in timeline tracer for the worker, scanner and render threads.
+Each thread records complete events (a name, a start time, a duration and up
+to two integer arguments) into its own ring buffer without taking any locks.
+traceDump() writes every thread's ring out as Chrome trace_event JSON, which
+can be opened in Perfetto or chrome://tracing.
+Event and argument names must be string literals, since only the pointers
+are stored. Building with NO_PROFILE compiles all probes out.
+*/
+
+namespace eihort {
+
+// Whether events are currently being recorded
+extern volatile bool g_traceEnabled;
+
+// Start or stop recording events
+void traceEnable( bool enable );
+// Name the calling thread in the trace
+// The name must outlive the thread
+void traceSetThreadName( const char *name );
+// Record an event which started at the given performance counter time
+// and ends now
+void traceRecord( const char *name, Uint64 start,
+                  const char *arg0Name = NULL, int arg0 = 0,
+                  const char *arg1Name = NULL, int arg1 = 0 );
+// Write all recorded events to a JSON file
+bool traceDump( const char *filename );
+
+class TraceScope {
+	// Records an event spanning its construction and destruction
+
+public:
+	explicit TraceScope( const char *name,
+	                     const char *arg0Name = NULL, int arg0 = 0,
+	                     const char *arg1Name = NULL, int arg1 = 0 )
+		: name(g_traceEnabled ? name : NULL), arg0Name(arg0Name), arg1Name(arg1Name), arg0(arg0), arg1(arg1)
+		, start(this->name ? SDL_GetPerformanceCounter() : 0) { }
+	~TraceScope() {
+		if( name )
+			traceRecord( name, start, arg0Name, arg0, arg1Name, arg1 );
+	}
+
+private:
+	// Name of the event, or NULL if tracing was off at construction
+	const char *name;
+	// Names of the arguments
+	const char *arg0Name, *arg1Name;
+	// Values of the arguments
+	int arg0, arg1;
+	// Time at construction
+	Uint64 start;
+};
+
+} // namespace eihort
+
+#ifdef NO_PROFILE
+#define TRACE_SCOPE( name )
+#define TRACE_SCOPE2( name, arg0Name, arg0, arg1Name, arg1 )
+#define TRACE_NOW() ((Uint64)0)
+#define TRACE_RECORD( name, start ) ((void)(start))
+#else
+#define TRACE_CONCAT_( a, b ) a##b
+#define TRACE_CONCAT( a, b ) TRACE_CONCAT_( a, b )
+// Trace the rest of the enclosing block
+#define TRACE_SCOPE( name ) eihort::TraceScope TRACE_CONCAT( traceScope, __LINE__ )( name )
+// Trace the rest of the enclosing block, tagged with two integer arguments
+#define TRACE_SCOPE2( name, arg0Name, arg0, arg1Name, arg1 ) eihort::TraceScope TRACE_CONCAT( traceScope, __LINE__ )( name, arg0Name, arg0, arg1Name, arg1 )
+// Read the clock, for events split across several pieces of code
+#define TRACE_NOW() (eihort::g_traceEnabled ? SDL_GetPerformanceCounter() : (Uint64)0)
+// Record an event started with TRACE_NOW
+#define TRACE_RECORD( name, start ) do { Uint64 traceStart_ = (start); if( traceStart_ && eihort::g_traceEnabled ) eihort::traceRecord( name, traceStart_ ); } while( 0 )
+#endif
+
+// Lock a mutex, tracing the time spent waiting for it
+#define TRACE_MUTEXP( mutex, name ) do { TRACE_SCOPE( name ); SDL_mutexP( mutex ); } while( 0 )
+
+#endif // TRACE_H
@@ -23,10 +23,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 
 #include "worker.h"
+#include "trace.h"
 #include <iostream>
 
 #include <SDL_thread.h>
 #include <SDL_mutex.h>
+#include <SDL_timer.h>
 
 #ifdef _WINDOWS
 #include <windows.h>
@@ -41,6 +43,7 @@ Worker::Worker()
 	queueLock = SDL_CreateMutex();
 
 	endWorker = false;
+	SDL_AtomicSet( &busyMs, 0 );
 	thread = SDL_CreateThread( workerFunc, "Eihort Worker", this );
 }
 
@@ -89,11 +92,15 @@ int Worker::workerFunc( void *worker_ ) {
 
 
 	Worker *worker = (Worker*)worker_;
+	traceSetThreadName( "Worker" );
 
 	// Main loop
 	while( !worker->endWorker ) {
 		// Wait for work
-		SDL_SemWait( worker->workToDo );
+		{
+			TRACE_SCOPE( "waitForWork" );
+			SDL_SemWait( worker->workToDo );
+		}
 
 		// Get the work
 		SDL_LockMutex( worker->queueLock );
@@ -102,7 +109,9 @@ int Worker::workerFunc( void *worker_ ) {
 		SDL_UnlockMutex( worker->queueLock );
 
 		// Do the work
+		Uint32 start = SDL_GetTicks();
 		t.exec( t.cookie );
+		SDL_AtomicAdd( &worker->busyMs, (int)(SDL_GetTicks() - start) );
 	}
 
 	// Cleanup
@@ -27,6 +27,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <list>
 #include <SDL_mutex.h>
 #include <SDL_thread.h>
+#include <SDL_atomic.h>
 
 namespace eihort {
 
@@ -43,6 +44,8 @@ public:
 	void doTask( Executor exec, void *cookie );
 	// Kill the worker thread after it completes its tasks
 	void killWorker();
+	// Total time spent running tasks, in milliseconds
+	unsigned getBusyTime() { return (unsigned)SDL_AtomicGet( &busyMs ); }
 
 private:
 	~Worker();
@@ -69,6 +72,8 @@ private:
 	SDL_mutex *queueLock;
 	// Termination flag
 	bool endWorker;
+	// Time spent running tasks so far, in milliseconds
+	SDL_atomic_t busyMs;
 };
 
 } // namespace
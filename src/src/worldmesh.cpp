@@ -28,18 +28,41 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include "worldmeshbuilder.h"
 #include "worldmesh.h"
 #include "geombase.h"
+#include "geomsolid.h"
 #include "mcbiome.h"
 #include "mcblockdesc.h"
+#include "occlusionbuffer.h"
+#include "profile.h"
 
 namespace eihort {
 
 // ============================ WorldMeshSection =============================
 
-WorldMeshSection::WorldMeshSection( const WorldMeshSectionData &data )
+#ifndef VERTEX_LIGHTING
+// -----------------------------------------------------------------
+static const uint8_t *expandLighting( const uint8_t *packed, unsigned count ) {
+	// GL has no packed 4:4 byte format to upload from, so the packed
+	// (block, sky) nibbles are spread into bytes for GL_LUMINANCE_ALPHA
+	// Sections are only uploaded from the main thread, so the buffer is shared
+	static std::vector<uint8_t> expanded;
+	if( expanded.size() < 2u * count )
+		expanded.resize( 2u * count );
+	uint8_t *out = &expanded[0];
+	for( unsigned i = 0; i < count; i++ ) {
+		*out++ = (uint8_t)(packed[i] << 4);
+		*out++ = (uint8_t)(packed[i] & 0xf0);
+	}
+	return &expanded[0];
+}
+#endif
+
+WorldMeshSection::WorldMeshSection( const WorldMeshSectionData &data, GpuResidency *gpu )
 : biomeSrc(data.biomeSrc), lightTex(0), meta(NULL)
-, opaqueEnd(0), transpEnd(0), vtx_vbo(0), idx_vbo(0)
-, vtxMem(0), idxMem(0), texMem(0)
+, opaqueEnd(0), transpEnd(0)
+, gpu(gpu), vtxRange(NULL), idxRange(NULL)
 {
+	for( unsigned i = 0; i < GpuResidency::N_CATEGORIES; i++ )
+		gpuMem[i] = 0;
 	opaqueEnd = data.opaqueEnd;
 	transpEnd = data.transpEnd;
 
@@ -48,20 +71,17 @@ WorldMeshSection::WorldMeshSection( const WorldMeshSectionData &data )
 		meta = malloc( data.metaStream.getVertSize() );
 		memcpy( meta, data.metaStream.getVertices(), data.metaStream.getVertSize() );
 
-		// Generate and upload the vertex and index VBOs
-		glGenBuffers( 1, &vtx_vbo );
-		glBindBuffer( GL_ARRAY_BUFFER, vtx_vbo );
-		glBufferData( GL_ARRAY_BUFFER, data.vtxStream.getVertSize(), data.vtxStream.getVertices(), GL_STATIC_DRAW );
-		vtxMem += data.vtxStream.getVertSize();
-
-		glGenBuffers( 1, &idx_vbo );
-		glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, idx_vbo );
-		glBufferData( GL_ELEMENT_ARRAY_BUFFER, data.idxStream.getVertSize(), data.idxStream.getVertices(), GL_STATIC_DRAW );
-		idxMem += data.idxStream.getVertSize();
+		// Upload the vertices and indices into the shared buffers
+		// If the worker already staged them, this only queues GPU copies
+		vtxRange = gpu->getVertexPool().alloc( data.vtxStream.getVertSize() );
+		gpu->getStaging().upload( vtxRange, data.vtxStaged, data.vtxStagingOffset, data.vtxStream.getVertices() );
+		gpuMem[GpuResidency::VERTICES] = GpuBufferPool::getBlockSize( vtxRange->size );
 
-		glBindBuffer( GL_ARRAY_BUFFER, 0 );
-		glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+		idxRange = gpu->getIndexPool().alloc( data.idxStream.getVertSize() );
+		gpu->getStaging().upload( idxRange, data.idxStaged, data.idxStagingOffset, data.idxStream.getVertices() );
+		gpuMem[GpuResidency::INDICES] = GpuBufferPool::getBlockSize( idxRange->size );
 
+#ifndef VERTEX_LIGHTING
 		// Generate and upload the lighting texture
 		glGenTextures( 1, &lightTex );
 		glEnable( GL_TEXTURE_3D );
@@ -76,19 +96,22 @@ WorldMeshSection::WorldMeshSection( const WorldMeshSectionData &data )
 
 		glTexParameteri( GL_TEXTURE_3D, GL_GENERATE_MIPMAP, GL_FALSE ); 
 
-		glTexImage3D( GL_TEXTURE_3D, 0, GL_LUMINANCE4_ALPHA4, data.ltSzX, data.ltSzY, data.ltSzZ, 0, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, data.lightingTex.data() );
-		texMem += data.ltSzX * data.ltSzY * data.ltSzZ;
+		unsigned texels = unsigned(data.ltSzX * data.ltSzY * data.ltSzZ);
+		glTexImage3D( GL_TEXTURE_3D, 0, GL_LUMINANCE4_ALPHA4, data.ltSzX, data.ltSzY, data.ltSzZ, 0, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, expandLighting( data.lightingTex.get(), texels ) );
+		gpuMem[GpuResidency::LIGHT_TEXTURES] = texels;
+		gpu->addTextureBytes( GpuResidency::LIGHT_TEXTURES, texels );
 
 		glDisable( GL_TEXTURE_3D );
 		glBindTexture( GL_TEXTURE_3D, 0 );
+#endif
 
 		// Generate and upload the biome textures
 		biomeSrc = data.biomeSrc;
-		texMem += biomeSrc->finalizeBiomeTextures( data.biomeCoords, unsigned(data.ltSzX), unsigned(data.ltSzY), &biomeTex[0] );
+		gpuMem[GpuResidency::BIOME_TEXTURES] = biomeSrc->finalizeBiomeTextures( data.biomeCoords, unsigned(data.ltSzX), unsigned(data.ltSzY), &biomeTex[0] );
+		gpu->addTextureBytes( GpuResidency::BIOME_TEXTURES, gpuMem[GpuResidency::BIOME_TEXTURES] );
 	} else {
 		// Empty mesh
 		meta = NULL;
-		cost = 0;
 
 		biomeSrc = NULL;
 		biomeTex[0] = 0;
@@ -96,9 +119,12 @@ WorldMeshSection::WorldMeshSection( const WorldMeshSectionData &data )
 		biomeTex[2] = 0;
 	}
 
+	hull = data.hull;
+	occluded = false;
 	origin[0] = data.origin[0];
 	origin[1] = data.origin[1];
 	origin[2] = data.origin[2];
+	scale = (double)(1u << data.lod);
 	lightTexScale[0] = (1.0/16.0) / data.ltSzX;
 	lightTexScale[1] = (1.0/16.0) / data.ltSzY;
 	lightTexScale[2] = (1.0/16.0) / data.ltSzZ;
@@ -106,15 +132,19 @@ WorldMeshSection::WorldMeshSection( const WorldMeshSectionData &data )
 
 // -----------------------------------------------------------------
 WorldMeshSection::~WorldMeshSection() {
-	if( lightTex )
+	if( lightTex ) {
 		glDeleteTextures( 1, &lightTex );
+		gpu->removeTextureBytes( GpuResidency::LIGHT_TEXTURES, gpuMem[GpuResidency::LIGHT_TEXTURES] );
+	}
 
-	if( biomeSrc )
+	if( biomeSrc ) {
 		biomeSrc->freeBiomeTextures( &biomeTex[0] );
+		gpu->removeTextureBytes( GpuResidency::BIOME_TEXTURES, gpuMem[GpuResidency::BIOME_TEXTURES] );
+	}
 
 	if( meta ) {
-		glDeleteBuffers( 1, &vtx_vbo );
-		glDeleteBuffers( 1, &idx_vbo );
+		gpu->getVertexPool().free( vtxRange );
+		gpu->getIndexPool().free( idxRange );
 		free( meta );
 	}
 }
@@ -125,12 +155,12 @@ void WorldMeshSection::renderOpaque( geom::RenderContext *ctx ) {
 		beginRender( ctx );
 		jVec3 oldViewPos;
 		jVec3Copy( &oldViewPos, &ctx->viewPos );
-		ctx->viewPos.x -= (float)origin[0];
-		ctx->viewPos.y -= (float)origin[1];
-		ctx->viewPos.z -= (float)origin[2];
-		ctx->vertexSize += vtxMem;
-		ctx->indexSize += idxMem;
-		ctx->texSize += texMem;
+		ctx->viewPos.x = (ctx->viewPos.x - (float)origin[0]) / (float)scale;
+		ctx->viewPos.y = (ctx->viewPos.y - (float)origin[1]) / (float)scale;
+		ctx->viewPos.z = (ctx->viewPos.z - (float)origin[2]) / (float)scale;
+		ctx->vertexSize += gpuMem[GpuResidency::VERTICES];
+		ctx->indexSize += gpuMem[GpuResidency::INDICES];
+		ctx->texSize += gpuMem[GpuResidency::LIGHT_TEXTURES] + gpuMem[GpuResidency::BIOME_TEXTURES];
 		
 		unsigned char *cursor = (unsigned char*)meta;
 		unsigned char *end = cursor + opaqueEnd;
@@ -141,6 +171,10 @@ void WorldMeshSection::renderOpaque( geom::RenderContext *ctx ) {
 			mesh->geom->render( (void*&)cursor, ctx );
 		} while( cursor < end );
 
+		// Draw the solid faces collected from this section
+		if( ctx->solidBatch )
+			ctx->solidBatch->flush( ctx );
+
 		jVec3Copy( &ctx->viewPos, &oldViewPos );
 		endRender();
 	}
@@ -152,9 +186,9 @@ void WorldMeshSection::renderTransparent( geom::RenderContext *ctx ) {
 		beginRender( ctx );
 		jVec3 oldViewPos;
 		jVec3Copy( &oldViewPos, &ctx->viewPos );
-		ctx->viewPos.x -= (float)origin[0];
-		ctx->viewPos.y -= (float)origin[1];
-		ctx->viewPos.z -= (float)origin[2];
+		ctx->viewPos.x = (ctx->viewPos.x - (float)origin[0]) / (float)scale;
+		ctx->viewPos.y = (ctx->viewPos.y - (float)origin[1]) / (float)scale;
+		ctx->viewPos.z = (ctx->viewPos.z - (float)origin[2]) / (float)scale;
 		
 		unsigned char *cursor = (unsigned char*)meta;
 		unsigned char *end = cursor + transpEnd;
@@ -175,15 +209,20 @@ void WorldMeshSection::renderTransparent( geom::RenderContext *ctx ) {
 // -----------------------------------------------------------------
 void WorldMeshSection::beginRender( geom::RenderContext *ctx ) {
 	// Bind the giant vertex and index buffers
-	glBindBuffer( GL_ARRAY_BUFFER, vtx_vbo );
-	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, idx_vbo );
+	// The ranges are looked up every time, as defragmentation moves them
+	glBindBuffer( GL_ARRAY_BUFFER, vtxRange->buffer );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, idxRange->buffer );
+	ctx->vtxBase = vtxRange->offset;
+	ctx->idxBase = idxRange->offset;
 
-	// Bind the lighting texture
 	glActiveTexture( GL_TEXTURE1 );
+#ifndef VERTEX_LIGHTING
+	// Bind the lighting texture
 	glEnable( GL_TEXTURE_3D );
 	glBindTexture( GL_TEXTURE_3D, lightTex );
+#endif
 	
-	// Set up the lighting scale
+	// Set up the lighting scale (also used for biome lookups)
 	glMatrixMode( GL_TEXTURE );
 	glLoadIdentity();
 	glTranslated( 0.5, 0.5, 0.5 );
@@ -195,7 +234,7 @@ void WorldMeshSection::beginRender( geom::RenderContext *ctx ) {
 	glMatrixMode( GL_MODELVIEW );
 	glPushMatrix();
 	glTranslated( origin[0], origin[1], origin[2] );
-	glScaled( 1.0/16.0, 1.0/16.0, 1.0/16.0 );
+	glScaled( scale/16.0, scale/16.0, scale/16.0 );
 
 	// Point to the appropriate biome textures
 	ctx->biomeTextures = biomeTex;
@@ -207,8 +246,10 @@ void WorldMeshSection::endRender() {
 	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
 
 	glActiveTexture( GL_TEXTURE1 );
+#ifndef VERTEX_LIGHTING
 	glDisable( GL_TEXTURE_3D );
 	glBindTexture( GL_TEXTURE_3D, 0 );
+#endif
 
 	glMatrixMode( GL_MODELVIEW );
 	glPopMatrix();
@@ -221,21 +262,19 @@ void WorldMeshSection::endRender() {
 
 // ================================ WorldMesh ================================
 
-WorldMesh::WorldMesh( const std::list<WorldMeshSectionData> &data )
-: vtxMem(0)
-, idxMem(0)
-, texMem(0)
-, cost(0)
+WorldMesh::WorldMesh( const std::list<WorldMeshSectionData> &data, GpuResidency *gpu )
 {
+	PROFILE_SCOPE( PROFILE_MESH_UPLOAD );
+	for( unsigned c = 0; c < GpuResidency::N_CATEGORIES; c++ )
+		gpuMem[c] = 0;
+
 	nSections = data.size();
 	sections = (WorldMeshSection*)malloc( sizeof(WorldMeshSection) * nSections );
 	size_t i = 0;
 	for( auto it = data.begin(); it != data.end(); ++it, ++i ) {
-		WorldMeshSection *mesh = new(&sections[i]) WorldMeshSection( *it );
-		vtxMem += mesh->vtxMem;
-		idxMem += mesh->idxMem;
-		texMem += mesh->texMem;
-		cost += mesh->cost;
+		WorldMeshSection *mesh = new(&sections[i]) WorldMeshSection( *it, gpu );
+		for( unsigned c = 0; c < GpuResidency::N_CATEGORIES; c++ )
+			gpuMem[c] += mesh->gpuMem[c];
 	}
 }
 
@@ -246,6 +285,14 @@ WorldMesh::~WorldMesh() {
 	free( sections );
 }
 
+// -----------------------------------------------------------------
+unsigned WorldMesh::getGpuMemUse() const {
+	unsigned total = 0;
+	for( unsigned c = 0; c < GpuResidency::N_CATEGORIES; c++ )
+		total += gpuMem[c];
+	return total;
+}
+
 // -----------------------------------------------------------------
 bool WorldMesh::isEmpty() const {
 	for( size_t i = 0; i < nSections; i++ )
@@ -256,14 +303,20 @@ bool WorldMesh::isEmpty() const {
 
 // -----------------------------------------------------------------
 void WorldMesh::renderOpaque( geom::RenderContext *ctx ) {
-	for( size_t i = 0; i < nSections; i++ )
-		sections[i].renderOpaque( ctx );
+	for( size_t i = 0; i < nSections; i++ ) {
+		WorldMeshSection &section = sections[i];
+		section.occluded = nSections > 1 && !section.isEmpty() && ctx->occlusion && ctx->occlusion->isOccluded( section.hull );
+		if( !section.occluded )
+			section.renderOpaque( ctx );
+	}
 }
 
 // -----------------------------------------------------------------
 void WorldMesh::renderTransparent( geom::RenderContext *ctx ) {
-	for( size_t i = 0; i < nSections; i++ )
-		sections[i].renderTransparent( ctx );
+	for( size_t i = 0; i < nSections; i++ ) {
+		if( !sections[i].occluded )
+			sections[i].renderTransparent( ctx );
+	}
 }
 
 } // namespace eihort
@@ -27,12 +27,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include <vector>
 #include "geombase.h"
+#include "gpuresidency.h"
 #include "mcbiome.h"
+#include "worldmeshbuilder.h"
 
 namespace eihort {
 
-struct WorldMeshSectionData;
-
 class WorldMeshSection {
 	// Generates, manages, and renders the geometry belonging to an axis
 	// aligned section of the world
@@ -43,19 +43,16 @@ public:
 	WorldMeshSection() = delete;
 	WorldMeshSection( const WorldMeshSection& ) = delete;
 	WorldMeshSection( WorldMeshSection&& ) = delete;
-	explicit WorldMeshSection( const WorldMeshSectionData &data );
+	// All video memory is allocated from and accounted to gpu
+	WorldMeshSection( const WorldMeshSectionData &data, GpuResidency *gpu );
 	~WorldMeshSection();
 
 	// Complete the loading of the mesh (uploads VBOs and textures)
 	void finalizeLoad();
 	// Is there any geometry in this mesh?
 	inline bool isEmpty() const { return meta == NULL; }
-	// Get an estimate of the cost of this geometry
-	// Used to throttle the re-upload of off-screen geometry when the
-	// camera moves quickly so as to minimize chopping
-	inline int getCost() { return cost; }
 	// Get the video memory used by this geometry
-	inline int getGpuMemUse() { return vtxMem+idxMem+texMem; }
+	inline unsigned getGpuMemUse( GpuResidency::Category cat ) const { return gpuMem[cat]; }
 
 	// Render the opaque geometry in this mesh
 	void renderOpaque( eihort::geom::RenderContext *ctx );
@@ -91,15 +88,22 @@ private:
 	// The index of the end of the opaque and transparent
 	// geometries in the metadata
 	unsigned opaqueEnd, transpEnd;
-	// The vertex and index buffers
-	unsigned vtx_vbo, idx_vbo;
+	// Owner of the video memory
+	GpuResidency *gpu;
+	// The ranges of the pooled buffers holding this section's geometry
+	GpuBufferPool::Range *vtxRange, *idxRange;
 	// Center of the section
 	double origin[3];
-
-	// Size in bytes of the vertex buffer, index buffer, and textures
-	unsigned vtxMem, idxMem, texMem;
-	// Cost of the geometry (see WorldQTree::newMeshAllowance)
-	int cost;
+	// Size of the blocks in the geometry (greater than 1 for LOD meshes)
+	double scale;
+	// Blocks covered by the geometry
+	Extents hull;
+	// Was the section found to be occluded by the last renderOpaque?
+	bool occluded;
+
+	// Bytes of video memory used in each category
+	// The buffer sizes are those of the pool blocks holding them
+	unsigned gpuMem[GpuResidency::N_CATEGORIES];
 };
 
 class WorldMesh {
@@ -112,15 +116,17 @@ public:
 	WorldMesh() = delete;
 	WorldMesh( const WorldMesh& ) = delete;
 	WorldMesh( WorldMesh&& ) = delete;
-	explicit WorldMesh( const std::list<WorldMeshSectionData> &data );
+	WorldMesh( const std::list<WorldMeshSectionData> &data, GpuResidency *gpu );
 	~WorldMesh();
 
 	// Is there any geometry here?
 	bool isEmpty() const;
-	// Get the cost of this mesh group
-	inline int getCost() const { return cost; }
 	// Get the amount of video memory used by this mesh group
-	inline int getGpuMemUse() const { return vtxMem+idxMem+texMem; }
+	unsigned getGpuMemUse() const;
+	// Get the amount of video memory used by this mesh group in a category
+	inline unsigned getGpuMemUse( GpuResidency::Category cat ) const { return gpuMem[cat]; }
+	// Get the boxes of opaque blocks which hide what is behind this mesh
+	inline std::vector<Extents> &getOccluders() { return occluders; }
 
 	// Render the opaque geometry in this mesh group
 	void renderOpaque( geom::RenderContext *ctx );
@@ -132,11 +138,11 @@ private:
 	WorldMeshSection *sections;
 	// Number of sections in this mesh
 	size_t nSections;
+	// Coarse heightfield of opaque blocks (see WorldMeshBuilder::generateOccluders)
+	std::vector<Extents> occluders;
 
-	// Size in bytes of the vertex buffer, index buffer, and textures
-	unsigned vtxMem, idxMem, texMem;
-	// Cost of the geometry
-	int cost;
+	// Bytes of video memory used in each category
+	unsigned gpuMem[GpuResidency::N_CATEGORIES];
 };
 
 } // namespace eihort
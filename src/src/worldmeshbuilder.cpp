@@ -23,6 +23,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 
 #include <cassert>
+#include <climits>
 #include <cstring>
 #include <GL/glew.h>
 
@@ -33,13 +34,25 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include "mcbiome.h"
 #include "mcblockdesc.h"
 #include "json.h"
+#include "profile.h"
 
 namespace eihort {
 
+// Fixed cost of a section, in bytes of lighting texture
+// Accounts for the extra buffers, textures and draw calls of each section
+// and the geometry which gets split at section boundaries
+static const uint64_t SECTION_OVERHEAD = 32 * 1024;
+// GPU memory used by the biome textures for each column of a section
+// (typically three RGBA textures)
+static const uint64_t BIOME_BYTES_PER_COLUMN = 3 * 4;
+// Width of the cells of the occluder heightfield, in blocks
+static const int OCCLUDER_CELL = 8;
+
 // -----------------------------------------------------------------
 WorldMeshBuilder::WorldMeshBuilder( MCMap *map, const MCBlockDesc *blocks )
 : blockInfo(NULL), sizex(0), sizey(0), sizez(0), totalSize(0)
-, allOne(NULL), lightingTex(NULL)
+, allOne(NULL), allOneSize(0), lightingTex(NULL)
+, optimizeMeshes(true), biomeLOD(0)
 , blockDesc(blocks), map(map)
 {
 }
@@ -56,14 +69,26 @@ void WorldMeshBuilder::generate( const Extents &hull, const Extents &ltext, Worl
 	reorient( hull, ltext );
 
 	// Make space for the lighting texture
-	into.lightingTex.resize( 2u << (shiftx+shifty+shiftz), 0 );
-	lightingTex = &into.lightingTex[0];
+	// The texture is filled column by column, so it is not cleared here
+	into.lightingTex.reset( new uint8_t[sizex * sizey * sizez] );
+	lightingTex = into.lightingTex.get();
+	litColumns.assign( sizex * sizey, 0 );
 	into.ltSzX = ltext.maxx - ltext.minx + 1;
 	into.ltSzY = ltext.maxy - ltext.miny + 1;
 	into.ltSzZ = ltext.maxz - ltext.minz + 1;
+	Uint64 lightStart = PROFILE_NOW();
 	lightMapEdges();
+#ifdef VERTEX_LIGHTING
+	// The lighting must be complete before any vertices are emitted
+	lightMapAll();
+	clearUnlitColumns();
+#endif
+	Uint64 lightTicks = PROFILE_NOW() - lightStart;
 
 	// Main geometry generation
+	// Columns are lit as they are reached, so that time is moved from the
+	// islands to the lighting
+	Uint64 islandStart = PROFILE_NOW();
 	for( int x = hull.minx; x <= hull.maxx; x++ ) {
 		for( int y = hull.miny; y <= hull.maxy; y++ ) {
 			MCMap::Column col;
@@ -83,8 +108,14 @@ void WorldMeshBuilder::generate( const Extents &hull, const Extents &ltext, Worl
 					}
 				}
 
+#ifndef VERTEX_LIGHTING
 				// Fill in lighting
+				Uint64 columnStart = PROFILE_NOW();
 				lightMapColumn( x, y, col, &sides[0] );
+				Uint64 columnTicks = PROFILE_NOW() - columnStart;
+				lightTicks += columnTicks;
+				islandStart += columnTicks;
+#endif
 
 				int stopatz = std::min( hull.maxz, col.maxZ );
 				for( int z = std::max( hull.minz, col.minZ ); z <= stopatz; z++ ) {
@@ -125,6 +156,9 @@ void WorldMeshBuilder::generate( const Extents &hull, const Extents &ltext, Worl
 						island.origin.block.pos.x = x; island.origin.block.pos.y = y; island.origin.block.pos.z = z;
 						geom::Point worldSpacePos = island.origin.block.pos;
 						toLocalSpace( island.origin.block.pos );
+#ifdef VERTEX_LIGHTING
+						getLightingAt( x, y, z, island.origin.light );
+#endif
 
 						// Generate geometry for this block
 						if( geom->beginEmit( getGeometryCluster( id ), &island.origin ) ) {
@@ -137,15 +171,27 @@ void WorldMeshBuilder::generate( const Extents &hull, const Extents &ltext, Worl
 		}
 	}
 
+	PROFILE_RECORD( PROFILE_MESH_ISLANDS, PROFILE_NOW() - islandStart );
+	PROFILE_RECORD( PROFILE_MESH_LIGHTING, lightTicks );
+
 	// Output sign text
-	outputSignsFromMap( hull.minx, hull.maxx, hull.miny, hull.maxy );
+	outputSignsFromMap( hull.minx, hull.maxx, hull.miny, hull.maxy, hull.minz, hull.maxz );
+
+#ifdef VERTEX_LIGHTING
+	// The lighting is in the vertices; no texture is needed
+	into.lightingTex.reset();
+	lightingTex = NULL;
+#else
+	// Columns missing from the map were never lit
+	clearUnlitColumns();
+#endif
 
 	// Get the biome coordinates
 	into.biomeSrc = blockDesc->getBiomes();
-	into.biomeCoords = into.biomeSrc->readBiomeCoords( map, ltext.minx, ltext.maxx, ltext.miny, ltext.maxy );
+	into.biomeCoords = into.biomeSrc->readBiomeCoords( map, ltext.minx, ltext.maxx, ltext.miny, ltext.maxy, biomeLOD );
 
 	// Get a list of all geometries in this mesh
-	std::vector< GeomAndCluster > renderOrder;
+	renderOrder.clear();
 	for( unsigned i = 0; i < BLOCK_ID_COUNT; i++ ) {
 		if( geomStreams[i] ) {
 			if( !geomStreams[i]->destroyIfEmpty() ) {
@@ -167,76 +213,263 @@ void WorldMeshBuilder::generate( const Extents &hull, const Extents &ltext, Worl
 		geom::GeometryStream &vtxStream = into.vtxStream;
 		geom::GeometryStream &idxStream = into.idxStream;
 		into.opaqueEnd = 0;
+		into.nTris = 0;
+		optimizer.resetStats();
+		PROFILE_SCOPE( PROFILE_MESH_FINALIZE );
 		for( std::vector< GeomAndCluster >::const_iterator it = renderOrder.begin(); it != renderOrder.end(); ++it ) {
-			it->cluster->finalize( &metaStream, &vtxStream, &idxStream );
+			into.nTris += it->cluster->finalize( &metaStream, &vtxStream, &idxStream, optimizeMeshes ? &optimizer : NULL );
 
 			if( it->geom->getRenderGroup() < geom::RenderGroup::TRANSPARENT )
 				into.opaqueEnd = metaStream.getVertSize();
 		}
 		into.transpEnd = metaStream.getVertSize();
+		into.optStats = optimizer.getStats();
 	} else {
 		// Empty mesh
 		into.opaqueEnd = 0;
 		into.transpEnd = 0;
+		into.nTris = 0;
+		into.optStats.clear();
 	}
 
 	into.origin[0] = origin[0];
 	into.origin[1] = origin[1];
 	into.origin[2] = origin[2];
+	into.hull = hull;
+	into.lod = 0;
 	into.lightTexScale[0] = (1.0/16.0) / sizex;
 	into.lightTexScale[1] = (1.0/16.0) / sizey;
 	into.lightTexScale[2] = (1.0/16.0) / sizez;
+	into.mem.set( sizeof(WorldMeshSectionData)
+		+ (into.lightingTex ? sizex * sizey * sizez : 0)
+		+ (into.biomeCoords ? into.ltSzX * into.ltSzY * sizeof(unsigned short) : 0) );
 }
 
 // -----------------------------------------------------------------
 void WorldMeshBuilder::generateOptimal( Extents &ext, std::list<WorldMeshSectionData> &into ) {
 	into.clear();
-	if( !map->getRegions()->isAnvil() ) {
-		// MCRegion - create a single section from 0-127
-		Extents ltext( ext.minx - 1, ext.maxx + 1, ext.miny - 1, ext.maxy + 1, ext.minz, ext.maxz );
+
+	// Cover only the occupied parts of the area, so that the lighting
+	// textures don't waste space on air and missing chunks
+	std::vector<Extents> hulls;
+	planSections( ext, hulls );
+	for( std::vector<Extents>::const_iterator it = hulls.begin(); it != hulls.end(); ++it ) {
 		into.emplace_back();
-		generate( ext, ltext, into.back() );
+		generate( *it, getLightingExtents( *it ), into.back() );
+	}
+}
+
+// -----------------------------------------------------------------
+void WorldMeshBuilder::generateOccluders( const Extents &ext, std::vector<Extents> &into ) {
+	// The area is divided into cells of OCCLUDER_CELL x OCCLUDER_CELL
+	// columns. A cell's occluder spans the heights at which all of its
+	// columns are opaque, taking the highest such run of blocks
+	into.clear();
+	for( int cy = ext.miny; cy <= ext.maxy; cy += OCCLUDER_CELL ) {
+		int cellMaxY = std::min( cy + OCCLUDER_CELL - 1, ext.maxy );
+		for( int cx = ext.minx; cx <= ext.maxx; cx += OCCLUDER_CELL ) {
+			int cellMaxX = std::min( cx + OCCLUDER_CELL - 1, ext.maxx );
+			int lo = ext.minz, hi = ext.maxz;
+			for( int y = cy; y <= cellMaxY && lo <= hi; y++ ) {
+				for( int x = cx; x <= cellMaxX && lo <= hi; x++ ) {
+					MCMap::Column col;
+					if( !map->getColumn( x, y, col ) ) {
+						hi = lo - 1;
+						break;
+					}
+					// Find the top run of opaque blocks within [lo, hi]
+					int z = std::min( hi, col.maxZ );
+					while( z >= lo && !blockDesc->isOpaque( col.getId( z ) ) )
+						z--;
+					hi = z;
+					while( z >= lo && blockDesc->isOpaque( col.getId( z ) ) )
+						z--;
+					lo = z + 1;
+				}
+			}
+			if( lo > hi )
+				continue;
+
+			// Extend the previous cell's occluder if it is level with this one
+			if( !into.empty() ) {
+				Extents &prev = into.back();
+				if( prev.maxx + 1 == cx && prev.miny == cy && prev.minz == lo && prev.maxz == hi ) {
+					prev.maxx = cellMaxX;
+					continue;
+				}
+			}
+			into.push_back( Extents( cx, cellMaxX, cy, cellMaxY, lo, hi ) );
+		}
+	}
+}
+
+// -----------------------------------------------------------------
+Extents WorldMeshBuilder::getLightingExtents( const Extents &hull ) {
+	// Light is needed for one block around the hull
+	Extents ltext( hull.minx - 1, hull.maxx + 1, hull.miny - 1, hull.maxy + 1, hull.minz - 1, hull.maxz + 1 );
+
+	// Texels only line up with blocks when the sizes are even
+	if( (ltext.maxx - ltext.minx) % 2 == 0 )
+		ltext.maxx++;
+	if( (ltext.maxy - ltext.miny) % 2 == 0 )
+		ltext.maxy++;
+	if( (ltext.maxz - ltext.minz) % 2 == 0 )
+		ltext.maxz++;
+	return ltext;
+}
+
+// -----------------------------------------------------------------
+void WorldMeshBuilder::planSections( const Extents &ext, std::vector<Extents> &hulls ) {
+	// Gather the vertical extents of all the chunks in the area
+	chunkRangeMinX = shift_right( ext.minx, 4 );
+	chunkRangeMinY = shift_right( ext.miny, 4 );
+	chunkRangeSizeX = shift_right( ext.maxx, 4 ) - chunkRangeMinX + 1;
+	int chunkRangeSizeY = shift_right( ext.maxy, 4 ) - chunkRangeMinY + 1;
+	chunkZRanges.resize( chunkRangeSizeX * chunkRangeSizeY );
+	for( int cy = 0; cy < chunkRangeSizeY; cy++ ) {
+		for( int cx = 0; cx < chunkRangeSizeX; cx++ ) {
+			ChunkZRange &range = chunkZRanges[cy * chunkRangeSizeX + cx];
+			MCMap::Column col;
+			if( map->getColumn( (chunkRangeMinX + cx) << 4, (chunkRangeMinY + cy) << 4, col ) ) {
+				range.minz = col.minZ;
+				range.maxz = col.maxZ;
+			} else {
+				range.minz = 1;
+				range.maxz = 0;
+			}
+		}
+	}
+
+	Extents hull = ext;
+	if( tightenSection( hull ) )
+		subdivideSection( hull, hulls );
+}
+
+// -----------------------------------------------------------------
+bool WorldMeshBuilder::tightenSection( Extents &hull ) const {
+	int minx = INT_MAX, maxx = INT_MIN;
+	int miny = INT_MAX, maxy = INT_MIN;
+	int minz = INT_MAX, maxz = INT_MIN;
+	for( int cy = shift_right( hull.miny, 4 ); cy <= shift_right( hull.maxy, 4 ); cy++ ) {
+		for( int cx = shift_right( hull.minx, 4 ); cx <= shift_right( hull.maxx, 4 ); cx++ ) {
+			const ChunkZRange &range = chunkZRanges[(cy - chunkRangeMinY) * chunkRangeSizeX + cx - chunkRangeMinX];
+			int lo = std::max( range.minz, hull.minz );
+			int hi = std::min( range.maxz, hull.maxz );
+			if( lo <= hi ) {
+				minx = std::min( minx, cx << 4 );
+				maxx = std::max( maxx, (cx << 4) + 15 );
+				miny = std::min( miny, cy << 4 );
+				maxy = std::max( maxy, (cy << 4) + 15 );
+				minz = std::min( minz, lo );
+				maxz = std::max( maxz, hi );
+			}
+		}
+	}
+	if( minz > maxz )
+		return false;
+
+	hull.minx = std::max( hull.minx, minx );
+	hull.maxx = std::min( hull.maxx, maxx );
+	hull.miny = std::max( hull.miny, miny );
+	hull.maxy = std::min( hull.maxy, maxy );
+	hull.minz = minz;
+	hull.maxz = maxz;
+	return true;
+}
+
+// -----------------------------------------------------------------
+void WorldMeshBuilder::subdivideSection( const Extents &hull, std::vector<Extents> &hulls ) const {
+	// Look for the cheapest split of the section along a chunk or sub-chunk
+	// boundary
+	uint64_t bestCost = getSectionCost( hull );
+	Extents bestA, bestB;
+	bool split = false;
+	for( int x = (hull.minx & ~15) + 16; x <= hull.maxx; x += 16 ) {
+		Extents a = hull, b = hull;
+		a.maxx = x - 1;
+		b.minx = x;
+		split |= trySplitSection( a, b, bestCost, bestA, bestB );
+	}
+	for( int y = (hull.miny & ~15) + 16; y <= hull.maxy; y += 16 ) {
+		Extents a = hull, b = hull;
+		a.maxy = y - 1;
+		b.miny = y;
+		split |= trySplitSection( a, b, bestCost, bestA, bestB );
+	}
+	for( int z = (hull.minz & ~15) + 16; z <= hull.maxz; z += 16 ) {
+		Extents a = hull, b = hull;
+		a.maxz = z - 1;
+		b.minz = z;
+		split |= trySplitSection( a, b, bestCost, bestA, bestB );
+	}
+
+	if( split ) {
+		// Empty halves are marked with minz > maxz
+		if( bestA.minz <= bestA.maxz )
+			subdivideSection( bestA, hulls );
+		if( bestB.minz <= bestB.maxz )
+			subdivideSection( bestB, hulls );
 	} else {
-		// Anvil - potentially 256 blocks high
-		Extents hull = ext;
-		map->getExtentsWithin( ext.minx, ext.maxx, ext.miny, ext.maxy, ext.minz, ext.maxz );
-		
-		// TODO: More intelligent shrinking and subdivision of the volume
-		if( ext.maxz <= 127 )
-			hull.maxz = 127;
+		hulls.push_back( hull );
+	}
+}
 
-		Extents ltext( hull.minx - 1, hull.maxx + 1, hull.miny - 1, hull.maxy + 1, hull.minz, hull.maxz );
-		into.emplace_back();
-		generate( hull, ltext, into.back() );
+// -----------------------------------------------------------------
+bool WorldMeshBuilder::trySplitSection( Extents a, Extents b, uint64_t &bestCost, Extents &bestA, Extents &bestB ) const {
+	uint64_t cost = 0;
+	if( tightenSection( a ) ) {
+		cost += getSectionCost( a );
+	} else {
+		a.minz = 1;
+		a.maxz = 0;
+	}
+	if( tightenSection( b ) ) {
+		cost += getSectionCost( b );
+	} else {
+		b.minz = 1;
+		b.maxz = 0;
+	}
+
+	if( cost < bestCost ) {
+		bestCost = cost;
+		bestA = a;
+		bestB = b;
+		return true;
 	}
+	return false;
+}
+
+// -----------------------------------------------------------------
+uint64_t WorldMeshBuilder::getSectionCost( const Extents &hull ) {
+	Extents ltext = getLightingExtents( hull );
+	uint64_t columns = uint64_t(ltext.maxx - ltext.minx + 1) * uint64_t(ltext.maxy - ltext.miny + 1);
+	return columns * uint64_t(ltext.maxz - ltext.minz + 1) + columns * BIOME_BYTES_PER_COLUMN + SECTION_OVERHEAD;
 }
 
 // -----------------------------------------------------------------
 void WorldMeshBuilder::reorient( const Extents &hull, const Extents &ltext ) {
-	// Ensure the allOne vector is large enough
-	unsigned minsizez = unsigned(ltext.maxz - ltext.minz + 1);
-	if( sizez < minsizez ) {
+	// Ensure the allOne vector is large enough to stand in for any
+	// column reaching up to the top of the lighting extents
+	unsigned minAllOne = unsigned(std::max( ltext.maxz + 2, ltext.maxz - ltext.minz + 1 ));
+	if( allOneSize < minAllOne ) {
 		delete[] allOne;
-		allOne = new unsigned short[minsizez];
-		for( unsigned z = 0; z < minsizez; z++ )
+		allOne = new unsigned short[allOneSize = minAllOne];
+		for( unsigned z = 0; z < minAllOne; z++ )
 			allOne[z] = 1;
 	}
 
-	// Get the new sizes, shifts, and origin
+	// Get the new sizes and origin
 	hullExt = hull;
 	pow2Ext = ltext;
 	sizex = (unsigned)(pow2Ext.maxx-pow2Ext.minx+1);
 	sizey = (unsigned)(pow2Ext.maxy-pow2Ext.miny+1);
 	sizez = (unsigned)(pow2Ext.maxz-pow2Ext.minz+1);
-	shiftx = getPow2( sizex );
-	shifty = getPow2( sizey );
-	shiftz = getPow2( sizez );
 	origin[0] = pow2Ext.minx + (sizex>>1);
 	origin[1] = pow2Ext.miny + (sizey>>1);
 	origin[2] = pow2Ext.minz + (sizez>>1);
 
 	// Resize blockInfo if needed
-	unsigned newTotalSize = 1u << (shiftx + shifty + shiftz);
+	unsigned newTotalSize = sizex * sizey * sizez;
 	if( newTotalSize > totalSize ) {
 		delete[] blockInfo;
 		blockInfo = new unsigned short[totalSize = newTotalSize];
@@ -274,49 +507,34 @@ void WorldMeshBuilder::transformHolesToLocalSpace() {
 	}
 }
 
-// -----------------------------------------------------------------
-unsigned WorldMeshBuilder::getPow2( unsigned i ) {
-	if( i ) {
-		i >>= 1;
-		unsigned shift = 0;
-		while( i ) {
-			shift++;
-			i >>= 1;
-		}
-		return shift;
-	}
-	return 0;
-}
-
 // -----------------------------------------------------------------
 unsigned WorldMeshBuilder::gatherHoleContourPoints( unsigned *&ends, geom::Point *&points, geom::Point *&inside ) {
 	// Get the indices of the endpoints for each hole in the final point array
-	ends = new unsigned[holes.size()];
-	inside = new geom::Point[holes.size()];
+	holeEnds.clear();
+	holeInside.clear();
+	holePoints.clear();
 	unsigned pointCount = 0, n = 0;
 	for( std::list< IslandHole >::const_iterator it = holes.begin(); it != holes.end(); ++it ) {
 		if( !it->isRemovable() ) {
-			ends[n] = (pointCount += (unsigned)it->points().size());
-			inside[n] = it->insidePoint();
+			holeEnds.push_back( pointCount += (unsigned)it->points().size() );
+			holeInside.push_back( it->insidePoint() );
 			n++;
 		}
 	}
 		
 	if( n ) {
 		// There are non-removed holes.. serialize the contour points
-		geom::Point *pt = points = new geom::Point[ends[n-1]];
 		for( std::list< IslandHole >::const_iterator it = holes.begin(); it != holes.end(); ++it ) {
-			if( !it->isRemovable() ) {
-				memcpy( pt, &it->points()[0], sizeof(geom::Point) * it->points().size() );
-				pt += it->points().size();
-			}
+			if( !it->isRemovable() )
+				holePoints.insert( holePoints.end(), it->points().begin(), it->points().end() );
 		}
+		ends = &holeEnds[0];
+		points = &holePoints[0];
+		inside = &holeInside[0];
 	} else {
 		// All holes were removed.. return nothing
 		points = NULL;
-		delete[] ends;
 		ends = NULL;
-		delete[] inside;
 		inside = NULL;
 	}
 
@@ -446,6 +664,13 @@ bool WorldMeshBuilder::scanContourAndFlag( const geom::Point &start, unsigned st
 				goto dont_continue_island;
 		}
 
+#ifdef VERTEX_LIGHTING
+		// Vertex lighting can't follow the light across a triangulated
+		// island, so the whole island must be evenly lit
+		if( !isLitLikeIsland( nextPos ) )
+			goto dont_continue_island;
+#endif
+
 		// Continue the island
 		lastDir = islDir;
 		if( exploratory ) {
@@ -559,6 +784,14 @@ void WorldMeshBuilder::holeScan( const geom::Point &start, unsigned dir ) {
 				goto its_a_hole;
 		}
 
+#ifdef VERTEX_LIGHTING
+		// Differently lit blocks get their own island
+		if( !isLitLikeIsland( nextPos ) ) {
+			holeIsVisible = true;
+			goto its_a_hole;
+		}
+#endif
+
 		// Not a hole
 		pos = nextPos;
 		markDone( pos, island.islandAxis );
@@ -633,11 +866,46 @@ void WorldMeshBuilder::unflagContour( const std::vector< geom::Point > &contourB
 	}
 }
 
+#ifdef VERTEX_LIGHTING
+// -----------------------------------------------------------------
+bool WorldMeshBuilder::getFaceLight( const geom::Point &pos, unsigned char corners[2][2][2] ) {
+	// Light of the 3x3 blocks in front of the face and around it
+	unsigned char around[3][3][2];
+	geom::Point front = pos;
+	front.v[island.zax] += island.zd;
+	for( int dx = 0; dx < 3; dx++ ) {
+		for( int dy = 0; dy < 3; dy++ ) {
+			geom::Point pt = front;
+			pt.v[island.xax] += dx - 1;
+			pt.v[island.yax] += dy - 1;
+			getLightingAt( pt.x, pt.y, pt.z, around[dx][dy] );
+		}
+	}
+
+	// Each corner is shared by four of the blocks
+	for( unsigned x = 0; x < 2; x++ ) {
+		for( unsigned y = 0; y < 2; y++ ) {
+			for( unsigned i = 0; i < 2; i++ ) {
+				unsigned sum = around[x][y][i] + around[x+1][y][i] + around[x][y+1][i] + around[x+1][y+1][i];
+				corners[x][y][i] = (unsigned char)((sum + 2) / 4);
+			}
+		}
+	}
+
+	for( unsigned i = 0; i < 2; i++ ) {
+		if( corners[0][1][i] != corners[0][0][i] || corners[1][0][i] != corners[0][0][i] || corners[1][1][i] != corners[0][0][i] )
+			return false;
+	}
+	return true;
+}
+#endif
+
 // -----------------------------------------------------------------
 void WorldMeshBuilder::generateIslands( geom::BlockGeometry *geom ) {
-	std::vector< geom::Point > contourBlocks;
-	std::vector< geom::Point > contourPoints;
-	std::vector< std::vector< geom::BlockData > > holes;
+	std::vector< geom::Point > &contourBlocks = islandContourBlocks;
+	std::vector< geom::Point > &contourPoints = islandContourPoints;
+	contourBlocks.clear();
+	contourPoints.clear();
 
 	geom::GeometryCluster *cluster = getGeometryCluster( island.origin.block.id );
 	geom::BlockData oriBlock = island.origin.block;
@@ -703,6 +971,14 @@ void WorldMeshBuilder::generateIslands( geom::BlockGeometry *geom ) {
 
 		// Start island generation
 		unsigned mode = geom->beginIsland( &island );
+#ifdef VERTEX_LIGHTING
+		// Faces with uneven light stand alone so each corner gets its own light
+		island.cornerLit = !getFaceLight( island.origin.block.pos, island.cornerLight );
+		island.light[0] = island.cornerLight[0][0][0];
+		island.light[1] = island.cornerLight[0][0][1];
+#else
+		island.cornerLit = false;
+#endif
 		if( island.checkVisibility && island.origin.sides[dir].solid )
 			continue;
 		if( island.checkFacingSameId && island.origin.sides[dir].id == island.origin.block.id )
@@ -760,12 +1036,6 @@ void WorldMeshBuilder::generateIslands( geom::BlockGeometry *geom ) {
 				island.nContourPoints = (unsigned)contourPoints.size();
 				island.contourPoints = &contourPoints[0];
 				geom->emitIsland( cluster, &island );
-
-				if( island.nHoles ) {
-					delete[] island.holeContourEnd;
-					delete[] island.holeContourPoints;
-					delete[] island.holeInsidePoint;
-				}
 			} else {
 				// Single square - mark as done and clear flags
 				if( markAsDone )
@@ -799,6 +1069,7 @@ void WorldMeshBuilder::glowAreaAround( int x, int y, int z ) {
 		for( int yp = y - 1; yp <= y + 1; yp++ ) {
 			for( int zp = z - 1; zp <= z + 1; zp++ ) {
 				if( pow2Ext.contains( xp, yp, zp ) ) {
+					beginLightColumn( xp, yp, true );
 					unsigned lv = (xp==x ? 0u : 1u) + (yp==y ? 0u : 1u) + (zp==z ? 0u : 1u);
 					setLightingAt( xp, yp, zp, LIGHT_LEVEL[lv], 0 );
 				}
@@ -811,11 +1082,24 @@ void WorldMeshBuilder::glowAreaAround( int x, int y, int z ) {
 void WorldMeshBuilder::lightMapColumn( int x, int y, const MCMap::Column &col, const MCMap::Column *sides ) {
 	const unsigned AO_HARSHNESS = 4;
 
-	for( int z = hullExt.minz; z <= hullExt.maxz; z++ ) {
+	// Direct light
+	// A column which has not been written yet is simply overwritten
+	bool fresh = beginLightColumn( x, y, false );
+	for( int z = pow2Ext.minz; z <= pow2Ext.maxz; z++ ) {
+		unsigned blockLight = blockDesc->enableBlockLighting() ? col.getBlockLight( z ) : 0u;
+		unsigned skyLight = col.getSkyLight( z );
+		if( fresh ) {
+			storeLightingAt( x, y, z, blockLight, skyLight );
+		} else {
+			setLightingAt( x, y, z, blockLight, skyLight );
+		}
+	}
+
+	// Highlights and light seeping into blocks
+	for( int z = pow2Ext.minz; z <= pow2Ext.maxz; z++ ) {
 		unsigned id = col.getId( z );
 		unsigned blockLight = blockDesc->enableBlockLighting() ? col.getBlockLight( z ) : 0u;
 		unsigned skyLight = col.getSkyLight( z );
-		setLightingAt( x, y, z, blockLight, skyLight );
 
 		if( id > 0 ) {
 			if( blockDesc->shouldHighlight( id ) ) {
@@ -897,6 +1181,7 @@ void WorldMeshBuilder::lightMapColumn( int x, int y ) {
 			if( !sideExists[i] ) {
 				sides[i].id = allOne;
 				sides[i].minZ = col.minZ;
+				sides[i].maxZ = col.maxZ;
 			}
 		}
 
@@ -904,6 +1189,40 @@ void WorldMeshBuilder::lightMapColumn( int x, int y ) {
 	}
 }
 
+// -----------------------------------------------------------------
+void WorldMeshBuilder::lightMapAll() {
+	// The edges are done by lightMapEdges
+	for( int x = pow2Ext.minx + 1; x < pow2Ext.maxx; x++ ) {
+		for( int y = pow2Ext.miny + 1; y < pow2Ext.maxy; y++ )
+			lightMapColumn( x, y );
+	}
+}
+
+// -----------------------------------------------------------------
+bool WorldMeshBuilder::beginLightColumn( int x, int y, bool clear ) {
+	unsigned char &lit = litColumns[(unsigned)(x-pow2Ext.minx) + (unsigned)(y-pow2Ext.miny) * sizex];
+	if( lit )
+		return false;
+	lit = 1;
+	if( !clear )
+		return true;
+
+	// Clear the column
+	unsigned stride = sizex * sizey;
+	unsigned char *texel = &lightingTex[toLLinCoord( x, y, pow2Ext.minz )];
+	for( unsigned z = 0; z < sizez; z++, texel += stride )
+		*texel = 0;
+	return true;
+}
+
+// -----------------------------------------------------------------
+void WorldMeshBuilder::clearUnlitColumns() {
+	for( int x = pow2Ext.minx; x <= pow2Ext.maxx; x++ ) {
+		for( int y = pow2Ext.miny; y <= pow2Ext.maxy; y++ )
+			beginLightColumn( x, y, true );
+	}
+}
+
 // -----------------------------------------------------------------
 void WorldMeshBuilder::lightMapEdges() {
 	// Set up the lighting around the edge of the section
@@ -939,13 +1258,16 @@ static std::size_t parseText( char *dest, std::size_t destLen, const char *src,
 }
 
 // -----------------------------------------------------------------
-void WorldMeshBuilder::outputSignsFromMap( int minx, int maxx, int miny, int maxy ) {
+void WorldMeshBuilder::outputSignsFromMap( int minx, int maxx, int miny, int maxy, int minz, int maxz ) {
 	geom::SignTextGeometry *signGeom = (geom::SignTextGeometry*)blockDesc->getGeometry( SIGNTEXT_BLOCK_ID );
 	geom::GeometryCluster *cluster = getGeometryCluster( SIGNTEXT_BLOCK_ID );
 	MCMap::SignList signs;
 	map->getSignsInArea( minx, maxx, miny, maxy, signs );
 	char text[512];
 	for( MCMap::SignList::const_iterator it = signs.begin(); it != signs.end(); ++it ) {
+		if( it->z < minz || it->z > maxz )
+			continue; // Belongs to another section
+
 		char *t = &text[0];
 		uint32_t n = uint32_t(sizeof(text));
 		for( unsigned i = 0; i < 4; i++ ) {
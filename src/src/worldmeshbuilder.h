@@ -25,12 +25,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #ifndef WORLDMESHBUILDER_H
 #define WORLDMESHBUILDER_H
 
+#include <memory>
 #include <vector>
 #include <list>
 
 #include "geombase.h"
 #include "mcblockdesc.h"
 #include "mcmap.h"
+#include "memstats.h"
 
 namespace eihort {
 
@@ -89,8 +91,9 @@ struct WorldMeshSectionData {
 	unsigned short *biomeCoords;
 	// The biome texture source
 	const MCBiome *biomeSrc;
-	// The big 3D lighting texture handle
-	std::vector<uint8_t> lightingTex;
+	// The 3D lighting texture, one byte per block
+	// Block light is in the low nibble, sky light in the high nibble
+	std::unique_ptr<uint8_t[]> lightingTex;
 	// Size of the lighting texture
 	int ltSzX, ltSzY, ltSzZ;
 	// The scaling for the lighting texture to line up with the
@@ -102,6 +105,21 @@ struct WorldMeshSectionData {
 	unsigned opaqueEnd, transpEnd;
 	// Center of the WorldMesh
 	double origin[3];
+	// Blocks covered by the geometry, in full-resolution world space
+	Extents hull;
+	// Level of detail: each block in the geometry is (1<<lod) blocks wide
+	unsigned lod;
+	// Number of triangles drawn by the geometry (not counting geometry
+	// generated at render time, like sign text)
+	unsigned nTris;
+	// Results of optimizing the geometry streams
+	geom::MeshOptimizeStats optStats;
+	// Have the vertices and indices been copied into the staging ring,
+	// and where? (see GpuStaging::stage)
+	bool vtxStaged, idxStaged;
+	unsigned vtxStagingOffset, idxStagingOffset;
+	// Memory held by this structure outside of its streams
+	MemCharge<MEM_MESH_SECTIONS> mem;
 };
 
 class WorldMeshBuilder {
@@ -113,13 +131,25 @@ public:
 	~WorldMeshBuilder();
 
 	// Generate geometry for the section of the world within hull
-	// pow2Ext must encompass hullExt and have power-of-two sizes in all
-	// dimensions (though they can be different)
+	// ltext must encompass hull and have even sizes in all dimensions
+	// (though they can be different)
 	void generate( const Extents &hull, const Extents &ltext, WorldMeshSectionData &into );
 	// Generate geometry for the section of the world within extents
 	// Outputs multiple WorldMeshSectionData's which should weight
 	// less than a single WorldMeshSectionData for the whole area
 	void generateOptimal( Extents &extents, std::list<WorldMeshSectionData> &into );
+	// Build the coarse heightfield of occluders for the area within ext
+	// Each output box is made entirely of opaque blocks
+	void generateOccluders( const Extents &ext, std::vector<Extents> &into );
+
+	// Get the lighting texture extents required for a section with the given hull
+	static Extents getLightingExtents( const Extents &hull );
+
+	// Turn welding and vertex cache optimization of the geometry on or off
+	inline void setOptimizeMeshes( bool on ) { optimizeMeshes = on; }
+	// Set the LOD of the map (see MCMap_Downsampled), so that biome
+	// information read from outside the map lines up with its blocks
+	inline void setBiomeLOD( unsigned lod ) { biomeLOD = lod; }
 
 private:
 	class IslandHole {
@@ -131,6 +161,13 @@ private:
 		{ }
 		~IslandHole() { }
 
+		// Empty the hole for reuse, keeping the memory of its contours
+		void reset( bool firstPointVisible ) {
+			firstBlockIsNonVisible = !firstPointVisible;
+			contourBlocks.clear();
+			contourPoints.clear();
+		}
+
 		// Get a point inside the hole
 		const geom::Point &insidePoint() const { return inside; }
 		// Get a point inside the hole
@@ -159,6 +196,12 @@ private:
 		std::vector< geom::Point > contourPoints;
 	};
 
+	struct ChunkZRange {
+		// The vertical extents of the data in a chunk
+		// minz > maxz if the chunk does not exist
+		int minz, maxz;
+	};
+
 	struct GeomAndCluster {
 		// The geometry generator
 		geom::BlockGeometry *geom;
@@ -217,11 +260,17 @@ private:
 
 	// Create a new hole in the current island
 	inline IslandHole *newHole( bool visible ) {
-		holes.push_back( IslandHole(visible) );
+		if( spareHoles.empty() ) {
+			holes.push_back( IslandHole(visible) );
+		} else {
+			holes.splice( holes.end(), spareHoles, spareHoles.begin() );
+			holes.back().reset( visible );
+		}
 		return &holes.back(); }
 	// Remove all stored holes
+	// The holes are kept aside for reuse
 	inline void clearHoles() {
-		holes.clear(); }
+		spareHoles.splice( spareHoles.end(), holes ); }
 	// Get the current list of holes
 	inline std::list< IslandHole > &getHoles() {
 		return holes; }
@@ -229,8 +278,19 @@ private:
 	// Get the geometry cluster for the given block ID
 	geom::GeometryCluster *getGeometryCluster( unsigned id );
 
-	// Finds the smallest j such that (1<<j) >= i
-	unsigned getPow2( unsigned i );
+	// Find the set of sections which cover the occupied parts of the
+	// world within ext most cheaply
+	void planSections( const Extents &ext, std::vector<Extents> &hulls );
+	// Shrink the hull to the occupied chunks and sub-chunks within it
+	// Returns false if nothing within the hull is occupied
+	bool tightenSection( Extents &hull ) const;
+	// Split the hull into cheaper sections if possible, and output the results
+	void subdivideSection( const Extents &hull, std::vector<Extents> &hulls ) const;
+	// Evaluate splitting the hull into a and b, keeping the split if it is
+	// cheaper than bestCost
+	bool trySplitSection( Extents a, Extents b, uint64_t &bestCost, Extents &bestA, Extents &bestB ) const;
+	// Estimate the cost of a section in GPU memory
+	static uint64_t getSectionCost( const Extents &hull );
 
 	// Transforms a point from world space into mesh-local space
 	inline void toLocalSpace( geom::Point &pt ) {
@@ -243,23 +303,55 @@ private:
 	void transformHolesToLocalSpace();
 	// Consolidates the contour points of holes into lists of points
 	// Resturns the number of holes
-	// NOTE: These arrays must be delete[]ed
+	// The arrays remain valid until the next call
 	unsigned gatherHoleContourPoints( unsigned *&ends, geom::Point *&points, geom::Point *&inside );
 
 	// Set the light value at a particular block
+	// The light only ever increases
 	inline void setLightingAt( int x, int y, int z, unsigned block, unsigned sky ) {
-		unsigned i = toLLinCoord(x,y,z) << 1;
-		lightingTex[i] = std::max( lightingTex[i], (unsigned char)(block<<4) );
-		lightingTex[i+1] = std::max( lightingTex[i+1], (unsigned char)(sky<<4) );
+		unsigned char &texel = lightingTex[toLLinCoord(x,y,z)];
+		block = std::max( block & 15u, texel & 15u );
+		sky = std::max( sky & 15u, (unsigned)texel >> 4 );
+		texel = (unsigned char)(block | (sky << 4));
+	}
+	// Overwrite the light value at a particular block
+	inline void storeLightingAt( int x, int y, int z, unsigned block, unsigned sky ) {
+		lightingTex[toLLinCoord(x,y,z)] = (unsigned char)((block & 15u) | ((sky & 15u) << 4));
 	}
 
+#ifdef VERTEX_LIGHTING
+	// Get the (block, sky) light at a particular block, scaled to 0-255 for
+	// storage in the vertices
+	inline void getLightingAt( int x, int y, int z, unsigned char *light ) {
+		x = std::min( std::max( x, pow2Ext.minx ), pow2Ext.maxx );
+		y = std::min( std::max( y, pow2Ext.miny ), pow2Ext.maxy );
+		z = std::min( std::max( z, pow2Ext.minz ), pow2Ext.maxz );
+		unsigned char texel = lightingTex[toLLinCoord(x,y,z)];
+		light[0] = (unsigned char)((texel & 15) * 17);
+		light[1] = (unsigned char)((texel >> 4) * 17);
+	}
+	// Get the light at the corners of the current island's face of the block
+	// at pos, as the lighting texture would be sampled there (each corner
+	// averages the four texels in front of the face around it)
+	// Returns true if the light is the same at all corners
+	bool getFaceLight( const geom::Point &pos, unsigned char corners[2][2][2] );
+	// Does the face of the block at pos have the same light as the current island?
+	inline bool isLitLikeIsland( const geom::Point &pos ) {
+		if( island.cornerLit )
+			return false;
+		unsigned char corners[2][2][2];
+		return getFaceLight( pos, corners ) &&
+			corners[0][0][0] == island.light[0] && corners[0][0][1] == island.light[1];
+	}
+#endif
+
 	// Tansform a world-space coordinate into an index into our local data array
 	inline unsigned toLinCoord( int x, int y, int z ) {
-		return (unsigned)(z-pow2Ext.minz) + ((unsigned)(x-pow2Ext.minx)<<shiftz) + ((unsigned)(y-pow2Ext.miny)<<(shiftz+shiftx)); }
+		return (unsigned)(z-pow2Ext.minz) + ((unsigned)(x-pow2Ext.minx) + (unsigned)(y-pow2Ext.miny) * sizex) * sizez; }
 	// Tansform a world-space coordinate into an index into our local lighing array
 	inline unsigned toLLinCoord( int x, int y, int z ) {
 		// Ordered as we want GL to order the texture
-		return (unsigned)(x-pow2Ext.minx) + ((unsigned)(y-pow2Ext.miny)<<shiftx) + ((unsigned)(z-pow2Ext.minz)<<(shifty+shiftx));
+		return (unsigned)(x-pow2Ext.minx) + ((unsigned)(y-pow2Ext.miny) + (unsigned)(z-pow2Ext.minz) * sizey) * sizex;
 	}
 
 	// Move the coordinates in the given direction within the island's plane
@@ -285,11 +377,19 @@ private:
 	void lightMapColumn( int x, int y, const MCMap::Column &col, const MCMap::Column *sides );
 	// Generate the lighting texture for a column of the world
 	void lightMapColumn( int x, int y );
+	// Generate the lighting for every column of the section
+	void lightMapAll();
+	// Marks a column of the lighting texture as written
+	// Returns true if the column was not written before, in which case
+	// it is zeroed if clear is true
+	bool beginLightColumn( int x, int y, bool clear );
+	// Zero all columns of the lighting texture which were never written
+	void clearUnlitColumns();
 	// Generate the lighting texture for the columns at the edges of this
 	// section's lighting extents
 	void lightMapEdges();
 	// Find and output all sign text in the given extents
-	void outputSignsFromMap( int minx, int maxx, int miny, int maxy );
+	void outputSignsFromMap( int minx, int maxx, int miny, int maxy, int minz, int maxz );
 
 	// The geometry clusters into which to dump all the geometry
 	geom::GeometryCluster *geomStreams[BLOCK_ID_COUNT];
@@ -299,18 +399,21 @@ private:
 	unsigned short *blockInfo;
 	// Size of the area to generate geometry for
 	unsigned sizex, sizey, sizez;
-	// Total size, in blocks, of the area to generate geometry for
+	// Number of entries allocated in blockInfo
 	unsigned totalSize;
-	// Shifts for the power of two above the size in each dimension
-	unsigned shiftx, shifty, shiftz;
 	// Origin of the area to generate geometry for
 	int origin[3];
 	// A vector of all ones, used as a substitute for other arrays in
 	// several functions
 	unsigned short *allOne;
+	// Number of entries in allOne
+	unsigned allOneSize;
 
 	// The lighting texture to fill in
 	unsigned char *lightingTex;
+	// Which columns of the lighting texture have been written
+	// The texture is not cleared up front, as most columns are overwritten
+	std::vector<unsigned char> litColumns;
 	// Extents of the lighting texture
 	Extents pow2Ext;
 	// Extents of the are to generate geometry for
@@ -320,11 +423,33 @@ private:
 	geom::IslandDesc island;
 	// List of holes in the currently-generated island
 	std::list< IslandHole > holes;
+	// Holes from previous islands, kept to reuse their memory
+	std::list< IslandHole > spareHoles;
+	// Contour of the currently-generated island
+	std::vector< geom::Point > islandContourBlocks, islandContourPoints;
+	// Storage for the arrays output by gatherHoleContourPoints
+	std::vector< unsigned > holeEnds;
+	std::vector< geom::Point > holePoints, holeInside;
+	// Geometries of the current mesh, in render order
+	std::vector< GeomAndCluster > renderOrder;
+	// Welds and reorders the finalized geometry
+	geom::MeshOptimizer optimizer;
+	// Should the geometry be optimized?
+	bool optimizeMeshes;
+	// LOD at which to read biome information
+	unsigned biomeLOD;
 
 	// Geometry generators
 	const MCBlockDesc *blockDesc;
 	// Source map
 	MCMap *map;
+
+	// Vertical extents of the chunks in the area being planned by planSections
+	std::vector<ChunkZRange> chunkZRanges;
+	// Chunk coordinates of the first entry in chunkZRanges
+	int chunkRangeMinX, chunkRangeMinY;
+	// Width of the chunkZRanges grid, in chunks
+	int chunkRangeSizeX;
 };
 
 } // namespace eihort
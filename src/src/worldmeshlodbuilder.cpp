@@ -0,0 +1,78 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include "worldmeshlodbuilder.h"
+#include "mcmap.h"
+
+namespace eihort {
+
+// -----------------------------------------------------------------
+WorldMeshLODBuilder::WorldMeshLODBuilder( MCMap_Downsampled *map, const MCBlockDesc *blocks )
+: map(map)
+, builder( map, blocks )
+{
+	builder.setBiomeLOD( map->getLOD() );
+}
+
+// -----------------------------------------------------------------
+WorldMeshLODBuilder::~WorldMeshLODBuilder() {
+}
+
+// -----------------------------------------------------------------
+void WorldMeshLODBuilder::generate( const Extents &ext, std::list<WorldMeshSectionData> &into ) {
+	into.clear();
+	unsigned lod = map->getLOD();
+	int cell = 1 << lod;
+
+	// Each coarse block belongs to the section containing its lowest
+	// corner, so that neighbouring sections never generate the same block
+	Extents hull;
+	hull.minx = shift_right( ext.minx + cell - 1, lod );
+	hull.maxx = shift_right( ext.maxx + cell, lod ) - 1;
+	hull.miny = shift_right( ext.miny + cell - 1, lod );
+	hull.maxy = shift_right( ext.maxy + cell, lod ) - 1;
+
+	// Only cover the heights where the source has chunks, as the
+	// full-resolution sections do
+	int minx = hull.minx, maxx = hull.maxx, miny = hull.miny, maxy = hull.maxy;
+	hull.minz = shift_right( ext.minz, lod );
+	hull.maxz = shift_right( ext.maxz, lod );
+	map->getExtentsWithin( minx, maxx, miny, maxy, hull.minz, hull.maxz );
+	if( hull.minz > hull.maxz )
+		return;
+
+	into.emplace_back();
+	WorldMeshSectionData &data = into.back();
+	builder.generate( hull, WorldMeshBuilder::getLightingExtents( hull ), data );
+
+	// Bring the origin back into full-resolution space
+	data.origin[0] *= cell;
+	data.origin[1] *= cell;
+	data.origin[2] *= cell;
+	data.hull = Extents( hull.minx * cell, (hull.maxx + 1) * cell - 1, hull.miny * cell, (hull.maxy + 1) * cell - 1,
+	                     hull.minz * cell, (hull.maxz + 1) * cell - 1 );
+	data.lod = lod;
+}
+
+} // namespace eihort
@@ -0,0 +1,65 @@
+/* Copyright (c) 2012, Jason Lloyd-Price
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef WORLDMESHLODBUILDER_H
+#define WORLDMESHLODBUILDER_H
+
+#include <list>
+
+#include "worldmeshbuilder.h"
+
+// The coarsest level of detail - blocks are (1<<MAX_LOD_LEVEL) wide
+// Must not exceed 4 so that every coarse block lies within one chunk
+#define MAX_LOD_LEVEL 4
+
+namespace eihort {
+
+class MCMap_Downsampled;
+
+class WorldMeshLODBuilder {
+	// Level-of-detail mesh construction class
+	// Builds coarse versions of sections of the world by running the
+	// normal WorldMeshBuilder pipeline over a downsampled view of the map
+
+public:
+	// Create a new LOD mesh builder
+	// The map's LOD determines the LOD of the generated geometry
+	WorldMeshLODBuilder( MCMap_Downsampled *map, const MCBlockDesc *blocks );
+	~WorldMeshLODBuilder();
+
+	// Generate coarse geometry for the section of the world within extents
+	// extents are in full-resolution block coordinates
+	void generate( const Extents &extents, std::list<WorldMeshSectionData> &into );
+	// Turn welding and vertex cache optimization of the geometry on or off
+	inline void setOptimizeMeshes( bool on ) { builder.setOptimizeMeshes( on ); }
+
+private:
+	// The downsampled source map
+	MCMap_Downsampled *map;
+	// The builder generating the actual geometry from the downsampled map
+	WorldMeshBuilder builder;
+};
+
+} // namespace eihort
+
+#endif // WORLDMESHLODBUILDER_H
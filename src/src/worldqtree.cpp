@@ -23,12 +23,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 
 #include <float.h>
+#include <algorithm>
 #include <GL/glew.h>
 
 #include "worldqtree.h"
 #include "worker.h"
 #include "eihortshader.h"
 #include "worldmesh.h"
+#include "worldmeshlodbuilder.h"
+#include "profile.h"
+#include "trace.h"
 
 extern bool g_needRefresh;
 extern unsigned g_nWorkers;
@@ -39,6 +43,30 @@ extern jPlane g_viewFrustum[];
 
 namespace eihort {
 
+// Log2 of the size of the pages of the vertex and index buffer pools
+static const unsigned BUFFER_POOL_PAGE_SHIFT = 22;
+// Bytes of geometry the buffer pools may move around in an idle frame
+static const unsigned BUFFER_POOL_DEFRAG_BYTES = 1024*1024;
+// Size of the ring workers stage geometry in (when persistently mapped)
+static const unsigned STAGING_RING_SIZE = 32*1024*1024;
+// Number of the nearest visible leaves whose occluders are drawn each frame
+static const unsigned OCCLUDER_LEAVES = 32;
+// Bits kept in the render queue's distance keys
+static const unsigned DISTANCE_KEY_BITS = 24;
+// Frames an uploaded leaf may go undrawn before its latency is discarded
+static const unsigned LATENCY_DRAW_FRAMES = 8;
+// Number of the slowest leaves to become visible which are kept
+static const unsigned SLOWEST_LEAVES = 16;
+
+// -----------------------------------------------------------------
+static inline unsigned getDistanceKey( float distance ) {
+	// Non-negative floats sort like their bit patterns; dropping the low
+	// mantissa bits leaves a relative precision of 2^-15
+	union { float f; unsigned u; } bits;
+	bits.f = distance;
+	return bits.u >> (32 - DISTANCE_KEY_BITS);
+}
+
 // -----------------------------------------------------------------
 inline void keepMinLevel( unsigned &minLevel, int target, unsigned leafSize ) {
 	// Helper to determine the minimum level of the root node of the quadtree
@@ -49,20 +77,30 @@ inline void keepMinLevel( unsigned &minLevel, int target, unsigned leafSize ) {
 
 // -----------------------------------------------------------------
 WorldQTree::WorldQTree( MCRegionMap *regions, MCBlockDesc *blocks, unsigned leafShift, const BiomeCoordData *biomeIdToCoords )
-: newMeshAllowance(0)
-, gpuAllowanceLeft(512*1024*1024)
+: uploadBudgetUs(4000)
+, uploadUsPerKB(10.0f)
+, workerLimit(MAX_WORKERS)
+, gpu(BUFFER_POOL_PAGE_SHIFT, STAGING_RING_SIZE)
 , holdLoading(false)
-, unseenLeafHead(NULL), unseenLeafTail(NULL)
-, curRenderHead(NULL), curRenderTail(NULL)
+, nodePool(MEM_QTREE)
+, leafPool(MEM_QTREE)
 , regions(regions)
 , blockDesc(blocks)
 , leafShift(leafShift)
 , leafSize((1u<<leafShift)-2)
+, lodDistance(0.0f)
 , limitLoadDistance(FLT_MAX)
 , trisILD(0)
 , vtxSpaceILD(0)
 , idxSpaceILD(0)
 , texSpaceILD(0)
+, drawCallsILD(0)
+, uploadsILD(0), uploadTimeILD(0)
+, cullTimeILD(0), sortTimeILD(0)
+, leavesBuilt(0), builderHeapAllocs(0), builderReuses(0)
+, buildTimeTotal(0)
+, waitingForWorkerILD(0), waitingForUploadILD(0)
+, optimizeMeshes(true)
 , nMeshesLoading(0)
 , lastRender(0)
 , fogStart(1.0f), fogEnd(1000.0f)
@@ -75,6 +113,11 @@ WorldQTree::WorldQTree( MCRegionMap *regions, MCBlockDesc *blocks, unsigned leaf
 	Extents ext;
 	regions->getWorldBlockExtents( ext.minx, ext.maxx, ext.miny, ext.maxy );
 
+	for( unsigned i = 0; i < geom::VertexFormat::COUNT; i++ )
+		vtxFormatSpaceILD[i] = 0;
+	instancesILD = instanceSpaceILD = instanceExpandedSpaceILD = 0;
+	meshOptStats.clear();
+
 	// Make the qtree root sufficiently high to accommodate the world
 	unsigned minLevel = 0;
 	keepMinLevel( minLevel, ext.minx, leafSize );
@@ -110,6 +153,18 @@ WorldQTree::WorldQTree( MCRegionMap *regions, MCBlockDesc *blocks, unsigned leaf
 		} else {
 			meshesLoading[i].map = new MCMap_MCRegion( regions );
 		}
+		for( unsigned l = 0; l < MAX_LOD_LEVEL; l++ )
+			meshesLoading[i].lodMaps[l] = new MCMap_Downsampled( meshesLoading[i].map, blocks, l + 1 );
+
+		// Each worker keeps its builders between leaves
+		meshesLoading[i].builder = new WorldMeshBuilder( meshesLoading[i].map, blocks );
+		for( unsigned l = 0; l < MAX_LOD_LEVEL; l++ )
+			meshesLoading[i].lodBuilders[l] = new WorldMeshLODBuilder( meshesLoading[i].lodMaps[l], blocks );
+		meshesLoading[i].arena = new geom::ScratchArena;
+		meshesLoading[i].heapAllocs = 0;
+		meshesLoading[i].reuses = 0;
+		meshesLoading[i].buildTime = 0;
+		meshesLoading[i].staging = &gpu.getStaging();
 	}
 
 	// Have the region map inform us when things change
@@ -125,13 +180,26 @@ WorldQTree::WorldQTree( MCRegionMap *regions, MCBlockDesc *blocks, unsigned leaf
 
 // -----------------------------------------------------------------
 WorldQTree::~WorldQTree() {
-	while( curRenderHead )
-		freeLeafMesh( curRenderHead );
-	while( unseenLeafHead )
-		freeLeafMesh( unseenLeafHead );
+	while( gpu.getResidentCount() )
+		freeLeafMesh( (QTreeLeaf*)gpu.getResident( 0 )->owner );
 
 	SDL_DestroyMutex( loadingMutex );
 
+	// Meshes which were never uploaded still hold the block descriptions
+	// and their part of the staging ring
+	for( auto it = uploadQueue.begin(); it != uploadQueue.end(); ++it )
+		discardUpload( *it );
+
+	// Free the workers' builders, unless a worker is still using them
+	for( unsigned i = 0; i < g_nWorkers; i++ ) {
+		if( !meshesLoading[i].leaf ) {
+			delete meshesLoading[i].builder;
+			for( unsigned l = 0; l < MAX_LOD_LEVEL; l++ )
+				delete meshesLoading[i].lodBuilders[l];
+			delete meshesLoading[i].arena;
+		}
+	}
+
 	// Nodes and leaves will be freed by the MemoryPools
 }
 
@@ -147,6 +215,11 @@ void WorldQTree::setViewDistance( float dist ) {
 	frustumIsDirty = true;
 }
 
+// -----------------------------------------------------------------
+void WorldQTree::setLODDistance( float dist ) {
+	lodDistance = dist;
+}
+
 // -----------------------------------------------------------------
 void WorldQTree::setCameraParams( float yfov, float aspect, float n, float f ) {
 	yfov_2 = yfov / 2;
@@ -174,8 +247,11 @@ const jPlane *WorldQTree::getFrustum() const {
 
 // -----------------------------------------------------------------
 void WorldQTree::draw() {
-	if( nMeshesLoading || !meshesToKill.empty() ) {
-		SDL_mutexP( loadingMutex );
+	TRACE_SCOPE( "drawWorld" );
+	uploadsILD = 0;
+	uploadTimeILD = 0;
+	if( nMeshesLoading || !meshesToKill.empty() || !uploadQueue.empty() ) {
+		TRACE_MUTEXP( loadingMutex, "waitLoadingMutex" );
 
 		// Free any meshes scheduled for freeing
 		while( !meshesToKill.empty() ) {
@@ -190,40 +266,52 @@ void WorldQTree::draw() {
 		if( nMeshesLoading )
 			completeLoading();
 
+		// Upload as many as fit in this frame
+		if( !uploadQueue.empty() )
+			processUploads();
+
 		SDL_mutexV( loadingMutex );
+	} else {
+		// Nothing is arriving; compact the geometry buffers a little
+		gpu.getVertexPool().defragment( BUFFER_POOL_DEFRAG_BYTES );
+		gpu.getIndexPool().defragment( BUFFER_POOL_DEFRAG_BYTES );
 	}
+	gpu.getStaging().endUploads();
 
 	// New frame!
 	lastRender++;
-	newMeshAllowance = 80;
 
 	{
-		// Move the last frame's render list into the unseen render list
-		if( curRenderHead ) {
-			if( unseenLeafHead ) {
-				unseenLeafHead->prev = curRenderTail;
-			} else {
-				unseenLeafTail = curRenderTail;
-			}
-			curRenderTail->next = unseenLeafHead;
-			unseenLeafHead = curRenderHead;
+		// Draw the occluders of the nearest leaves seen last frame
+		float tanY = tanf( yfov_2 );
+		occlusion.begin( &eyeMat, tanY * screenAspect, tanY, nearPlane );
+		unsigned nOccluderLeaves = 0;
+		for( auto it = renderQueue.begin(); it != renderQueue.end() && nOccluderLeaves < OCCLUDER_LEAVES; ++it ) {
+			if( !it->leaf->mesh )
+				continue;
+			const std::vector<Extents> &occluders = it->leaf->mesh->getOccluders();
+			if( occluders.empty() )
+				continue;
+			for( auto occ = occluders.begin(); occ != occluders.end(); ++occ )
+				occlusion.addOccluder( *occ );
+			nOccluderLeaves++;
 		}
+		occlusion.rasterize();
 
-		// Regenerate the new render list
-		QTreeLeaf *lists[32];
-		for( unsigned i = 0; i < sizeof(lists)/sizeof(QTreeLeaf*); i++ )
-			lists[i] = NULL; 
-		unsigned maxn = 0;
+		// Regenerate the render queue
+		renderQueue.clear();
 		newLoadDistanceLimit = FLT_MAX;
-		generateRenderList( &rootNode, &lists[0], maxn );
-		if( maxn || lists[0] ) {
-			mergeRenderListsFinal( &lists[0], maxn, curRenderHead, curRenderTail );
-		} else {
-			curRenderHead = NULL;
-			curRenderTail = NULL;
-		}
+		waitingForWorkerILD = 0;
+		waitingForUploadILD = 0;
+		Uint64 freq = SDL_GetPerformanceFrequency();
+		Uint64 cullStart = SDL_GetPerformanceCounter();
+		generateRenderList( &rootNode, false );
+		Uint64 sortStart = SDL_GetPerformanceCounter();
+		sortRenderQueue();
+		cullTimeILD = (unsigned)((sortStart - cullStart) * 1000000 / freq);
+		sortTimeILD = (unsigned)((SDL_GetPerformanceCounter() - sortStart) * 1000000 / freq);
 		limitLoadDistance = newLoadDistanceLimit;
-		if( limitLoadDistance < FLT_MAX && unseenLeafHead )
+		if( limitLoadDistance < FLT_MAX && gpu.getResidentCount() > renderQueue.size() )
 			limitLoadDistance += 1.0f;
 	}
 
@@ -231,12 +319,20 @@ void WorldQTree::draw() {
 	eihort::geom::RenderContext rctx;
 	jVec3Copy( &rctx.viewPos, &eyeMat.pos );
 	rctx.renderedTriCount = 0;
+	rctx.drawCallCount = 0;
 	rctx.vertexSize = 0;
 	rctx.indexSize = 0;
 	rctx.texSize = 0;
+	for( unsigned i = 0; i < geom::VertexFormat::COUNT; i++ )
+		rctx.vertexFormatSize[i] = 0;
+	rctx.instanceCount = 0;
+	rctx.instanceSize = 0;
+	rctx.instanceExpandedSize = 0;
 	rctx.shader = g_shader;
 	rctx.lightModels = lightModels;
 	rctx.enableBlockLighting = blockDesc->enableBlockLighting();
+	rctx.solidBatch = NULL;
+	rctx.occlusion = &occlusion;
 
 	// Set up the camera
 	initCamera();
@@ -252,37 +348,39 @@ void WorldQTree::draw() {
 	g_shader->bindNormal();
 
 	// First, render all opaque geometry front-to-back
-	QTreeLeaf *leaf = curRenderHead;
-	while( leaf ) {
-		leaf->mesh->renderOpaque( &rctx );
-		leaf = leaf->next;
-	}
+	// The solid faces of each section are batched
+	rctx.solidBatch = &solidBatch;
+	for( auto it = renderQueue.begin(); it != renderQueue.end(); ++it )
+		it->leaf->mesh->renderOpaque( &rctx );
+	rctx.solidBatch = NULL;
 	
 	// Now, render all transparent geometry back-to-front
-	leaf = curRenderTail;
-	while( leaf ) {
-		leaf->mesh->renderTransparent( &rctx );
-		leaf = leaf->prev;
-	}
+	// This must stay in order, so nothing is batched
+	for( auto it = renderQueue.rbegin(); it != renderQueue.rend(); ++it )
+		it->leaf->mesh->renderTransparent( &rctx );
 
 	// Cleanup
 	LightModel::unloadGL();
 	g_shader->unbind();
 
 	glDisable( GL_FOG );
+	recordFirstDraws();
 	
 	trisILD = rctx.renderedTriCount;
 	vtxSpaceILD = rctx.vertexSize;
 	idxSpaceILD = rctx.indexSize;
 	texSpaceILD = rctx.texSize;
-
-	if( newMeshAllowance < 0 ) // Some newly drawn meshes didn't fit
-		g_needRefresh = true;
+	drawCallsILD = rctx.drawCallCount;
+	for( unsigned i = 0; i < geom::VertexFormat::COUNT; i++ )
+		vtxFormatSpaceILD[i] = rctx.vertexFormatSize[i];
+	instancesILD = rctx.instanceCount;
+	instanceSpaceILD = rctx.instanceSize;
+	instanceExpandedSpaceILD = rctx.instanceExpandedSize;
 }
 
 // -----------------------------------------------------------------
 void WorldQTree::drawLoadingCarat() {
-	if( nMeshesLoading ) {
+	if( isLoading() ) {
 		float white[] = { 1.0f, 1.0f, 1.0f, 1.0f };
 		glMaterialfv( GL_FRONT, GL_AMBIENT_AND_DIFFUSE, &white[0] );
 		glColor3f( 0.05f, 0.5f, 1.0f );
@@ -353,7 +451,7 @@ void WorldQTree::drawLoadingCarat() {
 
 // -----------------------------------------------------------------
 void WorldQTree::chunkChanged( int x, int y ) {
-	SDL_mutexP( loadingMutex );
+	TRACE_MUTEXP( loadingMutex, "waitLoadingMutex" );
 
 	// Get the extents to invalidate
 	Extents ext;
@@ -472,6 +570,10 @@ WorldQTree::QTreeNode::QTreeNode( WorldQTree *qtree, unsigned level, int minz, i
 	ext.maxy =  mlMin-1;
 	ext.minz = minz;
 	ext.maxz = maxz;
+	lodLeaf = NULL;
+	parent = NULL;
+	lastDescended = 0;
+	lastPending = 0;
 
 	if( level ) {
 		subNodes[0] = subNodes[1] = subNodes[2] = subNodes[3] = NULL;
@@ -479,18 +581,15 @@ WorldQTree::QTreeNode::QTreeNode( WorldQTree *qtree, unsigned level, int minz, i
 		// On the off chance that the root node has leaves beneath it,
 		// initialize them
 		for( unsigned j = 0; j < 4; j++ ) {
-			QTreeLeaf *leaf = leaves[j] = qtree->leafPool.alloc();
-			leaf->lastRender = 0;
-			leaf->mesh = NULL;
-			leaf->load = true;
-			leaf->next = NULL;
-			leaf->prev = NULL;
+			Extents leafExt = ext;
+			splitExtents( &leafExt, j );
+			leaves[j] = qtree->newLeaf( leafExt, 0 );
 		}
 	}
 }
 
 // -----------------------------------------------------------------
-WorldQTree::QTreeNode::QTreeNode( WorldQTree *qtree, const QTreeNode *parent, unsigned quadrant ) {
+WorldQTree::QTreeNode::QTreeNode( WorldQTree *qtree, QTreeNode *parent, unsigned quadrant ) {
 	// Intermediate node initialization
 
 	// Set the position in the world of this node
@@ -503,22 +602,35 @@ WorldQTree::QTreeNode::QTreeNode( WorldQTree *qtree, const QTreeNode *parent, un
 		(ext.maxz + ext.minz) / 2.0f );
 
 	// Initialize sub-objects
+	lodLeaf = NULL;
+	this->parent = parent;
+	lastDescended = 0;
+	lastPending = 0;
 	if( level ) {
 		subNodes[0] = subNodes[1] = subNodes[2] = subNodes[3] = NULL;
 	} else {
 		for( unsigned j = 0; j < 4; j++ ) {
-			QTreeLeaf *leaf = leaves[j] = qtree->leafPool.alloc();
-			leaf->lastRender = 0;
-			leaf->mesh = NULL;
-			leaf->load = true;
-			leaf->next = NULL;
-			leaf->prev = NULL;
-			leaf->lastExtents = ext;
-			splitExtents( &leaf->lastExtents, j );
+			Extents leafExt = ext;
+			splitExtents( &leafExt, j );
+			leaves[j] = qtree->newLeaf( leafExt, 0 );
 		}
 	}
 }
 
+// -----------------------------------------------------------------
+WorldQTree::QTreeLeaf *WorldQTree::newLeaf( const Extents &ext, unsigned lod ) {
+	QTreeLeaf *leaf = leafPool.alloc();
+	leaf->lastRender = 0;
+	leaf->mesh = NULL;
+	leaf->load = true;
+	leaf->built = false;
+	leaf->queuedAt = 0;
+	leaf->lastWanted = 0;
+	leaf->lastExtents = ext;
+	leaf->lod = lod;
+	return leaf;
+}
+
 // -----------------------------------------------------------------
 void WorldQTree::reloadArea( QTreeNode *node, const Extents *ext ) {
 	for( unsigned i = 0; i < 4; i++ ) {
@@ -526,345 +638,449 @@ void WorldQTree::reloadArea( QTreeNode *node, const Extents *ext ) {
 		splitExtents( &ext2, i );
 		if( ext2.intersects( *ext ) ) {
 			if( node->level ) {
-				if( node->subNodes[i] )
+				if( node->subNodes[i] ) {
+					if( node->subNodes[i]->lodLeaf )
+						reloadLeaf( node->subNodes[i]->lodLeaf );
 					reloadArea( node->subNodes[i], ext );
-			} else {
-				QTreeLeaf *leaf = node->leaves[i];
-				if( leaf->mesh && lastRender - leaf->lastRender > 3 ) {
-					// The mesh is not visible - kick it out silently
-					meshesToKill.push_back( leaf );
 				}
-				leaf->load = true;
+			} else {
+				reloadLeaf( node->leaves[i] );
 			}
 		}
 	}
 }
 
 // -----------------------------------------------------------------
-void WorldQTree::completeLoading() {
-	QTreeLeaf *toAppend = NULL, *toAppendTail = NULL;
+void WorldQTree::reloadLeaf( QTreeLeaf *leaf ) {
+	if( leaf->mesh && lastRender - leaf->lastRender > 3 ) {
+		// The mesh is not visible - kick it out silently
+		meshesToKill.push_back( leaf );
+	}
+	leaf->load = true;
+}
 
+// -----------------------------------------------------------------
+void WorldQTree::completeLoading() {
 	for( unsigned i = 0; i < g_nWorkers; i++ ) {
 		if( meshesLoading[i].loaded ) {
-			// This mesh has finished loading - finalize it
-			QTreeLeaf *leaf = meshesLoading[i].leaf;
-			WorldMesh *wmesh = new WorldMesh( meshesLoading[i].loadedData );
-			meshesLoading[i].loadedData.clear();
-
-			// Free what was there already
-			if( leaf->mesh )
-				freeLeafMesh( leaf );
-
-			if( wmesh->isEmpty() ) {
-				delete wmesh;
-			} else {
-				unsigned gpuCost = wmesh->getGpuMemUse();
-				leaf->lastExtents = meshesLoading[i].loadingExt;
-				if( gpuCost > gpuAllowanceLeft ) {
-					// Too many meshes in memory - start kicking stuff out
-					while( unseenLeafTail && gpuCost > gpuAllowanceLeft ) {
-						// Start by eating non-visible leaves
-						QTreeLeaf *toRemove = unseenLeafTail;
-						freeLeafMesh( toRemove );
-						toRemove->load = true;
-					}
-					if( gpuCost > gpuAllowanceLeft ) {
-						// No old meshes to free.. start cannibalizing the distant visible ones
-						unsigned nToRemove = 0, freedSpace = 0;
-						QTreeLeaf *toRemove = curRenderTail;
-						while( gpuCost > gpuAllowanceLeft + freedSpace && toRemove && toRemove->distance > leaf->distance ) {
-							nToRemove++;
-							freedSpace += toRemove->mesh->getGpuMemUse();
-							toRemove = toRemove->prev;
-						}
-						if( gpuCost <= gpuAllowanceLeft + freedSpace ) {
-							// There are enough visible meshes farther than this one to make space for it!
-							for( unsigned i = 0; i < nToRemove; i++ ) {
-								toRemove = curRenderTail;
-								freeLeafMesh( toRemove );
-								toRemove->load = true;
-							}
-						}
-					}
-					if( gpuCost > gpuAllowanceLeft ) {
-						// No memory to free... have to give up on this mesh :(
-						delete wmesh;
-						wmesh = NULL;
-						leaf->load = true;
-						gpuCost = 0;
-						limitLoadDistance = std::min( limitLoadDistance, leaf->distance );
-					}
-				}
-
-				if( wmesh ) {
-					// Connect the mesh with the leaf
-					gpuAllowanceLeft -= gpuCost;
-					leaf->mesh = wmesh;
-
-					leaf->next = toAppend;
-					if( toAppend ) {
-						toAppend->prev = leaf;
-					} else {
-						toAppendTail = leaf;
-					}
-					toAppend = leaf;
-
-					limitLoadDistance = FLT_MAX;
-				}
+			// This mesh has finished loading - queue it for upload
+			// The block descriptions stay locked until it is uploaded
+			uploadQueue.emplace_back();
+			PendingUpload &up = uploadQueue.back();
+			up.leaf = meshesLoading[i].leaf;
+			up.data.splice( up.data.end(), meshesLoading[i].loadedData );
+			up.ext = meshesLoading[i].loadingExt;
+			up.buildTime = meshesLoading[i].buildTime;
+			up.timeline = meshesLoading[i].timeline;
+			up.occluders.swap( meshesLoading[i].occluders );
+			up.bytes = 0;
+			up.gpuBytes = 0;
+			for( auto it = up.data.begin(); it != up.data.end(); ++it ) {
+				unsigned texBytes = (unsigned)(it->ltSzX * it->ltSzY * it->ltSzZ);
+				up.bytes += it->vtxStream.getVertSize() + it->idxStream.getVertSize() + texBytes;
+				if( it->transpEnd > 0 )
+					up.gpuBytes += GpuBufferPool::getBlockSize( it->vtxStream.getVertSize() ) + GpuBufferPool::getBlockSize( it->idxStream.getVertSize() ) + texBytes;
+				meshOptStats.add( it->optStats );
 			}
 
+			leavesBuilt++;
+			buildTimeTotal += meshesLoading[i].buildTime;
+			builderHeapAllocs += meshesLoading[i].heapAllocs;
+			builderReuses += meshesLoading[i].reuses;
+
 			// Done loading
 			meshesLoading[i].leaf = NULL;
 			meshesLoading[i].loaded = false;
-			blockDesc->unlock();
 			nMeshesLoading--;
 		}
 	}
 
 	// After loading the last mesh, free up some memory
 	if( nMeshesLoading == 0 ) {
-		for( unsigned i = 0; i < g_nWorkers; i++ )
+		for( unsigned i = 0; i < g_nWorkers; i++ ) {
 			meshesLoading[i].map->clearAllLoadedChunks();
-	}
-
-	// Append any new meshes to the current frame's render list
-	if( toAppend ) {
-		if( curRenderTail ) {
-			toAppend->prev = curRenderTail;
-			curRenderTail->next = toAppend;
-		} else {
-			curRenderHead = toAppend;
-			toAppend->prev = NULL;
+			for( unsigned l = 0; l < MAX_LOD_LEVEL; l++ )
+				meshesLoading[i].lodMaps[l]->clearAllLoadedChunks();
 		}
-		curRenderTail = toAppendTail;
 	}
 }
 
 // -----------------------------------------------------------------
-void WorldQTree::freeLeafMesh( QTreeLeaf *leaf ) {
-	// Free resources
-	gpuAllowanceLeft += leaf->mesh->getGpuMemUse();
-	delete leaf->mesh;
-	leaf->mesh = NULL;
+void WorldQTree::processUploads() {
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	Uint64 start = SDL_GetPerformanceCounter();
+	unsigned elapsed = 0, nUploaded = 0;
+	while( !uploadQueue.empty() ) {
+		PendingUpload &up = uploadQueue.front();
+
+		// Leave the rest for later frames if this one is expected to
+		// overrun the budget, but always make some progress
+		unsigned expected = (unsigned)(uploadUsPerKB * (float)up.bytes / 1024.0f);
+		if( nUploaded > 0 && elapsed + expected > uploadBudgetUs )
+			break;
 
-	// Disconnect from the render lists
-	if( leaf->prev ) {
-		leaf->prev->next = leaf->next;
-	} else {
-		(leaf == curRenderHead ? curRenderHead : unseenLeafHead) = leaf->next;
-	}
-	if( leaf->next ) {
-		leaf->next->prev = leaf->prev;
-	} else {
-		(leaf == curRenderTail ? curRenderTail : unseenLeafTail) = leaf->prev;
+		Uint64 before = SDL_GetPerformanceCounter();
+		uploadMesh( up );
+		Uint64 after = SDL_GetPerformanceCounter();
+
+		// Keep a running estimate of the upload speed
+		float us = (float)((after - before) * 1000000 / freq);
+		if( up.bytes > 0 )
+			uploadUsPerKB = 0.9f * uploadUsPerKB + 0.1f * us * 1024.0f / (float)up.bytes;
+
+		elapsed = (unsigned)((after - start) * 1000000 / freq);
+		nUploaded++;
+		uploadQueue.pop_front();
 	}
+	uploadsILD = nUploaded;
+	uploadTimeILD = elapsed;
+	if( !uploadQueue.empty() )
+		g_needRefresh = true;
 }
 
 // -----------------------------------------------------------------
-void WorldQTree::generateRenderList( QTreeNode *node, QTreeLeaf **lists, unsigned &maxn ) {
-	float distances[4];
-	jVec3 pos, dv;
-	float halfDist = (float)(leafSize<<node->level) / 2.0f;
-	float visRadius = subVisRadii[node->level];
-
-	// Get distances to each sub-node
-	jVec3Set( &dv, -halfDist, -halfDist, 0.0f );
-	jVec3Add( &pos, &node->center, &dv );
-	distances[0] = getVisibleDistance( &frustum[0], &pos, visRadius );
-
-	jVec3Set( &dv, halfDist, -halfDist, 0.0f );
-	jVec3Add( &pos, &node->center, &dv );
-	distances[1] = getVisibleDistance( &frustum[0], &pos, visRadius );
-
-	jVec3Set( &dv, -halfDist, halfDist, 0.0f );
-	jVec3Add( &pos, &node->center, &dv );
-	distances[2] = getVisibleDistance( &frustum[0], &pos, visRadius );
-
-	jVec3Set( &dv, halfDist, halfDist, 0.0f );
-	jVec3Add( &pos, &node->center, &dv );
-	distances[3] = getVisibleDistance( &frustum[0], &pos, visRadius );
-
-	// Sort them
-	unsigned minI[4] = { 0u, 1u, 2u, 3u };
-	if( distances[0] > distances[1] )
-		std::swap( minI[0], minI[1] );
-	if( distances[2] > distances[3] )
-		std::swap( minI[2], minI[3] );
-	if( distances[minI[0]] > distances[minI[2]] )
-		std::swap( minI[0], minI[2] );
-	if( distances[minI[1]] > distances[minI[3]] )
-		std::swap( minI[1], minI[3] );
-	if( distances[minI[1]] > distances[minI[2]] )
-		std::swap( minI[1], minI[2] );
-
-	if( node->level == 0 ) {
-		for( unsigned k = 0; k < 4; k++ ) {
-			unsigned i = minI[k];
-			QTreeLeaf *leaf = node->leaves[i];
-			leaf->distance = distances[i];
-			if( leaf->distance != FLT_MAX && frustumIntersectsExtents( &frustum[0], leaf->lastExtents ) ) {
-				// This leaf is visible...
-				if( leaf->mesh ) {
-					if( leaf->lastRender == lastRender - 1 || (newMeshAllowance -= leaf->mesh->getCost()) > -leaf->mesh->getCost() ) {
-						// .. remove it from the unseen list and add to the current list
-						leaf->lastRender = lastRender;
-						if( leaf->prev ) {
-							leaf->prev->next = leaf->next;
-						} else {
-							unseenLeafHead = leaf->next;
-						}
-						if( leaf->next ) {
-							leaf->next->prev = leaf->prev;
-						} else {
-							unseenLeafTail = leaf->prev;
-						}
-						mergeLeafIntoRenderLists( lists, maxn, leaf );
-					}
-				}
-				if( leaf->load && nMeshesLoading < g_nWorkers && !holdLoading ) {
-					// Distance cutoff in VRAM limiting situations
-					if( leaf->distance >= limitLoadDistance ) {
-						newLoadDistanceLimit = std::min( leaf->distance, newLoadDistanceLimit );
-						continue;
-					}
-					// Find a worker to load this leaf
-					for( unsigned j = 0; j < g_nWorkers; j++ ) {
-						if( !meshesLoading[j].leaf ) {
-							leaf->load = false;
-							meshesLoading[j].leaf = leaf;
-							meshesLoading[j].loadingExt = node->ext;
-							splitExtents( &meshesLoading[j].loadingExt, i );
-							meshesLoading[j].blocks = blockDesc;
-							g_workers[j]->doTask( loadMesh_worker, &meshesLoading[j] );
-							blockDesc->lock();
-							nMeshesLoading++;
-							break;
-						}
-					}
-				}
-			}
-		}
-	} else {
-		// Recurse down the visible nodes
-		for( unsigned k = 0; k < 4; k++ ) {
-			unsigned i = minI[k];
-			if( distances[i] != FLT_MAX ) {
-				if( !node->subNodes[i] )
-					node->subNodes[i] = new( nodePool.alloc() ) QTreeNode( this, node, i );
-				generateRenderList( node->subNodes[i], lists, maxn );
+void WorldQTree::uploadMesh( PendingUpload &up ) {
+	TRACE_SCOPE2( "uploadLeaf", "x", up.ext.minx, "y", up.ext.miny );
+	QTreeLeaf *leaf = up.leaf;
+
+	// Free what was there already
+	if( leaf->mesh )
+		freeLeafMesh( leaf );
+
+	// Make room for the mesh before uploading it, so that no upload is
+	// wasted on a mesh which has to be dropped
+	unsigned long long used = gpu.getUsedBytes() + up.gpuBytes;
+	if( used > gpu.getBudget() ) {
+		// Too many meshes in memory - kick out the ones least worth keeping
+		if( gpu.chooseEvictions( used - gpu.getBudget(), leaf->distance, lastRender, evictions ) ) {
+			for( auto it = evictions.begin(); it != evictions.end(); ++it ) {
+				QTreeLeaf *toRemove = (QTreeLeaf*)(*it)->owner;
+				gpu.noteEviction( *it );
+				freeLeafMesh( toRemove );
+				toRemove->load = true;
 			}
+		} else {
+			// No memory to free... have to give up on this mesh :(
+			discardUpload( up );
+			gpu.noteDropped();
+			leaf->load = true;
+			limitLoadDistance = std::min( limitLoadDistance, leaf->distance );
+			return;
 		}
 	}
+
+	WorldMesh *wmesh = new WorldMesh( up.data, &gpu );
+	up.data.clear();
+	wmesh->getOccluders().swap( up.occluders );
+	blockDesc->unlock();
+
+	if( wmesh->isEmpty() ) {
+		delete wmesh;
+		leaf->built = true;
+		return;
+	}
+
+	leaf->lastExtents = up.ext;
+
+	GpuResidency::Resident *res = &leaf->resident;
+	res->owner = leaf;
+	for( unsigned c = 0; c < GpuResidency::N_CATEGORIES; c++ )
+		res->bytes[c] = wmesh->getGpuMemUse( (GpuResidency::Category)c );
+	res->rebuildCost = up.buildTime;
+
+	// Connect the mesh with the leaf
+	gpu.add( res, lastRender, leaf->distance );
+	leaf->mesh = wmesh;
+	leaf->built = true;
+
+	limitLoadDistance = FLT_MAX;
+
+	// Its latency is complete once it is drawn
+	up.timeline.uploaded = SDL_GetPerformanceCounter();
+	LeafAwaitingDraw waiting = { leaf, wmesh, lastRender, up.timeline };
+	leavesAwaitingDraw.push_back( waiting );
 }
 
 // -----------------------------------------------------------------
-void WorldQTree::mergeLeafIntoRenderLists( QTreeLeaf **lists, unsigned &maxn, QTreeLeaf *leaf ) {
-	// Merge-sort the leaf into the list of lists
-	QTreeLeaf *toMerge = leaf;
-	leaf->next = NULL;
-	unsigned level = 0;
-	while( lists[level] ) {
-		toMerge = mergeRenderLists( lists[level], toMerge );
-		lists[level] = NULL;
-		level++;
-	}
-	lists[level] = toMerge;
-	if( level > maxn )
-		maxn = level;
-}
-
-// -----------------------------------------------------------------
-WorldQTree::QTreeLeaf *WorldQTree::mergeRenderLists( QTreeLeaf *list1, QTreeLeaf *list2 ) {
-	// Merge two sorted lists of leaves into a single sorted list
-	QTreeLeaf *head = NULL;
-	QTreeLeaf **prevNext = &head;
-	while( true ) {
-		if( list1->distance < list2->distance ) {
-			*prevNext = list1;
-			prevNext = &list1->next;
-			list1 = list1->next;
-			if( !list1 ) {
-				*prevNext = list2;
-				return head;
-			}
-		} else {
-			*prevNext = list2;
-			prevNext = &list2->next;
-			list2 = list2->next;
-			if( !list2 ) {
-				*prevNext = list1;
-				return head;
+bool WorldQTree::isSlowerLeaf( const SlowLeaf &a, const SlowLeaf &b ) {
+	return a.drawn - a.timeline.queued > b.drawn - b.timeline.queued;
+}
+
+// -----------------------------------------------------------------
+void WorldQTree::recordFirstDraws() {
+	Uint64 now = SDL_GetPerformanceCounter();
+	for( size_t i = 0; i < leavesAwaitingDraw.size(); ) {
+		LeafAwaitingDraw &waiting = leavesAwaitingDraw[i];
+		bool current = waiting.leaf->mesh == waiting.mesh;
+		if( current && waiting.leaf->lastRender == lastRender ) {
+			// Drawn for the first time
+			LeafTimeline &t = waiting.timeline;
+			if( !t.queued )
+				t.queued = t.started;
+			PROFILE_RECORD( PROFILE_LEAF_QUEUE, t.started - t.queued );
+			PROFILE_RECORD( PROFILE_LEAF_CHUNKS, t.chunkTicks );
+			PROFILE_RECORD( PROFILE_LEAF_MESH, t.built - t.started - t.chunkTicks );
+			PROFILE_RECORD( PROFILE_LEAF_UPLOAD_WAIT, t.uploaded - t.built );
+			PROFILE_RECORD( PROFILE_LEAF_DRAW_WAIT, now - t.uploaded );
+			PROFILE_RECORD( PROFILE_LEAF_VISIBLE, now - t.queued );
+
+			SlowLeaf slow = { waiting.leaf->lastExtents, waiting.leaf->lod, t, now };
+			if( slowestLeaves.size() < SLOWEST_LEAVES ) {
+				slowestLeaves.push_back( slow );
+				std::push_heap( slowestLeaves.begin(), slowestLeaves.end(), &isSlowerLeaf );
+			} else if( isSlowerLeaf( slow, slowestLeaves.front() ) ) {
+				std::pop_heap( slowestLeaves.begin(), slowestLeaves.end(), &isSlowerLeaf );
+				slowestLeaves.back() = slow;
+				std::push_heap( slowestLeaves.begin(), slowestLeaves.end(), &isSlowerLeaf );
 			}
+		} else if( current && lastRender - waiting.frame <= LATENCY_DRAW_FRAMES ) {
+			i++;
+			continue;
 		}
+
+		// Done with this leaf: it was drawn, lost its mesh, or went
+		// out of sight
+		waiting = leavesAwaitingDraw.back();
+		leavesAwaitingDraw.pop_back();
 	}
 }
 
 // -----------------------------------------------------------------
-WorldQTree::QTreeLeaf *WorldQTree::mergeRenderLists( WorldQTree::QTreeLeaf *list1, WorldQTree::QTreeLeaf *list2, WorldQTree::QTreeLeaf *&tail ) {
-	// Merge two sorted lists of leaves into a single sorted list
-	QTreeLeaf *head = NULL;
-	QTreeLeaf **prevNext = &head, *prev = NULL;
-	while( true ) {
-		if( list1->distance < list2->distance ) {
-			*prevNext = list1;
-			list1->prev = prev;
-			if( list1->next ) {
-				prev = list1;
-				prevNext = &prev->next;
-				list1 = list1->next;
-			} else {
-				list1->next = list2;
-				list2->prev = list1;
-				tail = list2;
-				break;
+void WorldQTree::discardUpload( PendingUpload &up ) {
+	for( auto it = up.data.begin(); it != up.data.end(); ++it ) {
+		// Only sections with geometry went through the ring
+		if( it->transpEnd == 0 )
+			continue;
+		if( it->vtxStaged )
+			gpu.getStaging().discard( it->vtxStagingOffset );
+		if( it->idxStaged )
+			gpu.getStaging().discard( it->idxStagingOffset );
+	}
+	up.data.clear();
+	blockDesc->unlock();
+}
+
+// -----------------------------------------------------------------
+void WorldQTree::freeLeafMesh( QTreeLeaf *leaf ) {
+	// Free resources
+	gpu.remove( &leaf->resident );
+	delete leaf->mesh;
+	leaf->mesh = NULL;
+	leaf->built = false;
+}
+
+// -----------------------------------------------------------------
+void WorldQTree::generateRenderList( QTreeNode *root, bool loadOnly ) {
+	PROFILE_SCOPE( PROFILE_RENDER_LIST );
+	TRACE_SCOPE( "renderList" );
+
+	// Depth first, nearest child first
+	// Children are pushed farthest first so that they pop off in order
+	traversalStack.clear();
+	TraversalItem rootItem = { root, false, loadOnly };
+	traversalStack.push_back( rootItem );
+
+	while( !traversalStack.empty() ) {
+		TraversalItem item = traversalStack.back();
+		traversalStack.pop_back();
+		QTreeNode *node = item.node;
+
+		if( item.lodLeaf ) {
+			QTreeLeaf *leaf = node->lodLeaf;
+			visitLeaf( leaf, node, node->ext, frustumIntersectsExtents( &frustum[0], leaf->lastExtents ), item.loadOnly );
+			continue;
+		}
+		node->lastDescended = lastRender;
+
+		float halfDist = (float)(leafSize<<node->level) / 2.0f;
+		float visRadius = subVisRadii[node->level];
+
+		// Get distances to each sub-node
+		float x[4] = {
+			node->center.x - halfDist, node->center.x + halfDist,
+			node->center.x - halfDist, node->center.x + halfDist };
+		float y[4] = {
+			node->center.y - halfDist, node->center.y - halfDist,
+			node->center.y + halfDist, node->center.y + halfDist };
+		float distances[4];
+		frustum4.getVisibleDistances( &distances[0], &x[0], &y[0], node->center.z, visRadius );
+
+		// Sort them
+		unsigned minI[4] = { 0u, 1u, 2u, 3u };
+		if( distances[0] > distances[1] )
+			std::swap( minI[0], minI[1] );
+		if( distances[2] > distances[3] )
+			std::swap( minI[2], minI[3] );
+		if( distances[minI[0]] > distances[minI[2]] )
+			std::swap( minI[0], minI[2] );
+		if( distances[minI[1]] > distances[minI[3]] )
+			std::swap( minI[1], minI[3] );
+		if( distances[minI[1]] > distances[minI[2]] )
+			std::swap( minI[1], minI[2] );
+
+		if( distances[minI[0]] == FLT_MAX )
+			continue;
+
+		if( node->level == 0 ) {
+			// Test the last known extents of all 4 leaves at once
+			float cx[4], cy[4], cz[4], hx[4], hy[4], hz[4];
+			for( unsigned i = 0; i < 4; i++ ) {
+				const Extents &le = node->leaves[i]->lastExtents;
+				cx[i] = ((float)le.maxx + (float)le.minx) / 2.0f;
+				cy[i] = ((float)le.maxy + (float)le.miny) / 2.0f;
+				cz[i] = ((float)le.maxz + (float)le.minz) / 2.0f;
+				hx[i] = ((float)le.maxx - (float)le.minx) / 2.0f;
+				hy[i] = ((float)le.maxy - (float)le.miny) / 2.0f;
+				hz[i] = ((float)le.maxz - (float)le.minz) / 2.0f;
+			}
+			unsigned inFrustum = frustum4.intersectBoxes( &cx[0], &cy[0], &cz[0], &hx[0], &hy[0], &hz[0] );
+
+			for( unsigned k = 0; k < 4; k++ ) {
+				unsigned i = minI[k];
+				QTreeLeaf *leaf = node->leaves[i];
+				leaf->distance = distances[i];
+				Extents ext = node->ext;
+				splitExtents( &ext, i );
+				visitLeaf( leaf, node, ext, (inFrustum & (1u << i)) != 0, item.loadOnly );
 			}
 		} else {
-			*prevNext = list2;
-			list2->prev = prev;
-			if( list2->next ) {
-				prev = list2;
-				prevNext = &prev->next;
-				list2 = list2->next;
-			} else {
-				list2->next = list1;
-				list1->prev = list2;
-				tail = list1;
-				break;
+			// Queue up the visible nodes, farthest first
+			for( unsigned k = 4; k-- > 0; ) {
+				unsigned i = minI[k];
+				if( distances[i] == FLT_MAX )
+					continue;
+				if( !node->subNodes[i] )
+					node->subNodes[i] = new( nodePool.alloc() ) QTreeNode( this, node, i );
+				QTreeNode *sub = node->subNodes[i];
+				TraversalItem descend = { sub, false, item.loadOnly };
+				TraversalItem visitLOD = { sub, true, item.loadOnly };
+
+				if( shouldUseLOD( sub, distances[i] ) ) {
+					// Far away - draw the whole node with a single coarse mesh
+					if( !sub->lodLeaf )
+						sub->lodLeaf = newLeaf( sub->ext, node->level );
+					sub->lodLeaf->distance = distances[i];
+					if( !sub->lodLeaf->mesh && !sub->lodLeaf->built ) {
+						// Keep drawing the finer geometry until the coarse mesh is ready
+						traversalStack.push_back( descend );
+						visitLOD.loadOnly = true;
+					}
+					traversalStack.push_back( visitLOD );
+				} else {
+					// Keep drawing the coarse mesh until the finer geometry is ready
+					bool holdLOD = sub->lodLeaf && sub->lodLeaf->mesh && !isSubtreeReady( sub );
+					descend.loadOnly = item.loadOnly || holdLOD;
+					traversalStack.push_back( descend );
+					if( holdLOD ) {
+						sub->lodLeaf->distance = distances[i];
+						traversalStack.push_back( visitLOD );
+					}
+				}
 			}
 		}
 	}
-	while( tail->next ) {
-		tail->next->prev = tail;
-		tail = tail->next;
-	}
-	return head;
 }
 
 // -----------------------------------------------------------------
-void WorldQTree::mergeRenderListsFinal( QTreeLeaf **lists, unsigned maxn, QTreeLeaf *&head, QTreeLeaf *&tail ) {
-	// Finalize the merge sort of the leaves
-	unsigned level = 0;
-	while( !lists[level] )
-		level++;
+void WorldQTree::visitLeaf( QTreeLeaf *leaf, QTreeNode *owner, const Extents &ext, bool inFrustum, bool loadOnly ) {
+	if( leaf->distance == FLT_MAX || !inFrustum )
+		return;
+	// Hidden leaves are neither drawn nor loaded
+	if( occlusion.isOccluded( leaf->lastExtents ) )
+		return;
 
-	if( level == maxn ) {
-		// Only a single list - add in prev pointers and find the tail
-		tail = head = lists[level];
-		head->prev = NULL;
-		while( tail->next ) {
-			tail->next->prev = tail;
-			tail = tail->next;
-		}
+	// Coarse meshes above the leaf are held until it arrives, unless it
+	// can't be loaded for now (the node caches this for the next frame)
+	if( !leaf->mesh && !leaf->built && !holdLoading && leaf->distance < limitLoadDistance ) {
+		for( QTreeNode *n = owner; n && n->lastPending != lastRender; n = n->parent )
+			n->lastPending = lastRender;
+	}
+
+	// This leaf is visible...
+	if( leaf->mesh && !loadOnly ) {
+		// .. queue it for drawing
+		leaf->lastRender = lastRender;
+		gpu.touch( &leaf->resident, lastRender, leaf->distance );
+		RenderItem item = { getDistanceKey( leaf->distance ), leaf };
+		renderQueue.push_back( item );
+	}
+	if( !leaf->load || holdLoading )
+		return;
+	// Note when the leaf started waiting, for the latency statistics
+	if( !leaf->queuedAt || lastRender - leaf->lastWanted > 1 )
+		leaf->queuedAt = SDL_GetPerformanceCounter();
+	leaf->lastWanted = lastRender;
+	// Don't build more than the upload stage can keep up with
+	unsigned nWorkers = std::min( workerLimit, g_nWorkers );
+	if( nMeshesLoading >= nWorkers || uploadQueue.size() >= 2 * nWorkers ) {
+		// Count the leaves held back, for tuning the worker limit and the
+		// upload budget
+		if( leaf->distance < limitLoadDistance )
+			(nMeshesLoading >= nWorkers ? waitingForWorkerILD : waitingForUploadILD)++;
 		return;
 	}
+	// Distance cutoff in VRAM limiting situations
+	if( leaf->distance >= limitLoadDistance ) {
+		newLoadDistanceLimit = std::min( leaf->distance, newLoadDistanceLimit );
+		return;
+	}
+	// Find a worker to load this leaf
+	for( unsigned j = 0; j < g_nWorkers; j++ ) {
+		if( !meshesLoading[j].leaf ) {
+			leaf->load = false;
+			meshesLoading[j].leaf = leaf;
+			meshesLoading[j].loadingExt = ext;
+			meshesLoading[j].lod = leaf->lod;
+			meshesLoading[j].optimize = optimizeMeshes;
+			meshesLoading[j].blocks = blockDesc;
+			meshesLoading[j].timeline.queued = leaf->queuedAt;
+			leaf->queuedAt = 0;
+			g_workers[j]->doTask( loadMesh_worker, &meshesLoading[j] );
+			blockDesc->lock();
+			nMeshesLoading++;
+			break;
+		}
+	}
+}
+
+// -----------------------------------------------------------------
+bool WorldQTree::shouldUseLOD( const QTreeNode *node, float distance ) const {
+	// The node's coarse mesh is built at LOD (level+1), so that it has
+	// the same resolution as a single leaf
+	unsigned lod = node->level + 1;
+	if( lodDistance <= 0.0f || lod > MAX_LOD_LEVEL )
+		return false;
+
+	// Use the LOD mesh once the nearest point of the node is far enough
+	// away; hang on to it for a little longer once it's being drawn
+	float threshold = lodDistance * (float)(1u << node->level);
+	if( node->lodLeaf && node->lodLeaf->lastRender == lastRender - 1 )
+		threshold *= 0.9f;
+	return sqrtf( distance ) - subVisRadii[lod] >= threshold;
+}
 
-	// Lists must be merged
-	QTreeLeaf *toMerge = lists[level];
-	for( unsigned i = level + 1; i < maxn; i++ ) {
-		if( lists[i] )
-			toMerge = mergeRenderLists( lists[i], toMerge );
+// -----------------------------------------------------------------
+void WorldQTree::sortRenderQueue() {
+	// LSD radix sort on the distance keys, one byte at a time
+	// Stable, so leaves at equal distances stay in traversal order
+	renderSortScratch.resize( renderQueue.size() );
+	for( unsigned shift = 0; shift < DISTANCE_KEY_BITS; shift += 8 ) {
+		unsigned offsets[256] = { 0 };
+		for( auto it = renderQueue.begin(); it != renderQueue.end(); ++it )
+			offsets[(it->key >> shift) & 0xffu]++;
+		// Skip the pass if every key has the same digit
+		if( offsets[renderQueue.empty() ? 0 : (renderQueue[0].key >> shift) & 0xffu] == renderQueue.size() )
+			continue;
+		unsigned total = 0;
+		for( unsigned d = 0; d < 256; d++ ) {
+			unsigned n = offsets[d];
+			offsets[d] = total;
+			total += n;
+		}
+		for( auto it = renderQueue.begin(); it != renderQueue.end(); ++it )
+			renderSortScratch[offsets[(it->key >> shift) & 0xffu]++] = *it;
+		renderQueue.swap( renderSortScratch );
 	}
-	head = mergeRenderLists( lists[maxn], toMerge, tail );
 }
 
 // -----------------------------------------------------------------
@@ -946,8 +1162,42 @@ void WorldQTree::splitExtents( Extents *ext, unsigned corner ) {
 // -----------------------------------------------------------------
 void WorldQTree::loadMesh_worker( void *ldmesh_cookie ) {
 	WorldQTree::LoadingMesh *ldmesh = (WorldQTree::LoadingMesh*)ldmesh_cookie;
-	WorldMeshBuilder bld( ldmesh->map, ldmesh->blocks );
-	bld.generateOptimal( ldmesh->loadingExt, ldmesh->loadedData );
+	TRACE_SCOPE2( "loadLeaf", "x", ldmesh->loadingExt.minx, "y", ldmesh->loadingExt.miny );
+	unsigned heapAllocs = ldmesh->arena->getHeapAllocCount();
+	unsigned reuses = ldmesh->arena->getReuseCount();
+	unsigned start = SDL_GetTicks();
+	ldmesh->timeline.started = SDL_GetPerformanceCounter();
+	MCMap *chunkSource = ldmesh->lod ? ldmesh->lodMaps[ldmesh->lod-1] : ldmesh->map;
+	Uint64 chunkTicks = chunkSource->getChunkLoadTime();
+	geom::ScratchArena::bind( ldmesh->arena );
+	if( ldmesh->lod ) {
+		ldmesh->lodBuilders[ldmesh->lod-1]->setOptimizeMeshes( ldmesh->optimize );
+		ldmesh->lodBuilders[ldmesh->lod-1]->generate( ldmesh->loadingExt, ldmesh->loadedData );
+	} else {
+		ldmesh->builder->setOptimizeMeshes( ldmesh->optimize );
+		ldmesh->builder->generateOptimal( ldmesh->loadingExt, ldmesh->loadedData );
+	}
+	geom::ScratchArena::bind( NULL );
+	ldmesh->heapAllocs = ldmesh->arena->getHeapAllocCount() - heapAllocs;
+	ldmesh->reuses = ldmesh->arena->getReuseCount() - reuses;
+	if( ldmesh->lod ) {
+		ldmesh->occluders.clear();
+	} else {
+		ldmesh->builder->generateOccluders( ldmesh->loadingExt, ldmesh->occluders );
+	}
+	ldmesh->buildTime = SDL_GetTicks() - start;
+	ldmesh->timeline.chunkTicks = chunkSource->getChunkLoadTime() - chunkTicks;
+
+	// Copy the geometry straight into GPU-visible memory while still on
+	// the worker, if there is room
+	TRACE_SCOPE( "stageLeaf" );
+	for( auto it = ldmesh->loadedData.begin(); it != ldmesh->loadedData.end(); ++it ) {
+		if( it->transpEnd == 0 )
+			continue;
+		it->vtxStaged = ldmesh->staging->stage( it->vtxStream.getVertices(), it->vtxStream.getVertSize(), it->vtxStagingOffset );
+		it->idxStaged = ldmesh->staging->stage( it->idxStream.getVertices(), it->idxStream.getVertSize(), it->idxStagingOffset );
+	}
+	ldmesh->timeline.built = SDL_GetPerformanceCounter();
 	ldmesh->loaded = true;
 	g_needRefresh = true;
 }
@@ -984,6 +1234,7 @@ void WorldQTree::buildViewFrustum() {
 	// Last "plane" is now a bounding sphere
 	jVec3Copy( &frustum[5].n, &eyeMat.pos );
 	frustum[5].d = viewDistance;
+	frustum4.set( &frustum[0] );
 
 	windowHt_2 = nearPlane * tan_yfov_2;
 
@@ -1032,6 +1283,14 @@ int WorldQTree::lua_setViewDistance( lua_State *L ) {
 	return 0;
 }
 
+// -----------------------------------------------------------------
+int WorldQTree::lua_setLODDistance( lua_State *L ) {
+	// view:setLODDistance( distance )
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	qtree->setLODDistance( (float)luaL_checknumber( L, 2 ) );
+	return 0;
+}
+
 // -----------------------------------------------------------------
 int WorldQTree::lua_setCameraParams( lua_State *L ) {
 	// view:setCameraParams( yfov, aspect, near, far )
@@ -1062,10 +1321,11 @@ int WorldQTree::lua_getLightModel( lua_State *L ) {
 
 // -----------------------------------------------------------------
 int WorldQTree::lua_isLoading( lua_State *L ) {
-	// loading = view:isLoading()
+	// loading, leaves = view:isLoading()
 	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
 	lua_pushboolean( L, qtree->isLoading() );
-	return 1;
+	lua_pushnumber( L, qtree->getLoadingCount() );
+	return 2;
 }
 
 // -----------------------------------------------------------------
@@ -1105,7 +1365,7 @@ int WorldQTree::lua_reloadRegion( lua_State *L ) {
 int WorldQTree::lua_setGpuAllowance( lua_State *L ) {
 	// view:setGpuAllowance( allowance )
 	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
-	qtree->gpuAllowanceLeft = (unsigned)luaL_checknumber( L, 2 );
+	qtree->gpu.setBudget( (unsigned long long)luaL_checknumber( L, 2 ) );
 	return 0;
 }
 
@@ -1113,21 +1373,208 @@ int WorldQTree::lua_setGpuAllowance( lua_State *L ) {
 int WorldQTree::lua_getGpuAllowance( lua_State *L ) {
 	// allowance = view:getGpuAllowanceLeft()
 	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
-	lua_pushnumber( L, qtree->gpuAllowanceLeft );
+	lua_pushnumber( L, (lua_Number)qtree->gpu.getAvailableBytes() );
 	return 1;
 }
 
 // -----------------------------------------------------------------
 int WorldQTree::lua_getLastFrameStats( lua_State *L ) {
-	// tri, vtx, idx, tex = view:getLastFrameStats()
+	// tri, vtx, idx, tex, draws, cullUs, sortUs = view:getLastFrameStats()
 	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
 	lua_pushnumber( L, qtree->trisILD );
 	lua_pushnumber( L, qtree->vtxSpaceILD );
 	lua_pushnumber( L, qtree->idxSpaceILD );
 	lua_pushnumber( L, qtree->texSpaceILD );
+	lua_pushnumber( L, qtree->drawCallsILD );
+	lua_pushnumber( L, qtree->cullTimeILD );
+	lua_pushnumber( L, qtree->sortTimeILD );
+	return 7;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_getVertexFormatStats( lua_State *L ) {
+	// pos16, pos16uv8, pos16uv16 = view:getVertexFormatStats()
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	for( unsigned i = 0; i < geom::VertexFormat::COUNT; i++ )
+		lua_pushnumber( L, qtree->vtxFormatSpaceILD[i] );
+	return geom::VertexFormat::COUNT;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_getInstancingStats( lua_State *L ) {
+	// instances, instanceBytes, expandedBytes = view:getInstancingStats()
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	lua_pushnumber( L, qtree->instancesILD );
+	lua_pushnumber( L, qtree->instanceSpaceILD );
+	lua_pushnumber( L, qtree->instanceExpandedSpaceILD );
+	return 3;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_getBuilderStats( lua_State *L ) {
+	// leaves, heapAllocs, reuses = view:getBuilderStats()
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	lua_pushnumber( L, qtree->leavesBuilt );
+	lua_pushnumber( L, qtree->builderHeapAllocs );
+	lua_pushnumber( L, qtree->builderReuses );
+	return 3;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_getBufferPoolStats( lua_State *L ) {
+	// pages, reserved, allocated, used, moved = view:getBufferPoolStats()
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	const GpuBufferPool &vtx = qtree->gpu.getVertexPool(), &idx = qtree->gpu.getIndexPool();
+	lua_pushnumber( L, vtx.getPageCount() + idx.getPageCount() );
+	lua_pushnumber( L, (lua_Number)(vtx.getReservedBytes() + idx.getReservedBytes()) );
+	lua_pushnumber( L, (lua_Number)(vtx.getAllocatedBytes() + idx.getAllocatedBytes()) );
+	lua_pushnumber( L, (lua_Number)(vtx.getUsedBytes() + idx.getUsedBytes()) );
+	lua_pushnumber( L, (lua_Number)(vtx.getMovedBytes() + idx.getMovedBytes()) );
+	return 5;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_getGpuResidency( lua_State *L ) {
+	// stats = view:getGpuResidency()
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	const GpuResidency &gpu = qtree->gpu;
+	lua_createtable( L, 0, 5 + GpuResidency::N_CATEGORIES );
+	lua_pushnumber( L, (lua_Number)gpu.getBudget() );
+	lua_setfield( L, -2, "budget" );
+	lua_pushnumber( L, (lua_Number)gpu.getUsedBytes() );
+	lua_setfield( L, -2, "used" );
+	lua_pushnumber( L, (lua_Number)gpu.getResidentCount() );
+	lua_setfield( L, -2, "meshes" );
+	lua_pushnumber( L, gpu.getEvictionCount() );
+	lua_setfield( L, -2, "evictions" );
+	lua_pushnumber( L, gpu.getDroppedCount() );
+	lua_setfield( L, -2, "dropped" );
+	for( unsigned c = 0; c < GpuResidency::N_CATEGORIES; c++ ) {
+		lua_createtable( L, 0, 2 );
+		lua_pushnumber( L, (lua_Number)gpu.getBytes( (GpuResidency::Category)c ) );
+		lua_setfield( L, -2, "bytes" );
+		lua_pushnumber( L, (lua_Number)gpu.getEvictedBytes( (GpuResidency::Category)c ) );
+		lua_setfield( L, -2, "evicted" );
+		lua_setfield( L, -2, GpuResidency::getCategoryName( (GpuResidency::Category)c ) );
+	}
+	return 1;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_setUploadBudget( lua_State *L ) {
+	// view:setUploadBudget( microseconds )
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	qtree->uploadBudgetUs = (unsigned)luaL_checknumber( L, 2 );
+	return 0;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_getUploadStats( lua_State *L ) {
+	// queued, uploaded, us, staged, direct, held = view:getUploadStats()
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	lua_pushnumber( L, (lua_Number)qtree->uploadQueue.size() );
+	lua_pushnumber( L, qtree->uploadsILD );
+	lua_pushnumber( L, qtree->uploadTimeILD );
+	lua_pushnumber( L, (lua_Number)qtree->gpu.getStaging().getStagedBytes() );
+	lua_pushnumber( L, (lua_Number)qtree->gpu.getStaging().getDirectBytes() );
+	lua_pushnumber( L, (lua_Number)qtree->gpu.getStaging().getHeldBytes() );
+	return 6;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_setWorkerLimit( lua_State *L ) {
+	// view:setWorkerLimit( n )
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	int limit = (int)luaL_checknumber( L, 2 );
+	qtree->workerLimit = (unsigned)std::min( std::max( limit, 1 ), MAX_WORKERS );
+	return 0;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_getLoadStats( lua_State *L ) {
+	// workers, waitingForWorker, waitingForUpload, buildMs = view:getLoadStats()
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	lua_pushnumber( L, std::min( qtree->workerLimit, g_nWorkers ) );
+	lua_pushnumber( L, qtree->waitingForWorkerILD );
+	lua_pushnumber( L, qtree->waitingForUploadILD );
+	lua_pushnumber( L, qtree->buildTimeTotal );
 	return 4;
 }
 
+// -----------------------------------------------------------------
+static void setNumberField( lua_State *L, const char *name, lua_Number value ) {
+	// Sets a field of the table at the top of the stack
+	lua_pushnumber( L, value );
+	lua_setfield( L, -2, name );
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_getSlowestLeaves( lua_State *L ) {
+	// leaves = view:getSlowestLeaves()
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	std::vector<SlowLeaf> sorted( qtree->slowestLeaves );
+	std::sort_heap( sorted.begin(), sorted.end(), &isSlowerLeaf );
+
+	lua_Number ms = 1000.0 / (lua_Number)SDL_GetPerformanceFrequency();
+	lua_createtable( L, (int)sorted.size(), 0 );
+	for( size_t i = 0; i < sorted.size(); i++ ) {
+		const SlowLeaf &leaf = sorted[i];
+		const LeafTimeline &t = leaf.timeline;
+		lua_createtable( L, 0, 11 );
+		setNumberField( L, "x1", leaf.ext.minx );
+		setNumberField( L, "x2", leaf.ext.maxx );
+		setNumberField( L, "y1", leaf.ext.miny );
+		setNumberField( L, "y2", leaf.ext.maxy );
+		setNumberField( L, "lod", leaf.lod );
+		setNumberField( L, "total", (lua_Number)(leaf.drawn - t.queued) * ms );
+		setNumberField( L, "queue", (lua_Number)(t.started - t.queued) * ms );
+		setNumberField( L, "chunks", (lua_Number)t.chunkTicks * ms );
+		setNumberField( L, "mesh", (lua_Number)(t.built - t.started - t.chunkTicks) * ms );
+		setNumberField( L, "upload", (lua_Number)(t.uploaded - t.built) * ms );
+		setNumberField( L, "draw", (lua_Number)(leaf.drawn - t.uploaded) * ms );
+		lua_rawseti( L, -2, (int)i + 1 );
+	}
+	return 1;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_setOcclusionCulling( lua_State *L ) {
+	// view:setOcclusionCulling( enabled )
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	qtree->occlusion.setEnabled( !!lua_toboolean( L, 2 ) );
+	return 0;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_getOcclusionStats( lua_State *L ) {
+	// occluders, triangles, us, tested, occluded = view:getOcclusionStats()
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	lua_pushnumber( L, qtree->occlusion.getOccluderCount() );
+	lua_pushnumber( L, qtree->occlusion.getTriangleCount() );
+	lua_pushnumber( L, qtree->occlusion.getRasterTime() );
+	lua_pushnumber( L, qtree->occlusion.getTestCount() );
+	lua_pushnumber( L, qtree->occlusion.getOccludedCount() );
+	return 5;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_setMeshOptimization( lua_State *L ) {
+	// view:setMeshOptimization( enabled )
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	qtree->optimizeMeshes = !!lua_toboolean( L, 2 );
+	return 0;
+}
+
+// -----------------------------------------------------------------
+int WorldQTree::lua_getMeshOptimizationStats( lua_State *L ) {
+	// vertsSaved, acmrBefore, acmrAfter = view:getMeshOptimizationStats()
+	WorldQTree *qtree = getLuaObjectArg<WorldQTree>( L, 1, WORLDQTREE_META );
+	lua_pushnumber( L, qtree->meshOptStats.vertsIn - qtree->meshOptStats.vertsOut );
+	lua_pushnumber( L, qtree->meshOptStats.getACMRBefore() );
+	lua_pushnumber( L, qtree->meshOptStats.getACMRAfter() );
+	return 3;
+}
+
 // -----------------------------------------------------------------
 int WorldQTree::lua_render( lua_State *L ) {
 	// view:render()
@@ -1158,6 +1605,7 @@ int WorldQTree::lua_destroy( lua_State *L ) {
 static const luaL_Reg WorldQTree_functions[] = {
 	{ "setPosition", &WorldQTree::lua_setPosition },
 	{ "setViewDistance", &WorldQTree::lua_setViewDistance },
+	{ "setLODDistance", &WorldQTree::lua_setLODDistance },
 	{ "setCameraParams", &WorldQTree::lua_setCameraParams },
 	{ "setFog", &WorldQTree::lua_setFog },
 	{ "getLightModel", &WorldQTree::lua_getLightModel },
@@ -1169,6 +1617,20 @@ static const luaL_Reg WorldQTree_functions[] = {
 	{ "setGpuAllowance", &WorldQTree::lua_setGpuAllowance },
 	{ "getGpuAllowanceLeft", &WorldQTree::lua_getGpuAllowance },
 	{ "getLastFrameStats", &WorldQTree::lua_getLastFrameStats },
+	{ "getVertexFormatStats", &WorldQTree::lua_getVertexFormatStats },
+	{ "getInstancingStats", &WorldQTree::lua_getInstancingStats },
+	{ "getBuilderStats", &WorldQTree::lua_getBuilderStats },
+	{ "getBufferPoolStats", &WorldQTree::lua_getBufferPoolStats },
+	{ "getGpuResidency", &WorldQTree::lua_getGpuResidency },
+	{ "setUploadBudget", &WorldQTree::lua_setUploadBudget },
+	{ "getUploadStats", &WorldQTree::lua_getUploadStats },
+	{ "setWorkerLimit", &WorldQTree::lua_setWorkerLimit },
+	{ "getLoadStats", &WorldQTree::lua_getLoadStats },
+	{ "getSlowestLeaves", &WorldQTree::lua_getSlowestLeaves },
+	{ "setOcclusionCulling", &WorldQTree::lua_setOcclusionCulling },
+	{ "getOcclusionStats", &WorldQTree::lua_getOcclusionStats },
+	{ "setMeshOptimization", &WorldQTree::lua_setMeshOptimization },
+	{ "getMeshOptimizationStats", &WorldQTree::lua_getMeshOptimizationStats },
 
 	{ "render", &WorldQTree::lua_render },
 	{ "destroy", &WorldQTree::lua_destroy },
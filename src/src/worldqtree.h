@@ -26,6 +26,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include "mcregionmap.h"
 #include "worldmeshbuilder.h"
+#include "worldmeshlodbuilder.h"
+#include "geomsolid.h"
+#include "gpuresidency.h"
+#include "frustum4.h"
+#include "occlusionbuffer.h"
 #include "jmath.h"
 #include "luaobject.h"
 #include "lightmodel.h"
@@ -37,6 +42,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 namespace eihort {
 
 class MCMap;
+class MCMap_Downsampled;
 class MCBlockDesc;
 class WorldMesh;
 
@@ -52,6 +58,10 @@ public:
 	void setPosition( const jMatrix *mat );
 	// Set the view distance
 	void setViewDistance( float dist );
+	// Set the distance beyond which coarse level-of-detail meshes are used
+	// Each further doubling of the distance halves the resolution
+	// A distance of 0 disables LOD meshes
+	void setLODDistance( float dist );
 	// Set camera properties
 	void setCameraParams( float yfov, float aspect, float near, float far );
 	// Set the fog properties
@@ -73,8 +83,8 @@ public:
 	void kickOutAllMeshes();
 	// Remove meshes within the given extents
 	void kickOutTheseMeshes( const Extents *ext );
-	// How many quadtree leaves are currently loading?
-	unsigned getLoadingCount() const { return nMeshesLoading; }
+	// How many quadtree leaves are currently loading or waiting for upload?
+	unsigned getLoadingCount() const { return nMeshesLoading + (unsigned)uploadQueue.size(); }
 
 	// Stop the loading of new meshes
 	void pauseLoading( bool pause );
@@ -91,6 +101,7 @@ public:
 
 	static int lua_setPosition( lua_State *L );
 	static int lua_setViewDistance( lua_State *L );
+	static int lua_setLODDistance( lua_State *L );
 	static int lua_setCameraParams( lua_State *L );
 	static int lua_setFog( lua_State *L );
 	static int lua_getLightModel( lua_State *L );
@@ -101,6 +112,20 @@ public:
 	static int lua_setGpuAllowance( lua_State *L );
 	static int lua_getGpuAllowance( lua_State *L );
 	static int lua_getLastFrameStats( lua_State *L );
+	static int lua_getVertexFormatStats( lua_State *L );
+	static int lua_getInstancingStats( lua_State *L );
+	static int lua_getBuilderStats( lua_State *L );
+	static int lua_getBufferPoolStats( lua_State *L );
+	static int lua_getGpuResidency( lua_State *L );
+	static int lua_setUploadBudget( lua_State *L );
+	static int lua_getUploadStats( lua_State *L );
+	static int lua_setWorkerLimit( lua_State *L );
+	static int lua_getLoadStats( lua_State *L );
+	static int lua_getSlowestLeaves( lua_State *L );
+	static int lua_setOcclusionCulling( lua_State *L );
+	static int lua_getOcclusionStats( lua_State *L );
+	static int lua_setMeshOptimization( lua_State *L );
+	static int lua_getMeshOptimizationStats( lua_State *L );
 	static int lua_render( lua_State *L );
 	static void createNew( lua_State *L, MCRegionMap *regions, MCBlockDesc *blocks, unsigned leafShift, const BiomeCoordData& biomeIdToCoords );
 	static int lua_destroy( lua_State *L );
@@ -110,8 +135,6 @@ private:
 	struct QTreeLeaf {
 		// A leaf of the quadtree
 
-		// Previous/Next pointers for the render list
-		QTreeLeaf *prev, *next;
 		// Distance of the leaf from the camera (updated if visible)
 		float distance;
 		// The mesh associated with the leaf
@@ -120,8 +143,19 @@ private:
 		unsigned lastRender;
 		// Actual extents of the leaf mesh
 		Extents lastExtents;
+		// Level of detail of the leaf's mesh (0 for full resolution)
+		unsigned lod;
 		// false when this leaf is loading
 		bool load;
+		// Has the leaf's mesh been generated (even if it was empty)?
+		bool built;
+		// When generateRenderList started waiting for the leaf to be built,
+		// in performance counter ticks (0 when it isn't waiting)
+		Uint64 queuedAt;
+		// The last frame on which the leaf was waiting to be built
+		unsigned lastWanted;
+		// Eviction bookkeeping of the mesh (valid while mesh is set)
+		GpuResidency::Resident resident;
 	};
 
 	struct QTreeNode {
@@ -131,7 +165,7 @@ private:
 		// Root node constructor
 		QTreeNode( WorldQTree *qtree, unsigned level, int minz, int maxz );
 		// Intermediate node constructor
-		QTreeNode( WorldQTree *qtree, const QTreeNode *parent, unsigned quadrant );
+		QTreeNode( WorldQTree *qtree, QTreeNode *parent, unsigned quadrant );
 
 		// Full extents of all meshes in this world
 		Extents ext;
@@ -146,24 +180,58 @@ private:
 			// Leaves (if level == 0)
 			QTreeLeaf *leaves[4];
 		};
+		// Coarse mesh standing in for everything below this node when
+		// it is far away (NULL until needed)
+		QTreeLeaf *lodLeaf;
+		// The node above this one (NULL for the root)
+		QTreeNode *parent;
+		// The last frame on which generateRenderList descended into the node
+		unsigned lastDescended;
+		// The last frame on which a visible leaf below the node was still
+		// on its way to having a mesh
+		unsigned lastPending;
 	};
 
+	struct TraversalItem {
+		// Pending work for generateRenderList
+
+		// Node to descend into, or whose LOD leaf to visit
+		QTreeNode *node;
+		// Visit node->lodLeaf instead of descending into the node
+		bool lodLeaf;
+		// Load meshes only, without queueing them for drawing
+		bool loadOnly;
+	};
+
+	// Create a new, unloaded leaf
+	QTreeLeaf *newLeaf( const Extents &ext, unsigned lod );
 	// Unload meshes below node that intersect with ext
 	void reloadArea( QTreeNode *node, const Extents *ext );
-	// Complete the loading of any loading leaves
+	// Schedule a leaf for reloading
+	void reloadLeaf( QTreeLeaf *leaf );
+	// Move the meshes of leaves which have finished loading into the
+	// upload queue
 	void completeLoading();
+	// Upload queued meshes until the frame's upload budget is used up
+	void processUploads();
 	// Unload the mesh associated with a leaf
 	void freeLeafMesh( QTreeLeaf *leaf );
-	// Generate the render list of leaves below this node, and merge it into lists
-	void generateRenderList( QTreeNode *node, QTreeLeaf **lists, unsigned &maxn );
-	// Merge a leaf into a render list
-	static void mergeLeafIntoRenderLists( QTreeLeaf **lists, unsigned &maxn, QTreeLeaf *leaf );
-	// Merge render lists; returns the new first leaf
-	static QTreeLeaf *mergeRenderLists( QTreeLeaf *list1, QTreeLeaf *list2 );
-	// Merge render lists; returns the new first leaf; also give the new tail
-	static QTreeLeaf *mergeRenderLists( QTreeLeaf *list1, QTreeLeaf *list2, QTreeLeaf *&tail );
-	// Final merge of render lists (flattens the list of lists)
-	static void mergeRenderListsFinal( QTreeLeaf **lists, unsigned maxn, QTreeLeaf *&head, QTreeLeaf *&tail );
+	// Add the visible leaves below this node to the render queue
+	// If loadOnly is set, meshes are loaded but not queued for drawing
+	void generateRenderList( QTreeNode *root, bool loadOnly );
+	// Queue a visible leaf for drawing, and start loading its mesh if needed
+	// inFrustum tells if the leaf's last mesh extents intersect the frustum
+	// owner is the node the leaf belongs to
+	void visitLeaf( QTreeLeaf *leaf, QTreeNode *owner, const Extents &ext, bool inFrustum, bool loadOnly );
+	// Should the node (at the given squared distance) be drawn with its LOD mesh?
+	bool shouldUseLOD( const QTreeNode *node, float distance ) const;
+	// Did all visible leaves below the node which can be loaded have meshes
+	// to draw last frame?
+	inline bool isSubtreeReady( const QTreeNode *node ) const {
+		return node->lastDescended == lastRender - 1 && node->lastPending != lastRender - 1;
+	}
+	// Sort the render queue from nearest to farthest
+	void sortRenderQueue();
 
 	// Does the frustum intersect with the extents?
 	static bool frustumIntersectsExtents( const jPlane *frustum, const Extents &ext );
@@ -175,33 +243,149 @@ private:
 	// Divide the extents into the extents of one of its quadrants in the XY plane
 	static void splitExtents( Extents *ext, unsigned corner );
 
+	struct LeafTimeline {
+		// When a leaf passed each stage on its way to the screen, in
+		// performance counter ticks
+
+		// generateRenderList wanted the leaf built
+		Uint64 queued;
+		// A worker started building it
+		Uint64 started;
+		// The worker finished building and staging it
+		Uint64 built;
+		// Its mesh was uploaded
+		Uint64 uploaded;
+		// Time the build spent reading and decoding chunks
+		// Chunks are read as the builder reaches them, so this is a total
+		// rather than a point in time
+		Uint64 chunkTicks;
+	};
+
+	struct LeafAwaitingDraw {
+		// An uploaded leaf which has not been drawn yet
+
+		// The leaf
+		QTreeLeaf *leaf;
+		// The mesh it was given (forgotten if the leaf's mesh changes)
+		WorldMesh *mesh;
+		// The frame on which it was uploaded
+		unsigned frame;
+		// Its way through the loading stages
+		LeafTimeline timeline;
+	};
+
+	struct SlowLeaf {
+		// One of the slowest leaves to become visible
+
+		// Extents of the leaf's mesh
+		Extents ext;
+		// Level of detail of the mesh
+		unsigned lod;
+		// Its way through the loading stages
+		LeafTimeline timeline;
+		// When it was first drawn
+		Uint64 drawn;
+	};
+	// Orders the slowest leaves, slowest first
+	static bool isSlowerLeaf( const SlowLeaf &a, const SlowLeaf &b );
+	// Record the latency of uploaded leaves which were drawn this frame
+	void recordFirstDraws();
+
 	struct LoadingMesh {
 		// Leaf which requested the loading
 		QTreeLeaf *leaf;
 		// The loaded data structure
 		std::list<WorldMeshSectionData> loadedData;
+		// Occluders of the loaded area
+		std::vector<Extents> occluders;
 		// Blocks from which to get the data
 		const MCBlockDesc *blocks;
 		// This worker's map object
 		MCMap *map;
+		// Downsampled views of map, for LOD levels 1 to MAX_LOD_LEVEL
+		MCMap_Downsampled *lodMaps[MAX_LOD_LEVEL];
+		// This worker's mesh builder, reused for every leaf
+		WorldMeshBuilder *builder;
+		// This worker's LOD mesh builders, for LOD levels 1 to MAX_LOD_LEVEL
+		WorldMeshLODBuilder *lodBuilders[MAX_LOD_LEVEL];
+		// Recycles the geometry buffers of this worker's builders
+		geom::ScratchArena *arena;
+		// Heap allocations and recycled buffers of the last build
+		unsigned heapAllocs, reuses;
+		// Time taken by the last build, in ms
+		unsigned buildTime;
+		// Where the worker stages its geometry for upload
+		GpuStaging *staging;
+		// The level of detail to build the mesh at
+		unsigned lod;
+		// Should the builders weld and reorder the geometry?
+		bool optimize;
 		// The extents to load the mesh in
 		Extents loadingExt;
 		// Has this mesh finished loading?
 		bool loaded;
+		// When the leaf passed each loading stage
+		LeafTimeline timeline;
 	};
 
 	// Entrypoint for the mesh loading worker
 	static void loadMesh_worker( void *ldmesh );
 
+	struct PendingUpload {
+		// A built mesh waiting to be turned into GL objects
+
+		// Leaf which requested the loading
+		QTreeLeaf *leaf;
+		// The loaded data structure
+		std::list<WorldMeshSectionData> data;
+		// Occluders of the loaded area
+		std::vector<Extents> occluders;
+		// The extents the mesh was loaded in
+		Extents ext;
+		// Time taken by the build, in ms
+		unsigned buildTime;
+		// Bytes to upload (for estimating the upload time)
+		unsigned bytes;
+		// Video memory the mesh will take, with its vertices and indices
+		// rounded up to the buffer pools' block sizes (for making room in
+		// the GPU budget before uploading)
+		unsigned gpuBytes;
+		// When the leaf passed each loading stage
+		LeafTimeline timeline;
+	};
+
+	// Create the mesh of a queued upload and give it to its leaf
+	void uploadMesh( PendingUpload &up );
+	// Throw away a queued upload, giving back its staged data and its
+	// lock on the block descriptions
+	void discardUpload( PendingUpload &up );
+
 	// Rebuild the view frustum
 	void buildViewFrustum();
 
 	// Mesh loading controller
 	LoadingMesh meshesLoading[MAX_WORKERS];
-	// Total "cost" available for new meshes
-	int newMeshAllowance;
-	// VRAM available to use
-	unsigned gpuAllowanceLeft;
+	// Built meshes waiting to be uploaded, oldest first
+	std::list<PendingUpload> uploadQueue;
+	// Uploaded leaves waiting to be drawn for the first time
+	std::vector<LeafAwaitingDraw> leavesAwaitingDraw;
+	// The slowest leaves to become visible so far, as a heap with the
+	// fastest of them at the front
+	std::vector<SlowLeaf> slowestLeaves;
+	// Explicit stack used by generateRenderList (kept to reuse its storage)
+	std::vector<TraversalItem> traversalStack;
+	// Time which may be spent uploading meshes each frame, in microseconds
+	unsigned uploadBudgetUs;
+	// Running estimate of the upload time per KB of mesh data
+	float uploadUsPerKB;
+	// Most leaves built at once (also limited by the number of workers)
+	unsigned workerLimit;
+	// Owns the video memory of all meshes and picks what to evict
+	GpuResidency gpu;
+	// CPU depth buffer for culling leaves and sections hidden behind terrain
+	OcclusionBuffer occlusion;
+	// Leaves chosen for eviction (kept to avoid reallocating)
+	std::vector<GpuResidency::Resident*> evictions;
 	// Stops new leaves from loading
 	bool holdLoading;
 	// Mutex to protext large changes to the meshesLoading structure
@@ -213,10 +397,19 @@ private:
 	MemoryPool<QTreeLeaf> leafPool;
 	// The root qtree node
 	QTreeNode rootNode;
-	// Linked list of unseen leaves (in LRS order)
-	QTreeLeaf *unseenLeafHead, *unseenLeafTail;
-	// Linked list of currently visible leaves
-	QTreeLeaf *curRenderHead, *curRenderTail;
+	struct RenderItem {
+		// A leaf queued for drawing
+
+		// Sort key: the leaf's quantized squared distance
+		unsigned key;
+		// The leaf
+		QTreeLeaf *leaf;
+	};
+	// Leaves to draw this frame, nearest first once sorted
+	// (leaves which have no mesh anymore are skipped)
+	std::vector<RenderItem> renderQueue;
+	// Scratch space for sorting the render queue
+	std::vector<RenderItem> renderSortScratch;
 
 	// Region map from which to draw map data
 	MCRegionMap *regions;
@@ -229,6 +422,8 @@ private:
 
 	// Radius of a node at given level
 	float subVisRadii[32];
+	// Distance at which LOD meshes start being used (0 to disable)
+	float lodDistance;
 	// Used for limiting the draw distance when VRAM is limiting
 	float newLoadDistanceLimit, limitLoadDistance;
 	// Lighting models of the 6 sides
@@ -242,6 +437,35 @@ private:
 	unsigned idxSpaceILD;
 	// Texture memory used last frame
 	unsigned texSpaceILD;
+	// Draw calls submitted last frame
+	unsigned drawCallsILD;
+	// Vertex bytes drawn last frame, by vertex format
+	unsigned vtxFormatSpaceILD[geom::VertexFormat::COUNT];
+	// Instances drawn last frame, bytes of their instance data, and bytes
+	// of vertices they would have taken without instancing
+	unsigned instancesILD, instanceSpaceILD, instanceExpandedSpaceILD;
+	// Meshes uploaded last frame, and the time it took (in microseconds)
+	unsigned uploadsILD, uploadTimeILD;
+	// Time spent traversing the tree for the last render list, and
+	// sorting it (in microseconds)
+	unsigned cullTimeILD, sortTimeILD;
+	// Groups the solid block faces of each section into fewer draw calls
+	geom::SolidFaceBatch solidBatch;
+	// Number of leaves built
+	unsigned leavesBuilt;
+	// Geometry buffers allocated from the heap by the builders
+	unsigned builderHeapAllocs;
+	// Geometry buffers recycled by the builders
+	unsigned builderReuses;
+	// Total time the workers spent building leaves, in milliseconds
+	unsigned buildTimeTotal;
+	// Leaves which wanted to load last frame but were held back because
+	// all workers were busy, or because the upload queue was full
+	unsigned waitingForWorkerILD, waitingForUploadILD;
+	// Should built meshes be welded and reordered for the vertex cache?
+	bool optimizeMeshes;
+	// Results of optimizing the meshes built so far
+	geom::MeshOptimizeStats meshOptStats;
 	// Number of meshes currently loading
 	unsigned nMeshesLoading;
 	// The index of the current frame (compared with QTreeLeaf::lastRender)
@@ -251,6 +475,8 @@ private:
 
 	// Camera frustum planes
 	jPlane frustum[6];
+	// The same frustum, laid out for 4-wide tests
+	Frustum4 frustum4;
 	// Camera position
 	jMatrix eyeMat;
 	// Fog color